@@ -28,6 +28,11 @@
 // Networking
 #include "Tools.h"
 
+// the other way around from CellFromCoord, for drawing a cell that came over the network
+static inline glm::vec3 CoordFromCell(int cell) {
+	return glm::vec3(cell / 16, (cell / 4) % 4, cell % 4);
+}
+
 class Board {
 public:
 	GraphicsEngine *graphics = nullptr;
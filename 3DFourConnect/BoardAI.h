@@ -0,0 +1,327 @@
+// picks moves for players that are not people.
+// RANDOM takes any empty cell. GREEDY wins when it can, blocks when it has to and otherwise takes
+// the cell that sits on the most lines the opponent has not blocked yet.
+// PickSearchedMove looks ahead with a negamax search for as long as it is given, one depth at a time,
+// so it plays better the more time it gets and always has an answer when the time runs out.
+
+#ifndef BOARDAI_H
+#define BOARDAI_H
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "BoardRules.h"
+
+class BoardAI {
+public:
+	enum Level { RANDOM, GREEDY };
+
+	// returns the cell to play or -1 if the board is full
+	static int PickMove(const BitBoard &board, int color, Level level, std::mt19937 &rng) {
+		if (board.full()) {
+			return -1;
+		}
+
+		if (level == Level::GREEDY) {
+			// win right away
+			int cell = FindWinningCell(board, color);
+			if (cell >= 0) {
+				return cell;
+			}
+
+			// stop the opponent from winning next turn
+			cell = FindWinningCell(board, OtherColor(color));
+			if (cell >= 0) {
+				return cell;
+			}
+
+			return PickBestScoredCell(board, color, rng);
+		}
+
+		return PickRandomCell(board, rng);
+	}
+
+	// deepest the search ever goes, a board this far from full is never searched this deep in the time it gets anyway
+	static const int k_nMaxSearchDepth = 8;
+
+	// returns the cell to play or -1 if the board is full. depthReached is the deepest search that finished before the
+	// deadline, 0 if not even one move ahead could be looked at and the greedy pick was used instead.
+	static int PickSearchedMove(const BitBoard &board, int color, std::chrono::steady_clock::time_point deadline, int &depthReached, std::mt19937 &rng) {
+		depthReached = 0;
+		if (board.full()) {
+			return -1;
+		}
+
+		// nothing to think about
+		int cell = FindWinningCell(board, color);
+		if (cell < 0) {
+			cell = FindWinningCell(board, OtherColor(color));
+		}
+		if (cell >= 0) {
+			depthReached = 1;
+			return cell;
+		}
+
+		Search search(deadline);
+
+		// the best cells on their own go first, ties in a different order every time so the bot doesn't always play the same game.
+		// this runs for every move a bot makes, so it works on the stack instead of allocating
+		int moves[64];
+		int numMoves = 0;
+		for (int i = 0; i < 64; i++) {
+			if (board.isEmpty(i)) {
+				moves[numMoves++] = i;
+			}
+		}
+		std::shuffle(moves, moves + numMoves, rng);
+		auto moreLines = [](int a, int b) { return CellLines()[a].size() > CellLines()[b].size(); };
+		for (int i = 1; i < numMoves; i++) {
+			std::rotate(std::upper_bound(moves, moves + i, moves[i], moreLines), moves + i, moves + i + 1);
+		}
+
+		int bestCell = -1;
+		for (int depth = 1; depth <= k_nMaxSearchDepth && depth <= numMoves; depth++) {
+			int depthBest = -1;
+			int alpha = -k_nWinScore - 1;
+			for (int m = 0; m < numMoves; m++) {
+				int move = moves[m];
+				BitBoard next = board;
+				next.place(color, move);
+				int score = -search.Negamax(next, move, OtherColor(color), depth - 1, 1, -k_nWinScore - 1, -alpha);
+				if (search.aborted) {
+					break;
+				}
+				if (score > alpha) {
+					alpha = score;
+					depthBest = move;
+				}
+			}
+
+			// a depth that didn't finish could have missed the one reply that matters, keep the last one that did
+			if (search.aborted) {
+				break;
+			}
+			bestCell = depthBest;
+			depthReached = depth;
+
+			// try the best move first next time, it is the most likely to still be best and cuts the rest off sooner
+			int *pBest = std::find(moves, moves + numMoves, bestCell);
+			std::rotate(moves, pBest, pBest + 1);
+
+			// decided either way, looking further won't change it
+			if (alpha >= k_nWinScore - k_nMaxSearchDepth || alpha <= -k_nWinScore + k_nMaxSearchDepth) {
+				break;
+			}
+		}
+
+		if (bestCell < 0) {
+			return PickBestScoredCell(board, color, rng);
+		}
+		return bestCell;
+	}
+
+	// a cell that finishes a line of three for the color, -1 if there is none
+	static int FindWinningCell(const BitBoard &board, int color) {
+		uint64 own = color == BitBoard::Color::RED ? board.red : board.blue;
+		uint64 empty = ~board.occupied();
+
+		for (uint64 mask : WinLineMasks()) {
+			uint64 missing = mask & ~own;
+			// exactly one cell of the line is missing and it is empty
+			if (missing != 0 && (missing & (missing - 1)) == 0 && (missing & empty) != 0) {
+				return CellFromBit(missing);
+			}
+		}
+		return -1;
+	}
+
+	static int PickRandomCell(const BitBoard &board, std::mt19937 &rng) {
+		int numEmpty = 64 - board.count();
+		int pick = std::uniform_int_distribution<int>(0, numEmpty - 1)(rng);
+
+		for (int cell = 0; cell < 64; cell++) {
+			if (board.isEmpty(cell) && pick-- == 0) {
+				return cell;
+			}
+		}
+		return -1;
+	}
+
+	// lines with only our pieces count more the more pieces they already have, ties are broken randomly
+	static int PickBestScoredCell(const BitBoard &board, int color, std::mt19937 &rng) {
+		uint64 own = color == BitBoard::Color::RED ? board.red : board.blue;
+		uint64 other = color == BitBoard::Color::RED ? board.blue : board.red;
+
+		int scores[64] = { 0 };
+		for (uint64 mask : WinLineMasks()) {
+			if ((mask & other) != 0) {
+				continue;
+			}
+
+			int ownCount = PopCount(mask & own);
+			int value = 1 + ownCount * ownCount * 4;
+			for (uint64 bits = mask & ~board.occupied(); bits != 0; bits &= bits - 1) {
+				scores[CellFromBit(bits & (~bits + 1))] += value;
+			}
+		}
+
+		int bestCell = -1;
+		int bestScore = -1;
+		int ties = 0;
+		for (int cell = 0; cell < 64; cell++) {
+			if (!board.isEmpty(cell)) {
+				continue;
+			}
+
+			if (scores[cell] > bestScore) {
+				bestScore = scores[cell];
+				bestCell = cell;
+				ties = 1;
+			}
+			else if (scores[cell] == bestScore) {
+				// reservoir pick so every tied cell is equally likely
+				ties++;
+				if (std::uniform_int_distribution<int>(0, ties - 1)(rng) == 0) {
+					bestCell = cell;
+				}
+			}
+		}
+		return bestCell;
+	}
+
+	static const int k_nWinScore = 1000000;
+
+	// the lines through each cell, a move can only finish one of these
+	static const std::vector< std::vector<uint64> > &CellLines() {
+		static const std::vector< std::vector<uint64> > lines = BuildCellLines();
+		return lines;
+	}
+
+	static std::vector< std::vector<uint64> > BuildCellLines() {
+		std::vector< std::vector<uint64> > lines(64);
+		for (uint64 mask : WinLineMasks()) {
+			for (int cell = 0; cell < 64; cell++) {
+				if ((mask >> cell) & 1) {
+					lines[cell].push_back(mask);
+				}
+			}
+		}
+		return lines;
+	}
+
+	// the corners and the middle eight, every one of them is on seven lines instead of four
+	static uint64 StrongCells() {
+		static const uint64 strong = BuildStrongCells();
+		return strong;
+	}
+
+	static uint64 BuildStrongCells() {
+		uint64 strong = 0;
+		for (int cell = 0; cell < 64; cell++) {
+			if (CellLines()[cell].size() > 4) {
+				strong |= 1ull << cell;
+			}
+		}
+		return strong;
+	}
+
+	// lines only one side has pieces on count for that side, the more pieces the much more they count
+	static int Evaluate(const BitBoard &board, int color) {
+		static const int k_lineValues[4] = { 0, 1, 8, 64 };
+		uint64 own = color == BitBoard::Color::RED ? board.red : board.blue;
+		uint64 other = color == BitBoard::Color::RED ? board.blue : board.red;
+
+		int score = 0;
+		for (uint64 mask : WinLineMasks()) {
+			uint64 ownLine = mask & own;
+			uint64 otherLine = mask & other;
+			if (otherLine == 0) {
+				score += k_lineValues[PopCount(ownLine)];
+			}
+			else if (ownLine == 0) {
+				score -= k_lineValues[PopCount(otherLine)];
+			}
+		}
+		return score;
+	}
+
+	// one search, gives up once the deadline has passed
+	struct Search {
+		std::chrono::steady_clock::time_point deadline;
+		int nodes = 0;
+		bool aborted = false;
+
+		Search(std::chrono::steady_clock::time_point deadline) : deadline(deadline) {}
+
+		// the score for color to move on board, where lastCell was just played by the other color.
+		// ply counts from the root so a quicker win scores higher than a slower one.
+		int Negamax(const BitBoard &board, int lastCell, int color, int depth, int ply, int alpha, int beta) {
+			// the clock is only read every so often, it costs more than a node
+			if ((++nodes & 1023) == 0 && std::chrono::steady_clock::now() >= deadline) {
+				aborted = true;
+			}
+			if (aborted) {
+				return 0;
+			}
+
+			// the other color just won
+			uint64 last = OtherColor(color) == BitBoard::Color::RED ? board.red : board.blue;
+			for (uint64 mask : CellLines()[lastCell]) {
+				if ((last & mask) == mask) {
+					return -(k_nWinScore - ply);
+				}
+			}
+
+			if (board.full()) {
+				return 0;
+			}
+			if (depth == 0) {
+				return Evaluate(board, color);
+			}
+
+			// the cells on the most lines first, they are the most likely to cut the rest off
+			uint64 empty = ~board.occupied();
+			uint64 groups[2] = { empty & StrongCells(), empty & ~StrongCells() };
+			for (uint64 group : groups) {
+				for (; group != 0; group &= group - 1) {
+					int cell = CellFromBit(group & (~group + 1));
+					BitBoard next = board;
+					next.place(color, cell);
+					int score = -Negamax(next, cell, OtherColor(color), depth - 1, ply + 1, -beta, -alpha);
+					if (aborted) {
+						return 0;
+					}
+					if (score > alpha) {
+						alpha = score;
+						if (alpha >= beta) {
+							return alpha;
+						}
+					}
+				}
+			}
+			return alpha;
+		}
+	};
+
+	static int PopCount(uint64 bits) {
+		int n = 0;
+		for (; bits != 0; bits &= bits - 1) {
+			n++;
+		}
+		return n;
+	}
+
+	// index of the lowest set bit
+	static int CellFromBit(uint64 bit) {
+		int cell = 0;
+		while ((bit & 1) == 0) {
+			bit >>= 1;
+			cell++;
+		}
+		return cell;
+	}
+};
+
+#endif
@@ -0,0 +1,204 @@
+// the rules of 3d four connect without any graphics.
+// the board is two 64 bit masks, one bit per cell (see CellFromCoord), so it can be copied and checked cheaply
+// by things that never draw anything like bots and the server.
+
+#ifndef BOARDRULES_H
+#define BOARDRULES_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "Tools.h"
+
+// number of ways to get four in a row on a 4x4x4 board
+const int k_nNumWinLines = 76;
+
+// mask of the four cells of every winning line
+static std::vector<uint64> BuildWinLineMasks() {
+	std::vector<uint64> masks;
+
+	// walk each direction from every start cell, only keeping one of each pair of opposite directions
+	for (int dx = -1; dx <= 1; dx++) {
+		for (int dy = -1; dy <= 1; dy++) {
+			for (int dz = -1; dz <= 1; dz++) {
+				if (dx < 0 || (dx == 0 && dy < 0) || (dx == 0 && dy == 0 && dz <= 0)) {
+					continue;
+				}
+
+				for (int x = 0; x < 4; x++) {
+					for (int y = 0; y < 4; y++) {
+						for (int z = 0; z < 4; z++) {
+							int ex = x + dx * 3;
+							int ey = y + dy * 3;
+							int ez = z + dz * 3;
+							if (ex < 0 || ex > 3 || ey < 0 || ey > 3 || ez < 0 || ez > 3) {
+								continue;
+							}
+
+							uint64 mask = 0;
+							for (int i = 0; i < 4; i++) {
+								mask |= 1ull << CellFromCoord(x + dx * i, y + dy * i, z + dz * i);
+							}
+							masks.push_back(mask);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	return masks;
+}
+
+// built once on first use (thread safe)
+static const std::vector<uint64> &WinLineMasks() {
+	static const std::vector<uint64> masks = BuildWinLineMasks();
+	return masks;
+}
+
+// a random number for each color on each cell and one for blue to move. a board's hash is the numbers of all its
+// pieces xored together, so a piece going on or coming off changes it with a single xor and both ends can keep it
+// up to date move by move. they come from a fixed seed so every build makes the same ones.
+static std::vector<uint64> BuildZobristKeys() {
+	std::vector<uint64> keys(2 * 64 + 1);
+
+	// splitmix64
+	uint64 state = 0x3d4f0c0ec7a1b2e5ull;
+	for (uint64 &key : keys) {
+		state += 0x9e3779b97f4a7c15ull;
+		uint64 z = state;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		key = z ^ (z >> 31);
+	}
+	return keys;
+}
+
+static const std::vector<uint64> &ZobristKeys() {
+	static const std::vector<uint64> keys = BuildZobristKeys();
+	return keys;
+}
+
+// color is 1 for red and 2 for blue (see BitBoard::Color), anything else is 0
+static inline uint64 ZobristPiece(int color, int cell) {
+	if ((color != 1 && color != 2) || cell < 0 || cell >= 64) {
+		return 0;
+	}
+	return ZobristKeys()[(color - 1) * 64 + cell];
+}
+
+static inline uint64 ZobristTurn(int turn) {
+	return turn == 2 ? ZobristKeys()[2 * 64] : 0;
+}
+
+struct BitBoard
+{
+	// 1 is red and 2 is blue, the same numbers the DataPacket board uses
+	enum Color { EMPTY = 0, RED = 1, BLUE = 2 };
+
+	uint64 red = 0;
+	uint64 blue = 0;
+
+	uint64 occupied() const {
+		return red | blue;
+	}
+
+	bool isEmpty(int cell) const {
+		return ((occupied() >> cell) & 1) == 0;
+	}
+
+	int at(int cell) const {
+		if ((red >> cell) & 1) {
+			return Color::RED;
+		}
+		if ((blue >> cell) & 1) {
+			return Color::BLUE;
+		}
+		return Color::EMPTY;
+	}
+
+	// returns false if the cell is already taken
+	bool place(int color, int cell) {
+		if (!isEmpty(cell)) {
+			return false;
+		}
+		if (color == Color::RED) {
+			red |= 1ull << cell;
+		}
+		else if (color == Color::BLUE) {
+			blue |= 1ull << cell;
+		}
+		return true;
+	}
+
+	void remove(int cell) {
+		red &= ~(1ull << cell);
+		blue &= ~(1ull << cell);
+	}
+
+	void clear() {
+		red = 0;
+		blue = 0;
+	}
+
+	bool full() const {
+		return occupied() == ~0ull;
+	}
+
+	int count() const {
+		int n = 0;
+		for (uint64 bits = occupied(); bits != 0; bits &= bits - 1) {
+			n++;
+		}
+		return n;
+	}
+
+	// of the pieces only, xor in ZobristTurn for the whole game state
+	uint64 hash() const {
+		uint64 h = 0;
+		for (int cell = 0; cell < 64; cell++) {
+			h ^= ZobristPiece(at(cell), cell);
+		}
+		return h;
+	}
+
+	// returns the color with four in a row or EMPTY
+	int winner() const {
+		for (uint64 mask : WinLineMasks()) {
+			if ((red & mask) == mask) {
+				return Color::RED;
+			}
+			if ((blue & mask) == mask) {
+				return Color::BLUE;
+			}
+		}
+		return Color::EMPTY;
+	}
+
+	void fromPacket(const DataPacket *data) {
+		clear();
+		for (int x = 0; x < 4; x++) {
+			for (int y = 0; y < 4; y++) {
+				for (int z = 0; z < 4; z++) {
+					place(data->board[x][y][z], CellFromCoord(x, y, z));
+				}
+			}
+		}
+	}
+
+	void toPacket(DataPacket *data) const {
+		for (int x = 0; x < 4; x++) {
+			for (int y = 0; y < 4; y++) {
+				for (int z = 0; z < 4; z++) {
+					data->board[x][y][z] = at(CellFromCoord(x, y, z));
+				}
+			}
+		}
+	}
+};
+
+static inline int OtherColor(int color) {
+	return color == BitBoard::Color::RED ? BitBoard::Color::BLUE : BitBoard::Color::RED;
+}
+
+#endif
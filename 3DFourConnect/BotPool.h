@@ -0,0 +1,222 @@
+// worker threads that work out the moves of the server's bot players for every shard.
+// a shard hands over the board whenever it is a bot's turn and picks the move up from its own result queue.
+// the job with the earliest deadline always goes first and gets no more time than leaves room for every job
+// waiting behind it before the first of their deadlines, so when there is more to do than the threads can keep up
+// with the bots get weaker (they look fewer moves ahead) instead of slower.
+
+#ifndef BOTPOOL_H
+#define BOTPOOL_H
+
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include "Tools.h"
+#include "LockFreeQueue.h"
+#include "Metrics.h"
+#include "BoardRules.h"
+#include "BoardAI.h"
+
+// a bot's move should be back this long after its turn started, however busy the pool is
+const SteamNetworkingMicroseconds k_usecBotMoveDeadline = 250000;
+
+// most finished moves waiting for one shard before the workers have to wait for it
+const size_t k_nBotResultQueueSize = 4096;
+
+// a board a bot has to move on
+struct BotJob
+{
+	uint32 roomId;
+	int shard;
+	int seat;
+
+	// the room's seq when it asked, a move for a board that has changed since is thrown away
+	uint32 seq;
+	BitBoard board;
+
+	SteamNetworkingMicroseconds usecRequested;
+	SteamNetworkingMicroseconds usecDeadline;
+};
+
+// what the bot played, handed back to the shard that asked
+struct BotMove
+{
+	uint32 roomId;
+	int seat;
+	uint32 seq;
+	int cell;
+};
+
+class BotPool {
+public:
+	// usecBudget is the most time one move may take, a bot that gets all of it plays as well as it can.
+	// the metrics belong to the server's registry, the pool only updates them.
+	BotPool(int numThreads, int numShards, SteamNetworkingMicroseconds usecBudget, Counter &movesMade, Counter &movesLate, Counter &busyMicroseconds, Histogram &searchDepth, Histogram &moveDelay) : movesMade(movesMade), movesLate(movesLate), busyMicroseconds(busyMicroseconds), searchDepth(searchDepth), moveDelay(moveDelay) {
+		m_nThreads = std::max(1, numThreads);
+		m_usecBudget = std::max((SteamNetworkingMicroseconds)1000, std::min(usecBudget, k_usecBotMoveDeadline));
+		m_bRunning = false;
+		for (int i = 0; i < numShards; i++) {
+			m_vecResults.emplace_back(new MPSCQueue<BotMove>(k_nBotResultQueueSize));
+		}
+		m_vecWakeups.resize(numShards, nullptr);
+	}
+
+	~BotPool() {
+		Stop();
+	}
+
+	Counter &movesMade;
+	Counter &movesLate;
+	Counter &busyMicroseconds;
+	Histogram &searchDepth;
+	Histogram &moveDelay;
+
+	int Threads() const {
+		return m_nThreads;
+	}
+
+	SteamNetworkingMicroseconds Budget() const {
+		return m_usecBudget;
+	}
+
+	void Start() {
+		m_bRunning = true;
+		for (int i = 0; i < m_nThreads; i++) {
+			m_vecThreads.emplace_back([this]() { Run(); });
+		}
+	}
+
+	// jobs nobody has started on are dropped
+	void Stop() {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_bRunning = false;
+		}
+		m_cvJobs.notify_all();
+		for (std::thread &thread : m_vecThreads) {
+			thread.join();
+		}
+		m_vecThreads.clear();
+	}
+
+	// any shard thread
+	void Submit(const BotJob &job) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_queueJobs.push(job);
+		}
+		m_cvJobs.notify_one();
+	}
+
+	// shard thread number shard only
+	bool PopResult(int shard, BotMove &move) {
+		return m_vecResults[shard]->Pop(move);
+	}
+
+	// shard thread number shard only
+	bool HasResult(int shard) {
+		return !m_vecResults[shard]->Empty();
+	}
+
+	// woken whenever a move for the shard is ready. set before the shard submits anything and kept until the pool stops.
+	void SetWakeup(int shard, Wakeup *pWakeup) {
+		m_vecWakeups[shard] = pWakeup;
+	}
+
+private:
+	int m_nThreads;
+	SteamNetworkingMicroseconds m_usecBudget;
+	std::vector<std::thread> m_vecThreads;
+
+	struct LaterDeadline {
+		bool operator()(const BotJob &a, const BotJob &b) const {
+			return a.usecDeadline > b.usecDeadline;
+		}
+	};
+
+	// only changed with the mutex held so a waiting worker can't miss it
+	std::atomic<bool> m_bRunning;
+
+	// guards the jobs
+	std::mutex m_mutex;
+	std::condition_variable m_cvJobs;
+	std::priority_queue<BotJob, std::vector<BotJob>, LaterDeadline> m_queueJobs;
+
+	// one per shard, every worker pushes into them
+	std::vector< std::unique_ptr< MPSCQueue<BotMove> > > m_vecResults;
+	std::vector<Wakeup*> m_vecWakeups;
+
+	void Run() {
+		std::mt19937 rng{ std::random_device{}() };
+
+		while (true) {
+			BotJob job;
+			SteamNetworkingMicroseconds usecNextDeadline = 0;
+			int64 nWaiting = 0;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_cvJobs.wait(lock, [this]() { return !m_bRunning || !m_queueJobs.empty(); });
+				if (!m_bRunning) {
+					return;
+				}
+				job = m_queueJobs.top();
+				m_queueJobs.pop();
+				nWaiting = (int64)m_queueJobs.size();
+				if (nWaiting > 0) {
+					usecNextDeadline = m_queueJobs.top().usecDeadline;
+				}
+			}
+
+			// as long as the budget allows, but not so long that this job is late or that the threads can't get through
+			// the ones waiting before the earliest of their deadlines
+			SteamNetworkingMicroseconds usecStart = SteamNetworkingUtils()->GetLocalTimestamp();
+			SteamNetworkingMicroseconds usecSlice = std::min(m_usecBudget, job.usecDeadline - usecStart);
+			if (nWaiting > 0) {
+				usecSlice = std::min(usecSlice, (usecNextDeadline - usecStart) * m_nThreads / (nWaiting + 1));
+			}
+
+			int color = job.seat + 1;
+			int depth = 0;
+			BotMove move;
+			move.roomId = job.roomId;
+			move.seat = job.seat;
+			move.seq = job.seq;
+			if (usecSlice > 0) {
+				move.cell = BoardAI::PickSearchedMove(job.board, color, std::chrono::steady_clock::now() + std::chrono::microseconds(usecSlice), depth, rng);
+			}
+			else {
+				// already out of time, the quickest move that is still sensible
+				move.cell = BoardAI::PickMove(job.board, color, BoardAI::Level::GREEDY, rng);
+			}
+
+			SteamNetworkingMicroseconds usecEnd = SteamNetworkingUtils()->GetLocalTimestamp();
+			movesMade.Add();
+			if (usecEnd > job.usecDeadline) {
+				movesLate.Add();
+			}
+			busyMicroseconds.Add(usecEnd - usecStart);
+			searchDepth.Record(depth);
+			moveDelay.Record(usecEnd - job.usecRequested);
+
+			// a shard that has already stopped never takes it
+			while (!m_vecResults[job.shard]->Push(move) && m_bRunning) {
+				std::this_thread::yield();
+			}
+			if (m_vecWakeups[job.shard] != nullptr) {
+				m_vecWakeups[job.shard]->Notify();
+			}
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,185 @@
+// a recording of everything clients sent to the server, so a real load can be played back against it later
+// (see Replayer.h). the file is a CaptureHeader and then one CaptureRecord per connection opened or closed and
+// per message received, each message followed by its bytes. only the network thread writes it, through a big
+// buffer, so a capture costs a copy per message and no syncs.
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include "Tools.h"
+
+struct CaptureHeader
+{
+	char magic[4] = { '4', 'C', 'A', 'P' };
+	uint32 version = 1;
+};
+
+// fixed size with no padding, 12 bytes before the message itself
+struct CaptureRecord
+{
+	enum Kind { CONNECT, MESSAGE, CLOSE };
+
+	// time since the previous record, so a capture can run for over an hour between two records before it clamps
+	uint32 usecDelta = 0;
+
+	// the server's handle for the connection, only used to tell the connections apart
+	uint32 conn = 0;
+
+	// MESSAGE, how many bytes of message follow
+	uint16 cbSize = 0;
+
+	uint8 kind = 0;
+
+	// MESSAGE, k_nSteamNetworkingSend_Reliable if it came in reliably
+	uint8 flags = 0;
+};
+
+class CaptureWriter {
+public:
+	CaptureWriter() {
+		m_pFile = nullptr;
+		m_usecLast = 0;
+		m_nMessages = 0;
+		m_nBytes = 0;
+	}
+
+	~CaptureWriter() {
+		Close();
+	}
+
+	bool Open(const std::string &path) {
+		m_pFile = fopen(path.c_str(), "wb");
+		if (m_pFile == nullptr) {
+			return false;
+		}
+		setvbuf(m_pFile, nullptr, _IOFBF, 1024 * 1024);
+		m_sPath = path;
+
+		CaptureHeader header;
+		fwrite(&header, sizeof(header), 1, m_pFile);
+		m_nBytes = sizeof(header);
+		m_usecLast = SteamNetworkingUtils()->GetLocalTimestamp();
+		return true;
+	}
+
+	void Close() {
+		if (m_pFile == nullptr) {
+			return;
+		}
+		fclose(m_pFile);
+		m_pFile = nullptr;
+		std::cout << "Captured " << m_nMessages << " messages (" << m_nBytes << " bytes) to " << m_sPath << std::endl;
+	}
+
+	void Connect(HSteamNetConnection conn) {
+		Write(CaptureRecord::Kind::CONNECT, conn, SteamNetworkingUtils()->GetLocalTimestamp());
+	}
+
+	void Disconnect(HSteamNetConnection conn) {
+		Write(CaptureRecord::Kind::CLOSE, conn, SteamNetworkingUtils()->GetLocalTimestamp());
+	}
+
+	// stamped with when the library received it, not when we got round to it
+	void Message(const SteamNetworkingMessage_t *pMsg) {
+		// nothing a client sends comes close, a message this big isn't one of ours
+		if (pMsg->m_cbSize > 0xffff) {
+			return;
+		}
+
+		CaptureRecord record = MakeRecord(CaptureRecord::Kind::MESSAGE, pMsg->m_conn, pMsg->m_usecTimeReceived);
+		record.cbSize = (uint16)pMsg->m_cbSize;
+		record.flags = (pMsg->m_nFlags & k_nSteamNetworkingSend_Reliable) != 0 ? k_nSteamNetworkingSend_Reliable : 0;
+		fwrite(&record, sizeof(record), 1, m_pFile);
+		fwrite(pMsg->m_pData, 1, record.cbSize, m_pFile);
+		m_nMessages++;
+		m_nBytes += sizeof(record) + record.cbSize;
+	}
+
+private:
+	FILE *m_pFile;
+	std::string m_sPath;
+	SteamNetworkingMicroseconds m_usecLast;
+	uint64 m_nMessages;
+	uint64 m_nBytes;
+
+	void Write(int kind, HSteamNetConnection conn, SteamNetworkingMicroseconds usecTime) {
+		CaptureRecord record = MakeRecord(kind, conn, usecTime);
+		fwrite(&record, sizeof(record), 1, m_pFile);
+		m_nBytes += sizeof(record);
+	}
+
+	// a message received before the last record was written still goes after it, with no gap
+	CaptureRecord MakeRecord(int kind, HSteamNetConnection conn, SteamNetworkingMicroseconds usecTime) {
+		CaptureRecord record;
+		SteamNetworkingMicroseconds usecDelta = usecTime - m_usecLast;
+		if (usecDelta > 0) {
+			record.usecDelta = (uint32)std::min(usecDelta, (SteamNetworkingMicroseconds)0xffffffff);
+			m_usecLast = usecTime;
+		}
+		record.conn = conn;
+		record.kind = (uint8)kind;
+		return record;
+	}
+};
+
+class CaptureReader {
+public:
+	CaptureReader() {
+		m_pFile = nullptr;
+		m_usecTime = 0;
+	}
+
+	~CaptureReader() {
+		if (m_pFile != nullptr) {
+			fclose(m_pFile);
+		}
+	}
+
+	// false if the file can't be opened or isn't a capture
+	bool Open(const std::string &path) {
+		m_pFile = fopen(path.c_str(), "rb");
+		if (m_pFile == nullptr) {
+			return false;
+		}
+		setvbuf(m_pFile, nullptr, _IOFBF, 1024 * 1024);
+
+		CaptureHeader header, expected;
+		return fread(&header, sizeof(header), 1, m_pFile) == 1 && memcmp(header.magic, expected.magic, sizeof(header.magic)) == 0 && header.version == expected.version;
+	}
+
+	// the next record and, for a MESSAGE, its bytes. false at the end of the file or a record cut short.
+	bool Next(CaptureRecord &record, std::vector<char> &vecData) {
+		if (fread(&record, sizeof(record), 1, m_pFile) != 1) {
+			return false;
+		}
+
+		vecData.resize(record.kind == CaptureRecord::Kind::MESSAGE ? record.cbSize : 0);
+		if (!vecData.empty() && fread(vecData.data(), 1, vecData.size(), m_pFile) != vecData.size()) {
+			return false;
+		}
+
+		m_usecTime += record.usecDelta;
+		return true;
+	}
+
+	// when the last record read happened, counted from the start of the capture
+	SteamNetworkingMicroseconds Time() const {
+		return m_usecTime;
+	}
+
+private:
+	FILE *m_pFile;
+	SteamNetworkingMicroseconds m_usecTime;
+};
+
+#endif
@@ -31,6 +31,11 @@
 #include "Local3DFourConnect.h"
 
 #include "Tools.h"
+#include "BoardRules.h"
+#include "Transport.h"
+#include "MessageBatch.h"
+#include "ClockSync.h"
+#include "CommandRegistry.h"
 
 // prototypes
 // callbacks
@@ -46,6 +51,28 @@ public:
 	Local3DFourConnect game;
 	int currentTurn;
 
+	// max cursor updates sent to the server per second (0 sends every change right away)
+	float selectionSendRate = k_flDefaultSelectionSendRate;
+
+	// watch a match instead of playing, room 0 lets the server pick one
+	bool spectate = false;
+	uint32 spectateRoomId = 0;
+
+	// what the server's matchmaker pairs us by, 0 for its default
+	int rating = 0;
+
+	// play one of the server's bots instead of waiting for a person
+	bool againstBot = false;
+
+	// how many times to try getting back in after the connection drops mid game
+	int maxReconnectAttempts = 8;
+
+	// show the round trip to the server on screen
+	bool showLatency = false;
+
+	// what to connect over, the real network if left null
+	ITransport *transport = nullptr;
+
 	// Start and run the Client
 	void Run(const SteamNetworkingIPAddr &serverAddr)
 	{
@@ -55,55 +82,115 @@ public:
 		game.gameManager.setPiecePlaceCallback(placePieceCallback);
 		game.gameManager.setClearBoardCallback(clearBoardCallback);
 		game.gameManager.setOutlinePieceMoveCallback(outlinePieceMoveCallback);
+		game.gameManager.spectating = spectate;
 
 		// disable fps counter
 		game.enableFPSCounter = false;
 
-		// Select instance to use.  For now we'll always use the default.
-		m_pInterface = SteamNetworkingSockets();
+		if (showLatency) {
+			game.graphics.addText("Ping: -", "latency", 1, 85, 0.75f, glm::vec3(0.2f));
+		}
+
+		// Select instance to use.  The default unless we were given one.
+		m_pInterface = transport != nullptr ? transport : DefaultTransport();
 
 		// Start connecting
-		char szAddr[SteamNetworkingIPAddr::k_cchMaxString];
-		serverAddr.ToString(szAddr, sizeof(szAddr), true);
-		std::cout << "Connecting to chat server at " << szAddr << std::endl;
-		SteamNetworkingConfigValue_t opt;
-		opt.SetPtr(k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback);
-		m_hConnection = m_pInterface->ConnectByIPAddress(serverAddr, 1, &opt);
-		if (m_hConnection == k_HSteamNetConnection_Invalid) {
-			std::cout << "Failed to create connection" << std::endl;
-		}
+		m_serverAddr = serverAddr;
+		Connect();
 
-		std::cout << "Server commands include: '/quit' and '/clear'" << std::endl;
+		m_pPool = MessagePool::Create(256);
+		m_outbox.Init(m_pInterface, 16, m_pPool);
+
+		RegisterCommands();
+		m_commands.PrintCommands();
 
 		// main loop
 		while (!g_bQuit && game.run() == 1)
 		{
 			PollIncomingMessages();
 			PollConnectionStateChanges();
-			PollLocalUserInput();
+			TryReconnect();
+			m_commands.Poll();
+			FlushSelection();
+			SendPing();
+			m_outbox.Flush();
 			std::this_thread::sleep_for(std::chrono::milliseconds(10));
 		}
+
+		// anything still queued in the library keeps the pool alive until it is sent
+		m_pPool->Release();
+		m_pPool = nullptr;
 	}
 
 	void SendDataToServer(DataPacket *data) {
-		m_pInterface->SendMessageToConnection(m_hConnection, data, (uint32)sizeof(*data), k_nSteamNetworkingSend_Reliable, nullptr);
+		m_outbox.Add(m_hConnection, data, (uint32)sizeof(*data), k_nSteamNetworkingSend_Reliable);
 	}
 
-	// shortcut to just send all relevant info to the server
-	void SendCurrentDataToServer() {
-		// get the base packet
-		DataPacket data = convertBoardToPacket();
-		data.type = DataPacket::MsgType::GAME_DATA;
+	// one ping every k_usecPingInterval, stamped right before it goes out with the rest of the frame
+	void SendPing() {
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+		if (m_hConnection == k_HSteamNetConnection_Invalid || now < m_usecNextPing) {
+			return;
+		}
+
+		TimePacket ping;
+		ping.usecSent = now;
+		m_outbox.Add(m_hConnection, &ping, (uint32)sizeof(ping), k_nPingSendFlags);
+		m_usecNextPing = now + k_usecPingInterval;
+	}
+
+	// remember the latest hovered cell, FlushSelection decides when it actually goes out
+	void SetSelection(int cell) {
+		m_nPendingSelectionCell = cell;
+	}
 
-		// set scores
-		data.score1 = game.gameManager.score1;
-		data.score2 = game.gameManager.score2;
+	// sends the latest cursor cell at most selectionSendRate times a second. anything the cursor passed over in between is never sent.
+	// each change is sent one extra time on the next slot since unreliable packets can get lost and the opponent's marker would be stuck otherwise.
+	void FlushSelection() {
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+		if (selectionSendRate > 0 && now - m_usecLastSelectionSend < (SteamNetworkingMicroseconds)(1000000 / selectionSendRate)) {
+			return;
+		}
 
-		// send turn after the turn has been switched already.
-		data.currentTurn = game.gameManager.currentTurn;
+		if (m_nPendingSelectionCell != m_nSentSelectionCell) {
+			m_nSelectionSeq++;
+			m_nSentSelectionCell = m_nPendingSelectionCell;
+			m_bSelectionRepeatPending = true;
+		}
+		else if (m_bSelectionRepeatPending) {
+			// the repeat keeps the same seq so the receiver ignores it if the first one made it
+			m_bSelectionRepeatPending = false;
+		}
+		else {
+			return;
+		}
+
+		SelectionPacket data;
+		data.seq = m_nSelectionSeq;
+		data.cell = (int8)m_nSentSelectionCell;
+		m_outbox.Add(m_hConnection, &data, (uint32)sizeof(data), k_nSelectionSendFlags);
+
+		m_usecLastSelectionSend = now;
+	}
 
-		// send to server
-		SendDataToServer(&data);
+	// the piece is already on our board, it stays there unless the server turns it down
+	void SendMove(Piece::Color color, int cell) {
+		PendingMove_t pending;
+		pending.m_nMoveId = ++m_nLastMoveId;
+		pending.m_nCell = cell;
+		pending.m_nColor = color;
+		m_vecPendingMoves.push_back(pending);
+
+		MovePacket move;
+		move.moveId = pending.m_nMoveId;
+		move.cell = (int8)cell;
+		move.color = (int8)color;
+		m_outbox.Add(m_hConnection, &move, (uint32)sizeof(move), k_nSteamNetworkingSend_Reliable);
+	}
+
+	// the board was cleared, nothing predicted on the old one matters anymore
+	void ForgetPendingMoves() {
+		m_vecPendingMoves.clear();
 	}
 
 	// game stuff
@@ -137,108 +224,484 @@ private:
 	string filepath;
 
 	HSteamNetConnection m_hConnection;
-	ISteamNetworkingSockets *m_pInterface;
+	ITransport *m_pInterface;
+	SteamNetworkingIPAddr m_serverAddr;
+
+	// reconnect state. the token comes with GAME_SETUP and the seq with every board, both go back to the server on a reconnect
+	uint64 m_nSessionToken = 0;
+	uint32 m_nLastSeq = 0;
+	bool m_bReconnecting = false;
+
+	// the room a room directory sent us to, asked for in the join once we get to the server that has it
+	uint32 m_nRedirectRoomId = 0;
+
+	// the server's hot standby from GAME_SETUP, reconnects take turns between it and the server once the first try fails
+	SteamNetworkingIPAddr m_standbyAddr = {};
+	int m_nReconnectAttempts = 0;
+	SteamNetworkingMicroseconds m_usecNextReconnect = 0;
+
+	// outgoing messages for the current frame, built in buffers from the pool
+	MessageBatch m_outbox;
+	CommandRegistry m_commands{ "Client" };
+	MessagePool *m_pPool = nullptr;
+
+	// cursor channel state
+	int m_nPendingSelectionCell = -1;
+	int m_nSentSelectionCell = -1;
+	bool m_bSelectionRepeatPending = false;
+	uint32 m_nSelectionSeq = 0;
+	SteamNetworkingMicroseconds m_usecLastSelectionSend = 0;
+
+	// newest cursor update seen from the opponent's seat
+	uint32 m_nLastOpponentSelectionSeq = 0;
+
+	// moves we show but the server hasn't put on a board it sent us yet, oldest first.
+	// once confirmed a move stays until a board with at least confirmedSeq arrives, since the result comes before that board.
+	struct PendingMove_t
+	{
+		uint32 m_nMoveId;
+		int m_nCell;
+		int m_nColor;
+		bool m_bConfirmed = false;
+		uint32 m_nConfirmedSeq = 0;
+	};
+	std::vector<PendingMove_t> m_vecPendingMoves;
+	uint32 m_nLastMoveId = 0;
+
+	// round trip and clock offset to the server
+	ClockSync m_clock;
+	SteamNetworkingMicroseconds m_usecNextPing = 0;
+
+	// the newest board the server sent, what a turned down move rolls back to
+	BitBoard m_serverBoard;
+	int m_nServerTurn = Piece::Color::RED;
+
+	// BitBoard::hash of the board above, and whether we asked for the whole board after it stopped matching
+	uint64 m_nServerPieceHash = 0;
+	bool m_bResyncRequested = false;
+
+	void Connect()
+	{
+		char szAddr[SteamNetworkingIPAddr::k_cchMaxString];
+		m_serverAddr.ToString(szAddr, sizeof(szAddr), true);
+		std::cout << "Connecting to chat server at " << szAddr << std::endl;
+		SteamNetworkingConfigValue_t opt;
+		opt.SetPtr(k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback);
+		m_hConnection = m_pInterface->ConnectByIPAddress(m_serverAddr, 1, &opt);
+		if (m_hConnection == k_HSteamNetConnection_Invalid) {
+			std::cout << "Failed to create connection" << std::endl;
+		}
+	}
+
+	// from the directory to the server it picked, everything after this (reconnects too) goes straight there
+	void Redirect(const SteamNetworkingIPAddr &addr, uint32 roomId)
+	{
+		m_pInterface->CloseConnection(m_hConnection, 0, "Redirected", false);
+		m_hConnection = k_HSteamNetConnection_Invalid;
+		m_serverAddr = addr;
+		m_nRedirectRoomId = roomId;
+		Connect();
+	}
+
+	// waits between attempts double each time starting at a quarter second, capped at 4 seconds
+	void ScheduleReconnect()
+	{
+		if (m_nReconnectAttempts >= maxReconnectAttempts) {
+			std::cout << "Could not get back into the game, giving up." << std::endl;
+			m_bReconnecting = false;
+			g_bQuit = true;
+			return;
+		}
+
+		SteamNetworkingMicroseconds usecDelay = std::min((SteamNetworkingMicroseconds)250000 << m_nReconnectAttempts, (SteamNetworkingMicroseconds)4000000);
+		m_usecNextReconnect = SteamNetworkingUtils()->GetLocalTimestamp() + usecDelay;
+		m_nReconnectAttempts++;
+		m_bReconnecting = true;
+	}
+
+	void TryReconnect()
+	{
+		if (!m_bReconnecting || m_hConnection != k_HSteamNetConnection_Invalid) {
+			return;
+		}
+		if (SteamNetworkingUtils()->GetLocalTimestamp() < m_usecNextReconnect) {
+			return;
+		}
+
+		if (m_nReconnectAttempts > 1 && !m_standbyAddr.IsIPv6AllZeros()) {
+			std::swap(m_serverAddr, m_standbyAddr);
+		}
+
+		std::cout << "Reconnecting (attempt " << m_nReconnectAttempts << " of " << maxReconnectAttempts << ")" << std::endl;
+		Connect();
+		if (m_hConnection == k_HSteamNetConnection_Invalid) {
+			ScheduleReconnect();
+		}
+	}
 
 	void PollIncomingMessages()
 	{
-		while (!g_bQuit)
+		ISteamNetworkingMessage *pIncomingMsgs[k_nMaxMessagesPerPoll];
+
+		while (!g_bQuit && m_hConnection != k_HSteamNetConnection_Invalid)
 		{
-			ISteamNetworkingMessage *pIncomingMsg = nullptr;
-			int numMsgs = m_pInterface->ReceiveMessagesOnConnection(m_hConnection, &pIncomingMsg, 1);
+			int numMsgs = m_pInterface->ReceiveMessagesOnConnection(m_hConnection, pIncomingMsgs, k_nMaxMessagesPerPoll);
 			if (numMsgs == 0)
 				break;
 			if (numMsgs < 0)
+			{
 				std::cout << "Error checking for messages" << std::endl;
+				break;
+			}
+
+			// every GAME_DATA is the whole board so only the newest one in the batch and the moves after it need to be applied
+			int lastGameData = -1;
+			for (int i = 0; i < numMsgs; i++)
+			{
+				if (IsGameDataMessage(pIncomingMsgs[i]))
+					lastGameData = i;
+			}
+
+			// handle the whole batch in one pass
+			for (int i = 0; i < numMsgs; i++)
+			{
+				if (i >= lastGameData || !IsBoardMessage(pIncomingMsgs[i]))
+					HandleIncomingMessage(pIncomingMsgs[i]);
 
-			// Just echo anything we get from the server
-			// we trust anything coming from the server so just set the current board to whatever this is
-			DataPacket *data = (DataPacket*)pIncomingMsg->m_pData;
-			// std::cout << "data recieved" << std::endl;
-			switch (data->type) {
-				// connection info
-				// currently broken for some reason
-				case DataPacket::MsgType::CONNECTION_STATUS: {
-					// std::cout << data->msg.c_str() << std::endl;
+				// We don't need this anymore.
+				pIncomingMsgs[i]->Release();
+			}
+
+			// a partial batch means the queue is empty
+			if (numMsgs < k_nMaxMessagesPerPoll)
+				break;
+		}
+	}
+
+	static bool IsGameDataMessage(ISteamNetworkingMessage *pMsg)
+	{
+		return pMsg->m_cbSize >= (int)sizeof(DataPacket) && ((DataPacket*)pMsg->m_pData)->type == DataPacket::MsgType::GAME_DATA;
+	}
+
+	static bool IsBoardMessage(ISteamNetworkingMessage *pMsg)
+	{
+		return IsGameDataMessage(pMsg) || (pMsg->m_cbSize >= (int)sizeof(DataPacket::MsgType) && ((DataPacket*)pMsg->m_pData)->type == DataPacket::MsgType::GAME_DELTA);
+	}
+
+	void HandleIncomingMessage(ISteamNetworkingMessage *pIncomingMsg)
+	{
+		// too small to even hold the type
+		if (pIncomingMsg->m_cbSize < (int)sizeof(DataPacket::MsgType)) {
+			return;
+		}
+
+		// we trust anything coming from the server so just set the current board to whatever this is
+		DataPacket *data = (DataPacket*)pIncomingMsg->m_pData;
+		// std::cout << "data recieved" << std::endl;
+		switch (data->type) {
+			// connection info
+			// currently broken for some reason
+			case DataPacket::MsgType::CONNECTION_STATUS: {
+				// std::cout << data->msg.c_str() << std::endl;
+				break;
+			}
+			// a person is moving their outline piece
+			case DataPacket::MsgType::GAME_SELECTION: {
+				if (pIncomingMsg->m_cbSize < (int)sizeof(SelectionPacket)) {
 					break;
 				}
-				// a person is moving their outline piece
-				case DataPacket::MsgType::GAME_SELECTION: {
-					game.gameManager.setOpponentOutlinePiece(data->selectedVisible, data->selectedPiecePos);
 
+				// skip updates that got overtaken by a newer one on the way here
+				SelectionPacket *selection = (SelectionPacket*)pIncomingMsg->m_pData;
+				if (!IsNewerSeq(selection->seq, m_nLastOpponentSelectionSeq)) {
 					break;
 				}
-				// attempting to place a piece
-				case DataPacket::MsgType::GAME_DATA: {
-					// don't update the data on the board if one player is still in the win-pause menu.
-					if (!game.gameManager.winPause) {
-						// board pieces
-						game.gameManager.board.setBoardToData(data);
-
-						// set current scores
-						game.gameManager.setScores((int)data->score1, (int)data->score2);
-
-						// set the current turn
-						game.gameManager.setTurnToInt(data->currentTurn);
-					}
+				m_nLastOpponentSelectionSeq = selection->seq;
+
+				if (selection->cell >= 0 && selection->cell < 64) {
+					game.gameManager.setOpponentOutlinePiece(true, CoordFromCell(selection->cell));
+				}
+				else {
+					game.gameManager.setOpponentOutlinePiece(false, glm::vec3(-1));
+				}
+
+				break;
+			}
+			// attempting to place a piece
+			case DataPacket::MsgType::GAME_DATA: {
+				if (pIncomingMsg->m_cbSize < (int)sizeof(DataPacket)) {
+					break;
+				}
+
+				m_nLastSeq = data->seq;
+				m_serverBoard.fromPacket(data);
+				m_nServerTurn = data->currentTurn;
+				m_nServerPieceHash = m_serverBoard.hash();
+				m_bResyncRequested = false;
 
+				// don't update the data on the board if one player is still in the win-pause menu.
+				if (!game.gameManager.winPause) {
+					// board pieces and turn, with our own moves the server hasn't answered yet still on it
+					ShowServerBoard();
+
+					// set current scores
+					game.gameManager.setScores((int)data->score1, (int)data->score2);
+				}
+
+				break;
+			}
+			// only the moves since the last board
+			case DataPacket::MsgType::GAME_DELTA: {
+				DeltaPacket *delta = (DeltaPacket*)pIncomingMsg->m_pData;
+				if (pIncomingMsg->m_cbSize < (int)offsetof(DeltaPacket, moves)
+					|| delta->numMoves < 1 || delta->numMoves > k_nMaxDeltaMoves
+					|| pIncomingMsg->m_cbSize < (int)delta->size()) {
 					break;
 				}
-				// First setup message recieved from server that specifies the clients turn (Color)
-				case DataPacket::MsgType::GAME_SETUP: {
-					game.gameManager.placeOnlyOnTurn = data->assignedTurn;
 
+				if (ApplyDelta(delta) && !game.gameManager.winPause) {
+					ShowServerBoard();
+				}
+				break;
+			}
+			// the server timing us, send it straight back
+			case DataPacket::MsgType::PING: {
+				if (pIncomingMsg->m_cbSize < (int)sizeof(TimePacket)) {
+					break;
+				}
+
+				TimePacket pong = *(TimePacket*)pIncomingMsg->m_pData;
+				pong.type = DataPacket::MsgType::PONG;
+				pong.usecPeerReceived = pIncomingMsg->m_usecTimeReceived;
+				pong.usecPeerReplied = SteamNetworkingUtils()->GetLocalTimestamp();
+				m_outbox.Add(m_hConnection, &pong, (uint32)sizeof(pong), k_nPingSendFlags);
+				break;
+			}
+			// the answer to one of our pings
+			case DataPacket::MsgType::PONG: {
+				if (pIncomingMsg->m_cbSize < (int)sizeof(TimePacket)) {
+					break;
+				}
+
+				TimePacket *pong = (TimePacket*)pIncomingMsg->m_pData;
+				m_clock.AddSample(pong->usecSent, pong->usecPeerReceived, pong->usecPeerReplied, pIncomingMsg->m_usecTimeReceived);
+				if (showLatency) {
+					game.graphics.setText("latency", "Ping: " + std::to_string((m_clock.Rtt() + 500) / 1000) + " ms (+/- " + std::to_string((m_clock.Jitter() + 500) / 1000) + ")");
+				}
+				break;
+			}
+			// whether the server took one of our moves
+			case DataPacket::MsgType::GAME_MOVE_RESULT: {
+				if (pIncomingMsg->m_cbSize < (int)sizeof(MoveResultPacket)) {
+					break;
+				}
+
+				MoveResultPacket *result = (MoveResultPacket*)pIncomingMsg->m_pData;
+				for (size_t i = 0; i < m_vecPendingMoves.size(); i++) {
+					if (m_vecPendingMoves[i].m_nMoveId != result->moveId) {
+						continue;
+					}
+
+					if (result->accepted) {
+						m_vecPendingMoves[i].m_bConfirmed = true;
+						m_vecPendingMoves[i].m_nConfirmedSeq = result->seq;
+					}
+					else {
+						// anything placed after it was placed on a board that never existed
+						std::cout << "The server did not accept that move" << std::endl;
+						m_vecPendingMoves.erase(m_vecPendingMoves.begin() + i, m_vecPendingMoves.end());
+						if (!game.gameManager.winPause) {
+							ShowServerBoard();
+						}
+					}
 					break;
 				}
-				default: {
-					std::cout << "Recieved data of no known type" << std::endl;
+				break;
+			}
+			// First setup message recieved from server that specifies the clients turn (Color)
+			case DataPacket::MsgType::GAME_SETUP: {
+				// we reached a room directory, it says which server has our match
+				if (!data->redirect.IsIPv6AllZeros()) {
+					Redirect(data->redirect, data->redirectRoomId);
 					break;
 				}
+
+				game.gameManager.placeOnlyOnTurn = data->assignedTurn;
+				m_nSessionToken = data->sessionToken;
+				m_vecPendingMoves.clear();
+				if (!data->standby.IsIPv6AllZeros()) {
+					m_standbyAddr = data->standby;
+				}
+
+				// in a seat again, a standby that isn't serving yet only turns us away after we connect
+				m_nReconnectAttempts = 0;
+
+				// the server counts each seat's selections per room, a new room starts from the beginning again
+				m_nLastOpponentSelectionSeq = 0;
+
+				break;
 			}
+			// back in our seat after a reconnect, bring the board up to date
+			case DataPacket::MsgType::GAME_RESUME: {
+				ResumePacket *resume = (ResumePacket*)pIncomingMsg->m_pData;
+				if (pIncomingMsg->m_cbSize < (int)offsetof(ResumePacket, moves)
+					|| resume->numMoves < 0 || resume->numMoves > k_nMaxMovesPerGame
+					|| pIncomingMsg->m_cbSize < (int)resume->size()) {
+					break;
+				}
+
+				ApplyResume(resume);
 
-			// We don't need this anymore.
-			pIncomingMsg->Release();
+				// the seat could be back on the standby, which counts from the beginning again
+				m_nLastOpponentSelectionSeq = 0;
+				break;
+			}
+			default: {
+				std::cout << "Recieved data of no known type" << std::endl;
+				break;
+			}
 		}
 	}
 
-	void PollLocalUserInput()
+	// the server's board with the moves we are still waiting on put back on top.
+	// moves the board already has are dropped first, as are ones that no longer fit on it.
+	void ShowServerBoard()
 	{
-		std::string cmd;
-		while (!g_bQuit && LocalUserInput_GetNext(cmd))
+		BitBoard shown = m_serverBoard;
+		int turn = m_nServerTurn;
+		for (size_t i = 0; i < m_vecPendingMoves.size(); )
 		{
-
-			// Check for known commands
-			if (strcmp(cmd.c_str(), "/quit") == 0)
+			PendingMove_t &pending = m_vecPendingMoves[i];
+			bool bOnBoard = pending.m_bConfirmed && !IsNewerSeq(pending.m_nConfirmedSeq, m_nLastSeq);
+			if (bOnBoard || !shown.isEmpty(pending.m_nCell))
 			{
-				g_bQuit = true;
-				std::cout << "Disconnecting from chat server" << std::endl;
-
-				// Close the connection
-				m_pInterface->CloseConnection(m_hConnection, 0, "Goodbye", true);
-				break;
+				m_vecPendingMoves.erase(m_vecPendingMoves.begin() + i);
+				continue;
 			}
 
-			// reset the game board in case of error
-			if (strcmp(cmd.c_str(), "/clear") == 0) {
-				DataPacket data;
-				data.type = DataPacket::MsgType::GAME_DATA;
-				data.currentTurn = 1;
+			shown.place(pending.m_nColor, pending.m_nCell);
+			turn = OtherColor(pending.m_nColor);
+			i++;
+		}
 
-				for (int x = 0; x < 4; x++) {
-					for (int y = 0; y < 4; y++) {
-						for (int z = 0; z < 4; z++) {
-							data.board[x][y][z] = 0;
-						}
+		DataPacket data;
+		shown.toPacket(&data);
+		game.gameManager.board.setBoardToData(&data);
+		game.gameManager.setTurnToInt(turn);
+	}
+
+	// puts the moves on the server's board, keeping its hash up to date a piece at a time. false if they weren't used,
+	// when they don't start from the board we have or don't end up where the server says we ask for the whole board.
+	bool ApplyDelta(const DeltaPacket *delta)
+	{
+		// the whole board is on its way, or these moves are already on the one we have
+		if (m_bResyncRequested || !IsNewerSeq(delta->moves[delta->numMoves - 1].seq, m_nLastSeq)) {
+			return false;
+		}
+
+		if (delta->baseSeq != m_nLastSeq) {
+			RequestResync();
+			return false;
+		}
+
+		for (int i = 0; i < delta->numMoves; i++) {
+			const MoveRecord &move = delta->moves[i];
+			m_serverBoard.place(move.color, move.cell);
+			m_nServerPieceHash ^= ZobristPiece(move.color, move.cell);
+			m_nServerTurn = move.nextTurn;
+			m_nLastSeq = move.seq;
+		}
+
+		if ((m_nServerPieceHash ^ ZobristTurn(m_nServerTurn)) != delta->hash) {
+			RequestResync();
+			return false;
+		}
+		return true;
+	}
+
+	// asks once, anything that comes before the whole board is ignored
+	void RequestResync()
+	{
+		if (m_bResyncRequested) {
+			return;
+		}
+		m_bResyncRequested = true;
+
+		std::cout << "Lost track of the board, asking the server for all of it" << std::endl;
+		ResyncPacket resync;
+		m_outbox.Add(m_hConnection, &resync, (uint32)sizeof(resync), k_nSteamNetworkingSend_Reliable);
+	}
+
+	// the snapshot (or the board we still have) plus the moves we missed
+	void ApplyResume(const ResumePacket *resume)
+	{
+		DataPacket data = convertBoardToPacket();
+		BitBoard bits;
+		int turn = game.gameManager.currentTurn;
+		if (resume->hasSnapshot) {
+			bits.red = resume->red;
+			bits.blue = resume->blue;
+			turn = resume->currentTurn;
+			game.gameManager.setScores(resume->score1, resume->score2);
+			m_nLastSeq = resume->snapshotSeq;
+		}
+		else {
+			bits.fromPacket(&data);
+		}
+
+		for (int i = 0; i < resume->numMoves; i++) {
+			const MoveRecord &move = resume->moves[i];
+			bits.place(move.color, move.cell);
+			turn = move.nextTurn;
+			m_nLastSeq = move.seq;
+		}
+
+		bits.toPacket(&data);
+		game.gameManager.board.setBoardToData(&data);
+		game.gameManager.setTurnToInt(turn);
+
+		// whatever we sent before the connection dropped either made it into those moves or never arrived
+		m_serverBoard = bits;
+		m_nServerTurn = turn;
+		m_nServerPieceHash = bits.hash();
+		m_bResyncRequested = false;
+		m_vecPendingMoves.clear();
+
+		std::cout << "Back in the game, caught up on " << resume->numMoves << " move(s)" << (resume->hasSnapshot ? " from a snapshot" : "") << std::endl;
+	}
+
+	void RegisterCommands()
+	{
+		m_commands.Add("/quit", nullptr, [this](const std::string &) {
+			g_bQuit = true;
+			std::cout << "Disconnecting from chat server" << std::endl;
+
+			// Close the connection once the server has everything we sent
+			m_outbox.Flush();
+			FlushConnections(m_pInterface, { m_hConnection }, k_usecMaxFlushOnShutdown);
+			m_pInterface->CloseConnection(m_hConnection, 0, "Goodbye", true);
+		});
+
+		// start the next game, the server only clears the board once this one is won or full and sends it back otherwise
+		m_commands.Add("/clear", nullptr, [this](const std::string &) {
+			DataPacket data;
+			data.type = DataPacket::MsgType::GAME_DATA;
+			data.currentTurn = 1;
+
+			for (int x = 0; x < 4; x++) {
+				for (int y = 0; y < 4; y++) {
+					for (int z = 0; z < 4; z++) {
+						data.board[x][y][z] = 0;
 					}
 				}
-
-				SendDataToServer(&data);
 			}
 
-			std::cout << "Server commands include: '/quit' and '/clear'" << std::endl;
+			SendDataToServer(&data);
+		});
 
-			// Anything else, just send it to the server and let them parse it
-			// m_pInterface->SendMessageToConnection(m_hConnection, cmd.c_str(), (uint32)cmd.length(), k_nSteamNetworkingSend_Reliable, nullptr);
-		}
+		m_commands.Add("/ping", nullptr, [this](const std::string &) {
+			std::cout << "Round trip " << m_clock.Rtt() << " us, jitter " << m_clock.Jitter() << " us, server clock offset " << m_clock.Offset() << " us (" << m_clock.Samples() << " samples)" << std::endl;
+		});
 	}
 
 	void OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo)
@@ -255,7 +718,11 @@ private:
 		case k_ESteamNetworkingConnectionState_ClosedByPeer:
 		case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
 		{
-			g_bQuit = true;
+			// a player that already had a seat tries to get it back, everyone else is done
+			bool bReconnect = !g_bQuit && m_nSessionToken != 0 && !spectate && (m_bReconnecting || pInfo->m_eOldState == k_ESteamNetworkingConnectionState_Connected);
+			if (!bReconnect) {
+				g_bQuit = true;
+			}
 
 			// Print an appropriate message
 			if (pInfo->m_eOldState == k_ESteamNetworkingConnectionState_Connecting)
@@ -282,6 +749,10 @@ private:
 			// so we just pass 0's.
 			m_pInterface->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
 			m_hConnection = k_HSteamNetConnection_Invalid;
+
+			if (bReconnect) {
+				ScheduleReconnect();
+			}
 			break;
 		}
 
@@ -291,8 +762,21 @@ private:
 			break;
 
 		case k_ESteamNetworkingConnectionState_Connected:
+		{
 			std::cout << "Connected to server OK" << std::endl;
+			m_bReconnecting = false;
+
+			// ask for a seat or a match to watch, or for our old seat back
+			JoinPacket join;
+			join.role = spectate ? JoinPacket::Role::SPECTATOR : JoinPacket::Role::PLAYER;
+			join.roomId = spectate ? spectateRoomId : m_nRedirectRoomId;
+			join.sessionToken = m_nSessionToken;
+			join.lastSeq = m_nLastSeq;
+			join.rating = rating;
+			join.againstBot = againstBot ? 1 : 0;
+			m_outbox.Add(m_hConnection, &join, (uint32)sizeof(join), k_nSteamNetworkingSend_Reliable);
 			break;
+		}
 
 		default:
 			// Silences -Wswitch
@@ -315,24 +799,25 @@ private:
 
 // called when a piece is moved
 void outlinePieceMoveCallback(bool visible, glm::vec3 pos) {
-	// send packet to server
+	// hand the cell to the cursor channel, it gets sent on the next flush
 	Client *client = (Client*)clientPtr;
+	if (client->spectate) {
+		return;
+	}
 
-	DataPacket data;
-	data.type = data.GAME_SELECTION;
-	data.selectedVisible = visible;
-	data.selectedPiecePos = pos;
-
-	client->SendDataToServer(&data);
+	if (visible) {
+		client->SetSelection(CellFromCoord((int)pos.x, (int)pos.y, (int)pos.z));
+	}
+	else {
+		client->SetSelection(-1);
+	}
 }
 
 // called when a piece is placed
 void placePieceCallback(Piece::Color color, glm::vec3 pos) {
-	// send packet to server
+	// the game manager already put it on the board, tell the server about it
 	Client *client = (Client*)clientPtr;
-	// if it is the clients turn
-
-	client->SendCurrentDataToServer();
+	client->SendMove(color, CellFromCoord((int)pos.x, (int)pos.y, (int)pos.z));
 
 	// std::cout << "sent message to server of type" << std::endl;
 }
@@ -341,17 +826,22 @@ void placePieceCallback(Piece::Color color, glm::vec3 pos) {
 void clearBoardCallback() {
 	Client *client = (Client*)clientPtr;
 
+	// the players restart the game, spectators just wait for the new board
+	if (client->spectate) {
+		return;
+	}
+
+	client->ForgetPendingMoves();
+
 	// get empty board
 	DataPacket data = client->convertBoardToPacket();
 
 	// set packet type
 	data.type = data.GAME_DATA;
 
-	// set scores
-	data.score1 = client->game.gameManager.score1;
-	data.score2 = client->game.gameManager.score2;
-
-	// set turn to neutral so the original turns remain.
+	// the server keeps the scores and whose turn it is, only the empty board counts
+	data.score1 = 0;
+	data.score2 = 0;
 	data.currentTurn = 0;
 
 	client->SendDataToServer(&data);
@@ -0,0 +1,80 @@
+// round trip time and clock offset to the other end of a connection, from timestamped ping/pong pairs.
+// both ends stamp with their own SteamNetworkingUtils()->GetLocalTimestamp(), which starts at an arbitrary point
+// in each process, so the offset is what has to be added to one of the other end's timestamps to get ours.
+
+#ifndef CLOCKSYNC_H
+#define CLOCKSYNC_H
+
+#include <algorithm>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+
+// how often each end pings the other
+const SteamNetworkingMicroseconds k_usecPingInterval = 1000000;
+
+// the pings are unreliable and skip nagle so they aren't held back behind anything else
+const int k_nPingSendFlags = k_nSteamNetworkingSend_UnreliableNoNagle;
+
+class ClockSync {
+public:
+	ClockSync() {
+		m_usecRtt = 0;
+		m_usecRttVar = 0;
+		m_usecOffset = 0;
+		m_nSamples = 0;
+	}
+
+	// usecSent and usecReceived are ours (the ping going out, the pong coming in),
+	// usecPeerReceived and usecPeerReplied are the other end's (the ping coming in, the pong going out)
+	void AddSample(SteamNetworkingMicroseconds usecSent, SteamNetworkingMicroseconds usecPeerReceived, SteamNetworkingMicroseconds usecPeerReplied, SteamNetworkingMicroseconds usecReceived) {
+		// the time the other end held on to the ping doesn't count
+		SteamNetworkingMicroseconds rtt = std::max((SteamNetworkingMicroseconds)0, (usecReceived - usecSent) - (usecPeerReplied - usecPeerReceived));
+		SteamNetworkingMicroseconds offset = ((usecSent - usecPeerReceived) + (usecReceived - usecPeerReplied)) / 2;
+
+		if (m_nSamples == 0) {
+			m_usecRtt = rtt;
+			m_usecRttVar = rtt / 2;
+			m_usecOffset = offset;
+		}
+		else {
+			// the same smoothing tcp uses for its retransmit timer, 1/8 for the average and 1/4 for the deviation
+			SteamNetworkingMicroseconds diff = rtt - m_usecRtt;
+			m_usecRttVar += ((diff < 0 ? -diff : diff) - m_usecRttVar) / 4;
+			m_usecRtt += diff / 8;
+
+			// the offset is off by up to half the difference between the two directions, which is only small when
+			// the round trip is. a sample from a slow round trip is left out instead of pulling the estimate around.
+			if (rtt <= m_usecRtt + m_usecRttVar) {
+				m_usecOffset += (offset - m_usecOffset) / 8;
+			}
+		}
+		m_nSamples++;
+	}
+
+	// smoothed round trip time, 0 before the first sample
+	SteamNetworkingMicroseconds Rtt() const {
+		return m_usecRtt;
+	}
+
+	// smoothed mean deviation of the round trip time
+	SteamNetworkingMicroseconds Jitter() const {
+		return m_usecRttVar;
+	}
+
+	// add to a timestamp from the other end to get our time for it
+	SteamNetworkingMicroseconds Offset() const {
+		return m_usecOffset;
+	}
+
+	int Samples() const {
+		return m_nSamples;
+	}
+
+private:
+	SteamNetworkingMicroseconds m_usecRtt;
+	SteamNetworkingMicroseconds m_usecRttVar;
+	SteamNetworkingMicroseconds m_usecOffset;
+	int m_nSamples;
+};
+
+#endif
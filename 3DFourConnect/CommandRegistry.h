@@ -0,0 +1,87 @@
+// the console commands of a main loop. each one is a name like "/kick" and a handler that is given the rest of the
+// line, so "/kick 12 1" runs the "/kick" handler with "12 1". a line that isn't a command gets the list of them.
+
+#ifndef COMMANDREGISTRY_H
+#define COMMANDREGISTRY_H
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "Tools.h"
+
+class CommandRegistry {
+public:
+	typedef std::function<void(const std::string &args)> Handler;
+
+	// pszOwner starts the list of commands, "Server" gives "Server commands include: ..."
+	explicit CommandRegistry(const char *pszOwner) : m_sOwner(pszOwner) {}
+
+	// pszArgs is only for the list, "ROOM SEAT" shows up as "'/kick ROOM SEAT'". nullptr if it takes none.
+	void Add(const char *pszName, const char *pszArgs, Handler handler) {
+		Command_t command;
+		command.m_sName = pszName;
+		command.m_sArgs = pszArgs != nullptr ? pszArgs : "";
+		command.m_handler = handler;
+		m_vecCommands.push_back(command);
+	}
+
+	// runs the command the line starts with, false if there is none by that name
+	bool Dispatch(const std::string &line) {
+		size_t endName = line.find_first_of(" \t");
+		std::string name = line.substr(0, endName);
+		std::string args;
+		if (endName != std::string::npos) {
+			size_t startArgs = line.find_first_not_of(" \t", endName);
+			if (startArgs != std::string::npos) {
+				args = line.substr(startArgs);
+			}
+		}
+
+		for (const Command_t &command : m_vecCommands) {
+			if (command.m_sName == name) {
+				command.m_handler(args);
+				return true;
+			}
+		}
+		PrintCommands();
+		return false;
+	}
+
+	// every line typed since the last call, from inside the loop
+	void Poll() {
+		std::string line;
+		while (!g_bQuit && LocalUserInput_GetNext(line)) {
+			Dispatch(line);
+		}
+	}
+
+	void PrintCommands() const {
+		std::cout << m_sOwner << " commands include: ";
+		for (size_t i = 0; i < m_vecCommands.size(); i++) {
+			if (i > 0) {
+				std::cout << (i + 1 == m_vecCommands.size() ? " and " : ", ");
+			}
+			std::cout << "'" << m_vecCommands[i].m_sName;
+			if (!m_vecCommands[i].m_sArgs.empty()) {
+				std::cout << " " << m_vecCommands[i].m_sArgs;
+			}
+			std::cout << "'";
+		}
+		std::cout << std::endl;
+	}
+
+private:
+	struct Command_t
+	{
+		std::string m_sName;
+		std::string m_sArgs;
+		Handler m_handler;
+	};
+
+	std::string m_sOwner;
+	std::vector<Command_t> m_vecCommands;
+};
+
+#endif
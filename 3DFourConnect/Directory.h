@@ -0,0 +1,479 @@
+// the room directory, for spreading the matches over several server processes once one is not enough.
+// the processes connect to it and report where clients reach them and how busy they are (see DirectoryPacket),
+// and clients connect to it as if it was a server. it pairs the players up by rating the same way a server does,
+// picks the least loaded process for each match and sends both players there in GAME_SETUP with the room to join.
+// spectators go to the process whose block of room ids has the room they asked for. nothing about the games
+// themselves goes through it, so it stays cheap however many processes there are.
+
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include "Tools.h"
+#include "Transport.h"
+#include "MessageBatch.h"
+#include "Matchmaker.h"
+#include "CommandRegistry.h"
+
+class Directory {
+public:
+	// how long a player waits for an opponent here before they are sent to a process to wait there instead, where
+	// they can also take an open seat or be given a bot
+	int matchWaitSeconds = 5;
+
+	// what to listen on, the real network if left null
+	ITransport *transport = nullptr;
+
+	void Run(uint16 nPort)
+	{
+		m_pInterface = transport != nullptr ? transport : DefaultTransport();
+
+		SteamNetworkingIPAddr localAddr;
+		localAddr.Clear();
+		localAddr.m_port = nPort;
+		SteamNetworkingConfigValue_t opt;
+		opt.SetPtr(k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback);
+		m_hListenSock = m_pInterface->CreateListenSocketIP(localAddr, 1, &opt);
+		m_hPollGroup = m_pInterface->CreatePollGroup();
+		if (m_hListenSock == k_HSteamListenSocket_Invalid || m_hPollGroup == k_HSteamNetPollGroup_Invalid)
+			std::cout << "Failed to listen on port " << nPort << std::endl;
+		std::cout << "Room directory listening on port " << nPort << std::endl;
+
+		m_pPool = MessagePool::Create(256);
+		m_outbox.Init(m_pInterface, k_nMaxMessagesPerPoll, m_pPool);
+
+		RegisterCommands();
+		m_commands.PrintCommands();
+
+		while (!g_bQuit)
+		{
+			PollIncomingMessages();
+			PollConnectionStateChanges();
+			m_commands.Poll();
+			RunMatchmaking();
+			m_outbox.Flush();
+
+			// nothing here is in a hurry, the games don't go through us
+			LocalUserInput_Wait(k_usecTick);
+		}
+
+		std::cout << "Closing connections..." << std::endl;
+		std::vector<HSteamNetConnection> vecConns;
+		for (auto &process : m_mapProcesses)
+			vecConns.push_back(process.first);
+		for (auto &client : m_mapClients)
+			vecConns.push_back(client.first);
+		FlushConnections(m_pInterface, vecConns, k_usecMaxFlushOnShutdown);
+		for (auto &process : m_mapProcesses)
+			m_pInterface->CloseConnection(process.first, 0, "Directory Shutdown", true);
+		for (auto &client : m_mapClients)
+			m_pInterface->CloseConnection(client.first, 0, "Directory Shutdown", true);
+		m_mapProcesses.clear();
+		m_mapClients.clear();
+
+		m_pPool->Release();
+		m_pPool = nullptr;
+
+		m_pInterface->CloseListenSocket(m_hListenSock);
+		m_hListenSock = k_HSteamListenSocket_Invalid;
+		m_pInterface->DestroyPollGroup(m_hPollGroup);
+		m_hPollGroup = k_HSteamNetPollGroup_Invalid;
+	}
+
+private:
+	static const SteamNetworkingMicroseconds k_usecTick = 5000;
+
+	// a process that hasn't reported for this long is sent nobody new until it does
+	static const SteamNetworkingMicroseconds k_usecReportTimeout = 5000000;
+
+	HSteamListenSocket m_hListenSock;
+	HSteamNetPollGroup m_hPollGroup;
+	ITransport *m_pInterface;
+
+	MessageBatch m_outbox;
+	CommandRegistry m_commands{ "Directory" };
+	MessagePool *m_pPool = nullptr;
+
+	struct Process_t
+	{
+		SteamNetworkingIPAddr m_addr;
+		uint32 m_nFirstRoomId = 0;
+
+		// the next room for a match we make, from the top half of the process's block
+		uint32 m_nNextMatchRoomId = 0;
+
+		// as last reported, plus the players we sent there since
+		int m_nConnections = 0;
+		int m_nMaxConnections = 0;
+		int m_nRooms = 0;
+		int m_nQueued = 0;
+		SteamNetworkingMicroseconds m_usecLastReport = 0;
+
+		uint64 m_nPlayersSent = 0;
+	};
+
+	// by the process's connection to us
+	std::map< HSteamNetConnection, Process_t > m_mapProcesses;
+
+	// every other connection, until it has been sent somewhere and goes
+	struct Client_t
+	{
+		bool m_bJoined = false;
+	};
+	std::map< HSteamNetConnection, Client_t > m_mapClients;
+
+	Matchmaker m_matchmaker;
+	std::vector< Matchmaker::Match_t > m_vecMatches;
+	std::vector< HSteamNetConnection > m_vecOverdue;
+
+	uint64 m_nMatches = 0;
+	uint64 m_nRedirects = 0;
+	uint64 m_nTurnedAway = 0;
+
+	void PollIncomingMessages()
+	{
+		SteamNetworkingMessage_t *pIncomingMsgs[k_nMaxMessagesPerPoll];
+		while (!g_bQuit)
+		{
+			int numMsgs = m_pInterface->ReceiveMessagesOnPollGroup(m_hPollGroup, pIncomingMsgs, k_nMaxMessagesPerPoll);
+			if (numMsgs <= 0)
+				break;
+
+			for (int i = 0; i < numMsgs; i++)
+			{
+				HandleIncomingMessage(pIncomingMsgs[i]);
+				pIncomingMsgs[i]->Release();
+			}
+
+			// a partial batch means the queue is empty
+			if (numMsgs < k_nMaxMessagesPerPoll)
+				break;
+		}
+	}
+
+	void HandleIncomingMessage(SteamNetworkingMessage_t *pIncomingMsg)
+	{
+		if (pIncomingMsg->m_cbSize < (int)sizeof(DataPacket::MsgType))
+			return;
+
+		DataPacket *data = (DataPacket*)pIncomingMsg->m_pData;
+		switch (data->type)
+		{
+		case DataPacket::MsgType::DIRECTORY_REPORT:
+			if (pIncomingMsg->m_cbSize >= (int)sizeof(DirectoryPacket))
+				HandleReport(pIncomingMsg->m_conn, (DirectoryPacket*)pIncomingMsg->m_pData);
+			break;
+
+		case DataPacket::MsgType::GAME_JOIN:
+			if (pIncomingMsg->m_cbSize >= (int)sizeof(JoinPacket))
+				HandleJoin(pIncomingMsg->m_conn, (JoinPacket*)pIncomingMsg->m_pData);
+			break;
+
+		// everything else is for the game servers
+		default:
+			break;
+		}
+	}
+
+	// the first report makes the connection a process and gives it its block of room ids
+	void HandleReport(HSteamNetConnection conn, const DirectoryPacket *report)
+	{
+		auto itProcess = m_mapProcesses.find(conn);
+		if (itProcess == m_mapProcesses.end())
+		{
+			auto itClient = m_mapClients.find(conn);
+			if (itClient == m_mapClients.end() || itClient->second.m_bJoined)
+				return;
+			m_mapClients.erase(itClient);
+
+			uint32 firstRoomId = report->firstRoomId;
+			if (firstRoomId == 0 || firstRoomId % k_nRoomIdsPerProcess != 0 || BlockTaken(firstRoomId))
+				firstRoomId = FreeBlock();
+			if (firstRoomId == 0)
+			{
+				m_pInterface->CloseConnection(conn, 0, "No room ids left", true);
+				return;
+			}
+
+			Process_t &process = m_mapProcesses[conn];
+			process.m_nFirstRoomId = firstRoomId;
+			process.m_nNextMatchRoomId = firstRoomId + k_nRoomIdsPerProcess / 2;
+			m_pInterface->SetConnectionName(conn, "Server process");
+
+			DirectoryPacket answer;
+			answer.firstRoomId = process.m_nFirstRoomId;
+			m_outbox.Add(conn, &answer, (uint32)sizeof(answer), k_nSteamNetworkingSend_Reliable);
+
+			char szAddr[SteamNetworkingIPAddr::k_cchMaxString];
+			report->addr.ToString(szAddr, sizeof(szAddr), true);
+			std::cout << "Server process at " << szAddr << " joined, its rooms start at " << process.m_nFirstRoomId << std::endl;
+			itProcess = m_mapProcesses.find(conn);
+		}
+
+		Process_t &process = itProcess->second;
+		process.m_addr = report->addr;
+		process.m_nConnections = report->connections;
+		process.m_nMaxConnections = report->maxConnections;
+		process.m_nRooms = report->rooms;
+		process.m_nQueued = report->queued;
+		process.m_usecLastReport = SteamNetworkingUtils()->GetLocalTimestamp();
+	}
+
+	void HandleJoin(HSteamNetConnection conn, const JoinPacket *join)
+	{
+		auto itClient = m_mapClients.find(conn);
+		if (itClient == m_mapClients.end() || itClient->second.m_bJoined)
+			return;
+		itClient->second.m_bJoined = true;
+
+		// the room's id says which process has it, without one the busiest process has the best chance of a good match
+		if (join->role == JoinPacket::Role::SPECTATOR)
+		{
+			Process_t *pProcess = join->roomId != 0 ? ProcessForRoom(join->roomId) : BusiestProcess();
+			if (pProcess == nullptr)
+				TurnAway(conn, "There is no match to watch right now.");
+			else
+				Redirect(conn, *pProcess, join->roomId);
+			return;
+		}
+
+		if (join->againstBot != 0)
+		{
+			Process_t *pProcess = LeastLoadedProcess(false);
+			if (pProcess == nullptr)
+				TurnAway(conn, "Every server is full, try again later.");
+			else
+				Redirect(conn, *pProcess, 0);
+			return;
+		}
+
+		m_matchmaker.Enqueue(conn, join->rating > 0 ? join->rating : k_nDefaultRating, SteamNetworkingUtils()->GetLocalTimestamp());
+	}
+
+	// both players of every pair go to the least loaded process and into the same room there. a player still waiting
+	// after matchWaitSeconds goes to whichever process already has somebody waiting, or the least loaded one.
+	void RunMatchmaking()
+	{
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+		m_vecMatches.clear();
+		m_vecOverdue.clear();
+		m_matchmaker.FormMatches(now, (SteamNetworkingMicroseconds)matchWaitSeconds * 1000000, m_vecMatches, m_vecOverdue);
+
+		for (const Matchmaker::Match_t &match : m_vecMatches)
+		{
+			Process_t *pProcess = LeastLoadedProcess(false);
+			if (pProcess == nullptr)
+			{
+				TurnAway(match.m_players[0], "Every server is full, try again later.");
+				TurnAway(match.m_players[1], "Every server is full, try again later.");
+				continue;
+			}
+
+			uint32 roomId = pProcess->m_nNextMatchRoomId++;
+			if (pProcess->m_nNextMatchRoomId == pProcess->m_nFirstRoomId + k_nRoomIdsPerProcess)
+				pProcess->m_nNextMatchRoomId = pProcess->m_nFirstRoomId + k_nRoomIdsPerProcess / 2;
+			pProcess->m_nRooms++;
+
+			Redirect(match.m_players[0], *pProcess, roomId);
+			Redirect(match.m_players[1], *pProcess, roomId);
+			m_nMatches++;
+		}
+
+		for (HSteamNetConnection conn : m_vecOverdue)
+		{
+			m_matchmaker.Remove(conn);
+			Process_t *pProcess = LeastLoadedProcess(true);
+			if (pProcess == nullptr)
+			{
+				TurnAway(conn, "Every server is full, try again later.");
+				continue;
+			}
+
+			// one waiting there is as good as matched, otherwise this one is the one waiting now
+			pProcess->m_nQueued += pProcess->m_nQueued > 0 ? -1 : 1;
+			Redirect(conn, *pProcess, 0);
+		}
+	}
+
+	void Redirect(HSteamNetConnection conn, Process_t &process, uint32 roomId)
+	{
+		DataPacket setup;
+		setup.type = DataPacket::MsgType::GAME_SETUP;
+		setup.assignedTurn = 0;
+		setup.redirect = process.m_addr;
+		setup.redirectRoomId = roomId;
+		m_outbox.Add(conn, &setup, (uint32)sizeof(setup), k_nSteamNetworkingSend_Reliable);
+
+		// counts against the process until its next report says how it really is
+		process.m_nConnections++;
+		process.m_nPlayersSent++;
+		m_nRedirects++;
+	}
+
+	void TurnAway(HSteamNetConnection conn, const char *pszReason)
+	{
+		m_pInterface->CloseConnection(conn, 0, pszReason, true);
+		m_mapClients.erase(conn);
+		m_nTurnedAway++;
+	}
+
+	// has reported lately and has room for more, the one with the smallest share of its connections in use.
+	// with bPreferWaiting a process with a player waiting for an opponent comes first. nullptr if there is none.
+	Process_t *LeastLoadedProcess(bool bPreferWaiting)
+	{
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+		Process_t *pBest = nullptr;
+		double flBestLoad = 0;
+		for (auto &p : m_mapProcesses)
+		{
+			Process_t &process = p.second;
+			if (now - process.m_usecLastReport > k_usecReportTimeout || process.m_nConnections >= process.m_nMaxConnections)
+				continue;
+
+			// a process with somebody waiting counts as empty
+			double flLoad = (double)process.m_nConnections / process.m_nMaxConnections;
+			if (bPreferWaiting && process.m_nQueued > 0)
+				flLoad -= 1.0;
+
+			if (pBest == nullptr || flLoad < flBestLoad)
+			{
+				pBest = &process;
+				flBestLoad = flLoad;
+			}
+		}
+		return pBest;
+	}
+
+	Process_t *BusiestProcess()
+	{
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+		Process_t *pBest = nullptr;
+		for (auto &p : m_mapProcesses)
+		{
+			if (now - p.second.m_usecLastReport > k_usecReportTimeout || p.second.m_nRooms == 0)
+				continue;
+			if (pBest == nullptr || p.second.m_nRooms > pBest->m_nRooms)
+				pBest = &p.second;
+		}
+		return pBest;
+	}
+
+	Process_t *ProcessForRoom(uint32 roomId)
+	{
+		for (auto &p : m_mapProcesses)
+		{
+			if (roomId >= p.second.m_nFirstRoomId && roomId - p.second.m_nFirstRoomId < k_nRoomIdsPerProcess)
+				return &p.second;
+		}
+		return nullptr;
+	}
+
+	bool BlockTaken(uint32 firstRoomId)
+	{
+		for (auto &p : m_mapProcesses)
+		{
+			if (p.second.m_nFirstRoomId == firstRoomId)
+				return true;
+		}
+		return false;
+	}
+
+	// block 0 is left for servers running on their own, 0 if every block is in use
+	uint32 FreeBlock()
+	{
+		for (uint32 nBlock = 1; nBlock < 0x100; nBlock++)
+		{
+			if (!BlockTaken(nBlock * k_nRoomIdsPerProcess))
+				return nBlock * k_nRoomIdsPerProcess;
+		}
+		return 0;
+	}
+
+	void PrintStats()
+	{
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+		std::cout << m_mapProcesses.size() << " server processes, " << m_matchmaker.Size() << " players waiting, " << m_nMatches << " matches made, " << m_nRedirects << " clients sent on, " << m_nTurnedAway << " turned away" << std::endl;
+		for (auto &p : m_mapProcesses)
+		{
+			const Process_t &process = p.second;
+			char szAddr[SteamNetworkingIPAddr::k_cchMaxString];
+			process.m_addr.ToString(szAddr, sizeof(szAddr), true);
+			std::cout << "  " << szAddr << ": " << process.m_nConnections << "/" << process.m_nMaxConnections << " connections, " << process.m_nRooms << " rooms, " << process.m_nQueued << " waiting, "
+				<< process.m_nPlayersSent << " sent here, rooms from " << process.m_nFirstRoomId << ", reported " << (now - process.m_usecLastReport) / 1000 << " ms ago" << std::endl;
+		}
+	}
+
+	void RegisterCommands()
+	{
+		m_commands.Add("/quit", nullptr, [](const std::string &) {
+			g_bQuit = true;
+			std::cout << "Shutting down directory" << std::endl;
+		});
+		m_commands.Add("/stats", nullptr, [this](const std::string &) {
+			PrintStats();
+		});
+	}
+
+	void OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo)
+	{
+		switch (pInfo->m_info.m_eState)
+		{
+		case k_ESteamNetworkingConnectionState_ClosedByPeer:
+		case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
+		{
+			auto itProcess = m_mapProcesses.find(pInfo->m_hConn);
+			if (itProcess != m_mapProcesses.end())
+			{
+				char szAddr[SteamNetworkingIPAddr::k_cchMaxString];
+				itProcess->second.m_addr.ToString(szAddr, sizeof(szAddr), true);
+				std::cout << "Server process at " << szAddr << " left" << std::endl;
+				m_mapProcesses.erase(itProcess);
+			}
+
+			m_matchmaker.Remove(pInfo->m_hConn);
+			m_mapClients.erase(pInfo->m_hConn);
+			m_pInterface->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
+			break;
+		}
+
+		case k_ESteamNetworkingConnectionState_Connecting:
+		{
+			if (m_pInterface->AcceptConnection(pInfo->m_hConn) != k_EResultOK || !m_pInterface->SetConnectionPollGroup(pInfo->m_hConn, m_hPollGroup))
+			{
+				m_pInterface->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
+				break;
+			}
+			m_mapClients[pInfo->m_hConn];
+			break;
+		}
+
+		default:
+			// Silences -Wswitch
+			break;
+		}
+	}
+
+	static Directory *s_pCallbackInstance;
+
+	static void SteamNetConnectionStatusChangedCallback(SteamNetConnectionStatusChangedCallback_t *pInfo)
+	{
+		s_pCallbackInstance->OnSteamNetConnectionStatusChanged(pInfo);
+	}
+
+	void PollConnectionStateChanges()
+	{
+		s_pCallbackInstance = this;
+		m_pInterface->RunCallbacks();
+	}
+};
+
+#endif
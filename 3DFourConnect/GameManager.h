@@ -40,6 +40,9 @@ public:
 	// will prevent placing a piece (1 is red, 2 is blue) unless the int is set to zero in which both moves can be done.
 	int placeOnlyOnTurn;
 
+	// watching an online match, pieces can't be placed at all
+	bool spectating = false;
+
 	GraphicsEngine *graphics = nullptr;
 	Camera *camera = nullptr;
 
@@ -262,7 +265,7 @@ public:
 				outlinePiece.asset->visible = true;
 
 				// check for right click or left click events to set piece (does not activate when win pause activates).
-				if (!winPause && leftClickStatus && (currentTurn == placeOnlyOnTurn || placeOnlyOnTurn == 0)) {
+				if (!winPause && !spectating && leftClickStatus && (currentTurn == placeOnlyOnTurn || placeOnlyOnTurn == 0)) {
 					board.addPiece(currentTurn, (int)selectedPiece.x, (int)selectedPiece.y, (int)selectedPiece.z);
 					switchTurn();
 
@@ -278,10 +281,10 @@ public:
 				outlinePiece.asset->visible = false;
 			}
 
-			// check if the outline piece changed at all and if so, then activate callback
+			// check if the outline piece changed at all and if so, then activate callback (sends the board coordinate, not the world position)
 			if (tempBool != outlinePiece.asset->visible || tempVec3 != outlinePiece.asset->position) {
-				if (placePieceCallback != nullptr) {
-					outlinePieceMoveCallback(outlinePiece.asset->visible, outlinePiece.asset->position);
+				if (outlinePieceMoveCallback != nullptr) {
+					outlinePieceMoveCallback(outlinePiece.asset->visible, selectedPiece);
 				}
 			}
 
@@ -701,12 +704,17 @@ public:
 		rightClickStatus = true;
 	}
 
-	// set the opponent piece visibility and pos (pos is board coordinated not world
+	// set the opponent piece visibility and pos (pos is board coordinated not world)
 	void setOpponentOutlinePiece(bool visible, glm::vec3 pos) {
+		// the marker is made on the first update so it might not exist yet
+		if (opponentPiece.asset == nullptr) {
+			return;
+		}
+
 		opponentPiece.asset->visible = visible;
 
 		if (visible) {
-			opponentPiece.asset->setPosition(pos);
+			opponentPiece.asset->setPosition(board.getPiecePosFromCoord((int)pos.x, (int)pos.y, (int)pos.z));
 		}
 	}
 	
@@ -797,7 +805,7 @@ public:
 		clearBoardCallback = f;
 	}
 
-	// visible, position
+	// visible, board coordinate
 	void setOutlinePieceMoveCallback(void f(bool, glm::vec3)) {
 		outlinePieceMoveCallback = f;
 	}
@@ -0,0 +1,454 @@
+// an append only file of everything needed to bring the rooms back after the server dies.
+// the shard threads and the network thread each copy their records into their own ring, a journal thread writes them
+// out and syncs the file to disk every few milliseconds, so every record written since the last sync is made durable by the same fsync.
+// nobody on the hot path ever waits on the disk.
+// a shard can also let go of a room nobody is playing in and leave it to the journal, which reads it back when the
+// room is needed again.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <atomic>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include "Tools.h"
+#include "LockFreeQueue.h"
+#include "Metrics.h"
+
+// one entry in the file. fixed size with no padding so the checksum covers every byte before it.
+struct JournalRecord
+{
+	// SEAT hands a seat to a session token (0 frees it), BOARD is a room's board after a move, CLOSE ends a room for good.
+	// EVICT is the board of a room its shard let go of, the same as a BOARD to anything reading the file back.
+	enum Kind { SEAT, BOARD, CLOSE, EVICT };
+	uint32 kind = 0;
+	uint32 roomId = 0;
+
+	// SEAT, and for EVICT a bit for each seat played by a bot
+	int32 seat = 0;
+
+	// BOARD and EVICT, the room's seq and everything needed to carry on from there
+	uint32 seq = 0;
+
+	// SEAT
+	uint64 token = 0;
+
+	// BOARD and EVICT, one bit per cell (see CellFromCoord)
+	uint64 red = 0;
+	uint64 blue = 0;
+	int32 score1 = 0;
+	int32 score2 = 0;
+	int32 currentTurn = 0;
+
+	// FNV-1a of everything above, a record torn by a crash in the middle of a write doesn't match
+	uint32 checksum = 0;
+
+	uint32 computeChecksum() const {
+		const unsigned char *bytes = (const unsigned char*)this;
+		uint32 hash = 2166136261u;
+		for (size_t i = 0; i < offsetof(JournalRecord, checksum); i++) {
+			hash = (hash ^ bytes[i]) * 16777619u;
+		}
+		return hash;
+	}
+};
+
+// a room as far as the journal knows
+struct JournalRoom
+{
+	uint64 tokens[2] = { 0, 0 };
+
+	// the newest BOARD record, only set if the room had a move
+	bool hasBoard = false;
+	JournalRecord board;
+};
+
+// most records waiting in one thread's ring before it has to wait for the journal thread
+const size_t k_nJournalQueueSize = 8192;
+
+class Journal {
+public:
+	// the metrics belong to the server's registry, the journal only updates them
+	Journal(Counter &recordsWritten, Counter &syncs, Histogram &syncDuration) : recordsWritten(recordsWritten), syncs(syncs), syncDuration(syncDuration) {
+		m_pFile = nullptr;
+		m_bRunning = false;
+		m_bFailed = false;
+	}
+
+	~Journal() {
+		Close();
+	}
+
+	Counter &recordsWritten;
+	Counter &syncs;
+	Histogram &syncDuration;
+
+	// reads every intact record of the file into the rooms that are still open at the end of it.
+	// numBoards is how many BOARD records were applied. a missing file is an empty journal, returns false if it can't be read.
+	static bool Replay(const std::string &path, std::map<uint32, JournalRoom> &mapRooms, int &numRecords, int &numBoards) {
+		numRecords = 0;
+		numBoards = 0;
+
+		FILE *file = fopen(path.c_str(), "rb");
+		if (file == nullptr) {
+			return true;
+		}
+
+		// room ids are never handed out twice, but the shards and the network thread write through different rings
+		// so a room's last move can land after its CLOSE. anything for a closed room is ignored.
+		std::unordered_set<uint32> setClosed;
+
+		std::vector<JournalRecord> vecRecords(4096);
+		bool bDone = false;
+		while (!bDone) {
+			size_t count = fread(vecRecords.data(), sizeof(JournalRecord), vecRecords.size(), file);
+			if (count < vecRecords.size()) {
+				bDone = true;
+			}
+
+			for (size_t i = 0; i < count; i++) {
+				const JournalRecord &record = vecRecords[i];
+
+				// the rest is whatever was being written when the process died
+				if (record.checksum != record.computeChecksum()) {
+					bDone = true;
+					break;
+				}
+				numRecords++;
+
+				if (setClosed.count(record.roomId) > 0) {
+					continue;
+				}
+
+				switch (record.kind) {
+					case JournalRecord::Kind::SEAT: {
+						if (record.seat == 0 || record.seat == 1) {
+							mapRooms[record.roomId].tokens[record.seat] = record.token;
+						}
+						break;
+					}
+					case JournalRecord::Kind::BOARD:
+					case JournalRecord::Kind::EVICT: {
+						JournalRoom &room = mapRooms[record.roomId];
+						if (!room.hasBoard || IsNewerSeq(record.seq, room.board.seq)) {
+							room.hasBoard = true;
+							room.board = record;
+							room.board.kind = JournalRecord::Kind::BOARD;
+							room.board.seat = 0;
+						}
+						numBoards++;
+						break;
+					}
+					case JournalRecord::Kind::CLOSE: {
+						mapRooms.erase(record.roomId);
+						setClosed.insert(record.roomId);
+						break;
+					}
+				}
+			}
+		}
+
+		bool bOk = !ferror(file);
+		fclose(file);
+		return bOk;
+	}
+
+	// starts the journal over with just the rooms that are still open so it doesn't grow forever, then starts
+	// the journal thread. numProducers threads may call Append, each with its own index.
+	bool Open(const std::string &path, int numProducers, int syncIntervalMs, const std::map<uint32, JournalRoom> &mapRooms) {
+		std::string tempPath = path + ".tmp";
+		FILE *file = fopen(tempPath.c_str(), "wb");
+		if (file == nullptr) {
+			return false;
+		}
+
+		m_nRecordsInFile = 0;
+		bool bOk = true;
+		for (auto &room : mapRooms) {
+			for (int seat = 0; seat < 2; seat++) {
+				if (room.second.tokens[seat] != 0) {
+					JournalRecord record;
+					record.kind = JournalRecord::Kind::SEAT;
+					record.roomId = room.first;
+					record.seat = seat;
+					record.token = room.second.tokens[seat];
+					bOk = WriteRecord(file, record) && bOk;
+					m_nRecordsInFile++;
+				}
+			}
+			if (room.second.hasBoard) {
+				bOk = WriteRecord(file, room.second.board) && bOk;
+				m_nRecordsInFile++;
+			}
+		}
+
+		bOk = SyncFile(file) && bOk;
+		bOk = fclose(file) == 0 && bOk;
+		if (!bOk) {
+			return false;
+		}
+
+		// rename does not replace an existing file on windows
+		remove(path.c_str());
+		if (rename(tempPath.c_str(), path.c_str()) != 0) {
+			return false;
+		}
+
+		m_pFile = fopen(path.c_str(), "ab");
+		if (m_pFile == nullptr) {
+			return false;
+		}
+		setvbuf(m_pFile, nullptr, _IOFBF, 64 * 1024);
+
+		// evicted rooms are read back through a handle of their own
+		m_pReadFile = fopen(path.c_str(), "rb");
+		if (m_pReadFile == nullptr) {
+			return false;
+		}
+
+		m_syncInterval = std::chrono::milliseconds(std::max(1, syncIntervalMs));
+		for (int i = 0; i < numProducers; i++) {
+			m_vecRings.emplace_back(new SPSCRing<JournalRecord>(k_nJournalQueueSize));
+		}
+
+		m_bRunning = true;
+		m_bFailed = false;
+		m_thread = std::thread([this]() { Run(); });
+		return true;
+	}
+
+	// writes and syncs everything appended so far, then stops the journal thread
+	void Close() {
+		m_bRunning = false;
+		m_wakeup.Notify();
+		if (m_thread.joinable()) {
+			m_thread.join();
+		}
+		if (m_pFile != nullptr) {
+			fclose(m_pFile);
+			m_pFile = nullptr;
+		}
+
+		std::lock_guard<std::mutex> lock(m_evictedMutex);
+		if (m_pReadFile != nullptr) {
+			fclose(m_pReadFile);
+			m_pReadFile = nullptr;
+		}
+		m_mapEvicted.clear();
+		m_evictedWritten.notify_all();
+	}
+
+	// only ever called by the producer's own thread. this is the whole cost on the hot path, a copy into the ring and
+	// a look at whether the journal thread is asleep.
+	void Append(int producer, const JournalRecord &record) {
+		while (!m_vecRings[producer]->Push(record)) {
+			std::this_thread::yield();
+		}
+		m_wakeup.Notify();
+	}
+
+	// true once the file couldn't be written or synced. the journal stops there, anything appended after is dropped,
+	// so nothing should be left to it that only it could bring back.
+	bool Failed() const {
+		return m_bFailed;
+	}
+
+	// the board of a room the calling producer appended an EVICT for, so it can carry on with the room. this reads the
+	// disk, only a room coming back after sitting idle ever waits on it. if the EVICT is still on its way to the file
+	// this waits for the journal thread to write it, which takes a millisecond or two. false if it can't be read.
+	bool Reload(uint32 roomId, JournalRecord &record) {
+		std::unique_lock<std::mutex> lock(m_evictedMutex);
+		auto itEvicted = m_mapEvicted.find(roomId);
+		while (itEvicted == m_mapEvicted.end()) {
+			if (!m_bRunning || m_bFailed || m_pReadFile == nullptr) {
+				return false;
+			}
+			m_evictedWritten.wait_for(lock, std::chrono::milliseconds(10));
+			itEvicted = m_mapEvicted.find(roomId);
+		}
+		uint64 offset = itEvicted->second;
+		m_mapEvicted.erase(itEvicted);
+
+#ifdef _WIN32
+		bool bOk = _fseeki64(m_pReadFile, (int64)offset, SEEK_SET) == 0;
+#else
+		bool bOk = fseeko(m_pReadFile, (off_t)offset, SEEK_SET) == 0;
+#endif
+		bOk = bOk && fread(&record, sizeof(record), 1, m_pReadFile) == 1;
+		return bOk && record.checksum == record.computeChecksum() && record.kind == JournalRecord::Kind::EVICT && record.roomId == roomId;
+	}
+
+private:
+	FILE *m_pFile;
+	FILE *m_pReadFile = nullptr;
+
+	// journal thread only, where the next record goes
+	uint64 m_nRecordsInFile = 0;
+
+	// where the newest EVICT of each evicted room is in the file, once it is there. a reload takes it back out.
+	std::mutex m_evictedMutex;
+	std::condition_variable m_evictedWritten;
+	std::unordered_map<uint32, uint64> m_mapEvicted;
+
+	std::thread m_thread;
+	std::atomic<bool> m_bRunning;
+	std::atomic<bool> m_bFailed;
+
+	// the journal thread sleeps on this while there is nothing to write or sync
+	Wakeup m_wakeup;
+
+	std::vector< std::unique_ptr< SPSCRing<JournalRecord> > > m_vecRings;
+	std::chrono::microseconds m_syncInterval;
+
+	void Run() {
+		std::vector<JournalRecord> vecPending;
+		bool bDirty = false;
+		std::chrono::steady_clock::time_point nextSync;
+
+		// keep going until stopped and everything appended before that is on disk
+		while (true) {
+			bool bRunning = m_bRunning;
+
+			JournalRecord record;
+			for (auto &pRing : m_vecRings) {
+				while (pRing->Pop(record)) {
+					record.checksum = record.computeChecksum();
+					vecPending.push_back(record);
+				}
+			}
+
+			// after a failed write the rings are still emptied, so nobody appending ever waits on a full one
+			if (!vecPending.empty() && !m_bFailed) {
+				size_t nWritten = fwrite(vecPending.data(), sizeof(JournalRecord), vecPending.size(), m_pFile);
+				if (nWritten != vecPending.size()) {
+					Fail("Failed to write to the journal");
+				}
+				else {
+					recordsWritten.Add(vecPending.size());
+					NoteEvictions(vecPending);
+					m_nRecordsInFile += vecPending.size();
+
+					// the first write after a sync starts the clock for the next one
+					if (!bDirty) {
+						nextSync = std::chrono::steady_clock::now() + m_syncInterval;
+					}
+					bDirty = true;
+				}
+			}
+			vecPending.clear();
+
+			// one fsync for everything written since the last one
+			if (bDirty && !m_bFailed && (!bRunning || std::chrono::steady_clock::now() >= nextSync)) {
+				auto start = std::chrono::steady_clock::now();
+				if (!SyncFile(m_pFile)) {
+					Fail("Failed to sync the journal");
+				}
+				syncDuration.Record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+				syncs.Add();
+				bDirty = false;
+			}
+
+			if (!bRunning) {
+				break;
+			}
+
+			// until something is appended, or the sync is due for what was
+			int64 usecTimeout = -1;
+			if (bDirty) {
+				usecTimeout = std::max((int64)0, (int64)std::chrono::duration_cast<std::chrono::microseconds>(nextSync - std::chrono::steady_clock::now()).count());
+			}
+			m_wakeup.Wait(usecTimeout, [this]() {
+				if (!m_bRunning) {
+					return true;
+				}
+				for (auto &pRing : m_vecRings) {
+					if (!pRing->Empty()) {
+						return true;
+					}
+				}
+				return false;
+			});
+		}
+	}
+
+	// a file we can't write to is left as it is, whatever made it there is still good for a restart. rooms evicted
+	// since can't come back from it, so a reload waiting on one gives up.
+	void Fail(const char *pszReason) {
+		std::cout << pszReason << ", nothing more will be journaled" << std::endl;
+		std::lock_guard<std::mutex> lock(m_evictedMutex);
+		m_bFailed = true;
+		m_evictedWritten.notify_all();
+	}
+
+	// remembers where the EVICTs just written went and forgets rooms that closed. the file is flushed first so the
+	// read handle sees them, without waiting for the next sync.
+	void NoteEvictions(const std::vector<JournalRecord> &vecWritten) {
+		bool bEvictions = false;
+		bool bCloses = false;
+		for (const JournalRecord &record : vecWritten) {
+			bEvictions = bEvictions || record.kind == JournalRecord::Kind::EVICT;
+			bCloses = bCloses || record.kind == JournalRecord::Kind::CLOSE;
+		}
+		if (!bEvictions && !bCloses) {
+			return;
+		}
+		if (bEvictions) {
+			fflush(m_pFile);
+		}
+
+		std::lock_guard<std::mutex> lock(m_evictedMutex);
+		for (size_t i = 0; i < vecWritten.size(); i++) {
+			if (vecWritten[i].kind == JournalRecord::Kind::EVICT) {
+				m_mapEvicted[vecWritten[i].roomId] = (m_nRecordsInFile + i) * sizeof(JournalRecord);
+			}
+			else if (vecWritten[i].kind == JournalRecord::Kind::CLOSE) {
+				m_mapEvicted.erase(vecWritten[i].roomId);
+			}
+		}
+		if (bEvictions) {
+			m_evictedWritten.notify_all();
+		}
+	}
+
+	static bool WriteRecord(FILE *file, JournalRecord record) {
+		record.checksum = record.computeChecksum();
+		return fwrite(&record, sizeof(record), 1, file) == 1;
+	}
+
+	// out of our buffer and out of the os cache onto the disk
+	static bool SyncFile(FILE *file) {
+		if (fflush(file) != 0) {
+			return false;
+		}
+#ifdef _WIN32
+		return _commit(_fileno(file)) == 0;
+#else
+		return fsync(fileno(file)) == 0;
+#endif
+	}
+};
+
+#endif
@@ -0,0 +1,51 @@
+// keeps the most recent latency samples so percentiles can be printed from the console
+
+#ifndef LATENCYSAMPLER_H
+#define LATENCYSAMPLER_H
+
+#include <algorithm>
+#include <vector>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+
+class LatencySampler {
+public:
+	LatencySampler(int nMaxSamples = 4096) {
+		m_vecSamples.resize(nMaxSamples);
+		m_nNext = 0;
+		m_nCount = 0;
+	}
+
+	void Add(SteamNetworkingMicroseconds usec) {
+		m_vecSamples[m_nNext] = usec;
+		m_nNext = (m_nNext + 1) % (int)m_vecSamples.size();
+		m_nCount = std::min(m_nCount + 1, (int)m_vecSamples.size());
+	}
+
+	// flPercentile is 0-100, returns 0 if there are no samples yet
+	SteamNetworkingMicroseconds Percentile(float flPercentile) {
+		if (m_nCount == 0)
+			return 0;
+
+		std::vector<SteamNetworkingMicroseconds> sorted(m_vecSamples.begin(), m_vecSamples.begin() + m_nCount);
+		int index = std::min(m_nCount - 1, (int)(flPercentile / 100.0f * m_nCount));
+		std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+		return sorted[index];
+	}
+
+	int Count() {
+		return m_nCount;
+	}
+
+	void Clear() {
+		m_nNext = 0;
+		m_nCount = 0;
+	}
+
+private:
+	std::vector<SteamNetworkingMicroseconds> m_vecSamples;
+	int m_nNext;
+	int m_nCount;
+};
+
+#endif
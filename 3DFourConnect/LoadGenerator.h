@@ -0,0 +1,788 @@
+// runs lots of headless bot clients in one process against a server to find out how many matches it can carry.
+// every bot is a normal GameNetworkingSockets connection that joins a room and plays through the same messages
+// the real client sends. bots are added in steps and each step prints how the server held up.
+
+#ifndef LOADGENERATOR_H
+#define LOADGENERATOR_H
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <queue>
+#include <vector>
+#include <functional>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include <iostream>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "Tools.h"
+#include "Transport.h"
+#include "MessageBatch.h"
+#include "LatencySampler.h"
+#include "BoardRules.h"
+#include "BoardAI.h"
+#include "Matchmaker.h"
+#include "CommandRegistry.h"
+
+// total cpu time (user + kernel) another process has used so far in seconds, -1 if it can't be read
+static double GetProcessCpuSeconds(int pid)
+{
+#ifdef _WIN32
+	HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, (DWORD)pid);
+	if (hProcess == NULL)
+		return -1;
+
+	FILETIME ftCreation, ftExit, ftKernel, ftUser;
+	BOOL bOk = GetProcessTimes(hProcess, &ftCreation, &ftExit, &ftKernel, &ftUser);
+	CloseHandle(hProcess);
+	if (!bOk)
+		return -1;
+
+	// both are in 100 ns units
+	ULARGE_INTEGER kernel, user;
+	kernel.LowPart = ftKernel.dwLowDateTime;
+	kernel.HighPart = ftKernel.dwHighDateTime;
+	user.LowPart = ftUser.dwLowDateTime;
+	user.HighPart = ftUser.dwHighDateTime;
+	return (double)(kernel.QuadPart + user.QuadPart) / 10000000.0;
+#else
+	std::string path = "/proc/" + std::to_string(pid) + "/stat";
+	FILE *file = fopen(path.c_str(), "r");
+	if (file == nullptr)
+		return -1;
+
+	char buf[1024];
+	size_t len = fread(buf, 1, sizeof(buf) - 1, file);
+	fclose(file);
+	buf[len] = '\0';
+
+	// the process name is in brackets and can have spaces in it, so start counting fields after the last ')'
+	char *p = strrchr(buf, ')');
+	if (p == nullptr)
+		return -1;
+
+	unsigned long utime = 0, stime = 0;
+	if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+		return -1;
+
+	return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+#endif
+}
+
+class LoadGenerator {
+public:
+	// most bots connected at the end
+	int numBots = 1000;
+	// bots added at the start of every step
+	int botsPerStep = 100;
+	// how long each step runs before it reports
+	int stepSeconds = 10;
+	// average time a bot waits before making a move, each move is randomly 50-150% of this
+	int thinkMs = 500;
+	// pick moves with the greedy ai instead of random cells
+	bool useAI = false;
+	// every bot plays one of the server's bots instead of another one of ours
+	bool againstServerBots = false;
+	// spectators added at the start of every step, they all watch whatever match the server picks
+	int spectatorsPerStep = 0;
+	// steps run once every bot is connected and has a match, nobody new joins or gets seated in them so the load stays
+	// where it is. a player left without anybody to play holds them back until it gets one.
+	int holdSteps = 0;
+	// called after every step has reported, with the step's number
+	std::function<void(int step)> onStep;
+	// process id of the server to report cpu usage for, 0 skips it
+	int serverPid = 0;
+	// what the bots connect over, the real network if left null
+	ITransport *transport = nullptr;
+
+	void Run(const SteamNetworkingIPAddr &serverAddr)
+	{
+		m_pInterface = transport != nullptr ? transport : DefaultTransport();
+		m_serverAddr = serverAddr;
+
+		// every bot shares one poll group so a single receive call covers all of them
+		m_hPollGroup = m_pInterface->CreatePollGroup();
+		if (m_hPollGroup == k_HSteamNetPollGroup_Invalid)
+		{
+			std::cout << "Failed to create poll group" << std::endl;
+			return;
+		}
+
+		m_outbox.Init(m_pInterface, k_nMaxMessagesPerPoll * 4);
+		m_vecBots.reserve(numBots + (numBots / std::max(1, botsPerStep) + 1) * spectatorsPerStep);
+
+		char szAddr[SteamNetworkingIPAddr::k_cchMaxString];
+		serverAddr.ToString(szAddr, sizeof(szAddr), true);
+		std::cout << "Load testing " << szAddr << " with up to " << numBots << " bots, " << botsPerStep << " more every " << stepSeconds << " s, " << thinkMs << " ms think time, " << (useAI ? "greedy" : "random") << " moves" << (againstServerBots ? " against the server's bots" : "") << std::endl;
+		m_commands.Add("/quit", nullptr, [](const std::string &) {
+			g_bQuit = true;
+			std::cout << "Stopping load test" << std::endl;
+		});
+		std::cout << "Type '/quit' to stop early" << std::endl;
+
+		int step = 0;
+		int stepsHeld = 0;
+		while (!g_bQuit && (m_nPlayers < numBots || stepsHeld < holdSteps))
+		{
+			step++;
+			if (m_nPlayers < numBots)
+			{
+				int target = std::min(numBots, m_nPlayers + botsPerStep);
+				while (m_nPlayers < target)
+				{
+					ConnectBot(false);
+					m_nPlayers++;
+				}
+				for (int i = 0; i < spectatorsPerStep; i++)
+					ConnectBot(true);
+			}
+			else if (Settled())
+			{
+				stepsHeld++;
+			}
+
+			RunStep(step);
+			if (onStep)
+				onStep(step);
+		}
+
+		// close everyone down
+		m_outbox.Flush();
+		std::vector<HSteamNetConnection> vecConns;
+		for (Bot_t &bot : m_vecBots)
+			vecConns.push_back(bot.m_hConn);
+		FlushConnections(m_pInterface, vecConns, k_usecMaxFlushOnShutdown);
+		for (Bot_t &bot : m_vecBots)
+		{
+			if (bot.m_hConn != k_HSteamNetConnection_Invalid)
+				m_pInterface->CloseConnection(bot.m_hConn, 0, "Load test over", true);
+		}
+		m_vecBots.clear();
+
+		m_pInterface->DestroyPollGroup(m_hPollGroup);
+		m_hPollGroup = k_HSteamNetPollGroup_Invalid;
+	}
+
+private:
+	ITransport *m_pInterface;
+	HSteamNetPollGroup m_hPollGroup;
+	SteamNetworkingIPAddr m_serverAddr;
+
+	struct Bot_t
+	{
+		HSteamNetConnection m_hConn = k_HSteamNetConnection_Invalid;
+		bool m_bConnected = false;
+		SteamNetworkingMicroseconds m_usecConnectStart = 0;
+
+		// players only. what the server matches us by, and when we asked for a match (0 once we have one)
+		int m_nRating = 0;
+		SteamNetworkingMicroseconds m_usecJoinSent = 0;
+
+		// the room a directory sent us on to, asked for when we join there
+		uint32 m_nRedirectRoomId = 0;
+
+		// players only. the seat's token from GAME_SETUP, and the tries left to get it back on the standby if the server goes
+		uint64 m_nSessionToken = 0;
+		int m_nFailoverAttempts = 0;
+		SteamNetworkingMicroseconds m_usecNextFailover = 0;
+
+		// spectators only watch. they ask again every so often until the server gives them a match.
+		bool m_bSpectator = false;
+		bool m_bWatching = false;
+		SteamNetworkingMicroseconds m_usecNextJoin = 0;
+
+		// what the server last told us
+		int m_nColor = BitBoard::Color::EMPTY;
+		BitBoard m_board;
+		int m_nScore1 = 0;
+		int m_nScore2 = 0;
+		int m_nCurrentTurn = 0;
+		uint32 m_nLastSeq = 0;
+
+		// asked for the whole board after a GAME_DELTA didn't fit, deltas are ignored until it comes
+		bool m_bResyncRequested = false;
+
+		// 0 when no move is waiting
+		SteamNetworkingMicroseconds m_usecNextMove = 0;
+
+		// the last move sent, used to spot it coming back from the server
+		uint32 m_nMoveId = 0;
+		bool m_bAwaitingEcho = false;
+		int m_nLastCell = -1;
+		SteamNetworkingMicroseconds m_usecMoveSent = 0;
+	};
+
+	std::vector<Bot_t> m_vecBots;
+	int m_nPlayers = 0;
+	std::vector<int> m_vecSpectators;
+	SteamNetworkingMicroseconds m_usecNextSpectatorCheck = 0;
+
+	// the hot standby the server told the players about, and the players waiting to try it
+	SteamNetworkingIPAddr m_standbyAddr = {};
+	std::vector<int> m_vecFailingOver;
+	static const int k_nMaxFailoverAttempts = 10;
+	static const SteamNetworkingMicroseconds k_usecFailoverRetry = 500000;
+
+	// moves waiting for their think time to run out, soonest first
+	typedef std::pair<SteamNetworkingMicroseconds, int> ScheduledMove_t;
+	std::priority_queue<ScheduledMove_t, std::vector<ScheduledMove_t>, std::greater<ScheduledMove_t>> m_queueMoves;
+
+	MessageBatch m_outbox;
+	CommandRegistry m_commands{ "Load test" };
+	std::mt19937 m_rng{ std::random_device{}() };
+
+	// reset every step
+	LatencySampler m_connectTimes{ 65536 };
+	LatencySampler m_moveLatency{ 65536 };
+	LatencySampler m_matchWait{ 65536 };
+	int m_nMovesSent = 0;
+	int m_nGamesFinished = 0;
+	int m_nDisconnects = 0;
+	int m_nSpectatorUpdates = 0;
+	int m_nResyncs = 0;
+	int m_nFailovers = 0;
+
+	// every bot still connected is playing or watching, nobody is waiting on the server for a match. matches against the
+	// server's bots can't be watched, so spectators there never get one and aren't waited for.
+	bool Settled() const
+	{
+		for (const Bot_t &bot : m_vecBots)
+		{
+			if (bot.m_hConn == k_HSteamNetConnection_Invalid || (bot.m_bSpectator && againstServerBots))
+				continue;
+			bool bWaiting = bot.m_bSpectator ? !bot.m_bWatching : bot.m_usecJoinSent != 0 || bot.m_nColor == BitBoard::Color::EMPTY;
+			if (bWaiting)
+				return false;
+		}
+		return true;
+	}
+
+	void ConnectBot(bool bSpectator)
+	{
+		int index = (int)m_vecBots.size();
+		m_vecBots.emplace_back();
+		Bot_t &bot = m_vecBots.back();
+		bot.m_bSpectator = bSpectator;
+		if (bSpectator)
+			m_vecSpectators.push_back(index);
+
+		// spread around the default the way a real player base would be
+		bot.m_nRating = std::max(1, (int)std::normal_distribution<float>((float)k_nDefaultRating, 300.0f)(m_rng));
+
+		SteamNetworkingConfigValue_t opt;
+		opt.SetPtr(k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback);
+		bot.m_usecConnectStart = SteamNetworkingUtils()->GetLocalTimestamp();
+		bot.m_hConn = m_pInterface->ConnectByIPAddress(m_serverAddr, 1, &opt);
+		if (bot.m_hConn == k_HSteamNetConnection_Invalid)
+		{
+			m_nDisconnects++;
+			return;
+		}
+
+		// the index comes back on every message and callback for this connection
+		m_pInterface->SetConnectionUserData(bot.m_hConn, index);
+		m_pInterface->SetConnectionPollGroup(bot.m_hConn, m_hPollGroup);
+	}
+
+	void RunStep(int step)
+	{
+		m_connectTimes.Clear();
+		m_moveLatency.Clear();
+		m_matchWait.Clear();
+		m_nMovesSent = 0;
+		m_nGamesFinished = 0;
+		m_nDisconnects = 0;
+		m_nSpectatorUpdates = 0;
+		m_nResyncs = 0;
+		m_nFailovers = 0;
+
+		double cpuStart = serverPid > 0 ? GetProcessCpuSeconds(serverPid) : -1;
+		SteamNetworkingMicroseconds usecStart = SteamNetworkingUtils()->GetLocalTimestamp();
+		SteamNetworkingMicroseconds usecEnd = usecStart + (SteamNetworkingMicroseconds)stepSeconds * 1000000;
+
+		while (!g_bQuit && SteamNetworkingUtils()->GetLocalTimestamp() < usecEnd)
+		{
+			PollIncomingMessages();
+			PollConnectionStateChanges();
+			m_commands.Poll();
+			PlayDueMoves();
+			RetrySpectatorJoins();
+			RetryFailovers();
+			m_outbox.Flush();
+
+			// think times are in milliseconds so this is plenty
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		double seconds = (SteamNetworkingUtils()->GetLocalTimestamp() - usecStart) / 1000000.0;
+		double cpuEnd = serverPid > 0 ? GetProcessCpuSeconds(serverPid) : -1;
+
+		int connected = 0;
+		int watching = 0;
+		for (Bot_t &bot : m_vecBots)
+		{
+			if (bot.m_bConnected)
+				connected++;
+			if (bot.m_bWatching)
+				watching++;
+		}
+
+		char szReport[512];
+		snprintf(szReport, sizeof(szReport),
+			"Step %d: %d/%d bots connected, %.1f moves/s, %d games finished, %d disconnects, %d resyncs, %d failed over\n"
+			"  connect p50 %.2f ms p99 %.2f ms (%d new)\n"
+			"  match wait p50 %.2f ms p99 %.2f ms (%d matched)\n"
+			"  move round trip p50 %.2f ms p99 %.2f ms (%d moves)",
+			step, connected, (int)m_vecBots.size(), m_nMovesSent / seconds, m_nGamesFinished, m_nDisconnects, m_nResyncs, m_nFailovers,
+			m_connectTimes.Percentile(50) / 1000.0, m_connectTimes.Percentile(99) / 1000.0, m_connectTimes.Count(),
+			m_matchWait.Percentile(50) / 1000.0, m_matchWait.Percentile(99) / 1000.0, m_matchWait.Count(),
+			m_moveLatency.Percentile(50) / 1000.0, m_moveLatency.Percentile(99) / 1000.0, m_moveLatency.Count());
+		std::cout << szReport << std::endl;
+
+		if (!m_vecSpectators.empty())
+		{
+			snprintf(szReport, sizeof(szReport), "  %d/%d spectators watching, %.1f updates/s received", watching, (int)m_vecSpectators.size(), m_nSpectatorUpdates / seconds);
+			std::cout << szReport << std::endl;
+		}
+
+		if (cpuStart >= 0 && cpuEnd >= 0)
+		{
+			// 100% is one whole core
+			snprintf(szReport, sizeof(szReport), "  server cpu %.1f%%", (cpuEnd - cpuStart) / seconds * 100.0);
+			std::cout << szReport << std::endl;
+		}
+		else if (serverPid > 0)
+		{
+			std::cout << "  server cpu unavailable for pid " << serverPid << std::endl;
+		}
+	}
+
+	void PollIncomingMessages()
+	{
+		ISteamNetworkingMessage *pIncomingMsgs[k_nMaxMessagesPerPoll];
+
+		while (!g_bQuit)
+		{
+			int numMsgs = m_pInterface->ReceiveMessagesOnPollGroup(m_hPollGroup, pIncomingMsgs, k_nMaxMessagesPerPoll);
+			if (numMsgs == 0)
+				break;
+			if (numMsgs < 0)
+			{
+				std::cout << "Error checking for messages" << std::endl;
+				break;
+			}
+
+			for (int i = 0; i < numMsgs; i++)
+			{
+				int index = (int)pIncomingMsgs[i]->m_nConnUserData;
+				if (index >= 0 && index < (int)m_vecBots.size())
+					HandleIncomingMessage(m_vecBots[index], index, pIncomingMsgs[i]);
+
+				// We don't need this anymore.
+				pIncomingMsgs[i]->Release();
+			}
+
+			// a partial batch means the queue is empty
+			if (numMsgs < k_nMaxMessagesPerPoll)
+				break;
+		}
+	}
+
+	void HandleIncomingMessage(Bot_t &bot, int index, ISteamNetworkingMessage *pIncomingMsg)
+	{
+		if (pIncomingMsg->m_cbSize < (int)sizeof(DataPacket::MsgType))
+			return;
+
+		DataPacket *data = (DataPacket*)pIncomingMsg->m_pData;
+		if (bot.m_bSpectator) {
+			HandleSpectatorMessage(bot, index, pIncomingMsg);
+			return;
+		}
+
+		switch (data->type) {
+			case DataPacket::MsgType::GAME_SETUP: {
+				if (pIncomingMsg->m_cbSize < (int)sizeof(DataPacket)) {
+					break;
+				}
+				// from a directory, the match is on another server. the wait runs on until it starts there.
+				if (data->redirect.m_port != 0) {
+					Redirect(bot, index, data->redirect, data->redirectRoomId);
+					break;
+				}
+				bot.m_nColor = data->assignedTurn;
+				bot.m_nSessionToken = data->sessionToken;
+				bot.m_nFailoverAttempts = 0;
+				if (!data->standby.IsIPv6AllZeros()) {
+					m_standbyAddr = data->standby;
+				}
+				if (bot.m_usecJoinSent != 0) {
+					m_matchWait.Add(SteamNetworkingUtils()->GetLocalTimestamp() - bot.m_usecJoinSent);
+					bot.m_usecJoinSent = 0;
+				}
+				break;
+			}
+			case DataPacket::MsgType::GAME_DATA: {
+				if (pIncomingMsg->m_cbSize < (int)sizeof(DataPacket)) {
+					break;
+				}
+				bot.m_board.fromPacket(data);
+				bot.m_nScore1 = data->score1;
+				bot.m_nScore2 = data->score2;
+				if (data->currentTurn != 0)
+					bot.m_nCurrentTurn = data->currentTurn;
+				bot.m_nLastSeq = data->seq;
+				bot.m_bResyncRequested = false;
+				HandleBoard(bot, index);
+				break;
+			}
+			case DataPacket::MsgType::GAME_DELTA: {
+				DeltaPacket *delta = (DeltaPacket*)pIncomingMsg->m_pData;
+				if (pIncomingMsg->m_cbSize < (int)offsetof(DeltaPacket, moves)
+					|| delta->numMoves < 1 || delta->numMoves > k_nMaxDeltaMoves
+					|| pIncomingMsg->m_cbSize < (int)delta->size()) {
+					break;
+				}
+				if (ApplyDelta(bot, delta))
+					HandleBoard(bot, index);
+				break;
+			}
+			// a move the server turned down is still on our board, only the whole board gets rid of it
+			case DataPacket::MsgType::GAME_MOVE_RESULT: {
+				MoveResultPacket *result = (MoveResultPacket*)pIncomingMsg->m_pData;
+				if (pIncomingMsg->m_cbSize < (int)sizeof(MoveResultPacket) || result->accepted || result->moveId != bot.m_nMoveId) {
+					break;
+				}
+				bot.m_bAwaitingEcho = false;
+				if (!bot.m_bResyncRequested) {
+					ResyncPacket resync;
+					m_outbox.Add(bot.m_hConn, &resync, (uint32)sizeof(resync), k_nSteamNetworkingSend_Reliable);
+					bot.m_bResyncRequested = true;
+					m_nResyncs++;
+				}
+				break;
+			}
+			// back in our seat on the standby
+			case DataPacket::MsgType::GAME_RESUME: {
+				ResumePacket *resume = (ResumePacket*)pIncomingMsg->m_pData;
+				if (pIncomingMsg->m_cbSize < (int)offsetof(ResumePacket, moves)
+					|| resume->numMoves < 0 || resume->numMoves > k_nMaxMovesPerGame
+					|| pIncomingMsg->m_cbSize < (int)resume->size()) {
+					break;
+				}
+				ApplyResume(bot, resume);
+				m_nFailovers++;
+				HandleBoard(bot, index);
+				break;
+			}
+			// bots don't look at cursors or status messages
+			default: {
+				break;
+			}
+		}
+	}
+
+	void HandleSpectatorMessage(Bot_t &bot, int index, ISteamNetworkingMessage *pIncomingMsg)
+	{
+		DataPacket *data = (DataPacket*)pIncomingMsg->m_pData;
+		switch (data->type) {
+			case DataPacket::MsgType::GAME_SETUP: {
+				if (pIncomingMsg->m_cbSize >= (int)sizeof(DataPacket) && data->redirect.m_port != 0) {
+					Redirect(bot, index, data->redirect, data->redirectRoomId);
+					break;
+				}
+				bot.m_bWatching = true;
+				break;
+			}
+			case DataPacket::MsgType::GAME_DATA:
+			case DataPacket::MsgType::GAME_DELTA: {
+				m_nSpectatorUpdates++;
+				break;
+			}
+			// the only status a spectator gets is that there is nothing to watch (anymore), ask again in a bit
+			case DataPacket::MsgType::CONNECTION_STATUS: {
+				bot.m_bWatching = false;
+				bot.m_usecNextJoin = SteamNetworkingUtils()->GetLocalTimestamp() + 1000000;
+				break;
+			}
+			default: {
+				break;
+			}
+		}
+	}
+
+	void SendJoin(Bot_t &bot)
+	{
+		JoinPacket join;
+		join.role = bot.m_bSpectator ? JoinPacket::Role::SPECTATOR : JoinPacket::Role::PLAYER;
+		join.roomId = bot.m_nRedirectRoomId;
+		if (!bot.m_bSpectator)
+		{
+			join.sessionToken = bot.m_nSessionToken;
+			join.lastSeq = bot.m_nLastSeq;
+			join.rating = bot.m_nRating;
+			join.againstBot = againstServerBots ? 1 : 0;
+			if (bot.m_usecJoinSent == 0)
+				bot.m_usecJoinSent = SteamNetworkingUtils()->GetLocalTimestamp();
+		}
+		m_outbox.Add(bot.m_hConn, &join, (uint32)sizeof(join), k_nSteamNetworkingSend_Reliable);
+	}
+
+	// drops the directory's connection and joins again on the server it picked, the bot keeps its index
+	void Redirect(Bot_t &bot, int index, const SteamNetworkingIPAddr &addr, uint32 roomId)
+	{
+		if (bot.m_hConn != k_HSteamNetConnection_Invalid)
+			m_pInterface->CloseConnection(bot.m_hConn, 0, "Redirected", false);
+		bot.m_bConnected = false;
+		bot.m_nRedirectRoomId = roomId;
+
+		SteamNetworkingConfigValue_t opt;
+		opt.SetPtr(k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback);
+		bot.m_usecConnectStart = SteamNetworkingUtils()->GetLocalTimestamp();
+		bot.m_hConn = m_pInterface->ConnectByIPAddress(addr, 1, &opt);
+		if (bot.m_hConn == k_HSteamNetConnection_Invalid)
+		{
+			m_nDisconnects++;
+			return;
+		}
+		m_pInterface->SetConnectionUserData(bot.m_hConn, index);
+		m_pInterface->SetConnectionPollGroup(bot.m_hConn, m_hPollGroup);
+	}
+
+	void RetrySpectatorJoins()
+	{
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+		if (now < m_usecNextSpectatorCheck)
+			return;
+		m_usecNextSpectatorCheck = now + 100000;
+
+		for (int index : m_vecSpectators)
+		{
+			Bot_t &bot = m_vecBots[index];
+			if (bot.m_bConnected && !bot.m_bWatching && bot.m_usecNextJoin != 0 && now >= bot.m_usecNextJoin)
+			{
+				bot.m_usecNextJoin = 0;
+				SendJoin(bot);
+			}
+		}
+	}
+
+	// a player that lost its server goes back to its seat on the standby, which turns it away until it has taken over
+	void RetryFailovers()
+	{
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+		for (size_t i = 0; i < m_vecFailingOver.size(); )
+		{
+			int index = m_vecFailingOver[i];
+			Bot_t &bot = m_vecBots[index];
+			if (now < bot.m_usecNextFailover)
+			{
+				++i;
+				continue;
+			}
+			bot.m_usecNextFailover = 0;
+			Redirect(bot, index, m_standbyAddr, 0);
+			m_vecFailingOver[i] = m_vecFailingOver.back();
+			m_vecFailingOver.pop_back();
+		}
+	}
+
+	// the board the client would end up with, the moves we missed on top of the snapshot or our own board
+	void ApplyResume(Bot_t &bot, const ResumePacket *resume)
+	{
+		if (resume->hasSnapshot)
+		{
+			bot.m_board = BitBoard();
+			bot.m_board.red = resume->red;
+			bot.m_board.blue = resume->blue;
+			bot.m_nScore1 = resume->score1;
+			bot.m_nScore2 = resume->score2;
+			bot.m_nCurrentTurn = resume->currentTurn;
+			bot.m_nLastSeq = resume->snapshotSeq;
+		}
+		for (int i = 0; i < resume->numMoves; i++)
+		{
+			bot.m_board.place(resume->moves[i].color, resume->moves[i].cell);
+			bot.m_nCurrentTurn = resume->moves[i].nextTurn;
+			bot.m_nLastSeq = resume->moves[i].seq;
+		}
+		bot.m_bResyncRequested = false;
+	}
+
+	// the same checks the client makes, false if the moves weren't used
+	bool ApplyDelta(Bot_t &bot, const DeltaPacket *delta)
+	{
+		if (bot.m_bResyncRequested || !IsNewerSeq(delta->moves[delta->numMoves - 1].seq, bot.m_nLastSeq))
+			return false;
+
+		if (delta->baseSeq == bot.m_nLastSeq)
+		{
+			for (int i = 0; i < delta->numMoves; i++)
+			{
+				bot.m_board.place(delta->moves[i].color, delta->moves[i].cell);
+				bot.m_nCurrentTurn = delta->moves[i].nextTurn;
+				bot.m_nLastSeq = delta->moves[i].seq;
+			}
+			if ((bot.m_board.hash() ^ ZobristTurn(bot.m_nCurrentTurn)) == delta->hash)
+				return true;
+		}
+
+		ResyncPacket resync;
+		m_outbox.Add(bot.m_hConn, &resync, (uint32)sizeof(resync), k_nSteamNetworkingSend_Reliable);
+		bot.m_bResyncRequested = true;
+		m_nResyncs++;
+		return false;
+	}
+
+	// the board, scores and turn are already what the server sent
+	void HandleBoard(Bot_t &bot, int index)
+	{
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+
+		// our last move made it through the server and back
+		if (bot.m_bAwaitingEcho && bot.m_board.at(bot.m_nLastCell) == bot.m_nColor)
+		{
+			m_moveLatency.Add(now - bot.m_usecMoveSent);
+			bot.m_bAwaitingEcho = false;
+		}
+
+		// somebody won or the board filled up, red starts the next game the same way the client's clear board callback does
+		int winner = bot.m_board.winner();
+		if (winner != BitBoard::Color::EMPTY || bot.m_board.full())
+		{
+			if (bot.m_nColor == BitBoard::Color::RED)
+			{
+				m_nGamesFinished++;
+
+				DataPacket clear;
+				clear.type = DataPacket::MsgType::GAME_DATA;
+				BitBoard().toPacket(&clear);
+				clear.currentTurn = 0;
+				m_outbox.Add(bot.m_hConn, &clear, (uint32)sizeof(clear), k_nSteamNetworkingSend_Reliable);
+			}
+			bot.m_usecNextMove = 0;
+			return;
+		}
+
+		// our turn, think for a bit first
+		if (bot.m_nCurrentTurn == bot.m_nColor && bot.m_usecNextMove == 0)
+		{
+			int thinkUs = std::uniform_int_distribution<int>(thinkMs * 500, thinkMs * 1500)(m_rng);
+			bot.m_usecNextMove = now + thinkUs;
+			m_queueMoves.push(ScheduledMove_t(bot.m_usecNextMove, index));
+		}
+	}
+
+	void PlayDueMoves()
+	{
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+
+		while (!m_queueMoves.empty() && m_queueMoves.top().first <= now)
+		{
+			ScheduledMove_t move = m_queueMoves.top();
+			m_queueMoves.pop();
+
+			// skip moves that were cancelled since they were scheduled
+			Bot_t &bot = m_vecBots[move.second];
+			if (bot.m_usecNextMove != move.first || !bot.m_bConnected)
+				continue;
+			bot.m_usecNextMove = 0;
+
+			if (bot.m_nCurrentTurn != bot.m_nColor)
+				continue;
+
+			int cell = BoardAI::PickMove(bot.m_board, bot.m_nColor, useAI ? BoardAI::Level::GREEDY : BoardAI::Level::RANDOM, m_rng);
+			if (cell < 0)
+				continue;
+
+			// shown straight away like the client does, the board the server sends back has the final word
+			bot.m_board.place(bot.m_nColor, cell);
+			bot.m_nCurrentTurn = OtherColor(bot.m_nColor);
+
+			MovePacket packet;
+			packet.moveId = ++bot.m_nMoveId;
+			packet.cell = (int8)cell;
+			packet.color = (int8)bot.m_nColor;
+			m_outbox.Add(bot.m_hConn, &packet, (uint32)sizeof(packet), k_nSteamNetworkingSend_Reliable);
+
+			bot.m_bAwaitingEcho = true;
+			bot.m_nLastCell = cell;
+			bot.m_usecMoveSent = now;
+			m_nMovesSent++;
+		}
+	}
+
+	void OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo)
+	{
+		int index = (int)pInfo->m_info.m_nUserData;
+		if (index < 0 || index >= (int)m_vecBots.size())
+			return;
+		Bot_t &bot = m_vecBots[index];
+
+		switch (pInfo->m_info.m_eState)
+		{
+		case k_ESteamNetworkingConnectionState_None:
+			// NOTE: We will get callbacks here when we destroy connections.  You can ignore these.
+			break;
+
+		case k_ESteamNetworkingConnectionState_ClosedByPeer:
+		case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
+		{
+			// a player with a seat to go back to tries the standby a few times before it counts as lost,
+			// one line per bot would bury the reports so they are just counted
+			if (!bot.m_bSpectator && bot.m_nSessionToken != 0 && !m_standbyAddr.IsIPv6AllZeros() && bot.m_nFailoverAttempts < k_nMaxFailoverAttempts)
+			{
+				bot.m_nFailoverAttempts++;
+				bot.m_usecNextFailover = SteamNetworkingUtils()->GetLocalTimestamp() + k_usecFailoverRetry;
+				m_vecFailingOver.push_back(index);
+			}
+			else
+			{
+				m_nDisconnects++;
+			}
+
+			m_pInterface->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
+			bot.m_hConn = k_HSteamNetConnection_Invalid;
+			bot.m_bConnected = false;
+			bot.m_usecNextMove = 0;
+			break;
+		}
+
+		case k_ESteamNetworkingConnectionState_Connected:
+			bot.m_bConnected = true;
+			m_connectTimes.Add(SteamNetworkingUtils()->GetLocalTimestamp() - bot.m_usecConnectStart);
+			SendJoin(bot);
+			break;
+
+		default:
+			// Silences -Wswitch
+			break;
+		}
+	}
+
+	static LoadGenerator *s_pCallbackInstance;
+
+	static void SteamNetConnectionStatusChangedCallback(SteamNetConnectionStatusChangedCallback_t *pInfo)
+	{
+		s_pCallbackInstance->OnSteamNetConnectionStatusChanged(pInfo);
+	}
+
+	void PollConnectionStateChanges()
+	{
+		s_pCallbackInstance = this;
+		m_pInterface->RunCallbacks();
+	}
+};
+
+#endif
@@ -0,0 +1,213 @@
+// bounded lock free queues used to pass work between the network thread and the room shard threads.
+// both have a fixed size picked at construction so pushing never allocates, a full queue just returns false.
+// a consumer that runs out of work sleeps on a Wakeup until a producer has pushed something.
+
+#ifndef LOCKFREEQUEUE_H
+#define LOCKFREEQUEUE_H
+
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstddef>
+#include <stdint.h>
+
+// keeps the producer and consumer positions on separate cache lines so the two threads don't fight over one line
+const size_t k_nCacheLineSize = 64;
+
+static inline size_t RoundUpToPowerOfTwo(size_t n) {
+	size_t result = 1;
+	while (result < n) {
+		result <<= 1;
+	}
+	return result;
+}
+
+// many producers, one consumer. based on Dmitry Vyukov's bounded queue: every cell carries a sequence number
+// that tells a producer whether the cell is free for its position and the consumer whether it has been written yet.
+template<typename T>
+class MPSCQueue {
+public:
+	// nCapacity is rounded up to a power of two
+	MPSCQueue(size_t nCapacity) : m_vecCells(RoundUpToPowerOfTwo(nCapacity)) {
+		m_nMask = m_vecCells.size() - 1;
+
+		for (size_t i = 0; i < m_vecCells.size(); i++) {
+			m_vecCells[i].seq.store(i, std::memory_order_relaxed);
+		}
+
+		m_nEnqueuePos.store(0, std::memory_order_relaxed);
+		m_nDequeuePos = 0;
+	}
+
+	MPSCQueue(const MPSCQueue&) = delete;
+	MPSCQueue &operator=(const MPSCQueue&) = delete;
+
+	// any thread. returns false if the queue is full.
+	bool Push(const T &item) {
+		Cell *cell;
+		size_t pos = m_nEnqueuePos.load(std::memory_order_relaxed);
+		for (;;) {
+			cell = &m_vecCells[pos & m_nMask];
+			size_t seq = cell->seq.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+			if (diff == 0) {
+				// the cell is free, try to claim this position
+				if (m_nEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			}
+			else if (diff < 0) {
+				// the consumer has not gotten to this cell yet
+				return false;
+			}
+			else {
+				// another producer took the position first
+				pos = m_nEnqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+
+		cell->data = item;
+		cell->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// consumer thread only. returns false if the queue is empty.
+	bool Pop(T &item) {
+		Cell *cell = &m_vecCells[m_nDequeuePos & m_nMask];
+		size_t seq = cell->seq.load(std::memory_order_acquire);
+		if ((intptr_t)seq - (intptr_t)(m_nDequeuePos + 1) < 0) {
+			return false;
+		}
+
+		item = cell->data;
+		// mark the cell free for the producer that wraps around to it next
+		cell->seq.store(m_nDequeuePos + m_nMask + 1, std::memory_order_release);
+		m_nDequeuePos++;
+		return true;
+	}
+
+	// consumer thread only
+	bool Empty() {
+		const Cell &cell = m_vecCells[m_nDequeuePos & m_nMask];
+		return (intptr_t)cell.seq.load(std::memory_order_acquire) - (intptr_t)(m_nDequeuePos + 1) < 0;
+	}
+
+private:
+	struct Cell {
+		std::atomic<size_t> seq;
+		T data;
+	};
+
+	std::vector<Cell> m_vecCells;
+	size_t m_nMask;
+
+	alignas(k_nCacheLineSize) std::atomic<size_t> m_nEnqueuePos;
+	alignas(k_nCacheLineSize) size_t m_nDequeuePos;
+};
+
+// one producer, one consumer ring
+template<typename T>
+class SPSCRing {
+public:
+	// nCapacity is rounded up to a power of two
+	SPSCRing(size_t nCapacity) : m_vecItems(RoundUpToPowerOfTwo(nCapacity)) {
+		m_nMask = m_vecItems.size() - 1;
+
+		m_nHead.store(0, std::memory_order_relaxed);
+		m_nTail.store(0, std::memory_order_relaxed);
+	}
+
+	SPSCRing(const SPSCRing&) = delete;
+	SPSCRing &operator=(const SPSCRing&) = delete;
+
+	// producer thread only. returns false if the ring is full.
+	bool Push(const T &item) {
+		size_t tail = m_nTail.load(std::memory_order_relaxed);
+		if (tail - m_nHead.load(std::memory_order_acquire) == m_vecItems.size()) {
+			return false;
+		}
+
+		m_vecItems[tail & m_nMask] = item;
+		m_nTail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// consumer thread only. returns false if the ring is empty.
+	bool Pop(T &item) {
+		size_t head = m_nHead.load(std::memory_order_relaxed);
+		if (head == m_nTail.load(std::memory_order_acquire)) {
+			return false;
+		}
+
+		item = m_vecItems[head & m_nMask];
+		m_nHead.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool Empty() {
+		return m_nHead.load(std::memory_order_acquire) == m_nTail.load(std::memory_order_acquire);
+	}
+
+private:
+	std::vector<T> m_vecItems;
+	size_t m_nMask;
+
+	// head is read by the consumer, tail is written by the producer
+	alignas(k_nCacheLineSize) std::atomic<size_t> m_nHead;
+	alignas(k_nCacheLineSize) std::atomic<size_t> m_nTail;
+};
+
+// lets the consumer of some queues sleep once they are empty and wakes it as soon as anything is pushed.
+// a producer only takes the lock when the consumer is really asleep, otherwise a push costs a fence and a load.
+class Wakeup {
+public:
+	Wakeup() : m_bSleeping(false), m_bSignalled(false) {}
+
+	Wakeup(const Wakeup&) = delete;
+	Wakeup &operator=(const Wakeup&) = delete;
+
+	// any thread, after pushing
+	void Notify() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!m_bSleeping.load(std::memory_order_relaxed)) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_bSignalled = true;
+		}
+		m_cv.notify_one();
+	}
+
+	// consumer thread only. sleeps until Notify is called or usecTimeout is up, a negative timeout waits for Notify.
+	// fnReady takes one more look at the queues after the producers can see we are going to sleep, so something
+	// pushed just before can't be missed. it may also return early for no reason.
+	template<typename Fn>
+	void Wait(int64_t usecTimeout, Fn fnReady) {
+		m_bSleeping.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!fnReady()) {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (usecTimeout < 0) {
+				m_cv.wait(lock, [this]() { return m_bSignalled; });
+			}
+			else {
+				m_cv.wait_for(lock, std::chrono::microseconds(usecTimeout), [this]() { return m_bSignalled; });
+			}
+			m_bSignalled = false;
+		}
+		m_bSleeping.store(false, std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<bool> m_bSleeping;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	bool m_bSignalled;
+};
+
+#endif
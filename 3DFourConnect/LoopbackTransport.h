@@ -0,0 +1,525 @@
+// connections between transports in the same process, so a server and its clients can run in one process without
+// any sockets, for tests that have to come out the same every time and for benchmarking the protocol on its own.
+// every transport has its own connections, poll groups and callbacks and is only ever used by one thread, the same as
+// the library would be by each program. messages go straight into a lock free ring on the other end of the connection
+// and are never dropped, reordered or delayed.
+// messages and timestamps still come from SteamNetworkingUtils so the library has to be initialised, but it never opens a socket.
+
+#ifndef LOOPBACKTRANSPORT_H
+#define LOOPBACKTRANSPORT_H
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <string>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include "Transport.h"
+#include "LockFreeQueue.h"
+
+// most messages waiting on one end of a connection, a send past it fails like a full send buffer would
+const size_t k_nLoopbackQueueSize = 4096;
+
+// most connections in one poll group
+const size_t k_nLoopbackMaxPollGroupSize = 65536;
+
+class LoopbackTransport;
+
+// what the transports of one process share, connecting to a port finds whichever transport is listening on it
+class LoopbackNetwork {
+public:
+	LoopbackNetwork() : m_nNextHandle(1) {}
+
+	// for waiting on a server started on another thread before connecting to it
+	bool IsListening(uint16 nPort) {
+		std::lock_guard<std::mutex> lock(m_lock);
+		return m_mapListeners.count(nPort) > 0;
+	}
+
+private:
+	friend class LoopbackTransport;
+
+	struct Listener_t
+	{
+		LoopbackTransport *m_pTransport;
+		HSteamListenSocket m_hSocket;
+		FnSteamNetConnectionStatusChanged m_fnCallback;
+	};
+
+	std::mutex m_lock;
+	std::map<uint16, Listener_t> m_mapListeners;
+
+	// handles are never reused
+	std::atomic<uint32> m_nNextHandle;
+
+	uint32 NewHandle() {
+		return m_nNextHandle.fetch_add(1);
+	}
+};
+
+class LoopbackTransport : public ITransport {
+public:
+	LoopbackTransport(LoopbackNetwork &network) : m_network(network) {}
+
+	// only once nothing else is sending to this transport's connections
+	~LoopbackTransport() override {
+		// connections that showed up after the last RunCallbacks are still ours to close
+		for (Event_t &event : m_vecEvents) {
+			if (event.m_pIncoming != nullptr) {
+				m_mapConnections[event.m_pIncoming->m_hConn] = event.m_pIncoming;
+			}
+		}
+		m_vecEvents.clear();
+
+		while (!m_mapListenSockets.empty()) {
+			CloseListenSocket(m_mapListenSockets.begin()->first);
+		}
+		while (!m_mapConnections.empty()) {
+			CloseConnection(m_mapConnections.begin()->first, 0, nullptr, false);
+		}
+	}
+
+	HSteamListenSocket CreateListenSocketIP(const SteamNetworkingIPAddr &localAddress, int nOptions, const SteamNetworkingConfigValue_t *pOptions) override {
+		std::lock_guard<std::mutex> lock(m_network.m_lock);
+		if (m_network.m_mapListeners.count(localAddress.m_port) > 0) {
+			return k_HSteamListenSocket_Invalid;
+		}
+
+		LoopbackNetwork::Listener_t listener;
+		listener.m_pTransport = this;
+		listener.m_hSocket = m_network.NewHandle();
+		listener.m_fnCallback = CallbackFromOptions(nOptions, pOptions);
+		m_network.m_mapListeners[localAddress.m_port] = listener;
+		m_mapListenSockets[listener.m_hSocket] = localAddress.m_port;
+		return listener.m_hSocket;
+	}
+
+	// like the library, this also closes every connection that came in through the socket
+	bool CloseListenSocket(HSteamListenSocket hSocket) override {
+		auto itSocket = m_mapListenSockets.find(hSocket);
+		if (itSocket == m_mapListenSockets.end()) {
+			return false;
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_network.m_lock);
+			m_network.m_mapListeners.erase(itSocket->second);
+		}
+		m_mapListenSockets.erase(itSocket);
+
+		std::vector<HSteamNetConnection> vecAccepted;
+		for (auto &c : m_mapConnections) {
+			if (c.second->m_hListenSocket == hSocket) {
+				vecAccepted.push_back(c.first);
+			}
+		}
+		for (HSteamNetConnection hConn : vecAccepted) {
+			CloseConnection(hConn, 0, nullptr, false);
+		}
+		return true;
+	}
+
+	// the address only matters for its port. with nobody listening the connection fails on the next RunCallbacks.
+	HSteamNetConnection ConnectByIPAddress(const SteamNetworkingIPAddr &address, int nOptions, const SteamNetworkingConfigValue_t *pOptions) override {
+		Pair_t *pPair = new Pair_t();
+		Connection_t *pLocal = &pPair->m_ends[0];
+		Connection_t *pRemote = &pPair->m_ends[1];
+		pLocal->m_pPeer = pRemote;
+		pRemote->m_pPeer = pLocal;
+		pLocal->m_pPair = pPair;
+		pRemote->m_pPair = pPair;
+
+		pLocal->m_hConn = m_network.NewHandle();
+		pLocal->m_pOwner = this;
+		pLocal->m_fnCallback = CallbackFromOptions(nOptions, pOptions);
+		pLocal->m_eState = k_ESteamNetworkingConnectionState_Connecting;
+		pLocal->m_addrRemote = address;
+		SetDescription(pLocal, address.m_port);
+		m_mapConnections[pLocal->m_hConn] = pLocal;
+
+		std::lock_guard<std::mutex> lock(m_network.m_lock);
+		auto itListener = m_network.m_mapListeners.find(address.m_port);
+		if (itListener == m_network.m_mapListeners.end()) {
+			pPair->m_nOpenEnds = 1;
+			pLocal->m_eState = k_ESteamNetworkingConnectionState_ProblemDetectedLocally;
+			PostEvent(pLocal, k_ESteamNetworkingConnectionState_Connecting, k_ESteamNetConnectionEnd_Misc_Generic, "Nobody is listening on that port", false);
+			return pLocal->m_hConn;
+		}
+
+		pPair->m_nOpenEnds = 2;
+		pRemote->m_hConn = m_network.NewHandle();
+		pRemote->m_pOwner = itListener->second.m_pTransport;
+		pRemote->m_fnCallback = itListener->second.m_fnCallback;
+		pRemote->m_hListenSocket = itListener->second.m_hSocket;
+		pRemote->m_eState = k_ESteamNetworkingConnectionState_Connecting;
+		pRemote->m_addrRemote.SetIPv4(0x7f000001, 0);
+		SetDescription(pRemote, address.m_port);
+		pRemote->m_pOwner->PostEvent(pRemote, k_ESteamNetworkingConnectionState_None, 0, nullptr, true);
+		return pLocal->m_hConn;
+	}
+
+	EResult AcceptConnection(HSteamNetConnection hConn) override {
+		Connection_t *pConn = Find(hConn);
+		if (pConn == nullptr || pConn->m_hListenSocket == k_HSteamListenSocket_Invalid) {
+			return k_EResultInvalidParam;
+		}
+
+		// either end can have been closed by the other since the request came in
+		int eState = k_ESteamNetworkingConnectionState_Connecting;
+		if (!pConn->m_eState.compare_exchange_strong(eState, k_ESteamNetworkingConnectionState_Connected)) {
+			return k_EResultInvalidState;
+		}
+		PostEvent(pConn, k_ESteamNetworkingConnectionState_Connecting, 0, nullptr, false);
+
+		Connection_t *pPeer = pConn->m_pPeer;
+		eState = k_ESteamNetworkingConnectionState_Connecting;
+		if (pPeer->m_eState.compare_exchange_strong(eState, k_ESteamNetworkingConnectionState_Connected)) {
+			pPeer->m_pOwner->PostEvent(pPeer, k_ESteamNetworkingConnectionState_Connecting, 0, nullptr, false);
+		}
+		return k_EResultOK;
+	}
+
+	// everything already sent has been delivered, so lingering changes nothing
+	bool CloseConnection(HSteamNetConnection hPeer, int nReason, const char *pszDebug, bool /*bEnableLinger*/) override {
+		Connection_t *pConn = Find(hPeer);
+		if (pConn == nullptr) {
+			return false;
+		}
+		m_mapConnections.erase(hPeer);
+		pConn->m_eState = k_ESteamNetworkingConnectionState_None;
+
+		Pair_t *pPair = pConn->m_pPair;
+		if (pPair->m_nOpenEnds == 2) {
+			Connection_t *pPeer = pConn->m_pPeer;
+			int eState = pPeer->m_eState;
+			while (eState == k_ESteamNetworkingConnectionState_Connecting || eState == k_ESteamNetworkingConnectionState_Connected) {
+				if (pPeer->m_eState.compare_exchange_weak(eState, k_ESteamNetworkingConnectionState_ClosedByPeer)) {
+					pPeer->m_pOwner->PostEvent(pPeer, (ESteamNetworkingConnectionState)eState, nReason, pszDebug, false);
+					break;
+				}
+			}
+		}
+
+		// the last end to close frees both, neither owner touches the other end once its own is closed
+		if (pPair->m_nOpenEnds.fetch_sub(1) == 1) {
+			delete pPair;
+		}
+		return true;
+	}
+
+	bool SetConnectionUserData(HSteamNetConnection hPeer, int64 nUserData) override {
+		Connection_t *pConn = Find(hPeer);
+		if (pConn == nullptr) {
+			return false;
+		}
+		pConn->m_nUserData = nUserData;
+		return true;
+	}
+
+	void SetConnectionName(HSteamNetConnection hPeer, const char *pszName) override {
+		Connection_t *pConn = Find(hPeer);
+		if (pConn != nullptr) {
+			pConn->m_sName = pszName;
+		}
+	}
+
+	// the bytes sent but not yet received by the other end show up as pending reliable data
+	bool GetQuickConnectionStatus(HSteamNetConnection hConn, SteamNetworkingQuickConnectionStatus *pStats) override {
+		Connection_t *pConn = Find(hConn);
+		if (pConn == nullptr) {
+			return false;
+		}
+
+		memset(pStats, 0, sizeof(*pStats));
+		pStats->m_eState = (ESteamNetworkingConnectionState)pConn->m_eState.load();
+		pStats->m_flConnectionQualityLocal = 1.0f;
+		pStats->m_flConnectionQualityRemote = 1.0f;
+		if (pConn->m_pPair->m_nOpenEnds == 2) {
+			pStats->m_cbPendingReliable = pConn->m_pPeer->m_cbPending;
+		}
+		return true;
+	}
+
+	void SendMessages(int nMessages, SteamNetworkingMessage_t *const *pMessages, int64 *pOutMessageNumberOrResult) override {
+		for (int i = 0; i < nMessages; i++) {
+			SteamNetworkingMessage_t *pMsg = pMessages[i];
+			int64 nResult = Send(pMsg);
+			if (nResult < 0) {
+				pMsg->Release();
+			}
+			if (pOutMessageNumberOrResult != nullptr) {
+				pOutMessageNumberOrResult[i] = nResult;
+			}
+		}
+	}
+
+	int ReceiveMessagesOnConnection(HSteamNetConnection hConn, SteamNetworkingMessage_t **ppOutMessages, int nMaxMessages) override {
+		Connection_t *pConn = Find(hConn);
+		if (pConn == nullptr) {
+			return -1;
+		}
+		return Drain(pConn, ppOutMessages, nMaxMessages, SteamNetworkingUtils()->GetLocalTimestamp());
+	}
+
+	HSteamNetPollGroup CreatePollGroup() override {
+		HSteamNetPollGroup hPollGroup = m_network.NewHandle();
+		m_mapPollGroups[hPollGroup].reset(new PollGroup_t());
+		return hPollGroup;
+	}
+
+	bool DestroyPollGroup(HSteamNetPollGroup hPollGroup) override {
+		auto itPollGroup = m_mapPollGroups.find(hPollGroup);
+		if (itPollGroup == m_mapPollGroups.end()) {
+			return false;
+		}
+
+		for (auto &c : m_mapConnections) {
+			if (c.second->m_pPollGroup == itPollGroup->second.get()) {
+				c.second->m_pPollGroup = nullptr;
+			}
+		}
+
+		// another thread can be in the middle of a send that is about to wake it, so it is kept until we go away
+		m_vecDeadPollGroups.push_back(std::move(itPollGroup->second));
+		m_mapPollGroups.erase(itPollGroup);
+		return true;
+	}
+
+	bool SetConnectionPollGroup(HSteamNetConnection hConn, HSteamNetPollGroup hPollGroup) override {
+		Connection_t *pConn = Find(hConn);
+		if (pConn == nullptr) {
+			return false;
+		}
+		if (hPollGroup == k_HSteamNetPollGroup_Invalid) {
+			pConn->m_pPollGroup = nullptr;
+			return true;
+		}
+
+		auto itPollGroup = m_mapPollGroups.find(hPollGroup);
+		if (itPollGroup == m_mapPollGroups.end()) {
+			return false;
+		}
+
+		// anything that arrived before now has to be picked up by the new group, an extra wake up costs nothing
+		PollGroup_t *pPollGroup = itPollGroup->second.get();
+		pConn->m_pPollGroup = pPollGroup;
+		pConn->m_bQueued = true;
+		pPollGroup->m_ready.Push(hConn);
+		return true;
+	}
+
+	// only visits connections that have something waiting, oldest wake up first
+	int ReceiveMessagesOnPollGroup(HSteamNetPollGroup hPollGroup, SteamNetworkingMessage_t **ppOutMessages, int nMaxMessages) override {
+		auto itPollGroup = m_mapPollGroups.find(hPollGroup);
+		if (itPollGroup == m_mapPollGroups.end()) {
+			return -1;
+		}
+		PollGroup_t *pPollGroup = itPollGroup->second.get();
+
+		SteamNetworkingMicroseconds usecNow = SteamNetworkingUtils()->GetLocalTimestamp();
+		int numMsgs = 0;
+		HSteamNetConnection hConn;
+		while (numMsgs < nMaxMessages && pPollGroup->m_ready.Pop(hConn)) {
+			// closed or moved to another group since it was woken
+			Connection_t *pConn = Find(hConn);
+			if (pConn == nullptr || pConn->m_pPollGroup != pPollGroup) {
+				continue;
+			}
+
+			// cleared before draining, so a message sent from here on wakes it again
+			pConn->m_bQueued = false;
+			numMsgs += Drain(pConn, ppOutMessages + numMsgs, nMaxMessages - numMsgs, usecNow);
+
+			// out of room, there may be more left for next time
+			if (numMsgs == nMaxMessages && !pConn->m_bQueued.exchange(true)) {
+				pPollGroup->m_ready.Push(hConn);
+			}
+		}
+		return numMsgs;
+	}
+
+	void RunCallbacks() override {
+		std::vector<Event_t> vecEvents;
+		{
+			std::lock_guard<std::mutex> lock(m_lockEvents);
+			vecEvents.swap(m_vecEvents);
+		}
+
+		for (Event_t &event : vecEvents) {
+			if (event.m_pIncoming != nullptr) {
+				m_mapConnections[event.m_pIncoming->m_hConn] = event.m_pIncoming;
+			}
+
+			// nothing more is said about a connection once it is closed on our end
+			Connection_t *pConn = Find(event.m_info.m_hConn);
+			if (pConn == nullptr || pConn->m_fnCallback == nullptr) {
+				continue;
+			}
+			event.m_info.m_info.m_nUserData = pConn->m_nUserData;
+			pConn->m_fnCallback(&event.m_info);
+		}
+	}
+
+private:
+	struct PollGroup_t
+	{
+		// connections with messages waiting, each one is only in here once at a time (see Connection_t::m_bQueued)
+		MPSCQueue<HSteamNetConnection> m_ready;
+
+		PollGroup_t() : m_ready(k_nLoopbackMaxPollGroupSize) {}
+	};
+
+	struct Pair_t;
+
+	// one end of a connection, owned by a single transport
+	struct Connection_t
+	{
+		HSteamNetConnection m_hConn = k_HSteamNetConnection_Invalid;
+		LoopbackTransport *m_pOwner = nullptr;
+		Connection_t *m_pPeer = nullptr;
+		Pair_t *m_pPair = nullptr;
+		HSteamListenSocket m_hListenSocket = k_HSteamListenSocket_Invalid;
+		FnSteamNetConnectionStatusChanged m_fnCallback = nullptr;
+		std::string m_sName;
+		std::string m_sDescription;
+
+		// what the other end connected to, or localhost and no port for the end that was connected to
+		SteamNetworkingIPAddr m_addrRemote = {};
+
+		// only the other end changes it to closed by peer, everything else is the owner
+		std::atomic<int> m_eState;
+
+		// owner only
+		int64 m_nUserData = -1;
+		int64 m_nNextMessageNumber = 0;
+
+		// written by the other end's owner, read by ours
+		SPSCRing<SteamNetworkingMessage_t*> m_inbound;
+		std::atomic<int> m_cbPending;
+
+		// set when the connection is in its poll group's ready queue
+		std::atomic<PollGroup_t*> m_pPollGroup;
+		std::atomic<bool> m_bQueued;
+
+		Connection_t() : m_eState(k_ESteamNetworkingConnectionState_None), m_inbound(k_nLoopbackQueueSize), m_cbPending(0), m_pPollGroup(nullptr), m_bQueued(false) {}
+
+		~Connection_t() {
+			SteamNetworkingMessage_t *pMsg;
+			while (m_inbound.Pop(pMsg)) {
+				pMsg->Release();
+			}
+		}
+	};
+
+	// both ends of a connection live and die together
+	struct Pair_t
+	{
+		Connection_t m_ends[2];
+		std::atomic<int> m_nOpenEnds;
+	};
+
+	struct Event_t
+	{
+		// set for a new incoming connection, which becomes ours when the event is run
+		Connection_t *m_pIncoming;
+		SteamNetConnectionStatusChangedCallback_t m_info;
+	};
+
+	LoopbackNetwork &m_network;
+
+	// everything below is only touched by the thread using this transport
+	std::unordered_map<HSteamNetConnection, Connection_t*> m_mapConnections;
+	std::map<HSteamListenSocket, uint16> m_mapListenSockets;
+	std::map<HSteamNetPollGroup, std::unique_ptr<PollGroup_t>> m_mapPollGroups;
+	std::vector<std::unique_ptr<PollGroup_t>> m_vecDeadPollGroups;
+
+	// posted by any transport
+	std::mutex m_lockEvents;
+	std::vector<Event_t> m_vecEvents;
+
+	Connection_t *Find(HSteamNetConnection hConn) {
+		auto itConn = m_mapConnections.find(hConn);
+		return itConn != m_mapConnections.end() ? itConn->second : nullptr;
+	}
+
+	int64 Send(SteamNetworkingMessage_t *pMsg) {
+		// a connection we already closed is as gone as one the other end closed
+		Connection_t *pConn = Find(pMsg->m_conn);
+		if (pConn == nullptr || pConn->m_eState != k_ESteamNetworkingConnectionState_Connected) {
+			return -k_EResultNoConnection;
+		}
+
+		Connection_t *pPeer = pConn->m_pPeer;
+		pMsg->m_nMessageNumber = ++pConn->m_nNextMessageNumber;
+		pPeer->m_cbPending += pMsg->m_cbSize;
+		if (!pPeer->m_inbound.Push(pMsg)) {
+			pPeer->m_cbPending -= pMsg->m_cbSize;
+			return -k_EResultLimitExceeded;
+		}
+
+		// wake the other end's poll group unless it is already awake
+		PollGroup_t *pPollGroup = pPeer->m_pPollGroup;
+		if (pPollGroup != nullptr && !pPeer->m_bQueued.exchange(true)) {
+			pPollGroup->m_ready.Push(pPeer->m_hConn);
+		}
+		return pMsg->m_nMessageNumber;
+	}
+
+	int Drain(Connection_t *pConn, SteamNetworkingMessage_t **ppOutMessages, int nMaxMessages, SteamNetworkingMicroseconds usecNow) {
+		int numMsgs = 0;
+		SteamNetworkingMessage_t *pMsg;
+		while (numMsgs < nMaxMessages && pConn->m_inbound.Pop(pMsg)) {
+			pConn->m_cbPending -= pMsg->m_cbSize;
+
+			// it arrives as a message on our end of the connection
+			pMsg->m_conn = pConn->m_hConn;
+			pMsg->m_nConnUserData = pConn->m_nUserData;
+			pMsg->m_usecTimeReceived = usecNow;
+			ppOutMessages[numMsgs++] = pMsg;
+		}
+		return numMsgs;
+	}
+
+	// queues a state change of pConn for its owner's next RunCallbacks, any thread
+	void PostEvent(Connection_t *pConn, ESteamNetworkingConnectionState eOldState, int nEndReason, const char *pszEndDebug, bool bIncoming) {
+		Event_t event;
+		memset(&event.m_info, 0, sizeof(event.m_info));
+		event.m_pIncoming = bIncoming ? pConn : nullptr;
+		event.m_info.m_hConn = pConn->m_hConn;
+		event.m_info.m_eOldState = eOldState;
+		event.m_info.m_info.m_eState = (ESteamNetworkingConnectionState)pConn->m_eState.load();
+		event.m_info.m_info.m_hListenSocket = pConn->m_hListenSocket;
+		event.m_info.m_info.m_addrRemote = pConn->m_addrRemote;
+		event.m_info.m_info.m_eEndReason = nEndReason;
+		if (pszEndDebug != nullptr) {
+			snprintf(event.m_info.m_info.m_szEndDebug, sizeof(event.m_info.m_info.m_szEndDebug), "%s", pszEndDebug);
+		}
+		snprintf(event.m_info.m_info.m_szConnectionDescription, sizeof(event.m_info.m_info.m_szConnectionDescription), "%s", pConn->m_sDescription.c_str());
+
+		std::lock_guard<std::mutex> lock(m_lockEvents);
+		m_vecEvents.push_back(event);
+	}
+
+	static void SetDescription(Connection_t *pConn, uint16 nPort) {
+		char szDescription[64];
+		snprintf(szDescription, sizeof(szDescription), "#%u loopback:%u", pConn->m_hConn, (unsigned)nPort);
+		pConn->m_sDescription = szDescription;
+	}
+
+	static FnSteamNetConnectionStatusChanged CallbackFromOptions(int nOptions, const SteamNetworkingConfigValue_t *pOptions) {
+		for (int i = 0; i < nOptions; i++) {
+			if (pOptions[i].m_eValue == k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged) {
+				return (FnSteamNetConnectionStatusChanged)pOptions[i].m_val.m_ptr;
+			}
+		}
+		return nullptr;
+	}
+};
+
+#endif
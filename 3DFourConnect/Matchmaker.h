@@ -0,0 +1,124 @@
+// the queue of players waiting for an opponent, kept in rating order so everyone is paired with somebody close to
+// their own skill. how far apart two players may be starts small and widens the longer they wait, so nobody waits
+// forever just because there is nobody near their rating right now.
+
+#ifndef MATCHMAKER_H
+#define MATCHMAKER_H
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+
+// what a player that doesn't send a rating counts as
+const int k_nDefaultRating = 1500;
+
+class Matchmaker {
+public:
+	// how far apart two ratings may be straight away, and how much that grows every second of waiting
+	static const int k_nBaseWindow = 50;
+	static const int k_nWindowPerSecond = 50;
+
+	// the windows only grow this often, there is no point looking again before then unless somebody new came in
+	static const SteamNetworkingMicroseconds k_usecPassInterval = 100000;
+
+	struct Match_t {
+		HSteamNetConnection m_players[2];
+		SteamNetworkingMicroseconds m_usecWaited[2];
+	};
+
+	// a player already in the queue is moved to the new rating
+	void Enqueue(HSteamNetConnection conn, int rating, SteamNetworkingMicroseconds now) {
+		Remove(conn);
+		Waiting_t waiting;
+		waiting.m_hConn = conn;
+		waiting.m_usecQueued = now;
+		m_mapQueued[conn] = m_mapByRating.emplace(rating, waiting);
+		m_bChanged = true;
+	}
+
+	// false if the player wasn't waiting
+	bool Remove(HSteamNetConnection conn) {
+		auto itQueued = m_mapQueued.find(conn);
+		if (itQueued == m_mapQueued.end())
+			return false;
+		m_mapByRating.erase(itQueued->second);
+		m_mapQueued.erase(itQueued);
+		return true;
+	}
+
+	bool IsQueued(HSteamNetConnection conn) const {
+		return m_mapQueued.count(conn) > 0;
+	}
+
+	int Size() const {
+		return (int)m_mapQueued.size();
+	}
+
+	// when FormMatches could next find something, 0 if nobody is waiting
+	SteamNetworkingMicroseconds NextPass() const {
+		return m_mapByRating.empty() ? 0 : m_usecNextPass;
+	}
+
+	// one pass over the queue in rating order, pairing neighbours that are close enough and taking them out.
+	// players still waiting after usecOverdue are added to vecOverdue (and stay queued) so the caller can find them
+	// something else to do. does nothing if the last pass was too recent and nobody joined since.
+	void FormMatches(SteamNetworkingMicroseconds now, SteamNetworkingMicroseconds usecOverdue, std::vector<Match_t> &vecMatches, std::vector<HSteamNetConnection> &vecOverdue) {
+		if (m_mapByRating.empty() || (!m_bChanged && now < m_usecNextPass))
+			return;
+		m_bChanged = false;
+		m_usecNextPass = now + k_usecPassInterval;
+
+		auto it = m_mapByRating.begin();
+		while (it != m_mapByRating.end()) {
+			auto itNext = std::next(it);
+			if (itNext != m_mapByRating.end() && CanPlay(*it, *itNext, now)) {
+				Match_t match;
+				match.m_players[0] = it->second.m_hConn;
+				match.m_players[1] = itNext->second.m_hConn;
+				match.m_usecWaited[0] = now - it->second.m_usecQueued;
+				match.m_usecWaited[1] = now - itNext->second.m_usecQueued;
+				vecMatches.push_back(match);
+
+				m_mapQueued.erase(it->second.m_hConn);
+				m_mapQueued.erase(itNext->second.m_hConn);
+				m_mapByRating.erase(it);
+				it = m_mapByRating.erase(itNext);
+				continue;
+			}
+
+			if (now - it->second.m_usecQueued >= usecOverdue)
+				vecOverdue.push_back(it->second.m_hConn);
+			it = itNext;
+		}
+	}
+
+private:
+	struct Waiting_t {
+		HSteamNetConnection m_hConn;
+		SteamNetworkingMicroseconds m_usecQueued;
+	};
+
+	// rating to player, players with the same rating stay in the order they joined
+	typedef std::multimap<int, Waiting_t> ByRating_t;
+	ByRating_t m_mapByRating;
+
+	// where each waiting player is in m_mapByRating
+	std::map<HSteamNetConnection, ByRating_t::iterator> m_mapQueued;
+
+	bool m_bChanged = false;
+	SteamNetworkingMicroseconds m_usecNextPass = 0;
+
+	static int64 Window(const Waiting_t &waiting, SteamNetworkingMicroseconds now) {
+		return k_nBaseWindow + (now - waiting.m_usecQueued) * k_nWindowPerSecond / 1000000;
+	}
+
+	// the one that has waited longer decides, so a newcomer can't hold up somebody who has been waiting a while
+	static bool CanPlay(const ByRating_t::value_type &a, const ByRating_t::value_type &b, SteamNetworkingMicroseconds now) {
+		int64 window = std::max(Window(a.second, now), Window(b.second, now));
+		return (int64)b.first - a.first <= window;
+	}
+};
+
+#endif
@@ -0,0 +1,108 @@
+// collects the outgoing messages of one tick and hands them to the transport in a single SendMessages call
+// instead of one SendMessageToConnection per recipient.
+
+#ifndef MESSAGEBATCH_H
+#define MESSAGEBATCH_H
+
+#include <string.h>
+#include <vector>
+#include <iostream>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include "Transport.h"
+#include "MessagePool.h"
+
+class MessageBatch {
+public:
+	MessageBatch() {
+		m_pInterface = nullptr;
+		m_pPool = nullptr;
+	}
+
+	// nReserve is the most messages expected in one tick, the lists only grow past it under heavy load.
+	// messages added with Add take their buffers from pPool if there is one, only the thread that owns it may call Add.
+	void Init(ITransport *pInterface, int nReserve, MessagePool *pPool = nullptr) {
+		m_pInterface = pInterface;
+		m_pPool = pPool;
+
+		m_vecMessages.reserve(nReserve);
+		m_vecResults.reserve(nReserve);
+	}
+
+	// copy the data straight into a message owned by the library so it does not have to copy it again on send.
+	// safe to call from any thread that owns pPool (or with none), the message can be handed to another thread before it is added to a batch.
+	static SteamNetworkingMessage_t *CreateMessage(HSteamNetConnection conn, const void *pData, uint32 cbData, int nSendFlags, MessagePool *pPool = nullptr) {
+		SteamNetworkingMessage_t *pMsg = pPool != nullptr ? pPool->AllocateMessage(cbData) : SteamNetworkingUtils()->AllocateMessage((int)cbData);
+		memcpy(pMsg->m_pData, pData, cbData);
+		pMsg->m_conn = conn;
+		pMsg->m_nFlags = nSendFlags;
+
+		return pMsg;
+	}
+
+	void Add(HSteamNetConnection conn, const void *pData, uint32 cbData, int nSendFlags) {
+		m_vecMessages.push_back(CreateMessage(conn, pData, cbData, nSendFlags, m_pPool));
+	}
+
+	// add a message made with CreateMessage, the batch takes ownership of it
+	void AddMessage(SteamNetworkingMessage_t *pMsg) {
+		m_vecMessages.push_back(pMsg);
+	}
+
+	// send everything collected since the last flush. messages to the same connection keep the order they were added in.
+	void Flush() {
+		if (m_vecMessages.empty()) {
+			return;
+		}
+
+		m_vecResults.resize(m_vecMessages.size());
+		m_pInterface->SendMessages((int)m_vecMessages.size(), m_vecMessages.data(), m_vecResults.data());
+
+		// the library owns the messages now, negative results are failed sends (usually a connection that just closed)
+		for (size_t i = 0; i < m_vecResults.size(); i++) {
+			if (m_vecResults[i] < 0 && m_vecResults[i] != -k_EResultNoConnection) {
+				std::cout << "Failed to send message, result " << -m_vecResults[i] << std::endl;
+			}
+		}
+
+		m_vecMessages.clear();
+	}
+
+	// takes out and releases every waiting message pred returns true for, the rest keep their order. returns how many went.
+	template <typename Pred>
+	int Drop(Pred pred) {
+		size_t kept = 0;
+		for (size_t i = 0; i < m_vecMessages.size(); i++) {
+			if (pred(m_vecMessages[i])) {
+				m_vecMessages[i]->Release();
+			}
+			else {
+				m_vecMessages[kept++] = m_vecMessages[i];
+			}
+		}
+
+		int numDropped = (int)(m_vecMessages.size() - kept);
+		m_vecMessages.resize(kept);
+		return numDropped;
+	}
+
+	int size() {
+		return (int)m_vecMessages.size();
+	}
+
+	// the messages waiting for the next flush
+	const std::vector<SteamNetworkingMessage_t*> &Messages() {
+		return m_vecMessages;
+	}
+
+private:
+	ITransport *m_pInterface;
+	MessagePool *m_pPool;
+
+	std::vector<SteamNetworkingMessage_t*> m_vecMessages;
+	std::vector<int64> m_vecResults;
+};
+
+#endif
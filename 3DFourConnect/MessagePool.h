@@ -0,0 +1,126 @@
+// fixed size buffers for outgoing message data that are used over and over instead of being allocated for every send.
+// one thread owns a pool and takes buffers from it, the networking library gives them back from whatever thread
+// frees the message, so the free list is a lock free queue with the owner as its only consumer.
+// the pool only allocates while it warms up, after that every buffer handed out is one that came back.
+
+#ifndef MESSAGEPOOL_H
+#define MESSAGEPOOL_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include "LockFreeQueue.h"
+#include "Metrics.h"
+
+class MessagePool {
+public:
+	// room for the largest packet we send plus a shared payload header, anything bigger is allocated the old way
+	static const uint32 k_cbBlock = 1024;
+
+	// the library can still hold messages from the pool after its owner is done with it, so the pool is heap allocated
+	// and frees itself once the owner has called Release and the last buffer has come back.
+	// nMaxFree is the most buffers kept for reuse, the counters are optional and can be shared between pools.
+	static MessagePool *Create(size_t nMaxFree = 4096, Counter *pBuffersAllocated = nullptr, Counter *pBuffersReused = nullptr) {
+		return new MessagePool(nMaxFree, pBuffersAllocated, pBuffersReused);
+	}
+
+	// the owner is done with the pool
+	void Release() {
+		ReleaseRef();
+	}
+
+	// owner thread only. a buffer of k_cbBlock bytes or nullptr if cbData doesn't fit in one or there's no memory for it.
+	void *AllocateBlock(uint32 cbData) {
+		if (cbData > k_cbBlock) {
+			return nullptr;
+		}
+
+		Block_t *pBlock;
+		if (m_free.Pop(pBlock)) {
+			if (m_pBuffersReused != nullptr) {
+				m_pBuffersReused->Add();
+			}
+		}
+		else {
+			pBlock = (Block_t*)malloc(sizeof(Block_t) + k_cbBlock);
+			if (pBlock == nullptr) {
+				return nullptr;
+			}
+			pBlock->m_pPool = this;
+			if (m_pBuffersAllocated != nullptr) {
+				m_pBuffersAllocated->Add();
+			}
+		}
+
+		// every buffer out of the pool keeps it alive
+		m_nRefs.fetch_add(1, std::memory_order_relaxed);
+		return pBlock + 1;
+	}
+
+	// any thread. pData must have come from AllocateBlock of some pool.
+	static void FreeBlock(void *pData) {
+		Block_t *pBlock = (Block_t*)pData - 1;
+		MessagePool *pPool = pBlock->m_pPool;
+
+		// more came back than we keep, let this one go
+		if (!pPool->m_free.Push(pBlock)) {
+			free(pBlock);
+		}
+		pPool->ReleaseRef();
+	}
+
+	// owner thread only. a message with room for cbData bytes, the data goes back to the pool once the library frees the message.
+	SteamNetworkingMessage_t *AllocateMessage(uint32 cbData) {
+		void *pData = AllocateBlock(cbData);
+		if (pData == nullptr) {
+			return SteamNetworkingUtils()->AllocateMessage((int)cbData);
+		}
+
+		SteamNetworkingMessage_t *pMsg = SteamNetworkingUtils()->AllocateMessage(0);
+		pMsg->m_pData = pData;
+		pMsg->m_cbSize = (int)cbData;
+		pMsg->m_pfnFreeData = FreeMessageData;
+		return pMsg;
+	}
+
+private:
+	// sits right in front of the data, 16 bytes so the packet structs after it stay aligned
+	struct Block_t
+	{
+		MessagePool *m_pPool;
+		char m_pad[16 - sizeof(MessagePool*)];
+	};
+
+	MPSCQueue<Block_t*> m_free;
+
+	// one for the owner and one for every buffer that is out
+	std::atomic<int> m_nRefs;
+
+	Counter *m_pBuffersAllocated;
+	Counter *m_pBuffersReused;
+
+	MessagePool(size_t nMaxFree, Counter *pBuffersAllocated, Counter *pBuffersReused) : m_free(nMaxFree), m_nRefs(1), m_pBuffersAllocated(pBuffersAllocated), m_pBuffersReused(pBuffersReused) {}
+
+	~MessagePool() {
+		Block_t *pBlock;
+		while (m_free.Pop(pBlock)) {
+			free(pBlock);
+		}
+	}
+
+	void ReleaseRef() {
+		if (m_nRefs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			delete this;
+		}
+	}
+
+	static void FreeMessageData(SteamNetworkingMessage_t *pMsg) {
+		FreeBlock(pMsg->m_pData);
+	}
+};
+
+#endif
@@ -0,0 +1,266 @@
+// counters, gauges and latency histograms the server keeps about itself.
+// updating a metric is a single atomic add so any thread can do it, registering one and exporting take a lock
+// but only happen at startup and when the stats are printed or written out.
+// the export is the prometheus text format so a local scraper can read the file straight away.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+
+// only ever goes up
+class Counter {
+public:
+	Counter() {
+		m_nValue = 0;
+	}
+
+	void Add(uint64 n = 1) {
+		m_nValue.fetch_add(n, std::memory_order_relaxed);
+	}
+
+	uint64 Get() const {
+		return m_nValue.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<uint64> m_nValue;
+};
+
+// a value that can go up and down
+class Gauge {
+public:
+	Gauge() {
+		m_nValue = 0;
+	}
+
+	void Set(int64 n) {
+		m_nValue.store(n, std::memory_order_relaxed);
+	}
+
+	void Add(int64 n) {
+		m_nValue.fetch_add(n, std::memory_order_relaxed);
+	}
+
+	int64 Get() const {
+		return m_nValue.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<int64> m_nValue;
+};
+
+// log-linear buckets like an HDR histogram: every power of two is split into 16 equal buckets,
+// so any recorded value is off by at most 1/16 (about 6%) no matter how large it is.
+// values below 16 get a bucket each. everything is a fixed array so recording never allocates.
+class Histogram {
+public:
+	// 16 sub buckets per power of two up to 2^40 (12 days in microseconds)
+	static const int k_nSubBucketBits = 4;
+	static const int k_nSubBuckets = 1 << k_nSubBucketBits;
+	static const int k_nMaxExponent = 40;
+	static const int k_nNumBuckets = (k_nMaxExponent - k_nSubBucketBits + 2) * k_nSubBuckets;
+
+	Histogram() {
+		Clear();
+	}
+
+	void Record(int64 value) {
+		if (value < 0)
+			value = 0;
+
+		m_buckets[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+		m_nCount.fetch_add(1, std::memory_order_relaxed);
+		m_nSum.fetch_add(value, std::memory_order_relaxed);
+
+		int64 max = m_nMax.load(std::memory_order_relaxed);
+		while (value > max && !m_nMax.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+	}
+
+	// not atomic as a whole, a record that races with it can land on either side
+	void Clear() {
+		for (int i = 0; i < k_nNumBuckets; i++)
+			m_buckets[i].store(0, std::memory_order_relaxed);
+		m_nCount = 0;
+		m_nSum = 0;
+		m_nMax = 0;
+	}
+
+	uint64 Count() const {
+		return m_nCount.load(std::memory_order_relaxed);
+	}
+
+	int64 Sum() const {
+		return m_nSum.load(std::memory_order_relaxed);
+	}
+
+	int64 Max() const {
+		return m_nMax.load(std::memory_order_relaxed);
+	}
+
+	// flPercentile is 0-100, returns the top of the bucket it falls in (never more than the largest value seen), 0 if empty
+	int64 Percentile(float flPercentile) const {
+		uint64 count = Count();
+		if (count == 0)
+			return 0;
+
+		uint64 target = std::max((uint64)1, (uint64)(flPercentile / 100.0f * count + 0.5f));
+		uint64 seen = 0;
+		for (int i = 0; i < k_nNumBuckets; i++) {
+			seen += m_buckets[i].load(std::memory_order_relaxed);
+			if (seen >= target)
+				return std::min(BucketUpperBound(i), Max());
+		}
+		return Max();
+	}
+
+	static int BucketIndex(int64 value) {
+		if (value < k_nSubBuckets)
+			return (int)value;
+
+		int exponent = 63;
+		while (((uint64)value >> exponent) == 0)
+			exponent--;
+		if (exponent > k_nMaxExponent)
+			return k_nNumBuckets - 1;
+
+		int sub = (int)((value >> (exponent - k_nSubBucketBits)) & (k_nSubBuckets - 1));
+		return (exponent - k_nSubBucketBits + 1) * k_nSubBuckets + sub;
+	}
+
+	static int64 BucketUpperBound(int index) {
+		if (index < k_nSubBuckets)
+			return index;
+
+		int exponent = index / k_nSubBuckets + k_nSubBucketBits - 1;
+		int64 sub = index % k_nSubBuckets;
+		int64 width = (int64)1 << (exponent - k_nSubBucketBits);
+		return (k_nSubBuckets + sub) * width + width - 1;
+	}
+
+private:
+	std::atomic<uint64> m_buckets[k_nNumBuckets];
+	std::atomic<uint64> m_nCount;
+	std::atomic<int64> m_nSum;
+	std::atomic<int64> m_nMax;
+};
+
+class MetricsRegistry {
+public:
+	// metrics with the same name but different labels are one family in the export, register them one after another.
+	// labels are written as is, e.g. "type=\"game_data\"". the returned metric lives as long as the registry.
+	Counter &AddCounter(const std::string &name, const std::string &help, const std::string &labels = "") {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_vecEntries.push_back(Entry_t(Entry_t::Kind::COUNTER, name, help, labels));
+		m_vecEntries.back().m_pCounter.reset(new Counter());
+		return *m_vecEntries.back().m_pCounter;
+	}
+
+	Gauge &AddGauge(const std::string &name, const std::string &help, const std::string &labels = "") {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_vecEntries.push_back(Entry_t(Entry_t::Kind::GAUGE, name, help, labels));
+		m_vecEntries.back().m_pGauge.reset(new Gauge());
+		return *m_vecEntries.back().m_pGauge;
+	}
+
+	// exported as a prometheus summary with a few quantiles
+	Histogram &AddHistogram(const std::string &name, const std::string &help, const std::string &labels = "") {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_vecEntries.push_back(Entry_t(Entry_t::Kind::HISTOGRAM, name, help, labels));
+		m_vecEntries.back().m_pHistogram.reset(new Histogram());
+		return *m_vecEntries.back().m_pHistogram;
+	}
+
+	// everything in the prometheus text exposition format
+	std::string ToPrometheusText() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		std::string text;
+		char line[512];
+		const std::string *pLastName = nullptr;
+		for (const Entry_t &entry : m_vecEntries) {
+			if (pLastName == nullptr || *pLastName != entry.m_sName) {
+				const char *pszType = entry.m_eKind == Entry_t::Kind::COUNTER ? "counter" : entry.m_eKind == Entry_t::Kind::GAUGE ? "gauge" : "summary";
+				text += "# HELP " + entry.m_sName + " " + entry.m_sHelp + "\n";
+				text += "# TYPE " + entry.m_sName + " " + pszType + "\n";
+				pLastName = &entry.m_sName;
+			}
+
+			std::string labels = entry.m_sLabels.empty() ? "" : "{" + entry.m_sLabels + "}";
+			switch (entry.m_eKind) {
+				case Entry_t::Kind::COUNTER: {
+					snprintf(line, sizeof(line), "%s%s %llu\n", entry.m_sName.c_str(), labels.c_str(), (unsigned long long)entry.m_pCounter->Get());
+					text += line;
+					break;
+				}
+				case Entry_t::Kind::GAUGE: {
+					snprintf(line, sizeof(line), "%s%s %lld\n", entry.m_sName.c_str(), labels.c_str(), (long long)entry.m_pGauge->Get());
+					text += line;
+					break;
+				}
+				case Entry_t::Kind::HISTOGRAM: {
+					const float quantiles[] = { 50.0f, 90.0f, 99.0f, 99.9f };
+					for (float q : quantiles) {
+						std::string quantileLabels = "{" + entry.m_sLabels + (entry.m_sLabels.empty() ? "" : ",");
+						snprintf(line, sizeof(line), "%s%squantile=\"%g\"} %lld\n", entry.m_sName.c_str(), quantileLabels.c_str(), q / 100.0f, (long long)entry.m_pHistogram->Percentile(q));
+						text += line;
+					}
+					snprintf(line, sizeof(line), "%s_sum%s %lld\n%s_count%s %llu\n", entry.m_sName.c_str(), labels.c_str(), (long long)entry.m_pHistogram->Sum(), entry.m_sName.c_str(), labels.c_str(), (unsigned long long)entry.m_pHistogram->Count());
+					text += line;
+					break;
+				}
+			}
+		}
+		return text;
+	}
+
+	// write the export to a temporary file and move it over the old one so a scraper never reads half a file
+	bool WriteFile(const std::string &path) {
+		std::string text = ToPrometheusText();
+		std::string tempPath = path + ".tmp";
+
+		FILE *file = fopen(tempPath.c_str(), "wb");
+		if (file == nullptr)
+			return false;
+		bool bOk = fwrite(text.data(), 1, text.size(), file) == text.size();
+		bOk = fclose(file) == 0 && bOk;
+		if (!bOk)
+			return false;
+
+		// rename does not replace an existing file on windows
+		remove(path.c_str());
+		return rename(tempPath.c_str(), path.c_str()) == 0;
+	}
+
+private:
+	struct Entry_t
+	{
+		enum Kind { COUNTER, GAUGE, HISTOGRAM };
+		Kind m_eKind;
+
+		std::string m_sName;
+		std::string m_sHelp;
+		std::string m_sLabels;
+
+		// only the one matching the kind is set
+		std::unique_ptr<Counter> m_pCounter;
+		std::unique_ptr<Gauge> m_pGauge;
+		std::unique_ptr<Histogram> m_pHistogram;
+
+		Entry_t(Kind eKind, const std::string &name, const std::string &help, const std::string &labels) : m_eKind(eKind), m_sName(name), m_sHelp(help), m_sLabels(labels) {}
+	};
+
+	std::mutex m_mutex;
+	std::vector<Entry_t> m_vecEntries;
+};
+
+#endif
@@ -21,13 +21,20 @@
 #endif
 
 #include <iostream>
+#include <atomic>
+#include <new>
 #include <signal.h>
 
 #include "Local3DFourConnect.h"
 
 #include "Tools.h"
 #include "Server.h"
+#include "ServerOptions.h"
 #include "Client.h"
+#include "LoadGenerator.h"
+#include "LoopbackTransport.h"
+#include "Replayer.h"
+#include "Directory.h"
 
 // Board and game classes
 #include "GameManager.h"
@@ -41,14 +48,63 @@ Server *Server::s_pCallbackInstance = nullptr;
 
 Client *Client::s_pCallbackInstance = nullptr;
 
-const uint16 DEFAULT_SERVER_PORT = 25565;
+LoadGenerator *LoadGenerator::s_pCallbackInstance = nullptr;
+
+Replayer *Replayer::s_pCallbackInstance = nullptr;
+
+Directory *Directory::s_pCallbackInstance = nullptr;
+
+// every operator new in the process is counted while g_bCountAllocations is set, for "loadgen --check-buffers".
+// a thread that sets t_bAllocationsUncounted is left out, that is how the load generator keeps its own bots out of it.
+static std::atomic<bool> g_bCountAllocations(false);
+static std::atomic<uint64> g_nAllocations(0);
+static thread_local bool t_bAllocationsUncounted = false;
+
+void *operator new(size_t cb)
+{
+	if (g_bCountAllocations.load(std::memory_order_relaxed) && !t_bAllocationsUncounted)
+		g_nAllocations.fetch_add(1, std::memory_order_relaxed);
+
+	void *p = malloc(cb != 0 ? cb : 1);
+	if (p == nullptr)
+		throw std::bad_alloc();
+	return p;
+}
+
+void *operator new[](size_t cb)
+{
+	return operator new(cb);
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+	free(p);
+}
 
 void PrintUsageAndExit()
 {
 	std::cout << "The information entered was invalid.\n" <<
 		"Cmd argument usage:\n" << 
-		"3DFourConnect.exe client SERVER_ADDR\n" <<
-		"3DFourConnect.exe server [--port PORT]" << std::endl;
+		"3DFourConnect.exe client SERVER_ADDR [--cursor-rate HZ] [--spectate [ROOM]] [--latency] [--rating N] [--vs-bot]\n" <<
+		"3DFourConnect.exe server " << k_pszServerUsage << "\n" <<
+		"3DFourConnect.exe loadgen [SERVER_ADDR] [--bots N] [--step N] [--step-time SECONDS] [--think MS] [--ai] [--vs-bots] [--spectators N] [--server-pid PID] [--loopback] [--check-buffers]\n" <<
+		"3DFourConnect.exe replay CAPTURE_FILE [--fast] (and the server options)\n" <<
+		"3DFourConnect.exe directory [--port PORT] [--match-wait SECONDS]" << std::endl;
 }
 
 // start up options
@@ -57,13 +113,29 @@ int main(int argc, const char *argv[])
 	bool bServer = false;
 	bool bClient = false;
 	bool bLocal = false;
-	int nPort = DEFAULT_SERVER_PORT;
+	bool bLoadGen = false;
+	bool bReplay = false;
+	bool bDirectory = false;
+	std::string replayFile;
+	float flSelectionSendRate = k_flDefaultSelectionSendRate;
+	bool bSpectate = false;
+	int nSpectateRoom = 0;
+	bool bShowLatency = false;
+	int nRating = 0;
+	bool bAgainstBot = false;
+	bool bLoopback = false;
+	bool bCheckBuffers = false;
+	bool bCheckFailed = false;
+	ServerOptions serverOptions;
+	LoadGenerator loadGen;
+	Replayer replayer;
+	Directory directory;
 	SteamNetworkingIPAddr addrServer; addrServer.Clear();
 
 	// test exe cmd args
 	for (int i = 1; i < argc; ++i)
 	{
-		if (!bClient && !bServer)
+		if (!bClient && !bServer && !bLoadGen && !bReplay && !bDirectory)
 		{
 			if (!strcmp(argv[i], "client"))
 			{
@@ -75,20 +147,184 @@ int main(int argc, const char *argv[])
 				bServer = true;
 				continue;
 			}
+			if (!strcmp(argv[i], "loadgen"))
+			{
+				bLoadGen = true;
+				continue;
+			}
+			if (!strcmp(argv[i], "replay"))
+			{
+				bReplay = true;
+				continue;
+			}
+			if (!strcmp(argv[i], "directory"))
+			{
+				bDirectory = true;
+				continue;
+			}
 		}
-		if (!strcmp(argv[i], "--port"))
+		// server options
+		bool bInvalid;
+		if (serverOptions.Parse(argc, argv, i, bInvalid))
+		{
+			if (bInvalid)
+				PrintUsageAndExit();
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--cursor-rate"))
 		{
 			++i;
 			if (i >= argc)
 				PrintUsageAndExit();
-			nPort = atoi(argv[i]);
-			if (nPort <= 0 || nPort > 65535)
-				std::cout << "Invalid port " << nPort << std::endl;
+			flSelectionSendRate = (float)atof(argv[i]);
+			if (flSelectionSendRate < 0)
+				std::cout << "Invalid cursor rate " << flSelectionSendRate << std::endl;
+			continue;
+		}
+
+		// the room number is optional
+		if (!strcmp(argv[i], "--spectate"))
+		{
+			bSpectate = true;
+			if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]))
+			{
+				++i;
+				nSpectateRoom = atoi(argv[i]);
+			}
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--latency"))
+		{
+			bShowLatency = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--vs-bot"))
+		{
+			bAgainstBot = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--rating"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			nRating = atoi(argv[i]);
+			if (nRating <= 0)
+				PrintUsageAndExit();
+			continue;
+		}
+
+		// load generator options
+		if (!strcmp(argv[i], "--bots"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			loadGen.numBots = atoi(argv[i]);
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--step"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			loadGen.botsPerStep = std::max(1, atoi(argv[i]));
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--step-time"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			loadGen.stepSeconds = std::max(1, atoi(argv[i]));
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--think"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			loadGen.thinkMs = std::max(0, atoi(argv[i]));
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--spectators"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			loadGen.spectatorsPerStep = std::max(0, atoi(argv[i]));
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--server-pid"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			loadGen.serverPid = atoi(argv[i]);
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--ai"))
+		{
+			loadGen.useAI = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--vs-bots"))
+		{
+			loadGen.againstServerBots = true;
+			continue;
+		}
+
+		// run the server in this process and skip the sockets
+		if (!strcmp(argv[i], "--loopback"))
+		{
+			bLoopback = true;
+			continue;
+		}
+
+		// fail if the server still allocates anything once the load has settled, needs the server in this process
+		if (!strcmp(argv[i], "--check-buffers"))
+		{
+			bLoopback = true;
+			bCheckBuffers = true;
+			continue;
+		}
+
+		if (!strcmp(argv[i], "--fast"))
+		{
+			replayer.fast = true;
+			continue;
+		}
+
+		// directory options
+		if (!strcmp(argv[i], "--match-wait"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			directory.matchWaitSeconds = std::max(0, atoi(argv[i]));
+			continue;
+		}
+
+		// the capture to replay
+		if (bReplay && replayFile.empty())
+		{
+			replayFile = argv[i];
 			continue;
 		}
 
 		// Anything else, must be server address to connect to
-		if (bClient && addrServer.IsIPv6AllZeros())
+		if ((bClient || bLoadGen) && addrServer.IsIPv6AllZeros())
 		{
 			if (!addrServer.ParseString(argv[i]))
 				std::cout << "Invalid server address " << argv[i] << std::endl;
@@ -129,11 +365,11 @@ int main(int argc, const char *argv[])
 		if (type == "server") {
 			bServer = true;
 
-			std::cout << "Please enter the port you wish to open the server on.\nType \"0\" and Port: " << nPort << " will be defaulted to.\nMake sure the port is open on your network aswell. (Port Forward)" << std::endl;
+			std::cout << "Please enter the port you wish to open the server on.\nType \"0\" and Port: " << serverOptions.port << " will be defaulted to.\nMake sure the port is open on your network aswell. (Port Forward)" << std::endl;
 			std::cin >> additionalInfo;
 
 			if (std::stoi(additionalInfo) != 0) {
-				nPort = std::stoi(additionalInfo);
+				serverOptions.port = std::stoi(additionalInfo);
 			}
 		}
 
@@ -142,8 +378,17 @@ int main(int argc, const char *argv[])
 		}
 	}
 
+	// the load generator defaults to a server on this machine
+	if (bLoadGen && addrServer.IsIPv6AllZeros())
+	{
+		addrServer.ParseString("127.0.0.1");
+		addrServer.m_port = DEFAULT_SERVER_PORT;
+	}
+
 	// if invalid entries for some reason
-	if ((bClient == bServer || (bClient && addrServer.IsIPv6AllZeros())) && bLocal == false)
+	if ((bClient == bServer || (bClient && addrServer.IsIPv6AllZeros())) && bLocal == false && bLoadGen == false && bReplay == false && bDirectory == false)
+		PrintUsageAndExit();
+	if (bReplay && replayFile.empty())
 		PrintUsageAndExit();
 
 	// get the base path and send it to the game
@@ -161,23 +406,88 @@ int main(int argc, const char *argv[])
 		// game.gameManager.setWinCallback(winCallback);
 		while (game.run() == 1) {};
 	}
+	else if (bLoadGen && bLoopback)
+	{
+		// the server gets its own thread and the bots reach it through in process queues instead of sockets
+		serverOptions.RunOnLoopback([&](ITransport *pTransport, const SteamNetworkingIPAddr &addrLoopback, const Server &server) {
+			loadGen.transport = pTransport;
+
+			// every bot and at least one spectator (if there is a match it can watch), so board broadcasts go through
+			// the pools too, then one step for the pools to warm up in and one where the server's threads mustn't
+			// allocate anything at all, neither with operator new nor from the pools' malloc. the bots run on this
+			// thread and don't count.
+			std::vector<uint64> vecBuffersAllocated;
+			std::vector<uint64> vecAllocations;
+			if (bCheckBuffers)
+			{
+				// an odd one out would wait for a match for ever and never let the load settle
+				loadGen.numBots += loadGen.numBots % 2;
+				if (!loadGen.againstServerBots)
+					loadGen.spectatorsPerStep = std::max(1, loadGen.spectatorsPerStep);
+				loadGen.holdSteps = 2;
+				loadGen.onStep = [&](int) {
+					vecBuffersAllocated.push_back(server.BuffersAllocated());
+					vecAllocations.push_back(g_nAllocations.load());
+				};
+				t_bAllocationsUncounted = true;
+				g_bCountAllocations = true;
+			}
+			loadGen.Run(addrLoopback);
+			g_bCountAllocations = false;
+
+			if (bCheckBuffers)
+			{
+				size_t numSteps = vecBuffersAllocated.size();
+				if (numSteps < 2)
+				{
+					bCheckFailed = true;
+					std::cout << "Buffer check failed, the load test stopped early" << std::endl;
+				}
+				else
+				{
+					uint64 nBuffersAfter = vecBuffersAllocated[numSteps - 1] - vecBuffersAllocated[numSteps - 2];
+					uint64 nAllocationsAfter = vecAllocations[numSteps - 1] - vecAllocations[numSteps - 2];
+					bCheckFailed = nBuffersAfter != 0 || nAllocationsAfter != 0;
+					std::cout << "Buffer check " << (bCheckFailed ? "failed" : "passed") << ", the server allocated " << vecBuffersAllocated[numSteps - 2] << " message buffers and " << vecAllocations[numSteps - 2] << " times with new while warming up and " << nBuffersAfter << " and " << nAllocationsAfter << " after" << std::endl;
+				}
+			}
+		});
+	}
+	else if (bReplay)
+	{
+		// a capture is always played back to a server of its own, so nothing else shows up in the numbers
+		serverOptions.RunOnLoopback([&](ITransport *pTransport, const SteamNetworkingIPAddr &addrLoopback, const Server &) {
+			replayer.transport = pTransport;
+			replayer.Run(replayFile, addrLoopback);
+		});
+	}
+	else if (bDirectory)
+	{
+		directory.Run((uint16)serverOptions.port);
+	}
+	else if (bLoadGen)
+	{
+		loadGen.Run(addrServer);
+	}
 	else if (bClient)
 	{
 		Client client;
+		client.selectionSendRate = flSelectionSendRate;
+		client.spectate = bSpectate;
+		client.spectateRoomId = (uint32)nSpectateRoom;
+		client.showLatency = bShowLatency;
+		client.rating = nRating;
+		client.againstBot = bAgainstBot;
 		client.Run(addrServer);
 	}
 	else
 	{
-		Server server;
-		server.Run((uint16)nPort);
+		serverOptions.Run();
 	}
 
+	LocalUserInput_Kill();
 	ShutdownSteamDatagramConnectionSockets();
-
-	// Ug, why is there no simple solution for portable, non-blocking console user input?
-	// Just nuke the process
-	// LocalUserInput_Kill();
-	// NukeProcess(0);
+	return bCheckFailed ? 1 : 0;
 }
 
 // test callback
@@ -0,0 +1,310 @@
+// plays a capture (see Capture.h) back against a server, one connection for every connection in the capture and
+// every message sent on it again, either with the gaps they came in with or as fast as the server takes them.
+// what the server sends back is read and thrown away. used with a loopback server it measures how the server
+// does with a real mix of messages, with nothing else in the way.
+
+#ifndef REPLAYER_H
+#define REPLAYER_H
+
+#include <string.h>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include "Tools.h"
+#include "Transport.h"
+#include "Capture.h"
+
+class Replayer {
+public:
+	// ignore the recorded gaps and send everything as soon as the server can take it
+	bool fast = false;
+
+	// what to connect over, the real network if left null
+	ITransport *transport = nullptr;
+
+	// false if the capture can't be read
+	bool Run(const std::string &path, const SteamNetworkingIPAddr &serverAddr)
+	{
+		CaptureReader reader;
+		if (!reader.Open(path))
+		{
+			std::cout << "Can't read capture " << path << std::endl;
+			return false;
+		}
+
+		m_pInterface = transport != nullptr ? transport : DefaultTransport();
+		m_hPollGroup = m_pInterface->CreatePollGroup();
+		s_pCallbackInstance = this;
+
+		std::cout << "Replaying " << path << (fast ? " as fast as possible" : " at recorded speed") << std::endl;
+
+		SteamNetworkingMicroseconds usecStart = SteamNetworkingUtils()->GetLocalTimestamp();
+		CaptureRecord record;
+		std::vector<char> vecData;
+		int nRecords = 0;
+		while (!g_bQuit && reader.Next(record, vecData))
+		{
+			// wait for the record's time to come round, keeping up with the server while we do
+			if (!fast)
+			{
+				SteamNetworkingMicroseconds usecDue = usecStart + reader.Time();
+				while (!g_bQuit && SteamNetworkingUtils()->GetLocalTimestamp() < usecDue)
+				{
+					Pump();
+					if (usecDue - SteamNetworkingUtils()->GetLocalTimestamp() > 2000)
+						std::this_thread::sleep_for(std::chrono::milliseconds(1));
+					else
+						std::this_thread::yield();
+				}
+			}
+
+			switch (record.kind)
+			{
+			case CaptureRecord::Kind::CONNECT:
+				Connect(record.conn, serverAddr);
+				break;
+			case CaptureRecord::Kind::MESSAGE:
+				Send(record.conn, vecData, record.flags);
+				break;
+			case CaptureRecord::Kind::CLOSE:
+				Disconnect(record.conn);
+				break;
+			}
+
+			if (++nRecords % 256 == 0)
+				Pump();
+		}
+		SteamNetworkingMicroseconds usecSent = SteamNetworkingUtils()->GetLocalTimestamp();
+
+		// give the server time to get through the last of it, done once it has been quiet for a bit
+		SteamNetworkingMicroseconds usecLastReply = usecSent;
+		while (!g_bQuit && SteamNetworkingUtils()->GetLocalTimestamp() - usecLastReply < k_usecQuietTime)
+		{
+			if (Pump() > 0)
+				usecLastReply = SteamNetworkingUtils()->GetLocalTimestamp();
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+
+		double seconds = (usecSent - usecStart) / 1000000.0;
+		double secondsToLastReply = (usecLastReply - usecStart) / 1000000.0;
+		char szReport[512];
+		snprintf(szReport, sizeof(szReport),
+			"Replayed %llu messages on %llu connections (%.1f s of capture) in %.2f s, %.0f messages/s\n"
+			"  %llu replies, the last %.2f s after the start, %llu messages could not be sent",
+			(unsigned long long)m_nSent, (unsigned long long)m_nConnections, reader.Time() / 1000000.0, seconds, seconds > 0 ? m_nSent / seconds : 0.0,
+			(unsigned long long)m_nReplies, secondsToLastReply, (unsigned long long)m_nFailed);
+		std::cout << szReport << std::endl;
+
+		std::vector<HSteamNetConnection> vecConns;
+		for (auto &conn : m_mapConnections)
+			vecConns.push_back(conn.second.m_hConn);
+		FlushConnections(m_pInterface, vecConns, k_usecMaxFlushOnShutdown);
+		for (auto &conn : m_mapConnections)
+			m_pInterface->CloseConnection(conn.second.m_hConn, 0, "Replay over", true);
+		m_mapConnections.clear();
+		m_pInterface->DestroyPollGroup(m_hPollGroup);
+		m_hPollGroup = k_HSteamNetPollGroup_Invalid;
+		return true;
+	}
+
+private:
+	static const SteamNetworkingMicroseconds k_usecQuietTime = 500000;
+
+	ITransport *m_pInterface;
+	HSteamNetPollGroup m_hPollGroup;
+
+	// a connection from the capture, messages for it wait until it has connected
+	struct Connection_t
+	{
+		HSteamNetConnection m_hConn = k_HSteamNetConnection_Invalid;
+		bool m_bConnected = false;
+		bool m_bCloseWhenSent = false;
+		std::deque< std::pair< std::vector<char>, int > > m_queuePending;
+	};
+
+	// by the server's handle in the capture
+	std::map< uint32, Connection_t > m_mapConnections;
+
+	uint64 m_nConnections = 0;
+	uint64 m_nSent = 0;
+	uint64 m_nReplies = 0;
+	uint64 m_nFailed = 0;
+
+	// where the last message went, see WaitForServer
+	HSteamNetConnection m_hLastSent = k_HSteamNetConnection_Invalid;
+
+	void Connect(uint32 capturedConn, const SteamNetworkingIPAddr &serverAddr)
+	{
+		SteamNetworkingConfigValue_t opt;
+		opt.SetPtr(k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback);
+		HSteamNetConnection hConn = m_pInterface->ConnectByIPAddress(serverAddr, 1, &opt);
+		if (hConn == k_HSteamNetConnection_Invalid)
+			return;
+
+		// the captured handle comes back with every callback for this connection
+		m_pInterface->SetConnectionUserData(hConn, capturedConn);
+		m_pInterface->SetConnectionPollGroup(hConn, m_hPollGroup);
+		m_mapConnections[capturedConn].m_hConn = hConn;
+		m_nConnections++;
+	}
+
+	void Send(uint32 capturedConn, const std::vector<char> &vecData, int nSendFlags)
+	{
+		auto itConn = m_mapConnections.find(capturedConn);
+		if (itConn == m_mapConnections.end())
+		{
+			m_nFailed++;
+			return;
+		}
+
+		if (!itConn->second.m_bConnected)
+		{
+			itConn->second.m_queuePending.emplace_back(vecData, nSendFlags);
+			return;
+		}
+		SendNow(itConn->second.m_hConn, vecData, nSendFlags);
+	}
+
+	// the server's queue for the connection can fill up when it is behind, wait for it like a real client would
+	void SendNow(HSteamNetConnection hConn, const std::vector<char> &vecData, int nSendFlags)
+	{
+		if (hConn != m_hLastSent)
+			WaitForServer(m_hLastSent);
+		m_hLastSent = hConn;
+
+		while (!g_bQuit)
+		{
+			SteamNetworkingMessage_t *pMsg = SteamNetworkingUtils()->AllocateMessage((int)vecData.size());
+			memcpy(pMsg->m_pData, vecData.data(), vecData.size());
+			pMsg->m_conn = hConn;
+			pMsg->m_nFlags = nSendFlags;
+
+			int64 result;
+			m_pInterface->SendMessages(1, &pMsg, &result);
+			if (result >= 0)
+			{
+				m_nSent++;
+				return;
+			}
+			if (result != -k_EResultLimitExceeded)
+			{
+				m_nFailed++;
+				return;
+			}
+
+			Pump();
+			std::this_thread::yield();
+		}
+	}
+
+	void Disconnect(uint32 capturedConn)
+	{
+		auto itConn = m_mapConnections.find(capturedConn);
+		if (itConn == m_mapConnections.end())
+			return;
+
+		// it still has to send what it was given before it went
+		if (!itConn->second.m_bConnected)
+		{
+			itConn->second.m_bCloseWhenSent = true;
+			return;
+		}
+		WaitForServer(itConn->second.m_hConn);
+		m_pInterface->CloseConnection(itConn->second.m_hConn, 0, "Replayed disconnect", true);
+		m_mapConnections.erase(itConn);
+	}
+
+	// waits until the server has read everything sent on hConn. the server reads each connection's messages in
+	// batches, so without this a fast replay would hand it a player's next move before the other player's move that
+	// came first in the capture, and a close before the messages ahead of it. the real network doesn't keep order
+	// across connections either, this only works on the loopback transport.
+	void WaitForServer(HSteamNetConnection hConn)
+	{
+		SteamNetworkingQuickConnectionStatus status;
+		while (!g_bQuit && hConn != k_HSteamNetConnection_Invalid && m_pInterface->GetQuickConnectionStatus(hConn, &status) && status.m_cbPendingReliable > 0)
+		{
+			Pump();
+			std::this_thread::yield();
+		}
+	}
+
+	// reads everything the server sent and handles connection changes, returns how many messages there were
+	int Pump()
+	{
+		m_pInterface->RunCallbacks();
+
+		int nTotal = 0;
+		SteamNetworkingMessage_t *pIncomingMsgs[k_nMaxMessagesPerPoll];
+		while (true)
+		{
+			int numMsgs = m_pInterface->ReceiveMessagesOnPollGroup(m_hPollGroup, pIncomingMsgs, k_nMaxMessagesPerPoll);
+			if (numMsgs <= 0)
+				break;
+			for (int i = 0; i < numMsgs; i++)
+				pIncomingMsgs[i]->Release();
+			nTotal += numMsgs;
+			if (numMsgs < k_nMaxMessagesPerPoll)
+				break;
+		}
+		m_nReplies += nTotal;
+		return nTotal;
+	}
+
+	void OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo)
+	{
+		uint32 capturedConn = (uint32)pInfo->m_info.m_nUserData;
+		auto itConn = m_mapConnections.find(capturedConn);
+
+		switch (pInfo->m_info.m_eState)
+		{
+		case k_ESteamNetworkingConnectionState_ClosedByPeer:
+		case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
+			m_pInterface->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
+			if (itConn != m_mapConnections.end() && itConn->second.m_hConn == pInfo->m_hConn)
+			{
+				m_nFailed += itConn->second.m_queuePending.size();
+				m_mapConnections.erase(itConn);
+			}
+			break;
+
+		case k_ESteamNetworkingConnectionState_Connected:
+		{
+			if (itConn == m_mapConnections.end() || itConn->second.m_hConn != pInfo->m_hConn)
+				break;
+
+			// everything it was given while it connected, then the close if that came too
+			Connection_t &conn = itConn->second;
+			conn.m_bConnected = true;
+			while (!conn.m_queuePending.empty())
+			{
+				SendNow(conn.m_hConn, conn.m_queuePending.front().first, conn.m_queuePending.front().second);
+				conn.m_queuePending.pop_front();
+			}
+			if (conn.m_bCloseWhenSent)
+				Disconnect(capturedConn);
+			break;
+		}
+
+		default:
+			// Silences -Wswitch
+			break;
+		}
+	}
+
+	static Replayer *s_pCallbackInstance;
+
+	static void SteamNetConnectionStatusChangedCallback(SteamNetConnectionStatusChangedCallback_t *pInfo)
+	{
+		s_pCallbackInstance->OnSteamNetConnectionStatusChanged(pInfo);
+	}
+};
+
+#endif
@@ -0,0 +1,332 @@
+// keeps a hot standby server process up to date with our rooms so it can take them over if we go down.
+// the shards and the network thread append the same records the journal gets, the network thread ships them to the
+// standby in batches every few milliseconds and the standby acks the newest batch it has applied. a standby that
+// connects (or falls too far behind) is sent every open room first and from then on only what changed.
+
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <string.h>
+#include <stddef.h>
+#include <thread>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include "Tools.h"
+#include "LockFreeQueue.h"
+#include "MessageBatch.h"
+#include "Metrics.h"
+#include "Journal.h"
+
+// most records in one batch, a tick with more sends several
+const int k_nReplicaBatchRecords = 256;
+
+// room for the key the primary and its standby share, with its terminating zero
+const int k_cchReplicaKey = 64;
+
+// records for the standby in the order the primary took them out of its rings. only numRecords entries of records are sent.
+struct ReplicaBatchPacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::REPLICA_BATCH;
+
+	// goes up by one with every batch, the standby acks the newest it has applied
+	uint32 batchSeq = 0;
+
+	// 1 on the first batch of a snapshot, the standby throws away every room it had before applying it
+	uint32 reset = 0;
+
+	// the key both ends were started with, only sent with reset. a new connection starts with a snapshot, so this is
+	// what the standby checks before it takes the connection for its primary.
+	char key[k_cchReplicaKey] = {};
+
+	// the primary's block of room ids from the directory (0 without one) and the id its next room would get,
+	// the standby carries on from there when it takes over
+	uint32 firstRoomId = 0;
+	uint32 nextRoomId = 0;
+
+	int32 numRecords = 0;
+	JournalRecord records[k_nReplicaBatchRecords];
+
+	uint32 size() const {
+		return (uint32)(offsetof(ReplicaBatchPacket, records) + numRecords * sizeof(JournalRecord));
+	}
+};
+
+// the standby has applied everything up to and including batchSeq
+struct ReplicaAckPacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::REPLICA_ACK;
+	uint32 batchSeq = 0;
+};
+
+// true if the batch carries key. every byte is looked at whatever the first difference, so how long it takes doesn't
+// tell a stranger how much of a guess was right.
+inline bool ReplicaKeyMatches(const ReplicaBatchPacket &batch, const std::string &key) {
+	if (key.empty() || key.size() >= (size_t)k_cchReplicaKey) {
+		return false;
+	}
+	char expected[k_cchReplicaKey] = {};
+	memcpy(expected, key.data(), key.size());
+	unsigned char diff = 0;
+	for (int i = 0; i < k_cchReplicaKey; i++) {
+		diff |= (unsigned char)(batch.key[i] ^ expected[i]);
+	}
+	return diff == 0;
+}
+
+class Replicator {
+public:
+	// the metrics belong to the server's registry, the replicator only updates them. key goes to the standby with every snapshot.
+	Replicator(int numProducers, const std::string &key, Counter &recordsSent, Counter &movesSent, Counter &bytesSent, Counter &busyMicroseconds, Counter &snapshots, Gauge &lag, Histogram &ackTime)
+		: recordsSent(recordsSent), movesSent(movesSent), bytesSent(bytesSent), busyMicroseconds(busyMicroseconds), snapshots(snapshots), lag(lag), ackTime(ackTime) {
+		for (int i = 0; i < numProducers; i++) {
+			m_vecRings.emplace_back(new SPSCRing<JournalRecord>(k_nJournalQueueSize));
+		}
+		strncpy(m_szKey, key.c_str(), sizeof(m_szKey) - 1);
+	}
+
+	Counter &recordsSent;
+	Counter &movesSent;
+	Counter &bytesSent;
+	Counter &busyMicroseconds;
+	Counter &snapshots;
+	Gauge &lag;
+	Histogram &ackTime;
+
+	// applies one record to a copy of the rooms, the same way on both ends. a BOARD only counts for a room a SEAT
+	// started, so a room's last move that got drained after its CLOSE doesn't bring it back.
+	static void Apply(std::map<uint32, JournalRoom> &mapRooms, const JournalRecord &record) {
+		switch (record.kind) {
+			case JournalRecord::Kind::SEAT: {
+				if (record.seat == 0 || record.seat == 1) {
+					mapRooms[record.roomId].tokens[record.seat] = record.token;
+				}
+				break;
+			}
+			case JournalRecord::Kind::BOARD: {
+				auto itRoom = mapRooms.find(record.roomId);
+				if (itRoom != mapRooms.end() && (!itRoom->second.hasBoard || IsNewerSeq(record.seq, itRoom->second.board.seq))) {
+					itRoom->second.hasBoard = true;
+					itRoom->second.board = record;
+				}
+				break;
+			}
+			case JournalRecord::Kind::CLOSE: {
+				mapRooms.erase(record.roomId);
+				break;
+			}
+		}
+	}
+
+	// network thread only, before anything is appended. the rooms the server starts with, from the journal or a primary it took over from.
+	void Seed(const std::map<uint32, JournalRoom> &mapRooms) {
+		for (auto &room : mapRooms) {
+			m_mapRooms[room.first] = room.second;
+		}
+	}
+
+	// only ever called by the producer's own thread, the same copy into a ring the journal costs
+	void Append(int producer, const JournalRecord &record) {
+		while (!m_vecRings[producer]->Push(record)) {
+			std::this_thread::yield();
+		}
+	}
+
+	// network thread only. the standby (re)connected, it gets every open room before anything new.
+	void Connected() {
+		m_bSnapshotDue = true;
+	}
+
+	// network thread only. whatever was on its way is lost with the connection, the next one starts with a snapshot.
+	void Disconnected() {
+		m_bSnapshotDue = false;
+		m_bStreaming = false;
+		m_vecPending.clear();
+		m_dequeInFlight.clear();
+		lag.Set(0);
+	}
+
+	// network thread only. takes everything appended since the last call and, with a standby connected, sends what
+	// is due to it through outbox. returns when it next has to be called, 0 if there is no hurry.
+	SteamNetworkingMicroseconds Update(HSteamNetConnection hStandby, MessageBatch &outbox, uint32 firstRoomId, uint32 nextRoomId) {
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+
+		// the network thread's own ring first. its SEAT for a new room was appended before any shard had a move in
+		// the room, and its CLOSE only drops a board that was drained after it, see Apply.
+		JournalRecord record;
+		for (int i = (int)m_vecRings.size() - 1; i >= 0; i--) {
+			while (m_vecRings[i]->Pop(record)) {
+				Apply(m_mapRooms, record);
+				if (m_bStreaming) {
+					if (m_vecPending.empty()) {
+						m_usecBatchDue = now + k_usecBatchInterval;
+					}
+					m_vecPending.push_back(record);
+				}
+			}
+		}
+
+		if (hStandby == k_HSteamNetConnection_Invalid) {
+			busyMicroseconds.Add(SteamNetworkingUtils()->GetLocalTimestamp() - now);
+			return 0;
+		}
+
+		// a standby this far behind would take longer to catch up on every move than on the rooms as they are now
+		if (m_bStreaming && (int)m_dequeInFlight.size() >= k_nMaxBatchesInFlight && m_vecPending.size() >= k_nMaxPending) {
+			m_bSnapshotDue = true;
+		}
+
+		if (m_bSnapshotDue) {
+			SendSnapshot(hStandby, outbox, firstRoomId, nextRoomId, now);
+		}
+		else {
+			// whole batches straight away, the rest once it has waited long enough to be worth a message of its own
+			size_t sent = 0;
+			while ((int)m_dequeInFlight.size() < k_nMaxBatchesInFlight && sent < m_vecPending.size()) {
+				size_t count = std::min(m_vecPending.size() - sent, (size_t)k_nReplicaBatchRecords);
+				if (count < (size_t)k_nReplicaBatchRecords && now < m_usecBatchDue) {
+					break;
+				}
+				SendBatch(hStandby, outbox, &m_vecPending[sent], (int)count, false, firstRoomId, nextRoomId, now);
+				for (size_t i = sent; i < sent + count; i++) {
+					if (m_vecPending[i].kind == JournalRecord::Kind::BOARD) {
+						movesSent.Add();
+					}
+				}
+				sent += count;
+			}
+			m_vecPending.erase(m_vecPending.begin(), m_vecPending.begin() + sent);
+
+			// an empty batch now and then tells the standby we are still here
+			if (now >= m_usecNextHeartbeat) {
+				SendBatch(hStandby, outbox, nullptr, 0, false, firstRoomId, nextRoomId, now);
+			}
+		}
+
+		UpdateLag();
+		busyMicroseconds.Add(SteamNetworkingUtils()->GetLocalTimestamp() - now);
+
+		if (!m_vecPending.empty() && (int)m_dequeInFlight.size() < k_nMaxBatchesInFlight) {
+			return std::min(m_usecBatchDue, m_usecNextHeartbeat);
+		}
+		return m_usecNextHeartbeat;
+	}
+
+	// network thread only
+	void HandleAck(uint32 batchSeq) {
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+		while (!m_dequeInFlight.empty() && !IsNewerSeq(m_dequeInFlight.front().m_nBatchSeq, batchSeq)) {
+			ackTime.Record(now - m_dequeInFlight.front().m_usecSent);
+			m_dequeInFlight.pop_front();
+		}
+		UpdateLag();
+	}
+
+	// network thread only
+	size_t Rooms() const {
+		return m_mapRooms.size();
+	}
+
+private:
+	// how long a record may wait for others to fill its batch, and the longest the standby goes without hearing from us
+	static const SteamNetworkingMicroseconds k_usecBatchInterval = 5000;
+	static const SteamNetworkingMicroseconds k_usecHeartbeat = 250000;
+
+	// batches the standby hasn't acked before we stop sending it more, and records waiting then before it gets a snapshot instead
+	static const int k_nMaxBatchesInFlight = 64;
+	static const size_t k_nMaxPending = 64 * 1024;
+
+	std::vector< std::unique_ptr< SPSCRing<JournalRecord> > > m_vecRings;
+
+	// every open room as the standby will have it once it has everything we sent, what a snapshot is made from
+	std::map<uint32, JournalRoom> m_mapRooms;
+
+	// false until the standby has had a snapshot, only then is anything worth sending it piece by piece
+	bool m_bSnapshotDue = false;
+	bool m_bStreaming = false;
+	std::vector<JournalRecord> m_vecPending;
+	SteamNetworkingMicroseconds m_usecBatchDue = 0;
+	SteamNetworkingMicroseconds m_usecNextHeartbeat = 0;
+
+	struct InFlight_t
+	{
+		uint32 m_nBatchSeq;
+		SteamNetworkingMicroseconds m_usecSent;
+		int m_nRecords;
+	};
+	std::deque<InFlight_t> m_dequeInFlight;
+	uint32 m_nBatchSeq = 0;
+
+	// too big for the stack
+	ReplicaBatchPacket m_batch;
+
+	char m_szKey[k_cchReplicaKey] = {};
+
+	void SendSnapshot(HSteamNetConnection hStandby, MessageBatch &outbox, uint32 firstRoomId, uint32 nextRoomId, SteamNetworkingMicroseconds now) {
+		std::vector<JournalRecord> vecRecords;
+		vecRecords.reserve(m_mapRooms.size() * 3);
+		for (auto &room : m_mapRooms) {
+			for (int seat = 0; seat < 2; seat++) {
+				JournalRecord record;
+				record.kind = JournalRecord::Kind::SEAT;
+				record.roomId = room.first;
+				record.seat = seat;
+				record.token = room.second.tokens[seat];
+				vecRecords.push_back(record);
+			}
+			if (room.second.hasBoard) {
+				vecRecords.push_back(room.second.board);
+			}
+		}
+
+		// the first batch goes even when there are no rooms, it is what clears the standby
+		size_t sent = 0;
+		do {
+			size_t count = std::min(vecRecords.size() - sent, (size_t)k_nReplicaBatchRecords);
+			SendBatch(hStandby, outbox, vecRecords.data() + sent, (int)count, sent == 0, firstRoomId, nextRoomId, now);
+			sent += count;
+		} while (sent < vecRecords.size());
+
+		snapshots.Add();
+		m_vecPending.clear();
+		m_bSnapshotDue = false;
+		m_bStreaming = true;
+	}
+
+	void SendBatch(HSteamNetConnection hStandby, MessageBatch &outbox, const JournalRecord *pRecords, int count, bool bReset, uint32 firstRoomId, uint32 nextRoomId, SteamNetworkingMicroseconds now) {
+		m_batch.batchSeq = ++m_nBatchSeq;
+		m_batch.reset = bReset ? 1 : 0;
+		memset(m_batch.key, 0, sizeof(m_batch.key));
+		if (bReset) {
+			memcpy(m_batch.key, m_szKey, sizeof(m_batch.key));
+		}
+		m_batch.firstRoomId = firstRoomId;
+		m_batch.nextRoomId = nextRoomId;
+		m_batch.numRecords = count;
+		if (count > 0) {
+			memcpy(m_batch.records, pRecords, count * sizeof(JournalRecord));
+		}
+		outbox.Add(hStandby, &m_batch, m_batch.size(), k_nSteamNetworkingSend_Reliable);
+		recordsSent.Add(count);
+		bytesSent.Add(m_batch.size());
+
+		m_dequeInFlight.push_back(InFlight_t{ m_batch.batchSeq, now, count });
+		m_usecNextHeartbeat = now + k_usecHeartbeat;
+	}
+
+	void UpdateLag() {
+		int64 numRecords = (int64)m_vecPending.size();
+		for (const InFlight_t &batch : m_dequeInFlight) {
+			numRecords += batch.m_nRecords;
+		}
+		lag.Set(numRecords);
+	}
+};
+
+#endif
@@ -0,0 +1,294 @@
+// one match on the server. a room is owned by a single shard thread and only that thread ever touches it.
+// it is two cache lines with nothing on the heap, the shard keeps all of its rooms side by side in one slab.
+
+#ifndef ROOM_H
+#define ROOM_H
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+
+#include "Tools.h"
+#include "BoardRules.h"
+
+class alignas(64) Room {
+public:
+	uint32 id;
+
+	// board changes so far, every GAME_DATA sent out carries it
+	uint32 seq;
+
+	// seq of the last board that went out to everybody in the room, deltas start from it
+	uint32 sentSeq;
+
+	// wins so far, the board itself is bits below
+	int32 score1;
+	int32 score2;
+
+	// the scores after the last clear (or anything else that was not a single move), see moves
+	int32 baseScore1;
+	int32 baseScore2;
+
+	// connection in each seat, seat 0 plays red and seat 1 plays blue
+	HSteamNetConnection players[2];
+
+	// whose move it is now and at the base
+	uint8 currentTurn;
+	uint8 baseTurn;
+
+	// a bit for each seat played by the server's bots instead, whether one of them is working out a move right now,
+	// how many moves there have been since the base and whether the four in a row on the board was already scored
+	uint16 botSeats : 2;
+	uint16 botThinking : 1;
+	uint16 numMoves : 7;
+	uint16 winScored : 1;
+
+	// the board the players last saw and its BitBoard::hash, kept up to date a move at a time
+	BitBoard bits;
+	uint64 pieceHash;
+
+	// every move since the base, a reconnecting player can be caught up from these no matter how far behind it is.
+	// only the cell is kept, with k_nMoveAgain set if the same color had the next move too. the seqs follow on from
+	// the base one at a time and no piece has been taken off since, so the rest can be read off the board: the
+	// color is whatever is on the cell now and the base board is the current one without them.
+	uint8 moves[k_nMaxMovesPerGame];
+
+	static const uint8 k_nMoveCell = 0x3f;
+	static const uint8 k_nMoveAgain = 0x40;
+
+	Room() {
+		id = 0;
+		seq = 0;
+		sentSeq = 0;
+
+		score1 = 0;
+		score2 = 0;
+		baseScore1 = 0;
+		baseScore2 = 0;
+
+		players[0] = k_HSteamNetConnection_Invalid;
+		players[1] = k_HSteamNetConnection_Invalid;
+
+		currentTurn = BitBoard::Color::RED;
+		baseTurn = BitBoard::Color::RED;
+		botSeats = 0;
+		botThinking = 0;
+		numMoves = 0;
+		winScored = 0;
+
+		pieceHash = 0;
+	}
+
+	bool isBot(int seat) const {
+		return ((botSeats >> seat) & 1) != 0;
+	}
+
+	void setBot(int seat) {
+		botSeats |= 1 << seat;
+	}
+
+	// the seq of the board before the first of moves
+	uint32 baseSeq() const {
+		return seq - numMoves;
+	}
+
+	// the board before the first of moves
+	BitBoard baseBits() const {
+		uint64 logged = 0;
+		for (int i = 0; i < numMoves; i++) {
+			logged |= 1ull << (moves[i] & k_nMoveCell);
+		}
+		BitBoard base = bits;
+		base.red &= ~logged;
+		base.blue &= ~logged;
+		return base;
+	}
+
+	// moves[i] the way it goes out to the clients
+	MoveRecord moveRecord(int i) const {
+		MoveRecord move;
+		move.seq = baseSeq() + i + 1;
+		move.cell = (int8)(moves[i] & k_nMoveCell);
+		move.color = (int8)bits.at(move.cell);
+		move.nextTurn = (int8)((moves[i] & k_nMoveAgain) ? move.color : OtherColor(move.color));
+		return move;
+	}
+
+	// a player starting the next game. the only board a player may send is the empty one and only once this game is
+	// won or full, every piece comes in through applyMove. the scores and the turn stay ours whatever the packet says.
+	bool clearBoard(const DataPacket *data) {
+		BitBoard next;
+		next.fromPacket(data);
+		if (next.occupied() != 0 || (bits.winner() == BitBoard::Color::EMPTY && !bits.full())) {
+			return false;
+		}
+
+		recordChange(next);
+		return true;
+	}
+
+	// a single piece from a player. false if it isn't that color's turn, the cell is taken or the game is already won.
+	bool applyMove(int color, int cell) {
+		if (cell < 0 || cell >= 64 || color != currentTurn || !bits.isEmpty(cell) || bits.winner() != BitBoard::Color::EMPTY) {
+			return false;
+		}
+
+		BitBoard next = bits;
+		next.place(color, cell);
+
+		currentTurn = (uint8)OtherColor(currentTurn);
+
+		recordChange(next);
+		return true;
+	}
+
+	// a new seq for the board the game now has, logged as a move if it is one
+	void recordChange(const BitBoard &next) {
+		seq++;
+
+		uint64 added = next.occupied() & ~bits.occupied();
+		bool bSingleMove = (bits.red & ~next.red) == 0 && (bits.blue & ~next.blue) == 0 && added != 0 && (added & (added - 1)) == 0;
+		bool bSameScores = score1 == baseScore1 && score2 == baseScore2;
+
+		int cell = 0;
+		if (bSingleMove) {
+			while (((added >> cell) & 1) == 0) {
+				cell++;
+			}
+			pieceHash ^= ZobristPiece(next.at(cell), cell);
+		}
+		else {
+			pieceHash = next.hash();
+		}
+
+		if (bSingleMove && bSameScores && numMoves < k_nMaxMovesPerGame) {
+			moves[numMoves++] = (uint8)(cell | (currentTurn == next.at(cell) ? k_nMoveAgain : 0));
+		}
+		else {
+			baseScore1 = score1;
+			baseScore2 = score2;
+			baseTurn = currentTurn;
+			numMoves = 0;
+		}
+
+		bits = next;
+	}
+
+	// a point for whoever has four in a row, checked after every board that goes out. unlike the game manager the
+	// won board is not cleared here, the players see it until one of them sends the empty board to start the next
+	// game (and a bot doesn't move on it meanwhile), so the win is only scored the first time it is seen.
+	void checkWin() {
+		int win = bits.winner();
+		if (win == BitBoard::Color::EMPTY) {
+			winScored = 0;
+			return;
+		}
+		if (winScored) {
+			return;
+		}
+
+		winScored = 1;
+		if (win == BitBoard::Color::RED) {
+			score1++;
+		}
+		else if (win == BitBoard::Color::BLUE) {
+			score2++;
+		}
+	}
+
+	// only red or blue, anything else keeps the current turn
+	void setTurn(int turn) {
+		if (turn == BitBoard::Color::RED || turn == BitBoard::Color::BLUE) {
+			currentTurn = (uint8)turn;
+		}
+	}
+
+	// carry on from a board read back from the journal, it becomes the new base
+	void restore(uint32 restoredSeq, const BitBoard &board, int score1, int score2, int turn) {
+		this->score1 = score1;
+		this->score2 = score2;
+		setTurn(turn);
+
+		seq = restoredSeq;
+		bits = board;
+		pieceHash = board.hash();
+
+		// the journal has the scores from after the win was checked
+		winScored = board.winner() != BitBoard::Color::EMPTY;
+		baseScore1 = score1;
+		baseScore2 = score2;
+		baseTurn = currentTurn;
+		numMoves = 0;
+	}
+
+	// everything a player that last saw lastSeq needs to get back to the current board
+	ResumePacket makeResume(uint32 lastSeq) {
+		ResumePacket resume;
+
+		// the client's board is still good if it is somewhere in the log, otherwise start it from the base
+		int first = 0;
+		if (lastSeq >= baseSeq() && lastSeq <= seq) {
+			first = (int)(lastSeq - baseSeq());
+		}
+		else {
+			BitBoard base = baseBits();
+			resume.hasSnapshot = 1;
+			resume.snapshotSeq = baseSeq();
+			resume.red = base.red;
+			resume.blue = base.blue;
+			resume.score1 = baseScore1;
+			resume.score2 = baseScore2;
+			resume.currentTurn = baseTurn;
+		}
+
+		for (int i = first; i < numMoves; i++) {
+			resume.moves[resume.numMoves++] = moveRecord(i);
+		}
+		return resume;
+	}
+
+	// the board and whose turn it is, what the clients check their own copy against
+	uint64 hash() const {
+		return pieceHash ^ ZobristTurn(currentTurn);
+	}
+
+	// the moves since the last board that went out, false if anything else changed or there are too many of them
+	bool makeDelta(DeltaPacket &delta) const {
+		if (seq == sentSeq || sentSeq < baseSeq() || seq - sentSeq > (uint32)k_nMaxDeltaMoves) {
+			return false;
+		}
+
+		delta.baseSeq = sentSeq;
+		delta.hash = hash();
+		for (int i = (int)(sentSeq - baseSeq()); i < numMoves; i++) {
+			delta.moves[delta.numMoves++] = moveRecord(i);
+		}
+		return true;
+	}
+
+	// convert the board to data 1's and 2's to represent red and blue respectivley.
+	// returns a datapacket with the board, scores and turn filled in
+	DataPacket convertBoardToPacket() {
+		DataPacket data;
+		data.type = DataPacket::MsgType::GAME_DATA;
+
+		bits.toPacket(&data);
+
+		// set scores
+		data.score1 = score1;
+		data.score2 = score2;
+
+		// send turn after the turn has been switched already.
+		data.currentTurn = currentTurn;
+
+		data.seq = seq;
+
+		return data;
+	}
+
+	bool empty() {
+		return players[0] == k_HSteamNetConnection_Invalid && players[1] == k_HSteamNetConnection_Invalid;
+	}
+};
+
+static_assert(sizeof(Room) == 128, "a room should stay two cache lines");
+
+#endif
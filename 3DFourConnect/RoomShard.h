@@ -0,0 +1,807 @@
+// a worker thread that runs the game logic for its own set of rooms.
+// the network thread posts events into the shard's inbox and collects the finished messages from its outbox,
+// so nothing on the way from a received move to the relayed board takes a lock. a shard with nothing to do sleeps
+// until an event or a bot's move comes in.
+// neither side ever waits on a full queue. what doesn't fit is held on to by the side that made it, which takes on
+// no new work until it is through, so a slow shard makes the network thread read less and a slow network thread
+// makes the shard take in less.
+
+#ifndef ROOMSHARD_H
+#define ROOMSHARD_H
+
+#include <atomic>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include "Tools.h"
+#include "LockFreeQueue.h"
+#include "MessageBatch.h"
+#include "Metrics.h"
+#include "SharedPayload.h"
+#include "Journal.h"
+#include "Replication.h"
+#include "Room.h"
+#include "BotPool.h"
+#include "TimerWheel.h"
+
+// most events or outgoing messages waiting on one shard before the sender has to hold on to the rest
+const size_t k_nShardQueueSize = 4096;
+
+// passes with nothing to do a shard spins and then yields through before it goes to sleep
+const int k_nShardSpinPasses = 64;
+const int k_nShardYieldPasses = 256;
+
+// something that happened to a room, decoded by the network thread
+struct RoomEvent
+{
+	// WATCH is a spectator joining a room the network thread has no board for, see RoomBroadcast
+	enum Type { CREATE, RESTORE, JOIN, RESUME, LEAVE, MESSAGE, CLOSE, BOT_JOIN, WATCH };
+	Type type;
+
+	uint32 roomId;
+
+	// JOIN, RESUME, LEAVE and BOT_JOIN
+	int seat;
+	HSteamNetConnection conn;
+
+	// JOIN and RESUME, the player's session token and (RESUME only) the newest board it has
+	uint64 token;
+	uint32 lastSeq;
+
+	// MESSAGE, the shard releases it once it has been handled
+	SteamNetworkingMessage_t *pMsg;
+
+	// RESTORE, the room's last board from the journal (nullptr if it never had a move), the shard deletes it
+	JournalRecord *pBoard;
+};
+
+// a board update for everybody watching a room. the shard sends it to the players itself and
+// hands it to the network thread for the spectators, which it keeps track of on its own.
+struct RoomBroadcast
+{
+	uint32 roomId;
+
+	// one reference to each belongs to whoever takes the broadcast out of the shard.
+	// nullptr when the shard evicted the room, nobody needs its board again until somebody joins and it is read back.
+	SharedPayload *pPayload;
+
+	// the whole board when pPayload is only a GAME_DELTA, for whoever needs the board from scratch later. nullptr otherwise.
+	SharedPayload *pSnapshot;
+
+	// when the move that caused it was received (0 if none)
+	SteamNetworkingMicroseconds usecReceived;
+};
+
+class RoomShard {
+public:
+	// the metrics belong to the server's registry, the shard only updates them.
+	// every board it sends out is appended to the journal and the replicator (if there are any) as producer number index.
+	// the shard builds its messages in buffers from pPool and releases the pool when it is destroyed.
+	// the moves for bot seats are worked out by pBots, which every shard shares and which has to outlive the shard.
+	RoomShard(int index, Gauge &roomCount, Counter &movesHandled, Gauge &roomsEvicted, Counter &roomsReloaded, Counter &inboxFull, Counter &outboxFull, Journal *pJournal, Replicator *pReplicator, MessagePool *pPool, BotPool *pBots) : roomCount(roomCount), movesHandled(movesHandled), roomsEvicted(roomsEvicted), roomsReloaded(roomsReloaded), inboxFull(inboxFull), outboxFull(outboxFull), m_inbox(k_nShardQueueSize), m_outbox(k_nShardQueueSize), m_broadcasts(k_nShardQueueSize) {
+		m_nIndex = index;
+		m_pJournal = pJournal;
+		m_pReplicator = pReplicator;
+		m_pPool = pPool;
+		m_pBots = pBots;
+		m_pBots->SetWakeup(m_nIndex, &m_wakeup);
+		m_bRunning = false;
+		m_bStopped = true;
+	}
+
+	// whatever the shard still had to send is thrown away, the server stops it with Stop first
+	~RoomShard() {
+		Finish(nullptr, nullptr);
+		m_pPool->Release();
+	}
+
+	// the network thread can read these while the shard runs. roomCount is the rooms in memory, not the evicted ones.
+	// inboxFull counts the events the network thread had to hold on to and outboxFull the messages and board updates
+	// the shard did.
+	Gauge &roomCount;
+	Counter &movesHandled;
+	Gauge &roomsEvicted;
+	Counter &roomsReloaded;
+	Counter &inboxFull;
+	Counter &outboxFull;
+
+	// the hot standby players are told about in GAME_SETUP, set before Start
+	SteamNetworkingIPAddr standbyAddr = {};
+
+	// a room with no player connected for this long is evicted to the journal, 0 (or no journal) keeps every room in
+	// memory. set before Start.
+	int evictAfterSeconds = 0;
+
+	void Start() {
+		m_bRunning = true;
+		m_bStopped = false;
+		m_thread = std::thread([this]() { Run(); });
+	}
+
+	// network thread only. finishes every event posted so far, then stops the thread. what the shard sends until then
+	// goes into batch and vecBroadcasts the same as with Drain.
+	void Stop(MessageBatch &batch, std::vector<RoomBroadcast> &vecBroadcasts) {
+		Finish(&batch, &vecBroadcasts);
+	}
+
+	// network thread only. an event that finds the inbox full waits behind the ones before it until FlushBacklog
+	// gets it in.
+	void Post(const RoomEvent &event) {
+		if (!m_queueBacklog.empty() || !m_inbox.Push(event)) {
+			m_queueBacklog.push_back(event);
+			inboxFull.Add();
+			return;
+		}
+		m_wakeup.Notify();
+	}
+
+	// network thread only, every tick. false while some events are still waiting, the network thread should leave
+	// the rest of the messages where they are until then.
+	bool FlushBacklog() {
+		bool bPushed = false;
+		while (!m_queueBacklog.empty() && m_inbox.Push(m_queueBacklog.front())) {
+			m_queueBacklog.pop_front();
+			bPushed = true;
+		}
+		if (bPushed) {
+			m_wakeup.Notify();
+		}
+		return m_queueBacklog.empty();
+	}
+
+	// network thread only. moves every message the shard has finished into the batch and every board update into
+	// vecBroadcasts, returns how many there were in total.
+	int Drain(MessageBatch &batch, std::vector<RoomBroadcast> &vecBroadcasts) {
+		int count = 0;
+		SteamNetworkingMessage_t *pMsg;
+		while (m_outbox.Pop(pMsg)) {
+			batch.AddMessage(pMsg);
+			count++;
+		}
+
+		RoomBroadcast broadcast;
+		while (m_broadcasts.Pop(broadcast)) {
+			vecBroadcasts.push_back(broadcast);
+			count++;
+		}
+
+		// the shard may be waiting for the room
+		if (count > 0) {
+			m_wakeup.Notify();
+		}
+		return count;
+	}
+
+private:
+	int m_nIndex;
+	Journal *m_pJournal;
+	Replicator *m_pReplicator;
+	MessagePool *m_pPool;
+	BotPool *m_pBots;
+
+	std::thread m_thread;
+	std::atomic<bool> m_bRunning;
+	std::atomic<bool> m_bStopped;
+
+	MPSCQueue<RoomEvent> m_inbox;
+	SPSCRing<SteamNetworkingMessage_t*> m_outbox;
+	SPSCRing<RoomBroadcast> m_broadcasts;
+
+	// what the shard sleeps on, rung by the network thread and the bots
+	Wakeup m_wakeup;
+
+	// network thread only, events that didn't fit in the inbox
+	std::deque<RoomEvent> m_queueBacklog;
+
+	// shard thread only, messages and board updates that didn't fit in the outbox
+	std::vector<SteamNetworkingMessage_t*> m_vecPendingMessages;
+	std::vector<RoomBroadcast> m_vecPendingBroadcasts;
+
+	// every room on the shard side by side, found through its id. a slot freed by a room that closed or was
+	// evicted is reused before the slab grows.
+	std::vector<Room> m_vecRooms;
+	std::vector<uint32> m_vecFreeSlots;
+	std::unordered_map<uint32, uint32> m_mapRoomSlots;
+
+	// rooms left to the journal, read back the first time anything happens in them
+	std::unordered_set<uint32> m_setEvicted;
+
+	// rooms that lost their last player, evicted once their time is up if nobody came back. a room that filled up and
+	// emptied again in between may go a little early, which only costs a reload.
+	TimerWheel<uint32> m_evictionTimers;
+	std::vector<uint32> m_vecEvictionsDue;
+
+	// rooms that got a move in the current pass, each one sends its board once at the end of the pass
+	std::vector<uint32> m_vecChangedRooms;
+	std::vector<SteamNetworkingMicroseconds> m_vecChangedRoomTimes;
+
+	void Run() {
+		int idlePasses = 0;
+		m_evictionTimers.Start(SteamNetworkingUtils()->GetLocalTimestamp());
+
+		// keep going until stopped and everything that was posted before that has been handled and sent
+		while (true) {
+			bool bRunning = m_bRunning;
+
+			// nothing new is taken on while some of what came out of it is left over
+			bool bWork = false;
+			bool bBlocked = !FlushPending();
+			if (!bBlocked) {
+				RoomEvent event;
+				while (!Blocked() && m_inbox.Pop(event)) {
+					HandleEvent(event);
+					bWork = true;
+				}
+
+				BotMove move;
+				while (!Blocked() && m_pBots->PopResult(m_nIndex, move)) {
+					HandleBotMove(move);
+					bWork = true;
+				}
+
+				// one board update per room for everything handled above
+				for (size_t i = 0; i < m_vecChangedRooms.size(); i++) {
+					Room *pRoom = FindRoom(m_vecChangedRooms[i]);
+					if (pRoom != nullptr) {
+						SendCurrentDataToRoom(*pRoom, m_vecChangedRoomTimes[i]);
+					}
+				}
+				m_vecChangedRooms.clear();
+				m_vecChangedRoomTimes.clear();
+
+				if (m_evictionTimers.Armed() > 0) {
+					EvictIdleRooms();
+				}
+			}
+
+			if (!bRunning && !Blocked()) {
+				break;
+			}
+
+			// spin for a bit in case more is coming, then give up the core, then sleep until there is something to do.
+			// the outbox is only drained once a tick, so there is no point spinning on it.
+			if (bWork) {
+				idlePasses = 0;
+			}
+			else if (bBlocked) {
+				WaitForWork(true);
+			}
+			else {
+				idlePasses++;
+				if (idlePasses > k_nShardYieldPasses) {
+					WaitForWork(bBlocked);
+				}
+				else if (idlePasses > k_nShardSpinPasses) {
+					std::this_thread::yield();
+				}
+			}
+		}
+		m_bStopped = true;
+	}
+
+	// until an event, a bot's move or (if bBlocked) room in the outbox comes along, or the next eviction is due
+	void WaitForWork(bool bBlocked) {
+		int64 usecTimeout = -1;
+		if (m_evictionTimers.Armed() > 0) {
+			usecTimeout = std::max((int64)0, m_evictionTimers.NextDeadline() - SteamNetworkingUtils()->GetLocalTimestamp());
+		}
+		m_wakeup.Wait(usecTimeout, [this, bBlocked]() {
+			if (!m_bRunning) {
+				return true;
+			}
+			// the network thread empties both rings whenever it drains
+			if (bBlocked) {
+				return (m_vecPendingMessages.empty() || m_outbox.Empty()) && (m_vecPendingBroadcasts.empty() || m_broadcasts.Empty());
+			}
+			return !m_inbox.Empty() || m_pBots->HasResult(m_nIndex);
+		});
+	}
+
+	bool Blocked() const {
+		return !m_vecPendingMessages.empty() || !m_vecPendingBroadcasts.empty();
+	}
+
+	// what didn't fit in the outbox before, in order. false if some of it still doesn't.
+	bool FlushPending() {
+		size_t numSent = 0;
+		while (numSent < m_vecPendingMessages.size() && m_outbox.Push(m_vecPendingMessages[numSent])) {
+			numSent++;
+		}
+		m_vecPendingMessages.erase(m_vecPendingMessages.begin(), m_vecPendingMessages.begin() + numSent);
+
+		numSent = 0;
+		while (numSent < m_vecPendingBroadcasts.size() && m_broadcasts.Push(m_vecPendingBroadcasts[numSent])) {
+			numSent++;
+		}
+		m_vecPendingBroadcasts.erase(m_vecPendingBroadcasts.begin(), m_vecPendingBroadcasts.begin() + numSent);
+
+		return !Blocked();
+	}
+
+	// gets the backlog in and stops the thread, draining its outbox into batch and vecBroadcasts (thrown away if null)
+	// so it can't be held up on a full one
+	void Finish(MessageBatch *pBatch, std::vector<RoomBroadcast> *pVecBroadcasts) {
+		if (!m_thread.joinable()) {
+			return;
+		}
+
+		MessageBatch discard;
+		std::vector<RoomBroadcast> vecDiscard;
+		while (!FlushBacklog() || !m_bStopped) {
+			if (m_queueBacklog.empty()) {
+				m_bRunning = false;
+				m_wakeup.Notify();
+			}
+			Drain(pBatch != nullptr ? *pBatch : discard, pVecBroadcasts != nullptr ? *pVecBroadcasts : vecDiscard);
+			std::this_thread::yield();
+		}
+		m_thread.join();
+		Drain(pBatch != nullptr ? *pBatch : discard, pVecBroadcasts != nullptr ? *pVecBroadcasts : vecDiscard);
+
+		discard.Drop([](const SteamNetworkingMessage_t *) { return true; });
+		for (RoomBroadcast &broadcast : vecDiscard) {
+			if (broadcast.pPayload != nullptr) {
+				broadcast.pPayload->Release();
+			}
+			if (broadcast.pSnapshot != nullptr) {
+				broadcast.pSnapshot->Release();
+			}
+		}
+	}
+
+	void HandleEvent(RoomEvent &event) {
+		switch (event.type) {
+			case RoomEvent::Type::CREATE: {
+				Room &room = AddRoom(event.roomId);
+				roomCount.Add(1);
+
+				// so the network thread has a board to show spectators before the first move
+				DataPacket data = room.convertBoardToPacket();
+				Broadcast(room, SharedPayload::Create(&data, (uint32)sizeof(data), m_pPool), nullptr, 0);
+				break;
+			}
+			// a room from before the server restarted, the players reconnect to it with their tokens
+			case RoomEvent::Type::RESTORE: {
+				Room &room = AddRoom(event.roomId);
+				roomCount.Add(1);
+
+				if (event.pBoard != nullptr) {
+					BitBoard board;
+					board.red = event.pBoard->red;
+					board.blue = event.pBoard->blue;
+					room.restore(event.pBoard->seq, board, event.pBoard->score1, event.pBoard->score2, event.pBoard->currentTurn);
+					delete event.pBoard;
+				}
+
+				room.sentSeq = room.seq;
+				DataPacket data = room.convertBoardToPacket();
+				Broadcast(room, SharedPayload::Create(&data, (uint32)sizeof(data), m_pPool), nullptr, 0);
+
+				// nobody is in it until the players reconnect
+				ArmEviction(room);
+				break;
+			}
+			case RoomEvent::Type::CLOSE: {
+				if (m_setEvicted.erase(event.roomId) > 0) {
+					roomsEvicted.Add(-1);
+				}
+				else if (RemoveRoom(event.roomId)) {
+					roomCount.Add(-1);
+				}
+				break;
+			}
+			// reading the room back is all it takes, that sends the network thread its board
+			case RoomEvent::Type::WATCH: {
+				FindRoom(event.roomId);
+				break;
+			}
+			case RoomEvent::Type::JOIN: {
+				Room *pRoom = FindRoom(event.roomId);
+				if (pRoom == nullptr) {
+					break;
+				}
+				Room &room = *pRoom;
+				room.players[event.seat] = event.conn;
+
+				// send message to the other player that somebody joined
+				HSteamNetConnection other = room.players[1 - event.seat];
+				if (other != k_HSteamNetConnection_Invalid) {
+					SendString(other, "Player " + std::to_string(event.seat + 1) + " joined the room.");
+				}
+
+				// send game setup info to the new connection so they know what turn they are
+				SendSetup(event);
+
+				// send current gamedata
+				DataPacket current = room.convertBoardToPacket();
+				SendData(event.conn, &current, 0);
+				break;
+			}
+			// the seat is played by a bot from now on, it moves straight away if it is its turn
+			case RoomEvent::Type::BOT_JOIN: {
+				Room *pRoom = FindRoom(event.roomId);
+				if (pRoom == nullptr) {
+					break;
+				}
+				Room &room = *pRoom;
+				room.setBot(event.seat);
+
+				HSteamNetConnection other = room.players[1 - event.seat];
+				if (other != k_HSteamNetConnection_Invalid) {
+					SendString(other, "The computer joined the room as player " + std::to_string(event.seat + 1) + ".");
+				}
+				RequestBotMove(room);
+				break;
+			}
+			case RoomEvent::Type::RESUME: {
+				Room *pRoom = FindRoom(event.roomId);
+				if (pRoom == nullptr) {
+					break;
+				}
+				Room &room = *pRoom;
+				room.players[event.seat] = event.conn;
+
+				HSteamNetConnection other = room.players[1 - event.seat];
+				if (other != k_HSteamNetConnection_Invalid) {
+					SendString(other, "Player " + std::to_string(event.seat + 1) + " reconnected.");
+				}
+
+				// same seat and token as before, then only what changed while they were gone
+				SendSetup(event);
+				ResumePacket resume = room.makeResume(event.lastSeq);
+				Send(MessageBatch::CreateMessage(event.conn, &resume, resume.size(), k_nSteamNetworkingSend_Reliable, m_pPool), 0);
+				break;
+			}
+			case RoomEvent::Type::LEAVE: {
+				Room *pRoom = FindRoom(event.roomId);
+				if (pRoom == nullptr) {
+					break;
+				}
+				Room &room = *pRoom;
+				room.players[event.seat] = k_HSteamNetConnection_Invalid;
+
+				// Send a message so everybody else knows what happened
+				HSteamNetConnection other = room.players[1 - event.seat];
+				if (other != k_HSteamNetConnection_Invalid) {
+					SendString(other, "Player " + std::to_string(event.seat + 1) + " hath departed");
+				}
+				ArmEviction(room);
+				break;
+			}
+			case RoomEvent::Type::MESSAGE: {
+				Room *pRoom = FindRoom(event.roomId);
+				if (pRoom != nullptr) {
+					HandleMessage(*pRoom, event.seat, event.pMsg);
+				}
+
+				// We don't need this anymore.
+				event.pMsg->Release();
+				break;
+			}
+		}
+	}
+
+	// the network thread already checked the size against the type
+	void HandleMessage(Room &room, int seat, SteamNetworkingMessage_t *pMsg) {
+		DataPacket *data = (DataPacket*)pMsg->m_pData;
+		switch (data->type) {
+			// parse the outline piece recieved
+			case DataPacket::MsgType::GAME_SELECTION: {
+				// send the selected piece to the opponent
+				HSteamNetConnection other = room.players[1 - seat];
+				if (other != k_HSteamNetConnection_Invalid) {
+					Send(MessageBatch::CreateMessage(other, pMsg->m_pData, (uint32)sizeof(SelectionPacket), k_nSelectionSendFlags, m_pPool), pMsg->m_usecTimeReceived);
+				}
+				break;
+			}
+			// a player clearing the board for the next game. anything else they send as a board is turned down and they
+			// get ours back, so their copy doesn't stay on something the room never had.
+			case DataPacket::MsgType::GAME_DATA: {
+				if (room.clearBoard(data)) {
+					MarkChanged(room, pMsg->m_usecTimeReceived);
+				}
+				else {
+					DataPacket current = room.convertBoardToPacket();
+					SendData(pMsg->m_conn, &current, pMsg->m_usecTimeReceived);
+				}
+				break;
+			}
+			// a single piece, checked against the room's own board. the player already shows it and only hears back from us
+			// whether it stays, the board with it on goes out at the end of the pass like any other.
+			case DataPacket::MsgType::GAME_MOVE: {
+				MovePacket *move = (MovePacket*)pMsg->m_pData;
+
+				MoveResultPacket result;
+				result.moveId = move->moveId;
+				result.accepted = move->color == seat + 1 && room.applyMove(move->color, move->cell);
+				result.seq = room.seq;
+				Send(MessageBatch::CreateMessage(pMsg->m_conn, &result, (uint32)sizeof(result), k_nSteamNetworkingSend_Reliable, m_pPool), pMsg->m_usecTimeReceived);
+
+				if (result.accepted) {
+					movesHandled.Add();
+					MarkChanged(room, pMsg->m_usecTimeReceived);
+				}
+				break;
+			}
+			default: {
+				break;
+			}
+		}
+	}
+
+	// a bot's move, played the same way as a player's if the board is still the one it was worked out for
+	void HandleBotMove(const BotMove &move) {
+		Room *pRoom = FindRoom(move.roomId);
+		if (pRoom == nullptr) {
+			return;
+		}
+		Room &room = *pRoom;
+		room.botThinking = false;
+
+		if (move.seq == room.seq && move.cell >= 0 && room.applyMove(move.seat + 1, move.cell)) {
+			movesHandled.Add();
+			MarkChanged(room, 0);
+		}
+		else {
+			// somebody changed the board while it was thinking
+			RequestBotMove(room);
+		}
+	}
+
+	// if it is a bot's turn and the game is still going, ask the pool for its move
+	void RequestBotMove(Room &room) {
+		int seat = room.currentTurn - 1;
+		if (room.botThinking || (seat != 0 && seat != 1) || !room.isBot(seat)) {
+			return;
+		}
+		if (room.bits.winner() != BitBoard::Color::EMPTY || room.bits.full()) {
+			return;
+		}
+
+		BotJob job;
+		job.roomId = room.id;
+		job.shard = m_nIndex;
+		job.seat = seat;
+		job.seq = room.seq;
+		job.board = room.bits;
+		job.usecRequested = SteamNetworkingUtils()->GetLocalTimestamp();
+		job.usecDeadline = job.usecRequested + k_usecBotMoveDeadline;
+		m_pBots->Submit(job);
+		room.botThinking = true;
+	}
+
+	// a new room in a free slot of the slab (or the one already there)
+	Room &AddRoom(uint32 roomId) {
+		auto itSlot = m_mapRoomSlots.find(roomId);
+		if (itSlot != m_mapRoomSlots.end()) {
+			return m_vecRooms[itSlot->second];
+		}
+
+		uint32 slot;
+		if (!m_vecFreeSlots.empty()) {
+			slot = m_vecFreeSlots.back();
+			m_vecFreeSlots.pop_back();
+		}
+		else {
+			slot = (uint32)m_vecRooms.size();
+			m_vecRooms.emplace_back();
+
+			// every room can change in one pass, so the lists of them never have to grow while moves are coming in
+			m_vecChangedRooms.reserve(m_vecRooms.capacity());
+			m_vecChangedRoomTimes.reserve(m_vecRooms.capacity());
+		}
+		m_mapRoomSlots[roomId] = slot;
+
+		Room &room = m_vecRooms[slot];
+		room = Room();
+		room.id = roomId;
+		return room;
+	}
+
+	bool RemoveRoom(uint32 roomId) {
+		auto itSlot = m_mapRoomSlots.find(roomId);
+		if (itSlot == m_mapRoomSlots.end()) {
+			return false;
+		}
+		m_vecRooms[itSlot->second].id = 0;
+		m_vecFreeSlots.push_back(itSlot->second);
+		m_mapRoomSlots.erase(itSlot);
+		return true;
+	}
+
+	// the room if the shard has it, read back from the journal first if it was evicted. nullptr if it is gone.
+	// only good until the next room is added, the slab may move.
+	Room *FindRoom(uint32 roomId) {
+		auto itSlot = m_mapRoomSlots.find(roomId);
+		if (itSlot != m_mapRoomSlots.end()) {
+			return &m_vecRooms[itSlot->second];
+		}
+		if (m_setEvicted.erase(roomId) == 0) {
+			return nullptr;
+		}
+		roomsEvicted.Add(-1);
+
+		JournalRecord record;
+		if (!m_pJournal->Reload(roomId, record)) {
+			std::cout << "Could not read room " << roomId << " back from the journal" << std::endl;
+			return nullptr;
+		}
+
+		Room &room = AddRoom(roomId);
+		BitBoard board;
+		board.red = record.red;
+		board.blue = record.blue;
+		room.restore(record.seq, board, record.score1, record.score2, record.currentTurn);
+		room.botSeats = record.seat & 3;
+		room.sentSeq = room.seq;
+		roomCount.Add(1);
+		roomsReloaded.Add();
+
+		// the network thread let go of its board too
+		DataPacket data = room.convertBoardToPacket();
+		Broadcast(room, SharedPayload::Create(&data, (uint32)sizeof(data), m_pPool), nullptr, 0);
+
+		ArmEviction(room);
+		return &room;
+	}
+
+	// the room has nobody in it, it goes if it is still empty by the time the timer is up
+	void ArmEviction(Room &room) {
+		if (m_pJournal != nullptr && !m_pJournal->Failed() && evictAfterSeconds > 0 && room.empty()) {
+			m_evictionTimers.Schedule(SteamNetworkingUtils()->GetLocalTimestamp() + (SteamNetworkingMicroseconds)evictAfterSeconds * 1000000, room.id);
+		}
+	}
+
+	void EvictIdleRooms() {
+		m_evictionTimers.Advance(SteamNetworkingUtils()->GetLocalTimestamp(), m_vecEvictionsDue);
+		for (uint32 roomId : m_vecEvictionsDue) {
+			auto itSlot = m_mapRoomSlots.find(roomId);
+			if (itSlot == m_mapRoomSlots.end()) {
+				continue;
+			}
+			// a journal that stopped writing couldn't give it back
+			Room &room = m_vecRooms[itSlot->second];
+			if (!room.empty() || m_pJournal->Failed()) {
+				continue;
+			}
+
+			// the bot's move would find the room gone, it can go once the move is in
+			if (room.botThinking) {
+				ArmEviction(room);
+				continue;
+			}
+			Evict(room);
+		}
+		m_vecEvictionsDue.clear();
+	}
+
+	// the journal keeps the room from here on, the moves since its base are dropped. a player that comes back is
+	// caught up from the whole board instead.
+	void Evict(Room &room) {
+		JournalRecord record;
+		record.kind = JournalRecord::Kind::EVICT;
+		record.roomId = room.id;
+		record.seat = room.botSeats;
+		record.seq = room.seq;
+		record.red = room.bits.red;
+		record.blue = room.bits.blue;
+		record.score1 = room.score1;
+		record.score2 = room.score2;
+		record.currentTurn = room.currentTurn;
+		m_pJournal->Append(m_nIndex, record);
+
+		Broadcast(room, nullptr, nullptr, 0);
+
+		m_setEvicted.insert(room.id);
+		RemoveRoom(room.id);
+		roomCount.Add(-1);
+		roomsEvicted.Add(1);
+	}
+
+	// the updated board goes to both players at the end of the pass
+	void MarkChanged(Room &room, SteamNetworkingMicroseconds usecReceived) {
+		if (std::find(m_vecChangedRooms.begin(), m_vecChangedRooms.end(), room.id) == m_vecChangedRooms.end()) {
+			m_vecChangedRooms.push_back(room.id);
+			m_vecChangedRoomTimes.push_back(usecReceived);
+		}
+	}
+
+	// the board is serialised once and the same bytes go to the players and every spectator.
+	// when all it got since the last one went out were a few moves, only those moves are sent.
+	void SendCurrentDataToRoom(Room &room, SteamNetworkingMicroseconds usecReceived) {
+		DataPacket data = room.convertBoardToPacket();
+		SharedPayload *pPayload = SharedPayload::Create(&data, (uint32)sizeof(data), m_pPool);
+		SharedPayload *pSnapshot = nullptr;
+
+		DeltaPacket delta;
+		if (room.makeDelta(delta)) {
+			pSnapshot = pPayload;
+			pPayload = SharedPayload::Create(&delta, delta.size(), m_pPool);
+		}
+		room.sentSeq = room.seq;
+
+		for (int i = 0; i < 2; i++) {
+			if (room.players[i] != k_HSteamNetConnection_Invalid) {
+				Send(pPayload->CreateMessage(room.players[i], k_nSteamNetworkingSend_Reliable), usecReceived);
+			}
+		}
+		Broadcast(room, pPayload, pSnapshot, usecReceived);
+
+		// check for a win after the board went out, the same order the single threaded server used
+		room.checkWin();
+
+		// the board with any point the win just gave, so a restart or the standby carries on from exactly here
+		if (m_pJournal != nullptr || m_pReplicator != nullptr) {
+			JournalRecord record;
+			record.kind = JournalRecord::Kind::BOARD;
+			record.roomId = room.id;
+			record.seq = room.seq;
+			record.red = room.bits.red;
+			record.blue = room.bits.blue;
+			record.score1 = room.score1;
+			record.score2 = room.score2;
+			record.currentTurn = room.currentTurn;
+			if (m_pJournal != nullptr) {
+				m_pJournal->Append(m_nIndex, record);
+			}
+			if (m_pReplicator != nullptr) {
+				m_pReplicator->Append(m_nIndex, record);
+			}
+		}
+
+		RequestBotMove(room);
+	}
+
+	// passes our reference to the payload on to the network thread
+	void Broadcast(Room &room, SharedPayload *pPayload, SharedPayload *pSnapshot, SteamNetworkingMicroseconds usecReceived) {
+		RoomBroadcast broadcast;
+		broadcast.roomId = room.id;
+		broadcast.pPayload = pPayload;
+		broadcast.pSnapshot = pSnapshot;
+		broadcast.usecReceived = usecReceived;
+		if (!m_vecPendingBroadcasts.empty() || !m_broadcasts.Push(broadcast)) {
+			m_vecPendingBroadcasts.push_back(broadcast);
+			outboxFull.Add();
+		}
+	}
+
+	void SendData(HSteamNetConnection conn, DataPacket *data, SteamNetworkingMicroseconds usecReceived) {
+		Send(MessageBatch::CreateMessage(conn, data, (uint32)sizeof(*data), k_nSteamNetworkingSend_Reliable, m_pPool), usecReceived);
+	}
+
+	void SendSetup(const RoomEvent &event) {
+		DataPacket data;
+		data.type = data.GAME_SETUP;
+		data.assignedTurn = event.seat + 1;
+		data.sessionToken = event.token;
+		data.standby = standbyAddr;
+		SendData(event.conn, &data, 0);
+	}
+
+	void SendString(HSteamNetConnection conn, std::string str) {
+		DataPacket data;
+		data.type = data.CONNECTION_STATUS;
+		data.msg = str;
+		SendData(conn, &data, 0);
+	}
+
+	// usecReceived is when the message that caused this one came in (0 if none), the network thread uses it to time relays
+	void Send(SteamNetworkingMessage_t *pMsg, SteamNetworkingMicroseconds usecReceived) {
+		pMsg->m_nUserData = usecReceived;
+		if (!m_vecPendingMessages.empty() || !m_outbox.Push(pMsg)) {
+			m_vecPendingMessages.push_back(pMsg);
+			outboxFull.Add();
+		}
+	}
+};
+
+#endif
@@ -17,6 +17,7 @@
 #include <mutex>
 #include <queue>
 #include <map>
+#include <memory>
 #include <cctype>
 
 #include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
@@ -29,19 +30,143 @@
 #include <signal.h>
 
 #include "Tools.h"
-
-#include "Local3DFourConnect.h"
+#include "Transport.h"
+#include "MessageBatch.h"
+#include "TickScheduler.h"
+#include "Metrics.h"
+#include "SharedPayload.h"
+#include "MessagePool.h"
+#include "Journal.h"
+#include "Replication.h"
+#include "TimerWheel.h"
+#include "Capture.h"
+#include "TokenBucket.h"
+#include "ClockSync.h"
+#include "Matchmaker.h"
+#include "RoomShard.h"
+#include "CommandRegistry.h"
 
 class Server {
 public:
+	// how the main loop waits between polls, set before Run
+	TickScheduler scheduler;
+
+	// number of room shard threads, 0 picks one per core left over after the network thread
+	int numShards = 0;
+
+	// how long a player that lost its connection keeps its seat, 0 frees it straight away
+	int reconnectGraceSeconds = 30;
+
+	// where to write the metrics every metricsIntervalSeconds in the prometheus text format, empty to not write them
+	std::string metricsFile;
+	int metricsIntervalSeconds = 10;
+
+	// where to keep the journal the rooms are brought back from after a restart, empty to not keep one.
+	// everything appended is synced to disk together every journalIntervalMs.
+	std::string journalFile;
+	int journalIntervalMs = 20;
+
+	// with a journal, a room nobody has been connected to for this long leaves memory for the journal and is read back
+	// when somebody comes back to it. 0 keeps every room in memory.
+	int evictAfterSeconds = 10;
+
+	// threads that play the server's bots, the most time each bot move gets, and how long a player waits for a
+	// person before they are given a bot instead (0 only gives them one when they ask)
+	int botThreads = 1;
+	int botBudgetMs = 50;
+	int botWaitSeconds = 10;
+
+	// where to record everything the clients send so it can be replayed later, empty to not record it
+	std::string captureFile;
+
+	// new connections coming in faster than acceptRate a second (after a burst of as many again) are turned away
+	// without being accepted, 0 for no limit. so is every one past maxConnections.
+	int acceptRate = 500;
+	int maxConnections = 10000;
+
+	// the room directory to report to when this is one of several server processes (see Directory.h), none if all
+	// zeros. the directory sends clients to advertiseAddr, which is 127.0.0.1 and our port if left all zeros.
+	SteamNetworkingIPAddr directoryAddr = {};
+	SteamNetworkingIPAddr advertiseAddr = {};
+
+	// a server process to keep a hot standby of our rooms on (see Replication.h), none if all zeros. players are told
+	// where it is so they can reconnect there if we go down. with hotStandby set we are somebody else's standby
+	// instead: players are turned away until the primary replicating to us goes, then we take its rooms over.
+	// only a connection from primaryAddr is taken for the primary, any port since it connects from whichever it gets,
+	// and only once its first batch has shown it knows replicaKey. both ends need the same key.
+	SteamNetworkingIPAddr standbyAddr = {};
+	bool hotStandby = false;
+	SteamNetworkingIPAddr primaryAddr = {};
+	std::string replicaKey;
+
+	// what to listen on, the real network if left null
+	ITransport *transport = nullptr;
+
+	// outgoing message buffers the pools have had to allocate so far. any thread, once the server is listening.
+	uint64 BuffersAllocated() const
+	{
+		return m_pBuffersAllocated->Get();
+	}
+
 	// Start and run the server
 	void Run(uint16 nPort)
 	{
-		// init game stuff
-		game = GameManager();
+		RegisterMetrics();
+		RegisterCommands();
+		m_timers.Start(SteamNetworkingUtils()->GetLocalTimestamp());
+
+		if (numShards <= 0)
+			numShards = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+
+		// read back the rooms that were running when the server last stopped
+		std::map< uint32, JournalRoom > mapRestoredRooms;
+		if (!journalFile.empty())
+			OpenJournal(mapRestoredRooms);
+
+		// everything the journal gets goes to the standby too, starting with the rooms we have now
+		if (!standbyAddr.IsIPv6AllZeros())
+		{
+			m_pReplicator.reset(new Replicator(numShards + 1, replicaKey, *m_pReplicaRecords, *m_pReplicaMoves, *m_pReplicaBytes, *m_pReplicaBusyMicroseconds, *m_pReplicaSnapshots, *m_pReplicaLag, *m_pReplicaAckTime));
+			m_pReplicator->Seed(mapRestoredRooms);
+		}
+		m_bStandingBy = hotStandby;
 
-		// Select instance to use.  For now we'll always use the default.
-		m_pInterface = SteamNetworkingSockets();
+		// the bots for every shard share one set of threads
+		m_pBots.reset(new BotPool(botThreads, numShards, (SteamNetworkingMicroseconds)botBudgetMs * 1000, *m_pBotMoves, *m_pBotMovesLate, *m_pBotBusyMicroseconds, *m_pBotSearchDepth, *m_pBotMoveDelay));
+		m_pBots->Start();
+
+		// start the room shards
+		for (int i = 0; i < numShards; i++)
+		{
+			std::string labels = "shard=\"" + std::to_string(i) + "\"";
+			Gauge &roomCount = m_metrics.AddGauge("fourconnect_shard_rooms", "Rooms running on each shard thread.", labels);
+			Counter &movesHandled = m_metrics.AddCounter("fourconnect_shard_moves_total", "Moves applied by each shard thread.", labels);
+			Gauge &roomsEvicted = m_metrics.AddGauge("fourconnect_shard_rooms_evicted", "Idle rooms each shard thread left to the journal.", labels);
+			Counter &roomsReloaded = m_metrics.AddCounter("fourconnect_shard_rooms_reloaded_total", "Evicted rooms each shard thread read back from the journal.", labels);
+			Counter &inboxFull = m_metrics.AddCounter("fourconnect_shard_inbox_full_total", "Events that found a shard's inbox full and had to wait.", labels);
+			Counter &outboxFull = m_metrics.AddCounter("fourconnect_shard_outbox_full_total", "Messages and board updates that found a shard's outbox full and had to wait.", labels);
+			MessagePool *pPool = MessagePool::Create(k_nMaxPooledBuffers, m_pBuffersAllocated, m_pBuffersReused);
+			m_vecShards.emplace_back(new RoomShard(i, roomCount, movesHandled, roomsEvicted, roomsReloaded, inboxFull, outboxFull, m_pJournal.get(), m_pReplicator.get(), pPool, m_pBots.get()));
+			m_vecShards.back()->standbyAddr = standbyAddr;
+			m_vecShards.back()->evictAfterSeconds = evictAfterSeconds;
+			m_vecShards.back()->Start();
+		}
+		RestoreRooms(mapRestoredRooms);
+
+		m_acceptBucket.Set(acceptRate, acceptRate, SteamNetworkingUtils()->GetLocalTimestamp());
+
+		if (!captureFile.empty())
+		{
+			m_pCapture.reset(new CaptureWriter());
+			if (!m_pCapture->Open(captureFile))
+			{
+				std::cout << "Failed to open the capture " << captureFile << ", running without one" << std::endl;
+				m_pCapture.reset();
+			}
+		}
+
+		// Select instance to use.  The default unless we were given one.
+		m_pInterface = transport != nullptr ? transport : DefaultTransport();
 
 		// Start listening
 		SteamNetworkingIPAddr serverLocalAddr;
@@ -55,195 +180,1973 @@ public:
 		m_hPollGroup = m_pInterface->CreatePollGroup();
 		if (m_hPollGroup == k_HSteamNetPollGroup_Invalid)
 			std::cout << "Failed to listen on port " << nPort << std::endl;
-		std::cout << "Server listening on port " << nPort << std::endl;
+		std::cout << "Server listening on port " << nPort << " with " << numShards << " room threads and " << m_pBots->Threads() << " bot threads" << std::endl;
+
+		m_pPool = MessagePool::Create(k_nMaxPooledBuffers, m_pBuffersAllocated, m_pBuffersReused);
+		m_outbox.Init(m_pInterface, k_nMaxMessagesPerPoll * 4, m_pPool);
+
+		m_commands.PrintCommands();
+		if (m_bStandingBy)
+			std::cout << "Hot standby, players are turned away until the primary replicating to us goes" << std::endl;
+
+		if (!directoryAddr.IsIPv6AllZeros() && advertiseAddr.IsIPv6AllZeros())
+			advertiseAddr.SetIPv4(0x7f000001, nPort);
+		else if (advertiseAddr.m_port == 0)
+			advertiseAddr.m_port = nPort;
+
+		// Main server loop
+		while (!g_bQuit)
+		{
+			SteamNetworkingMicroseconds usecTickStart = SteamNetworkingUtils()->GetLocalTimestamp();
+			m_bActivity = false;
+
+			PollIncomingMessages();
+			PollConnectionStateChanges();
+			m_commands.Poll();
+			RunMatchmaking();
+			SendPings();
+			UpdateDirectory();
+			UpdateReplication();
+
+			// send everything this tick produced in one go
+			FlushOutbox();
+
+			RunTimers();
+			UpdateMetrics();
+
+			// only ticks that did something, the quiet ones would drown them out
+			if (m_bActivity)
+				m_pTickDuration->Record(SteamNetworkingUtils()->GetLocalTimestamp() - usecTickStart);
+
+			// wait for the next server update, a long one if nobody is there to wait for it
+			scheduler.Wait(m_bActivity, IsIdle());
+		}
+
+		// let the shards finish what they were given and send their last messages, the standby gets their last boards
+		for (auto &shard : m_vecShards)
+			shard->Stop(m_outbox, m_vecBroadcasts);
+		if (m_pReplicator && m_bStandbyConnected)
+			m_pReplicator->Update(m_hStandby, m_outbox, m_nFirstRoomId, m_nNextRoomId);
+		FlushOutbox();
+
+		// everybody gets what was sent them before their connection goes
+		std::vector< HSteamNetConnection > vecConns;
+		for (auto &client : m_mapClients)
+			vecConns.push_back(client.first);
+		if (m_hDirectory != k_HSteamNetConnection_Invalid)
+			vecConns.push_back(m_hDirectory);
+		if (m_hStandby != k_HSteamNetConnection_Invalid)
+			vecConns.push_back(m_hStandby);
+		FlushConnections(m_pInterface, vecConns, k_usecMaxFlushOnShutdown);
+
+		// the seats are not freed on the way out, so a restarted server gets every room back
+		if (m_pJournal)
+			m_pJournal->Close();
+		m_pCapture.reset();
+
+		if (m_hDirectory != k_HSteamNetConnection_Invalid)
+		{
+			m_pInterface->CloseConnection(m_hDirectory, 0, "Server Shutdown", true);
+			m_hDirectory = k_HSteamNetConnection_Invalid;
+		}
+
+		// the standby takes over once this goes
+		if (m_hStandby != k_HSteamNetConnection_Invalid)
+		{
+			m_pInterface->CloseConnection(m_hStandby, 0, "Server Shutdown", true);
+			m_hStandby = k_HSteamNetConnection_Invalid;
+		}
+		if (m_hPrimary != k_HSteamNetConnection_Invalid)
+		{
+			m_pInterface->CloseConnection(m_hPrimary, 0, "Server Shutdown", false);
+			m_hPrimary = k_HSteamNetConnection_Invalid;
+		}
+
+		// Close all the connections
+		std::cout << "Closing connections..." << std::endl;
+		for (auto it : m_mapClients)
+		{
+			// Send them one more goodbye message
+			// SendStringToClient(it.first, "Server is shutting down.  Goodbye.");
+
+			// Close Connection
+			m_pInterface->CloseConnection(it.first, 0, "Server Shutdown", true);
+		}
+		// Reset and destroy vars
+		m_mapClients.clear();
+		for (auto &room : m_mapRooms)
+		{
+			if (room.second.m_pSnapshot != nullptr)
+				room.second.m_pSnapshot->Release();
+		}
+		m_mapRooms.clear();
+
+		// no bot may be left to wake a shard that is gone
+		m_pBots.reset();
+		m_vecShards.clear();
+		m_pJournal.reset();
+		m_pReplicator.reset();
+
+		// buffers still queued in the library keep the pool alive until they are sent
+		m_pPool->Release();
+		m_pPool = nullptr;
+
+		m_pInterface->CloseListenSocket(m_hListenSock);
+		m_hListenSock = k_HSteamListenSocket_Invalid;
+
+		m_pInterface->DestroyPollGroup(m_hPollGroup);
+		m_hPollGroup = k_HSteamNetPollGroup_Invalid;
+	}
+private:
+
+	// Networking vars
+	HSteamListenSocket m_hListenSock;
+	HSteamNetPollGroup m_hPollGroup;
+	ITransport *m_pInterface;
+
+	// what a timer on m_timers is for. the one a client or seat has armed is kept next to it, so it can be cancelled
+	// when it isn't needed any more and one that goes off without being the current one is ignored.
+	struct Timer_t
+	{
+		enum class Kind { JOIN, SEAT };
+		Kind m_eKind = Kind::JOIN;
+
+		// JOIN, the connection that has to send GAME_JOIN
+		HSteamNetConnection m_hConn = k_HSteamNetConnection_Invalid;
+
+		// SEAT, the seat held for a player that lost its connection
+		uint32 m_nRoomId = 0;
+		int m_nSeat = 0;
+	};
+	typedef TimerWheel<Timer_t>::TimerId TimerId;
+
+	// every timeout of every client and room, run once a tick
+	TimerWheel<Timer_t> m_timers;
+	std::vector<Timer_t> m_vecExpiredTimers;
+
+	struct Client_t
+	{
+		std::string m_sNick;
+
+		// nothing until the client sends GAME_JOIN, a player is QUEUED until the matchmaker finds them an opponent
+		enum Role { NONE, QUEUED, PLAYER, SPECTATOR };
+		Role m_eRole = Role::NONE;
+		SteamNetworkingMicroseconds m_usecQueued = 0;
+
+		// newest cursor update relayed for this client
+		uint32 m_nLastSelectionSeq = 0;
+
+		// where the client is playing or watching
+		uint32 m_nRoomId = 0;
+		int m_nSeat = 0;
+
+		// set while the connection has too much queued, it skips board and cursor updates until it catches up
+		// and then gets the newest board instead of everything it missed
+		bool m_bBehind = false;
+
+		// closes the connection if it hasn't sent GAME_JOIN in time, 0 once it has
+		TimerId m_nJoinTimer = 0;
+
+		// one per message type, a message that finds its bucket empty is dropped without being read. every dropped
+		// message also takes from the flood allowance, a client that uses all of that up is disconnected.
+		TokenBucket m_messageLimits[k_nNumMsgTypes + 1];
+		TokenBucket m_floodAllowance;
+
+		// round trip and clock offset from our pings
+		ClockSync m_clock;
+
+		// where the connection came from
+		SteamNetworkingIPAddr m_addrRemote = {};
+	};
+
+	std::map< HSteamNetConnection, Client_t > m_mapClients;
+
+	// the network thread's view of the rooms, only used to hand out seats. the games themselves live on the shards.
+	struct RoomSeats_t
+	{
+		HSteamNetConnection m_players[2] = { k_HSteamNetConnection_Invalid, k_HSteamNetConnection_Invalid };
+
+		// played by a bot, which never leaves
+		bool m_bBots[2] = { false, false };
+
+		// session token of each seat. a player that lost its connection keeps the token (and the seat) until its
+		// seat timer goes off, 0 while nobody is away.
+		uint64 m_tokens[2] = { 0, 0 };
+		TimerId m_seatTimers[2] = { 0, 0 };
+
+		// the seq the last selection from each seat went on to the other player with. every client counts its own from
+		// 0, so a new player or a reconnect in the seat would start over below what the other player has already seen.
+		uint32 m_nSelectionSeqs[2] = { 0, 0 };
+
+		bool SeatFree(int seat)
+		{
+			return m_players[seat] == k_HSteamNetConnection_Invalid && m_tokens[seat] == 0 && !m_bBots[seat];
+		}
+
+		std::vector< HSteamNetConnection > m_vecSpectators;
+
+		// the newest board the shard sent out, what a new or lagging spectator is given. holds one reference.
+		SharedPayload *m_pSnapshot = nullptr;
+	};
+
+	std::map< uint32, RoomSeats_t > m_mapRooms;
+	uint32 m_nNextRoomId = 1;
+
+	// rooms that might have a free seat, checked newest first
+	std::vector< uint32 > m_vecOpenRooms;
+
+	// players waiting for an opponent. the pairs found each tick are handed out in one go.
+	Matchmaker m_matchmaker;
+	std::vector< Matchmaker::Match_t > m_vecMatches;
+	std::vector< HSteamNetConnection > m_vecOverdue;
+
+	// how long a queued player waits for a match before they are happy to take an open seat instead
+	static const SteamNetworkingMicroseconds k_usecOpenSeatWait = 5000000;
+
+	// which seat every session token belongs to
+	struct Session_t
+	{
+		uint32 m_nRoomId;
+		int m_nSeat;
+	};
+	std::map< uint64, Session_t > m_mapSessions;
+	std::mt19937_64 m_rngTokens{ std::random_device{}() };
+
+	// works out the bots' moves for all the shards
+	std::unique_ptr<BotPool> m_pBots;
+
+	// game logic threads, a room always lives on shard (id % number of shards)
+	std::vector< std::unique_ptr<RoomShard> > m_vecShards;
+
+	// nullptr without a journal file. the shards append as producers 0 to numShards - 1, the network thread as numShards.
+	std::unique_ptr<Journal> m_pJournal;
+	std::unique_ptr<CaptureWriter> m_pCapture;
+
+	// nullptr without a standby, fed by the same producers as the journal
+	std::unique_ptr<Replicator> m_pReplicator;
+
+	// outgoing messages for the current tick, built in buffers from our pool. every shard has a pool of its own.
+	MessageBatch m_outbox;
+	MessagePool *m_pPool = nullptr;
+	static const size_t k_nMaxPooledBuffers = 4096;
+
+	// board updates collected from the shards this tick, sent on to each room's spectators
+	std::vector< RoomBroadcast > m_vecBroadcasts;
+
+	// a client with more than this queued stops getting board and cursor updates, once it is down to the resume size
+	// it gets the newest board. one with more than the most pending is disconnected, that is still well under what
+	// the library will queue for a connection before it starts failing sends.
+	static const int k_cbBehindPending = 64 * 1024;
+	static const int k_cbResumePending = 4 * 1024;
+	static const int k_cbMaxPending = 256 * 1024;
+	static const SteamNetworkingMicroseconds k_usecSlowClientCheckInterval = 100000;
+	SteamNetworkingMicroseconds m_usecNextSlowClientCheck = 0;
+	int m_nClientsBehind = 0;
+
+	// how long a new connection has to send GAME_JOIN
+	static const SteamNetworkingMicroseconds k_usecJoinTimeout = 10000000;
+
+	// dropped messages a client may send in a burst and then every second before it counts as flooding
+	static const int k_nFloodBurst = 500;
+	static const int k_nFloodPerSecond = 10;
+
+	TokenBucket m_acceptBucket;
+
+	// our connection to the room directory and the first of the room ids it gave us, 0 until it has
+	HSteamNetConnection m_hDirectory = k_HSteamNetConnection_Invalid;
+	bool m_bDirectoryConnected = false;
+	uint32 m_nFirstRoomId = 0;
+	SteamNetworkingMicroseconds m_usecNextDirectoryReport = 0;
+	static const SteamNetworkingMicroseconds k_usecDirectoryReportInterval = 1000000;
+	static const SteamNetworkingMicroseconds k_usecDirectoryRetry = 2000000;
+
+	// our connection to the standby we replicate to
+	HSteamNetConnection m_hStandby = k_HSteamNetConnection_Invalid;
+	bool m_bStandbyConnected = false;
+	SteamNetworkingMicroseconds m_usecNextStandbyAttempt = 0;
+	static const SteamNetworkingMicroseconds k_usecStandbyRetry = 2000000;
+
+	// while we are a hot standby: the primary's connection to us, its rooms as of the newest batch and the batch to
+	// ack next tick. the primary sends at least one batch every quarter second, if it goes this long without one it is gone.
+	bool m_bStandingBy = false;
+	HSteamNetConnection m_hPrimary = k_HSteamNetConnection_Invalid;
+	std::map< uint32, JournalRoom > m_mapReplicaRooms;
+	uint32 m_nReplicaFirstRoomId = 0;
+	uint32 m_nReplicaNextRoomId = 0;
+	uint32 m_nReplicaBatchSeq = 0;
+	bool m_bReplicaAckDue = false;
+	SteamNetworkingMicroseconds m_usecLastReplicaBatch = 0;
+	static const SteamNetworkingMicroseconds k_usecPrimaryTimeout = 2000000;
+
+	// set when the tick handled any messages or connection changes so the scheduler polls again right away
+	bool m_bActivity = false;
+
+	// nothing connected to us, nothing we connected to and no timer to run
+	bool IsIdle() const
+	{
+		return m_mapClients.empty() && m_timers.Armed() == 0 && m_hDirectory == k_HSteamNetConnection_Invalid &&
+			m_hStandby == k_HSteamNetConnection_Invalid && m_hPrimary == k_HSteamNetConnection_Invalid;
+	}
+
+	// when the messages being relayed this tick were received, used to time how long a relay takes
+	std::vector<SteamNetworkingMicroseconds> m_vecRelayReceiveTimes;
+
+	MetricsRegistry m_metrics;
+
+	// what can be typed into the server's console, see RegisterCommands
+	CommandRegistry m_commands{ "Server" };
+
+	// messages and bytes by type, the last slot is for types we don't know
+	Counter *m_pMessagesIn[k_nNumMsgTypes + 1];
+	Counter *m_pBytesIn[k_nNumMsgTypes + 1];
+	Counter *m_pMessagesOut[k_nNumMsgTypes + 1];
+	Counter *m_pBytesOut[k_nNumMsgTypes + 1];
+
+	Counter *m_pConnectionsAccepted;
+	Counter *m_pConnectionsClosed;
+	Gauge *m_pConnections;
+	Gauge *m_pRooms;
+	Gauge *m_pSpectators;
+	Gauge *m_pSpectatorsBehind;
+	Counter *m_pSpectatorCatchUps;
+	Gauge *m_pPlayersBehind;
+	Counter *m_pPlayerCatchUps;
+	Counter *m_pUpdatesCoalesced;
+	Counter *m_pResyncs;
+	Counter *m_pConnectionsRejectedRate;
+	Counter *m_pConnectionsRejectedFull;
+	Counter *m_pConnectionsDroppedBehind;
+	Counter *m_pConnectionsDroppedJoinTimeout;
+	Counter *m_pConnectionsDroppedFlooding;
+	Counter *m_pMessagesLimited[k_nNumMsgTypes + 1];
+	Counter *m_pSessionsResumed;
+	Counter *m_pJournalRecords;
+	Counter *m_pBuffersAllocated;
+	Counter *m_pBuffersReused;
+	Counter *m_pJournalSyncs;
+	Counter *m_pReplicaRecords;
+	Counter *m_pReplicaMoves;
+	Counter *m_pReplicaBytes;
+	Counter *m_pReplicaBusyMicroseconds;
+	Counter *m_pReplicaSnapshots;
+	Gauge *m_pReplicaLag;
+	Counter *m_pReplicaRecordsApplied;
+	Counter *m_pMatchesFormed;
+	Gauge *m_pMatchmakingQueue;
+	Gauge *m_pTimersArmed;
+	Gauge *m_pBotRooms;
+	Counter *m_pBotMoves;
+	Counter *m_pBotMovesLate;
+	Counter *m_pBotBusyMicroseconds;
+	Gauge *m_pBotBusyPercent;
+	Gauge *m_pBotGamesPerCore;
+
+	Histogram *m_pTickDuration;
+	Histogram *m_pRelayLatency;
+	Histogram *m_pJournalSyncDuration;
+	Histogram *m_pReplicaAckTime;
+	Histogram *m_pMatchWait;
+	Histogram *m_pBotSearchDepth;
+	Histogram *m_pBotMoveDelay;
+
+	// per connection stats are sampled every k_usecConnectionSampleInterval, the histograms only hold the latest sample
+	Histogram *m_pConnectionPing;
+	Histogram *m_pConnectionRtt;
+	Histogram *m_pConnectionJitter;
+	SteamNetworkingMicroseconds m_usecNextPing = 0;
+	Histogram *m_pConnectionPendingBytes;
+	SteamNetworkingMicroseconds m_usecNextConnectionSample = 0;
+	uint64 m_nLastBotBusy = 0;
+	uint64 m_nLastBotMoves = 0;
+	SteamNetworkingMicroseconds m_usecNextMetricsWrite = 0;
+
+	static const SteamNetworkingMicroseconds k_usecConnectionSampleInterval = 1000000;
+
+	void RegisterMetrics()
+	{
+		for (int i = 0; i <= k_nNumMsgTypes; i++)
+			m_pMessagesIn[i] = &m_metrics.AddCounter("fourconnect_messages_received_total", "Messages received from clients by type.", std::string("type=\"") + MsgTypeName(i) + "\"");
+		for (int i = 0; i <= k_nNumMsgTypes; i++)
+			m_pBytesIn[i] = &m_metrics.AddCounter("fourconnect_bytes_received_total", "Message bytes received from clients by type.", std::string("type=\"") + MsgTypeName(i) + "\"");
+		for (int i = 0; i <= k_nNumMsgTypes; i++)
+			m_pMessagesOut[i] = &m_metrics.AddCounter("fourconnect_messages_sent_total", "Messages sent to clients by type.", std::string("type=\"") + MsgTypeName(i) + "\"");
+		for (int i = 0; i <= k_nNumMsgTypes; i++)
+			m_pBytesOut[i] = &m_metrics.AddCounter("fourconnect_bytes_sent_total", "Message bytes sent to clients by type.", std::string("type=\"") + MsgTypeName(i) + "\"");
+
+		m_pConnectionsAccepted = &m_metrics.AddCounter("fourconnect_connections_accepted_total", "Connections accepted.");
+		m_pConnectionsClosed = &m_metrics.AddCounter("fourconnect_connections_closed_total", "Connections closed by the peer or a local problem.");
+		m_pConnections = &m_metrics.AddGauge("fourconnect_connections", "Clients connected right now.");
+		m_pRooms = &m_metrics.AddGauge("fourconnect_rooms", "Rooms with at least one player.");
+		m_pSpectators = &m_metrics.AddGauge("fourconnect_spectators", "Connections watching a room.");
+		m_pSpectatorsBehind = &m_metrics.AddGauge("fourconnect_spectators_behind", "Spectators skipping updates because their send queue is full.");
+		m_pSessionsResumed = &m_metrics.AddCounter("fourconnect_sessions_resumed_total", "Players that reconnected and got their seat back.");
+		m_pMatchmakingQueue = &m_metrics.AddGauge("fourconnect_matchmaking_queued", "Players waiting for the matchmaker to find them an opponent.");
+		m_pTimersArmed = &m_metrics.AddGauge("fourconnect_timers_armed", "Join timeouts and held seats waiting to time out.");
+		m_pMatchesFormed = &m_metrics.AddCounter("fourconnect_matches_formed_total", "Pairs of players the matchmaker put in a new room.");
+		m_pBotRooms = &m_metrics.AddGauge("fourconnect_bot_rooms", "Rooms where a player is playing one of the server's bots.");
+		m_pBotMoves = &m_metrics.AddCounter("fourconnect_bot_moves_total", "Moves the server's bots made.");
+		m_pBotMovesLate = &m_metrics.AddCounter("fourconnect_bot_moves_late_total", "Bot moves that were finished after their deadline.");
+		m_pBotBusyMicroseconds = &m_metrics.AddCounter("fourconnect_bot_busy_us_total", "Time the bot threads spent working out moves.");
+		m_pBotBusyPercent = &m_metrics.AddGauge("fourconnect_bot_busy_percent", "Share of one core the bot threads spent searching over the last second.");
+		m_pBotGamesPerCore = &m_metrics.AddGauge("fourconnect_bot_games_per_core", "Bot games one core can play at full strength at the rate moves were asked for over the last second.");
+		m_pBotSearchDepth = &m_metrics.AddHistogram("fourconnect_bot_search_depth", "Moves ahead each bot move looked, lower when the bot threads are short of time.");
+		m_pBotMoveDelay = &m_metrics.AddHistogram("fourconnect_bot_move_delay_us", "Time from a bot's turn starting to its move being worked out.");
+		m_pSpectatorCatchUps = &m_metrics.AddCounter("fourconnect_spectator_catch_ups_total", "Times a lagging spectator was sent the newest board instead of what it missed.");
+		m_pPlayersBehind = &m_metrics.AddGauge("fourconnect_players_behind", "Players skipping board and cursor updates because their send queue is full.");
+		m_pPlayerCatchUps = &m_metrics.AddCounter("fourconnect_player_catch_ups_total", "Times a lagging player was sent the newest board instead of what it missed.");
+		m_pUpdatesCoalesced = &m_metrics.AddCounter("fourconnect_updates_coalesced_total", "Board and cursor updates not sent to lagging clients, they get the newest board once they catch up.");
+		m_pResyncs = &m_metrics.AddCounter("fourconnect_resyncs_total", "Whole boards sent to clients whose board no longer matched the moves they were sent.");
+		m_pConnectionsRejectedRate = &m_metrics.AddCounter("fourconnect_connections_rejected_total", "Connections turned away without being accepted.", "reason=\"rate\"");
+		m_pConnectionsRejectedFull = &m_metrics.AddCounter("fourconnect_connections_rejected_total", "Connections turned away without being accepted.", "reason=\"full\"");
+		m_pConnectionsDroppedBehind = &m_metrics.AddCounter("fourconnect_connections_dropped_total", "Connections the server closed itself.", "reason=\"behind\"");
+		m_pConnectionsDroppedJoinTimeout = &m_metrics.AddCounter("fourconnect_connections_dropped_total", "Connections the server closed itself.", "reason=\"join_timeout\"");
+		m_pConnectionsDroppedFlooding = &m_metrics.AddCounter("fourconnect_connections_dropped_total", "Connections the server closed itself.", "reason=\"flooding\"");
+		for (int i = 0; i <= k_nNumMsgTypes; i++)
+			m_pMessagesLimited[i] = &m_metrics.AddCounter("fourconnect_messages_rate_limited_total", "Messages dropped unread because the client sent too many of that type.", std::string("type=\"") + MsgTypeName(i) + "\"");
+
+		m_pTickDuration = &m_metrics.AddHistogram("fourconnect_tick_duration_us", "Time spent in server ticks that handled something, not counting the wait.");
+		m_pMatchWait = &m_metrics.AddHistogram("fourconnect_matchmaking_wait_us", "Time players spent queued before they were given a seat.");
+		m_pRelayLatency = &m_metrics.AddHistogram("fourconnect_relay_latency_us", "Time from a move or cursor update being received to the result being handed to the network library.");
+		m_pConnectionPing = &m_metrics.AddHistogram("fourconnect_connection_ping_ms", "Round trip time of each connection at the last sample.");
+		m_pConnectionRtt = &m_metrics.AddHistogram("fourconnect_connection_rtt_us", "Smoothed round trip time of our pings to each connection at the last sample.");
+		m_pConnectionJitter = &m_metrics.AddHistogram("fourconnect_connection_rtt_jitter_us", "Smoothed round trip time deviation of each connection at the last sample.");
+		m_pConnectionPendingBytes = &m_metrics.AddHistogram("fourconnect_connection_pending_bytes", "Bytes queued to send on each connection at the last sample.");
+
+		m_pBuffersAllocated = &m_metrics.AddCounter("fourconnect_message_buffers_allocated_total", "Outgoing message buffers allocated, flat once the pools have warmed up.");
+		m_pBuffersReused = &m_metrics.AddCounter("fourconnect_message_buffers_reused_total", "Outgoing message buffers taken from a pool instead of allocated.");
+
+		m_pJournalRecords = &m_metrics.AddCounter("fourconnect_journal_records_total", "Records written to the journal.");
+		m_pJournalSyncs = &m_metrics.AddCounter("fourconnect_journal_syncs_total", "Times the journal was synced to disk, each one covers everything written since the last.");
+		m_pJournalSyncDuration = &m_metrics.AddHistogram("fourconnect_journal_sync_us", "Time each journal sync took.");
+
+		m_pReplicaRecords = &m_metrics.AddCounter("fourconnect_replica_records_total", "Records sent to the hot standby.");
+		m_pReplicaMoves = &m_metrics.AddCounter("fourconnect_replica_moves_total", "Boards after a move sent to the hot standby, not counting snapshots.");
+		m_pReplicaBytes = &m_metrics.AddCounter("fourconnect_replica_bytes_total", "Bytes sent to the hot standby, snapshots included.");
+		m_pReplicaBusyMicroseconds = &m_metrics.AddCounter("fourconnect_replica_busy_us_total", "Time the network thread spent collecting and batching records for the hot standby.");
+		m_pReplicaSnapshots = &m_metrics.AddCounter("fourconnect_replica_snapshots_total", "Times the hot standby was sent every open room, when it connects or falls too far behind.");
+		m_pReplicaLag = &m_metrics.AddGauge("fourconnect_replica_lag_records", "Records the hot standby hasn't acked yet.");
+		m_pReplicaAckTime = &m_metrics.AddHistogram("fourconnect_replica_ack_us", "Time from a batch going to the hot standby to its ack.");
+		m_pReplicaRecordsApplied = &m_metrics.AddCounter("fourconnect_replica_records_applied_total", "Records from the primary applied while standing by.");
+	}
+
+	// replays the journal into mapRooms and starts it over with just those rooms
+	void OpenJournal(std::map< uint32, JournalRoom > &mapRooms)
+	{
+		SteamNetworkingMicroseconds usecStart = SteamNetworkingUtils()->GetLocalTimestamp();
+		int numRecords, numMoves;
+		if (!Journal::Replay(journalFile, mapRooms, numRecords, numMoves))
+			std::cout << "Failed to read all of the journal " << journalFile << std::endl;
+		double flSeconds = (SteamNetworkingUtils()->GetLocalTimestamp() - usecStart) / 1000000.0;
+
+		DropRoomsWithoutPlayers(mapRooms);
+
+		if (numRecords > 0)
+		{
+			std::cout << "Replayed " << numRecords << " journal records (" << numMoves << " moves) into " << mapRooms.size() << " rooms in " << flSeconds * 1000.0 << " ms, "
+				<< (flSeconds > 0 ? (int64)(numMoves / flSeconds) : 0) << " moves/s" << std::endl;
+		}
+
+		m_pJournal.reset(new Journal(*m_pJournalRecords, *m_pJournalSyncs, *m_pJournalSyncDuration));
+		if (!m_pJournal->Open(journalFile, numShards + 1, journalIntervalMs, mapRooms))
+		{
+			std::cout << "Failed to open the journal " << journalFile << ", running without one" << std::endl;
+			m_pJournal.reset();
+		}
+	}
+
+	// nobody can come back to a room without a token
+	static void DropRoomsWithoutPlayers(std::map< uint32, JournalRoom > &mapRooms)
+	{
+		for (auto it = mapRooms.begin(); it != mapRooms.end(); )
+		{
+			if (it->second.tokens[0] == 0 && it->second.tokens[1] == 0)
+				it = mapRooms.erase(it);
+			else
+				++it;
+		}
+	}
+
+	// the rooms from the journal with their players' seats held like they had just lost their connection
+	void RestoreRooms(const std::map< uint32, JournalRoom > &mapRooms)
+	{
+		SteamNetworkingMicroseconds usecExpires = SteamNetworkingUtils()->GetLocalTimestamp() + (SteamNetworkingMicroseconds)reconnectGraceSeconds * 1000000;
+		for (auto &it : mapRooms)
+		{
+			uint32 roomId = it.first;
+			RoomSeats_t &room = m_mapRooms[roomId];
+			for (int seat = 0; seat < 2; seat++)
+			{
+				uint64 token = it.second.tokens[seat];
+				if (token == 0)
+				{
+					m_vecOpenRooms.push_back(roomId);
+					continue;
+				}
+
+				room.m_tokens[seat] = token;
+				room.m_seatTimers[seat] = ScheduleSeatTimer(usecExpires, roomId, seat);
+				m_mapSessions[token] = Session_t{ roomId, seat };
+			}
+			m_nNextRoomId = std::max(m_nNextRoomId, roomId + 1);
+
+			RoomEvent event;
+			event.type = RoomEvent::Type::RESTORE;
+			event.roomId = roomId;
+			event.pBoard = it.second.hasBoard ? new JournalRecord(it.second.board) : nullptr;
+			ShardForRoom(roomId).Post(event);
+		}
+
+		if (!mapRooms.empty())
+			std::cout << "Holding the seats of " << m_mapSessions.size() << " players for " << reconnectGraceSeconds << " seconds" << std::endl;
+	}
+
+	void JournalSeat(uint32 roomId, int seat, uint64 token)
+	{
+		if (!m_pJournal && !m_pReplicator)
+			return;
+
+		JournalRecord record;
+		record.kind = JournalRecord::Kind::SEAT;
+		record.roomId = roomId;
+		record.seat = seat;
+		record.token = token;
+		AppendRecord(record);
+	}
+
+	void JournalClose(uint32 roomId)
+	{
+		if (!m_pJournal && !m_pReplicator)
+			return;
+
+		JournalRecord record;
+		record.kind = JournalRecord::Kind::CLOSE;
+		record.roomId = roomId;
+		AppendRecord(record);
+	}
+
+	// the network thread's records go to the journal and the standby as the producer after the last shard
+	void AppendRecord(const JournalRecord &record)
+	{
+		if (m_pJournal)
+			m_pJournal->Append((int)m_vecShards.size(), record);
+		if (m_pReplicator)
+			m_pReplicator->Append((int)m_vecShards.size(), record);
+	}
+
+	// how many of each message a client may send a second and in one burst, well above what our client ever sends.
+	// messages clients have no reason to send at all get the least.
+	static void MessageRateLimit(int type, double &perSecond, double &burst)
+	{
+		switch (type)
+		{
+		case DataPacket::MsgType::GAME_SELECTION:
+			perSecond = 3 * k_flDefaultSelectionSendRate;
+			break;
+		case DataPacket::MsgType::GAME_MOVE:
+		case DataPacket::MsgType::GAME_DATA:
+			perSecond = 50;
+			break;
+		case DataPacket::MsgType::PING:
+		case DataPacket::MsgType::PONG:
+			perSecond = 10;
+			break;
+		default:
+			perSecond = 5;
+			break;
+		}
+		burst = 2 * perSecond;
+	}
+
+	void InitMessageLimits(Client_t &client, SteamNetworkingMicroseconds now)
+	{
+		for (int i = 0; i <= k_nNumMsgTypes; i++)
+		{
+			double perSecond, burst;
+			MessageRateLimit(i, perSecond, burst);
+			client.m_messageLimits[i].Set(perSecond, burst, now);
+		}
+		client.m_floodAllowance.Set(k_nFloodPerSecond, k_nFloodBurst, now);
+	}
+
+	static int MsgTypeIndex(const SteamNetworkingMessage_t *pMsg)
+	{
+		if (pMsg->m_cbSize < (int)sizeof(DataPacket::MsgType))
+			return k_nNumMsgTypes;
+		int type = (int)((DataPacket*)pMsg->m_pData)->type;
+		return type >= 0 && type < k_nNumMsgTypes ? type : k_nNumMsgTypes;
+	}
+
+	// once a tick. samples every connection now and then and writes the metrics file when it is due.
+	void UpdateMetrics()
+	{
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+
+		m_pConnections->Set((int64)m_mapClients.size());
+		m_pRooms->Set((int64)m_mapRooms.size());
+
+		if (now >= m_usecNextConnectionSample)
+		{
+			m_pConnectionPing->Clear();
+			m_pConnectionPendingBytes->Clear();
+			m_pConnectionRtt->Clear();
+			m_pConnectionJitter->Clear();
+			for (auto &c : m_mapClients)
+			{
+				if (c.second.m_clock.Samples() > 0)
+				{
+					m_pConnectionRtt->Record(c.second.m_clock.Rtt());
+					m_pConnectionJitter->Record(c.second.m_clock.Jitter());
+				}
+
+				SteamNetworkingQuickConnectionStatus status;
+				if (!m_pInterface->GetQuickConnectionStatus(c.first, &status))
+					continue;
+				m_pConnectionPing->Record(status.m_nPing);
+				m_pConnectionPendingBytes->Record((int64)status.m_cbPendingReliable + status.m_cbPendingUnreliable);
+			}
+			// what the bots cost since the last sample. they use all the time they are given, so how busy the threads are
+			// says little. what a game costs at full strength is the rate its bot is asked for moves times the budget.
+			uint64 nBotBusy = m_pBotBusyMicroseconds->Get();
+			uint64 nBotMoves = m_pBotMoves->Get();
+			if (m_usecNextConnectionSample != 0)
+			{
+				SteamNetworkingMicroseconds usecElapsed = now - (m_usecNextConnectionSample - k_usecConnectionSampleInterval);
+				int64 nMoves = (int64)(nBotMoves - m_nLastBotMoves);
+				m_pBotBusyPercent->Set(usecElapsed > 0 ? (int64)(nBotBusy - m_nLastBotBusy) * 100 / usecElapsed : 0);
+				m_pBotGamesPerCore->Set(nMoves > 0 ? m_pBotRooms->Get() * usecElapsed / (nMoves * m_pBots->Budget()) : 0);
+			}
+			m_nLastBotBusy = nBotBusy;
+			m_nLastBotMoves = nBotMoves;
+
+			m_usecNextConnectionSample = now + k_usecConnectionSampleInterval;
+		}
+		scheduler.SetDeadline(m_usecNextConnectionSample);
+
+		if (!metricsFile.empty())
+		{
+			if (now >= m_usecNextMetricsWrite)
+			{
+				if (!m_metrics.WriteFile(metricsFile))
+					std::cout << "Failed to write metrics to " << metricsFile << std::endl;
+				m_usecNextMetricsWrite = now + (SteamNetworkingMicroseconds)std::max(1, metricsIntervalSeconds) * 1000000;
+			}
+			scheduler.SetDeadline(m_usecNextMetricsWrite);
+		}
+	}
+
+	// keeps the room directory up to date with where we are and how busy, connecting again whenever we lose it
+	void UpdateDirectory()
+	{
+		// a standby has nothing to offer until it takes over
+		if (directoryAddr.IsIPv6AllZeros() || m_bStandingBy)
+			return;
+
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+		if (m_hDirectory == k_HSteamNetConnection_Invalid && now >= m_usecNextDirectoryReport)
+		{
+			SteamNetworkingConfigValue_t opt;
+			opt.SetPtr(k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback);
+			m_hDirectory = m_pInterface->ConnectByIPAddress(directoryAddr, 1, &opt);
+			if (m_hDirectory == k_HSteamNetConnection_Invalid)
+				m_usecNextDirectoryReport = now + k_usecDirectoryRetry;
+		}
+		if (!m_bDirectoryConnected)
+		{
+			scheduler.SetDeadline(m_usecNextDirectoryReport);
+			return;
+		}
+
+		// all it ever sends back is our block of room ids
+		SteamNetworkingMessage_t *pIncomingMsgs[4];
+		int numMsgs;
+		while ((numMsgs = m_pInterface->ReceiveMessagesOnConnection(m_hDirectory, pIncomingMsgs, 4)) > 0)
+		{
+			for (int i = 0; i < numMsgs; i++)
+			{
+				DirectoryPacket *answer = (DirectoryPacket*)pIncomingMsgs[i]->m_pData;
+				if (pIncomingMsgs[i]->m_cbSize >= (int)sizeof(DirectoryPacket) && answer->type == DataPacket::MsgType::DIRECTORY_REPORT && answer->firstRoomId != 0)
+				{
+					// rooms we already have keep their ids, new ones come from the block
+					m_nFirstRoomId = answer->firstRoomId;
+					if (m_nNextRoomId < m_nFirstRoomId || m_nNextRoomId - m_nFirstRoomId >= k_nRoomIdsPerProcess / 2)
+						m_nNextRoomId = m_nFirstRoomId;
+					std::cout << "Registered with the room directory, rooms start at " << m_nFirstRoomId << std::endl;
+				}
+				pIncomingMsgs[i]->Release();
+			}
+		}
+
+		if (now >= m_usecNextDirectoryReport)
+		{
+			DirectoryPacket report;
+			report.addr = advertiseAddr;
+			report.connections = (int32)m_mapClients.size();
+			report.maxConnections = maxConnections;
+			report.rooms = (int32)m_mapRooms.size();
+			report.queued = m_matchmaker.Size();
+			report.firstRoomId = m_nFirstRoomId;
+			m_outbox.Add(m_hDirectory, &report, (uint32)sizeof(report), k_nSteamNetworkingSend_Reliable);
+			m_usecNextDirectoryReport = now + k_usecDirectoryReportInterval;
+		}
+		scheduler.SetDeadline(m_usecNextDirectoryReport);
+	}
+
+	void OnDirectoryConnectionChanged(SteamNetConnectionStatusChangedCallback_t *pInfo)
+	{
+		switch (pInfo->m_info.m_eState)
+		{
+		case k_ESteamNetworkingConnectionState_ClosedByPeer:
+		case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
+			if (m_bDirectoryConnected)
+				std::cout << "Lost the room directory (" << pInfo->m_info.m_szEndDebug << "), connecting again" << std::endl;
+			m_pInterface->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
+			m_hDirectory = k_HSteamNetConnection_Invalid;
+			m_bDirectoryConnected = false;
+			m_usecNextDirectoryReport = SteamNetworkingUtils()->GetLocalTimestamp() + k_usecDirectoryRetry;
+			break;
+
+		case k_ESteamNetworkingConnectionState_Connected:
+			m_bDirectoryConnected = true;
+			m_usecNextDirectoryReport = 0;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	// keeps our standby up to date, or while we are a standby acks what the primary sent and takes over once it goes quiet
+	void UpdateReplication()
+	{
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+		if (m_bStandingBy)
+		{
+			if (m_hPrimary == k_HSteamNetConnection_Invalid)
+				return;
+
+			// one ack a tick covers every batch that came in
+			if (m_bReplicaAckDue)
+			{
+				ReplicaAckPacket ack;
+				ack.batchSeq = m_nReplicaBatchSeq;
+				m_outbox.Add(m_hPrimary, &ack, (uint32)sizeof(ack), k_nSteamNetworkingSend_Reliable);
+				m_bReplicaAckDue = false;
+			}
+
+			// a primary that died without its connection closing
+			if (now - m_usecLastReplicaBatch > k_usecPrimaryTimeout)
+			{
+				m_pInterface->CloseConnection(m_hPrimary, 0, "Primary timed out", false);
+				m_hPrimary = k_HSteamNetConnection_Invalid;
+				TakeOver("no batch for too long");
+				return;
+			}
+			scheduler.SetDeadline(m_usecLastReplicaBatch + k_usecPrimaryTimeout);
+			return;
+		}
+
+		if (!m_pReplicator)
+			return;
+
+		if (m_hStandby == k_HSteamNetConnection_Invalid && now >= m_usecNextStandbyAttempt)
+		{
+			SteamNetworkingConfigValue_t opt;
+			opt.SetPtr(k_ESteamNetworkingConfig_Callback_ConnectionStatusChanged, (void*)SteamNetConnectionStatusChangedCallback);
+			m_hStandby = m_pInterface->ConnectByIPAddress(standbyAddr, 1, &opt);
+			if (m_hStandby == k_HSteamNetConnection_Invalid)
+				m_usecNextStandbyAttempt = now + k_usecStandbyRetry;
+		}
+
+		// all the standby ever sends back are acks
+		if (m_bStandbyConnected)
+		{
+			SteamNetworkingMessage_t *pIncomingMsgs[k_nMaxMessagesPerPoll];
+			int numMsgs;
+			while ((numMsgs = m_pInterface->ReceiveMessagesOnConnection(m_hStandby, pIncomingMsgs, k_nMaxMessagesPerPoll)) > 0)
+			{
+				for (int i = 0; i < numMsgs; i++)
+				{
+					ReplicaAckPacket *ack = (ReplicaAckPacket*)pIncomingMsgs[i]->m_pData;
+					if (pIncomingMsgs[i]->m_cbSize >= (int)sizeof(ReplicaAckPacket) && ack->type == DataPacket::MsgType::REPLICA_ACK)
+						m_pReplicator->HandleAck(ack->batchSeq);
+					pIncomingMsgs[i]->Release();
+				}
+			}
+		}
+
+		// the rings are drained whether the standby is there or not, what it missed comes with the snapshot
+		SteamNetworkingMicroseconds usecDue = m_pReplicator->Update(m_bStandbyConnected ? m_hStandby : k_HSteamNetConnection_Invalid, m_outbox, m_nFirstRoomId, m_nNextRoomId);
+		if (usecDue != 0)
+			scheduler.SetDeadline(usecDue);
+		if (m_hStandby == k_HSteamNetConnection_Invalid)
+			scheduler.SetDeadline(m_usecNextStandbyAttempt);
+	}
+
+	void OnStandbyConnectionChanged(SteamNetConnectionStatusChangedCallback_t *pInfo)
+	{
+		switch (pInfo->m_info.m_eState)
+		{
+		case k_ESteamNetworkingConnectionState_ClosedByPeer:
+		case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
+			if (m_bStandbyConnected)
+				std::cout << "Lost the hot standby (" << pInfo->m_info.m_szEndDebug << "), connecting again" << std::endl;
+			m_pInterface->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
+			m_hStandby = k_HSteamNetConnection_Invalid;
+			m_bStandbyConnected = false;
+			m_pReplicator->Disconnected();
+			m_usecNextStandbyAttempt = SteamNetworkingUtils()->GetLocalTimestamp() + k_usecStandbyRetry;
+			break;
+
+		case k_ESteamNetworkingConnectionState_Connected:
+			std::cout << "Replicating " << m_pReplicator->Rooms() << " rooms to the hot standby" << std::endl;
+			m_bStandbyConnected = true;
+			m_pReplicator->Connected();
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	void OnPrimaryConnectionChanged(SteamNetConnectionStatusChangedCallback_t *pInfo)
+	{
+		switch (pInfo->m_info.m_eState)
+		{
+		case k_ESteamNetworkingConnectionState_ClosedByPeer:
+		case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
+			m_pInterface->CloseConnection(pInfo->m_hConn, 0, nullptr, false);
+			m_hPrimary = k_HSteamNetConnection_Invalid;
+			if (m_bStandingBy)
+				TakeOver(pInfo->m_info.m_szEndDebug);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	// a connection from the primary's address that starts with a snapshot carrying our key while we stand by is the
+	// primary from then on, not a client. every local process shares an address, so the key is what really counts.
+	// anything else that sends a batch is closed.
+	bool AdoptPrimary(HSteamNetConnection conn, Client_t &client, ISteamNetworkingMessage *pIncomingMsg)
+	{
+		const ReplicaBatchPacket *batch = (const ReplicaBatchPacket*)pIncomingMsg->m_pData;
+		bool bFromPrimary = memcmp(client.m_addrRemote.m_ipv6, primaryAddr.m_ipv6, sizeof(primaryAddr.m_ipv6)) == 0;
+		bool bKeyMatches = pIncomingMsg->m_cbSize >= (int)offsetof(ReplicaBatchPacket, records) && batch->reset != 0 && ReplicaKeyMatches(*batch, replicaKey);
+		if (!bFromPrimary || !bKeyMatches)
+		{
+			char szAddr[SteamNetworkingIPAddr::k_cchMaxString];
+			client.m_addrRemote.ToString(szAddr, sizeof(szAddr), false);
+			std::cout << "Replication from " << szAddr << ", which isn't our primary (" << (bFromPrimary ? "wrong key" : "wrong address") << ")" << std::endl;
+			DropClient(conn, "Not our primary");
+			return false;
+		}
+
+		// it stops being a client the same way a closed connection does
+		LeaveRoom(conn, client);
+		m_timers.Cancel(client.m_nJoinTimer);
+		m_mapClients.erase(conn);
+		if (m_pCapture)
+			m_pCapture->Disconnect(conn);
+
+		if (m_hPrimary != k_HSteamNetConnection_Invalid)
+			m_pInterface->CloseConnection(m_hPrimary, 0, "Replaced by a new primary", false);
+		m_hPrimary = conn;
+		m_pInterface->SetConnectionName(conn, "Primary");
+		m_usecLastReplicaBatch = SteamNetworkingUtils()->GetLocalTimestamp();
+		std::cout << "A primary is replicating to us" << std::endl;
+		return true;
+	}
+
+	void HandleReplicaBatch(ISteamNetworkingMessage *pIncomingMsg)
+	{
+		ReplicaBatchPacket *batch = (ReplicaBatchPacket*)pIncomingMsg->m_pData;
+		if (pIncomingMsg->m_cbSize < (int)offsetof(ReplicaBatchPacket, records) || batch->type != DataPacket::MsgType::REPLICA_BATCH
+			|| batch->numRecords < 0 || batch->numRecords > k_nReplicaBatchRecords
+			|| pIncomingMsg->m_cbSize < (int)batch->size())
+			return;
+
+		if (batch->reset != 0)
+			m_mapReplicaRooms.clear();
+		for (int i = 0; i < batch->numRecords; i++)
+			Replicator::Apply(m_mapReplicaRooms, batch->records[i]);
+		m_pReplicaRecordsApplied->Add(batch->numRecords);
+
+		m_nReplicaFirstRoomId = batch->firstRoomId;
+		m_nReplicaNextRoomId = batch->nextRoomId;
+		m_nReplicaBatchSeq = batch->batchSeq;
+		m_bReplicaAckDue = true;
+		m_usecLastReplicaBatch = SteamNetworkingUtils()->GetLocalTimestamp();
+	}
+
+	// the primary is gone, its rooms are ours now with the seats held like after a restart from the journal
+	void TakeOver(const char *pszReason)
+	{
+		m_bStandingBy = false;
+		DropRoomsWithoutPlayers(m_mapReplicaRooms);
+		std::cout << "Lost the primary (" << pszReason << "), taking over its " << m_mapReplicaRooms.size() << " rooms" << std::endl;
+
+		// our own journal and standby start out with them
+		for (auto &room : m_mapReplicaRooms)
+		{
+			for (int seat = 0; seat < 2; seat++)
+			{
+				if (room.second.tokens[seat] != 0)
+					JournalSeat(room.first, seat, room.second.tokens[seat]);
+			}
+			if (room.second.hasBoard)
+				AppendRecord(room.second.board);
+		}
+
+		// new rooms carry on after the primary's, in its block if it had one
+		if (m_nReplicaFirstRoomId != 0)
+			m_nFirstRoomId = m_nReplicaFirstRoomId;
+		m_nNextRoomId = std::max(m_nNextRoomId, m_nReplicaNextRoomId);
+
+		RestoreRooms(m_mapReplicaRooms);
+		m_mapReplicaRooms.clear();
+	}
+
+	void PrintStats()
+	{
+		std::cout << m_mapClients.size() << " connections (" << m_pConnectionsAccepted->Get() << " accepted, " << m_pConnectionsClosed->Get() << " closed), " << m_mapRooms.size() << " rooms" << std::endl;
+		std::cout << "  " << m_pSpectators->Get() << " spectators, " << m_pSpectatorsBehind->Get() << " behind, " << m_pSpectatorCatchUps->Get() << " catch ups" << std::endl;
+		std::cout << "  " << m_pPlayersBehind->Get() << " players behind, " << m_pPlayerCatchUps->Get() << " catch ups, " << m_pUpdatesCoalesced->Get() << " updates coalesced, " << m_pResyncs->Get() << " resyncs" << std::endl;
+		std::cout << "  admission: " << m_pConnectionsRejectedRate->Get() << " turned away over the accept rate, " << m_pConnectionsRejectedFull->Get() << " when full, dropped " << m_pConnectionsDroppedBehind->Get() << " too far behind and " << m_pConnectionsDroppedJoinTimeout->Get() << " that never joined" << std::endl;
+		uint64 numLimited = 0;
+		for (int i = 0; i <= k_nNumMsgTypes; i++)
+			numLimited += m_pMessagesLimited[i]->Get();
+		std::cout << "  rate limits: " << numLimited << " messages dropped, " << m_pConnectionsDroppedFlooding->Get() << " clients disconnected for flooding" << std::endl;
+		for (int i = 0; i <= k_nNumMsgTypes; i++)
+		{
+			if (m_pMessagesIn[i]->Get() == 0 && m_pMessagesOut[i]->Get() == 0)
+				continue;
+			std::cout << "  " << MsgTypeName(i) << ": " << m_pMessagesIn[i]->Get() << " in (" << m_pBytesIn[i]->Get() << " bytes), " << m_pMessagesOut[i]->Get() << " out (" << m_pBytesOut[i]->Get() << " bytes)" << std::endl;
+		}
+		std::cout << "  matchmaking: " << m_pMatchmakingQueue->Get() << " waiting, " << m_pMatchesFormed->Get() << " matches, wait p50 " << m_pMatchWait->Percentile(50) / 1000 << " ms, p99 " << m_pMatchWait->Percentile(99) / 1000 << " ms, max " << m_pMatchWait->Max() / 1000 << " ms" << std::endl;
+		std::cout << "  bots: " << m_pBotRooms->Get() << " rooms, " << m_pBotMoves->Get() << " moves (" << m_pBotMovesLate->Get() << " late), depth p50 " << m_pBotSearchDepth->Percentile(50) << ", move delay p99 " << m_pBotMoveDelay->Percentile(99) / 1000 << " ms, " << m_pBotBusyPercent->Get() << "% busy, ~" << m_pBotGamesPerCore->Get() << " games per core at full strength" << std::endl;
+		std::cout << "  timers: " << m_pTimersArmed->Get() << " armed" << std::endl;
+		std::cout << "  message buffers: " << m_pBuffersAllocated->Get() << " allocated, " << m_pBuffersReused->Get() << " reused" << std::endl;
+		std::cout << "  tick: p50 " << m_pTickDuration->Percentile(50) << " us, p99 " << m_pTickDuration->Percentile(99) << " us, max " << m_pTickDuration->Max() << " us" << std::endl;
+		std::cout << "  relay: p50 " << m_pRelayLatency->Percentile(50) << " us, p99 " << m_pRelayLatency->Percentile(99) << " us, max " << m_pRelayLatency->Max() << " us" << std::endl;
+		std::cout << "  ping: p50 " << m_pConnectionPing->Percentile(50) << " ms, p99 " << m_pConnectionPing->Percentile(99) << " ms, max " << m_pConnectionPing->Max() << " ms" << std::endl;
+		std::cout << "  rtt: p50 " << m_pConnectionRtt->Percentile(50) << " us, p99 " << m_pConnectionRtt->Percentile(99) << " us, jitter p50 " << m_pConnectionJitter->Percentile(50) << " us" << std::endl;
+		std::cout << "  send queue: p50 " << m_pConnectionPendingBytes->Percentile(50) << " bytes, p99 " << m_pConnectionPendingBytes->Percentile(99) << " bytes, max " << m_pConnectionPendingBytes->Max() << " bytes" << std::endl;
+		if (m_pJournal)
+			std::cout << "  journal: " << m_pJournalRecords->Get() << " records, " << m_pJournalSyncs->Get() << " syncs, sync p50 " << m_pJournalSyncDuration->Percentile(50) << " us, p99 " << m_pJournalSyncDuration->Percentile(99) << " us" << (m_pJournal->Failed() ? ", FAILED" : "") << std::endl;
+		if (m_pReplicator)
+		{
+			uint64 numMoves = std::max((uint64)1, m_pReplicaMoves->Get());
+			std::cout << "  replication: " << (m_bStandbyConnected ? "connected" : "not connected") << ", " << m_pReplicator->Rooms() << " rooms, " << m_pReplicaMoves->Get() << " moves in " << m_pReplicaRecords->Get() << " records, "
+				<< m_pReplicaBytes->Get() / numMoves << " bytes and " << (double)m_pReplicaBusyMicroseconds->Get() / numMoves << " us per move, " << m_pReplicaSnapshots->Get() << " snapshots, "
+				<< m_pReplicaLag->Get() << " records unacked, ack p50 " << m_pReplicaAckTime->Percentile(50) << " us, p99 " << m_pReplicaAckTime->Percentile(99) << " us" << std::endl;
+		}
+		if (m_bStandingBy)
+		{
+			if (m_hPrimary == k_HSteamNetConnection_Invalid)
+				std::cout << "  standing by, no primary yet" << std::endl;
+			else
+				std::cout << "  standing by: " << m_mapReplicaRooms.size() << " rooms from the primary, " << m_pReplicaRecordsApplied->Get() << " records applied, last batch "
+					<< (SteamNetworkingUtils()->GetLocalTimestamp() - m_usecLastReplicaBatch) / 1000 << " ms ago" << std::endl;
+		}
+	}
+
+	// every client gets a ping once per k_usecPingInterval, all at the same time
+	void SendPings()
+	{
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+		if (now >= m_usecNextPing)
+		{
+			TimePacket ping;
+			ping.usecSent = now;
+			for (auto &c : m_mapClients)
+				m_outbox.Add(c.first, &ping, (uint32)sizeof(ping), k_nPingSendFlags);
+			m_usecNextPing = now + k_usecPingInterval;
+		}
+		scheduler.SetDeadline(m_usecNextPing);
+	}
+
+	// answer a client's ping or take the answer to ours. the receive time is when the library got it, not when we polled.
+	void HandleTimePacket(ISteamNetworkingMessage *pIncomingMsg, Client_t &client)
+	{
+		TimePacket *time = (TimePacket*)pIncomingMsg->m_pData;
+		if (time->type == DataPacket::MsgType::PING)
+		{
+			TimePacket pong = *time;
+			pong.type = DataPacket::MsgType::PONG;
+			pong.usecPeerReceived = pIncomingMsg->m_usecTimeReceived;
+			pong.usecPeerReplied = SteamNetworkingUtils()->GetLocalTimestamp();
+			m_outbox.Add(pIncomingMsg->m_conn, &pong, (uint32)sizeof(pong), k_nPingSendFlags);
+		}
+		else
+		{
+			client.m_clock.AddSample(time->usecSent, time->usecPeerReceived, time->usecPeerReplied, pIncomingMsg->m_usecTimeReceived);
+		}
+	}
+
+	void PrintPings()
+	{
+		for (auto &c : m_mapClients)
+		{
+			const ClockSync &clock = c.second.m_clock;
+			if (clock.Samples() == 0)
+				std::cout << c.second.m_sNick << ": no pongs yet" << std::endl;
+			else
+				std::cout << c.second.m_sNick << ": rtt " << clock.Rtt() << " us, jitter " << clock.Jitter() << " us, clock offset " << clock.Offset() << " us (" << clock.Samples() << " samples)" << std::endl;
+		}
+	}
+
+	RoomShard &ShardForRoom(uint32 roomId)
+	{
+		return *m_vecShards[roomId % m_vecShards.size()];
+	}
+
+	void FlushOutbox()
+	{
+		// collect what the shards finished, messages that were caused by a received one carry its receive time
+		for (auto &shard : m_vecShards)
+		{
+			if (shard->Drain(m_outbox, m_vecBroadcasts) > 0)
+				m_bActivity = true;
+		}
+		SendBroadcastsToSpectators();
+		CheckSlowClients();
+		if (m_nClientsBehind > 0)
+			CoalesceUpdatesForClientsBehind();
+		for (SteamNetworkingMessage_t *pMsg : m_outbox.Messages())
+		{
+			if (pMsg->m_nUserData != 0)
+				m_vecRelayReceiveTimes.push_back(pMsg->m_nUserData);
+
+			int type = MsgTypeIndex(pMsg);
+			m_pMessagesOut[type]->Add();
+			m_pBytesOut[type]->Add(pMsg->m_cbSize);
+		}
+
+		m_outbox.Flush();
+
+		// time from the library receiving a message to the relay being handed back to it
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+		for (SteamNetworkingMicroseconds usecReceived : m_vecRelayReceiveTimes)
+			m_pRelayLatency->Record(now - usecReceived);
+		m_vecRelayReceiveTimes.clear();
+	}
+
+	// the shards send board updates to the players, the spectators are sent the same payload from here
+	void SendBroadcastsToSpectators()
+	{
+		for (RoomBroadcast &broadcast : m_vecBroadcasts)
+		{
+			auto itRoom = m_mapRooms.find(broadcast.roomId);
+			if (itRoom == m_mapRooms.end())
+			{
+				// closed since the shard sent it
+				if (broadcast.pPayload != nullptr)
+					broadcast.pPayload->Release();
+				if (broadcast.pSnapshot != nullptr)
+					broadcast.pSnapshot->Release();
+				continue;
+			}
+			RoomSeats_t &room = itRoom->second;
+
+			// the shard evicted the room. its board goes too unless somebody is still watching, a spectator that comes
+			// along later has the shard read the room back for it.
+			if (broadcast.pPayload == nullptr)
+			{
+				if (room.m_vecSpectators.empty() && room.m_pSnapshot != nullptr)
+				{
+					room.m_pSnapshot->Release();
+					room.m_pSnapshot = nullptr;
+				}
+				continue;
+			}
+
+			for (size_t i = 0; i < room.m_vecSpectators.size(); )
+			{
+				HSteamNetConnection spectator = room.m_vecSpectators[i];
+				auto itClient = m_mapClients.find(spectator);
+				if (itClient == m_mapClients.end())
+				{
+					// gone without leaving the room, it has nothing to send to
+					room.m_vecSpectators[i] = room.m_vecSpectators.back();
+					room.m_vecSpectators.pop_back();
+					continue;
+				}
+				i++;
+				if (itClient->second.m_bBehind)
+					continue;
+
+				SteamNetworkingMessage_t *pMsg = broadcast.pPayload->CreateMessage(spectator, k_nSteamNetworkingSend_Reliable);
+				pMsg->m_nUserData = broadcast.usecReceived;
+				m_outbox.AddMessage(pMsg);
+			}
+
+			// the room keeps our reference to the whole board as its newest one
+			if (room.m_pSnapshot != nullptr)
+				room.m_pSnapshot->Release();
+			if (broadcast.pSnapshot != nullptr)
+			{
+				room.m_pSnapshot = broadcast.pSnapshot;
+				broadcast.pPayload->Release();
+			}
+			else
+			{
+				room.m_pSnapshot = broadcast.pPayload;
+			}
+		}
+		m_vecBroadcasts.clear();
+	}
+
+	// a client that can't keep up would make the library queue every update for it, so once too much is queued it
+	// stops getting boards and cursor updates and gets the newest whole board when it has caught up, so nothing it
+	// skipped is missed. one so far behind that even the rest piles up is disconnected, so it can't hold on to the
+	// server's memory (a connection that never joins times out in RunTimers).
+	void CheckSlowClients()
+	{
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+		if (now < m_usecNextSlowClientCheck)
+			return;
+		m_usecNextSlowClientCheck = now + k_usecSlowClientCheckInterval;
+
+		int numSpectators = 0;
+		int numSpectatorsBehind = 0;
+		int numPlayersBehind = 0;
+		std::vector< std::pair< HSteamNetConnection, const char* > > vecDrop;
+		for (auto &c : m_mapClients)
+		{
+			Client_t &client = c.second;
+			bool bSpectator = client.m_eRole == Client_t::Role::SPECTATOR;
+			if (bSpectator)
+				numSpectators++;
+
+			SteamNetworkingQuickConnectionStatus status;
+			if (!m_pInterface->GetQuickConnectionStatus(c.first, &status))
+				continue;
+			int cbPending = status.m_cbPendingReliable + status.m_cbPendingUnreliable;
+
+			if (cbPending > k_cbMaxPending)
+			{
+				vecDrop.emplace_back(c.first, "Too far behind");
+				m_pConnectionsDroppedBehind->Add();
+				continue;
+			}
+
+			if (!client.m_bBehind && cbPending > k_cbBehindPending)
+			{
+				client.m_bBehind = true;
+			}
+			else if (client.m_bBehind && cbPending <= k_cbResumePending)
+			{
+				client.m_bBehind = false;
+				auto itRoom = m_mapRooms.find(client.m_nRoomId);
+				if (itRoom != m_mapRooms.end() && (bSpectator || client.m_eRole == Client_t::Role::PLAYER))
+				{
+					SendSnapshot(c.first, itRoom->second);
+					(bSpectator ? m_pSpectatorCatchUps : m_pPlayerCatchUps)->Add();
+				}
+			}
+
+			if (client.m_bBehind)
+				(bSpectator ? numSpectatorsBehind : numPlayersBehind)++;
+		}
+
+		for (auto &drop : vecDrop)
+			DropClient(drop.first, drop.second);
+
+		m_nClientsBehind = numSpectatorsBehind + numPlayersBehind;
+		m_pSpectators->Set(numSpectators);
+		m_pSpectatorsBehind->Set(numSpectatorsBehind);
+		m_pPlayersBehind->Set(numPlayersBehind);
+	}
+
+	// takes the boards and cursor updates for clients that are behind out of this tick's messages
+	void CoalesceUpdatesForClientsBehind()
+	{
+		int numDropped = m_outbox.Drop([this](const SteamNetworkingMessage_t *pMsg) {
+			int type = MsgTypeIndex(pMsg);
+			if (type != DataPacket::MsgType::GAME_DATA && type != DataPacket::MsgType::GAME_DELTA && type != DataPacket::MsgType::GAME_SELECTION)
+				return false;
+			auto itClient = m_mapClients.find(pMsg->m_conn);
+			return itClient != m_mapClients.end() && itClient->second.m_bBehind;
+		});
+		m_pUpdatesCoalesced->Add(numDropped);
+	}
+
+	void SendSnapshot(HSteamNetConnection conn, RoomSeats_t &room)
+	{
+		if (room.m_pSnapshot != nullptr)
+			m_outbox.AddMessage(room.m_pSnapshot->CreateMessage(conn, k_nSteamNetworkingSend_Reliable));
+	}
+
+	void SendStringToClient(HSteamNetConnection conn, const char* str)
+	{
+		DataPacket data;
+		data.type = data.CONNECTION_STATUS;
+		data.msg = str;
+		m_outbox.Add(conn, &data, (uint32)sizeof(data), k_nSteamNetworkingSend_Reliable);
+	}
+
+	void SendStringToAllClients(std::string str, HSteamNetConnection except = k_HSteamNetConnection_Invalid)
+	{
+		for (auto &c : m_mapClients)
+		{
+			if (c.first != except)
+				SendStringToClient(c.first, str.c_str());
+		}
+	}
+
+	// find a free seat for a player that asked for a room, making a new room if it is full or gone
+	void AssignSeat(uint32 requestedRoomId, uint32 &roomId, int &seat)
+	{
+		roomId = 0;
+
+		auto itRequested = m_mapRooms.find(requestedRoomId);
+		if (itRequested != m_mapRooms.end())
+		{
+			for (int i = 0; i < 2 && roomId == 0; i++)
+			{
+				if (itRequested->second.SeatFree(i))
+				{
+					roomId = requestedRoomId;
+					seat = i;
+				}
+			}
+		}
+
+		// the directory names the rooms for its matches, the first of the pair makes it
+		if (roomId == 0 && itRequested == m_mapRooms.end() && IsDirectoryRoomId(requestedRoomId))
+		{
+			roomId = CreateRoom(requestedRoomId);
+			seat = 0;
+			m_vecOpenRooms.push_back(roomId);
+		}
+
+		if (roomId == 0 && !FindOpenSeat(roomId, seat))
+		{
+			roomId = CreateRoom();
+			seat = 0;
+			m_vecOpenRooms.push_back(roomId);
+		}
+	}
+
+	bool IsDirectoryRoomId(uint32 roomId)
+	{
+		return m_nFirstRoomId != 0 && roomId >= m_nFirstRoomId + k_nRoomIdsPerProcess / 2 && roomId - m_nFirstRoomId < k_nRoomIdsPerProcess;
+	}
+
+	// a free seat in a room that lost a player, false if there is none
+	bool FindOpenSeat(uint32 &roomId, int &seat)
+	{
+		while (!m_vecOpenRooms.empty())
+		{
+			auto itRoom = m_mapRooms.find(m_vecOpenRooms.back());
+			if (itRoom != m_mapRooms.end())
+			{
+				for (int i = 0; i < 2; i++)
+				{
+					if (itRoom->second.SeatFree(i))
+					{
+						roomId = itRoom->first;
+						seat = i;
+						return true;
+					}
+				}
+			}
 
-		std::cout << "Server commands include: '/quit' and '/test'" << std::endl;
+			// closed or full
+			m_vecOpenRooms.pop_back();
+		}
+		return false;
+	}
 
-		// Main server loop
-		while (!g_bQuit)
+	// a new id unless given one
+	uint32 CreateRoom(uint32 roomId = 0)
+	{
+		if (roomId == 0)
+			roomId = m_nNextRoomId++;
+
+		RoomEvent event;
+		event.type = RoomEvent::Type::CREATE;
+		event.roomId = roomId;
+		ShardForRoom(roomId).Post(event);
+		return roomId;
+	}
+
+	// give the seat to the connection with a new session token, the room sends the new player their color and the board
+	void SeatPlayer(HSteamNetConnection conn, Client_t &client, uint32 roomId, int seat)
+	{
+		RoomSeats_t &room = m_mapRooms[roomId];
+		room.m_players[seat] = conn;
+
+		// random so nobody can guess somebody else's, never 0 since that means no token
+		uint64 token;
+		do
 		{
-			PollIncomingMessages();
-			PollConnectionStateChanges();
-			PollLocalUserInput();
+			token = m_rngTokens();
+		} while (token == 0 || m_mapSessions.count(token) > 0);
+
+		room.m_tokens[seat] = token;
+		m_mapSessions[token] = Session_t{ roomId, seat };
+		JournalSeat(roomId, seat, token);
+
+		client.m_eRole = Client_t::Role::PLAYER;
+		client.m_nRoomId = roomId;
+		client.m_nSeat = seat;
+
+		// give a name based on the seat they took
+		std::string nick = "Player " + std::to_string(seat + 1) + " (room " + std::to_string(roomId) + ")";
+		SetClientNick(conn, nick.c_str());
+
+		RoomEvent event;
+		event.type = RoomEvent::Type::JOIN;
+		event.roomId = roomId;
+		event.seat = seat;
+		event.conn = conn;
+		event.token = token;
+		ShardForRoom(roomId).Post(event);
+	}
 
-			game.update();
+	// pair up whoever the matchmaker can and give every pair a room of its own. players that have waited a long time
+	// without a match take the free seat of a room whose other player is still there, if there is one, and after
+	// botWaitSeconds they play a bot.
+	void RunMatchmaking()
+	{
+		SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+		SteamNetworkingMicroseconds usecBotWait = (SteamNetworkingMicroseconds)botWaitSeconds * 1000000;
+		m_vecMatches.clear();
+		m_vecOverdue.clear();
+		SteamNetworkingMicroseconds usecOverdue = k_usecOpenSeatWait;
+		if (botWaitSeconds > 0 && usecBotWait < usecOverdue)
+			usecOverdue = usecBotWait;
+		m_matchmaker.FormMatches(now, usecOverdue, m_vecMatches, m_vecOverdue);
+
+		for (const Matchmaker::Match_t &match : m_vecMatches)
+		{
+			std::map< HSteamNetConnection, Client_t >::iterator itClients[2] = { m_mapClients.find(match.m_players[0]), m_mapClients.find(match.m_players[1]) };
+			if (itClients[0] == m_mapClients.end() && itClients[1] == m_mapClients.end())
+				continue;
 
-			//delay server update
-			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			// a player that went away still queued leaves an open seat for somebody else
+			uint32 roomId = CreateRoom();
+			for (int seat = 0; seat < 2; seat++)
+			{
+				if (itClients[seat] == m_mapClients.end())
+				{
+					m_vecOpenRooms.push_back(roomId);
+					continue;
+				}
+				SeatPlayer(match.m_players[seat], itClients[seat]->second, roomId, seat);
+				m_pMatchWait->Record(match.m_usecWaited[seat]);
+			}
+			m_pMatchesFormed->Add();
+			m_bActivity = true;
 		}
 
-		// Close all the connections
-		std::cout << "Closing connections..." << std::endl;
-		for (auto it : m_mapClients)
+		for (HSteamNetConnection conn : m_vecOverdue)
 		{
-			// Send them one more goodbye message
-			// SendStringToClient(it.first, "Server is shutting down.  Goodbye.");
+			auto itClient = m_mapClients.find(conn);
+			if (itClient == m_mapClients.end())
+			{
+				m_matchmaker.Remove(conn);
+				continue;
+			}
+			Client_t &client = itClient->second;
+			SteamNetworkingMicroseconds usecWaited = now - client.m_usecQueued;
 
-			// Close Connection
-			m_pInterface->CloseConnection(it.first, 0, "Server Shutdown", true);
-		}
-		// Reset and destroy vars
-		m_mapClients.clear();
+			uint32 roomId;
+			int seat;
+			if (usecWaited >= k_usecOpenSeatWait && FindOpenSeat(roomId, seat))
+			{
+				m_matchmaker.Remove(conn);
+				SeatPlayer(conn, client, roomId, seat);
+			}
+			else if (botWaitSeconds > 0 && usecWaited >= usecBotWait)
+			{
+				m_matchmaker.Remove(conn);
+				StartBotMatch(conn, client);
+			}
+			else
+			{
+				continue;
+			}
 
-		m_pInterface->CloseListenSocket(m_hListenSock);
-		m_hListenSock = k_HSteamListenSocket_Invalid;
+			m_pMatchWait->Record(usecWaited);
+			m_bActivity = true;
+		}
 
-		m_pInterface->DestroyPollGroup(m_hPollGroup);
-		m_hPollGroup = k_HSteamNetPollGroup_Invalid;
+		m_pMatchmakingQueue->Set(m_matchmaker.Size());
+		if (m_matchmaker.NextPass() != 0)
+			scheduler.SetDeadline(m_matchmaker.NextPass());
 	}
-private:
 
-	// Game vars
-	GameManager game;
+	// the player's connection is gone. the seat stays theirs for reconnectGraceSeconds in case they come back.
+	void ReleaseSeat(uint32 roomId, int seat)
+	{
+		auto itRoom = m_mapRooms.find(roomId);
+		if (itRoom == m_mapRooms.end())
+			return;
 
-	// Networking vars
-	HSteamListenSocket m_hListenSock;
-	HSteamNetPollGroup m_hPollGroup;
-	ISteamNetworkingSockets *m_pInterface;
+		itRoom->second.m_players[seat] = k_HSteamNetConnection_Invalid;
 
-	struct Client_t
-	{
-		std::string m_sNick;
-	};
+		RoomEvent event;
+		event.type = RoomEvent::Type::LEAVE;
+		event.roomId = roomId;
+		event.seat = seat;
+		ShardForRoom(roomId).Post(event);
 
-	std::map< HSteamNetConnection, Client_t > m_mapClients;
+		if (reconnectGraceSeconds <= 0)
+		{
+			FreeSeat(roomId, seat);
+			return;
+		}
 
-	void SendStringToClient(HSteamNetConnection conn, const char* str)
-	{
-		DataPacket data;
-		data.type = data.CONNECTION_STATUS;
-		data.msg = str;
-		m_pInterface->SendMessageToConnection(conn, &data, (uint32)sizeof(data), k_nSteamNetworkingSend_Reliable, nullptr);
+		SteamNetworkingMicroseconds usecExpires = SteamNetworkingUtils()->GetLocalTimestamp() + (SteamNetworkingMicroseconds)reconnectGraceSeconds * 1000000;
+		m_timers.Cancel(itRoom->second.m_seatTimers[seat]);
+		itRoom->second.m_seatTimers[seat] = ScheduleSeatTimer(usecExpires, roomId, seat);
 	}
 
-	void SendDataToClient(HSteamNetConnection conn, DataPacket *data) {
-		m_pInterface->SendMessageToConnection(conn, data, (uint32)sizeof(*data), k_nSteamNetworkingSend_Reliable, nullptr);
+	TimerId ScheduleSeatTimer(SteamNetworkingMicroseconds usecExpires, uint32 roomId, int seat)
+	{
+		Timer_t timer;
+		timer.m_eKind = Timer_t::Kind::SEAT;
+		timer.m_nRoomId = roomId;
+		timer.m_nSeat = seat;
+		return m_timers.Schedule(usecExpires, timer);
 	}
 
-	void SendCurrentDataToClient(HSteamNetConnection conn) {
-		// get the base packet
-		DataPacket data = convertBoardToPacket();
-		data.type = DataPacket::MsgType::GAME_DATA;
+	// nobody is coming back for this seat
+	void FreeSeat(uint32 roomId, int seat)
+	{
+		auto itRoom = m_mapRooms.find(roomId);
+		if (itRoom == m_mapRooms.end())
+			return;
 
-		// set scores
-		data.score1 = game.score1;
-		data.score2 = game.score2;
+		m_mapSessions.erase(itRoom->second.m_tokens[seat]);
+		itRoom->second.m_tokens[seat] = 0;
+		JournalSeat(roomId, seat, 0);
 
-		// send turn after the turn has been switched already.
-		data.currentTurn = game.currentTurn;
+		// throw the room away once both players are gone, otherwise somebody new can take the seat.
+		// nobody is waiting for a match against a bot.
+		if (itRoom->second.SeatFree(1 - seat) || itRoom->second.m_bBots[1 - seat])
+		{
+			if (itRoom->second.m_bBots[1 - seat])
+				m_pBotRooms->Add(-1);
 
-		// send to server
-		SendDataToClient(conn, &data);
-	}
+			RoomEvent event;
+			event.type = RoomEvent::Type::CLOSE;
+			event.roomId = roomId;
+			ShardForRoom(roomId).Post(event);
+			JournalClose(roomId);
 
-	void SendStringToAllClients(string str, HSteamNetConnection except = k_HSteamNetConnection_Invalid)
-	{
-		for (auto &c : m_mapClients)
+			// the spectators can join something else
+			for (HSteamNetConnection spectator : itRoom->second.m_vecSpectators)
+			{
+				auto itClient = m_mapClients.find(spectator);
+				if (itClient == m_mapClients.end())
+					continue;
+				Client_t &client = itClient->second;
+				client.m_eRole = Client_t::Role::NONE;
+				client.m_nRoomId = 0;
+				client.m_bBehind = false;
+				SendStringToClient(spectator, "The match you were watching is over.");
+			}
+
+			if (itRoom->second.m_pSnapshot != nullptr)
+				itRoom->second.m_pSnapshot->Release();
+			m_mapRooms.erase(itRoom);
+		}
+		else
 		{
-			if (c.first != except)
-				SendStringToClient(c.first, str.c_str());
+			m_vecOpenRooms.push_back(roomId);
 		}
 	}
 
-	void SendDataToAllClients(DataPacket *data, HSteamNetConnection except = k_HSteamNetConnection_Invalid)
+	// everything that timed out since the last tick: connections that never joined and seats whose players did not
+	// come back in time. only the timers that are due are looked at, however many are armed.
+	void RunTimers()
 	{
-		for (auto &c : m_mapClients)
+		m_timers.Advance(SteamNetworkingUtils()->GetLocalTimestamp(), m_vecExpiredTimers);
+		for (const Timer_t &timer : m_vecExpiredTimers)
 		{
-			if (c.first != except)
-				SendDataToClient(c.first, data);
+			if (timer.m_eKind == Timer_t::Kind::JOIN)
+			{
+				auto itClient = m_mapClients.find(timer.m_hConn);
+				if (itClient == m_mapClients.end() || itClient->second.m_nJoinTimer == 0)
+					continue;
+				m_pConnectionsDroppedJoinTimeout->Add();
+				DropClient(timer.m_hConn, "Did not join in time");
+			}
+			else
+			{
+				// the seat is still empty since this drop, a player that came back cancelled the timer
+				auto itRoom = m_mapRooms.find(timer.m_nRoomId);
+				if (itRoom == m_mapRooms.end() || itRoom->second.m_seatTimers[timer.m_nSeat] == 0)
+					continue;
+				itRoom->second.m_seatTimers[timer.m_nSeat] = 0;
+				if (itRoom->second.m_players[timer.m_nSeat] == k_HSteamNetConnection_Invalid)
+					FreeSeat(timer.m_nRoomId, timer.m_nSeat);
+			}
+			m_bActivity = true;
 		}
-	}
+		m_vecExpiredTimers.clear();
 
-	void SendCurrentDataToAllClients(HSteamNetConnection except = k_HSteamNetConnection_Invalid) {
-		for (auto &c : m_mapClients)
-		{
-			if (c.first != except)
-				SendCurrentDataToClient(c.first);
-		}
+		m_pTimersArmed->Set((int64)m_timers.Armed());
+		if (m_timers.NextDeadline() != 0)
+			scheduler.SetDeadline(m_timers.NextDeadline());
 	}
 
 	void PollIncomingMessages()
 	{
-		char temp[1024];
+		ISteamNetworkingMessage *pIncomingMsgs[k_nMaxMessagesPerPoll];
 
 		while (!g_bQuit)
 		{
-			ISteamNetworkingMessage *pIncomingMsg = nullptr;
-			int numMsgs = m_pInterface->ReceiveMessagesOnPollGroup(m_hPollGroup, &pIncomingMsg, 1);
+			// a shard that can't keep up leaves the rest in the library until it has taken what it was already given
+			if (!FlushShardBacklogs())
+			{
+				m_bActivity = true;
+				break;
+			}
+
+			int numMsgs = m_pInterface->ReceiveMessagesOnPollGroup(m_hPollGroup, pIncomingMsgs, k_nMaxMessagesPerPoll);
 			if (numMsgs == 0)
 				break;
 			if (numMsgs < 0)
+			{
 				std::cout << "Error checking for messages" << std::endl;
-			assert(numMsgs == 1 && pIncomingMsg);
-			auto itClient = m_mapClients.find(pIncomingMsg->m_conn);
-			assert(itClient != m_mapClients.end());
-
-			// Parse Data Recieve From Clients
-			DataPacket *data = (DataPacket*)pIncomingMsg->m_pData;
-			switch (data->type) {
-				// connection info
-				case DataPacket::MsgType::CONNECTION_STATUS: {
-					std::cout << "recieved connection data" << std::endl;
-					break;
-				}
-				// parse the outline piece recieved
-				case DataPacket::MsgType::GAME_SELECTION: {
-					// send the selected piece as opponent to all people except the one who sent it
-					SendDataToAllClients(data, pIncomingMsg->m_conn);
-					break;
-				}
-				// parse data recieved from clients (sorry it is not secure)
-				case DataPacket::MsgType::GAME_DATA: {
-					// if the current turn is set to the player that made the move
-					std::cout << "Recieved game data from client: " + m_mapClients[pIncomingMsg->m_conn].m_sNick << std::endl;
+				break;
+			}
 
-					game.board.setBoardToData(data);
+			m_bActivity = true;
 
-					game.setScores((int)data->score1, (int)data->score2);
+			// route the whole batch in one pass
+			for (int i = 0; i < numMsgs; i++)
+			{
+				// everything the client sent, even what gets turned away, so a replay gets the same treatment
+				if (m_pCapture)
+					m_pCapture->Message(pIncomingMsgs[i]);
 
-					if (data->currentTurn != 0) {
-						game.setTurnToInt(data->currentTurn);
-					}
+				// the shard releases the messages it is given
+				if (!RouteIncomingMessage(pIncomingMsgs[i]))
+					pIncomingMsgs[i]->Release();
+			}
+
+			// a partial batch means the queue is empty
+			if (numMsgs < k_nMaxMessagesPerPoll)
+				break;
+		}
+	}
+
+	// false if some shard still has events waiting for room in its inbox
+	bool FlushShardBacklogs()
+	{
+		bool bFlushed = true;
+		for (auto &shard : m_vecShards)
+		{
+			if (!shard->FlushBacklog())
+				bFlushed = false;
+		}
+		return bFlushed;
+	}
+
+	// check the message and pass it on to the shard that owns the client's room. returns false if it was not passed on.
+	bool RouteIncomingMessage(ISteamNetworkingMessage *pIncomingMsg)
+	{
+		// the primary we stand by for isn't a client and isn't held to their limits
+		if (pIncomingMsg->m_conn == m_hPrimary)
+		{
+			HandleReplicaBatch(pIncomingMsg);
+			return false;
+		}
+
+		// a connection replaced by a reconnect earlier in the same batch
+		auto itClient = m_mapClients.find(pIncomingMsg->m_conn);
+		if (itClient == m_mapClients.end())
+			return false;
+
+		// a primary introduces itself with its first batch
+		if (m_bStandingBy && pIncomingMsg->m_cbSize >= (int)sizeof(DataPacket::MsgType) && ((DataPacket*)pIncomingMsg->m_pData)->type == DataPacket::MsgType::REPLICA_BATCH)
+		{
+			if (AdoptPrimary(pIncomingMsg->m_conn, itClient->second, pIncomingMsg))
+				HandleReplicaBatch(pIncomingMsg);
+			return false;
+		}
+
+		int typeIndex = MsgTypeIndex(pIncomingMsg);
+		m_pMessagesIn[typeIndex]->Add();
+		m_pBytesIn[typeIndex]->Add(pIncomingMsg->m_cbSize);
+
+		// before anything else looks at it, so a client sending more than it should costs us as little as possible
+		if (!itClient->second.m_messageLimits[typeIndex].Take(pIncomingMsg->m_usecTimeReceived))
+		{
+			m_pMessagesLimited[typeIndex]->Add();
+			if (!itClient->second.m_floodAllowance.Take(pIncomingMsg->m_usecTimeReceived))
+			{
+				m_pConnectionsDroppedFlooding->Add();
+				DropClient(pIncomingMsg->m_conn, "Sending too many messages");
+			}
+			return false;
+		}
+
+		// too small to even hold the type
+		if (pIncomingMsg->m_cbSize < (int)sizeof(DataPacket::MsgType)) {
+			return false;
+		}
+
+		// Parse Data Recieve From Clients
+		DataPacket *data = (DataPacket*)pIncomingMsg->m_pData;
+
+		// everybody takes part in timing, joined or not
+		if (data->type == DataPacket::MsgType::PING || data->type == DataPacket::MsgType::PONG) {
+			if (pIncomingMsg->m_cbSize >= (int)sizeof(TimePacket)) {
+				HandleTimePacket(pIncomingMsg, itClient->second);
+			}
+			return false;
+		}
 
-					// send the updated board to all the users
-					SendCurrentDataToAllClients();
-					break;
+		// a board that went wrong, players and spectators both get the whole board again
+		if (data->type == DataPacket::MsgType::GAME_RESYNC) {
+			auto itRoom = m_mapRooms.find(itClient->second.m_nRoomId);
+			Client_t::Role role = itClient->second.m_eRole;
+			if ((role == Client_t::Role::PLAYER || role == Client_t::Role::SPECTATOR) && itRoom != m_mapRooms.end()) {
+				SendSnapshot(pIncomingMsg->m_conn, itRoom->second);
+				m_pResyncs->Add();
+			}
+			return false;
+		}
+
+		// only players get to change the game
+		if (data->type != DataPacket::MsgType::GAME_JOIN && itClient->second.m_eRole != Client_t::Role::PLAYER) {
+			return false;
+		}
+
+		switch (data->type) {
+			// wants to play or watch
+			case DataPacket::MsgType::GAME_JOIN: {
+				if (pIncomingMsg->m_cbSize < (int)sizeof(JoinPacket)) {
+					return false;
+				}
+				// players only come here when they can't reach the primary, they keep trying until we have taken over
+				if (m_bStandingBy) {
+					DropClient(pIncomingMsg->m_conn, "Standing by, not taking players yet");
+					return false;
+				}
+				HandleJoin(pIncomingMsg->m_conn, itClient->second, (JoinPacket*)pIncomingMsg->m_pData);
+				return false;
+			}
+			// connection info
+			case DataPacket::MsgType::CONNECTION_STATUS: {
+				std::cout << "recieved connection data" << std::endl;
+				return false;
+			}
+			// parse the outline piece recieved
+			case DataPacket::MsgType::GAME_SELECTION: {
+				if (pIncomingMsg->m_cbSize < (int)sizeof(SelectionPacket)) {
+					return false;
+				}
+
+				// drop updates that arrived after a newer one from the same client
+				SelectionPacket *selection = (SelectionPacket*)pIncomingMsg->m_pData;
+				if (!IsNewerSeq(selection->seq, itClient->second.m_nLastSelectionSeq)) {
+					return false;
+				}
+				itClient->second.m_nLastSelectionSeq = selection->seq;
+
+				// the other player goes by the seat's count, whoever sits in it
+				auto itRoom = m_mapRooms.find(itClient->second.m_nRoomId);
+				if (itRoom == m_mapRooms.end() || itClient->second.m_nSeat < 0 || itClient->second.m_nSeat > 1) {
+					return false;
+				}
+				selection->seq = ++itRoom->second.m_nSelectionSeqs[itClient->second.m_nSeat];
+				break;
+			}
+			// only ever the empty board, the room checks it
+			case DataPacket::MsgType::GAME_DATA: {
+				if (pIncomingMsg->m_cbSize < (int)sizeof(DataPacket)) {
+					return false;
 				}
-				// Recieved unknown data type
-				default: {
-					// std::cout << "Recieved data of no known type" << std::endl;
-					break;
+				break;
+			}
+			// a single piece, the room checks it
+			case DataPacket::MsgType::GAME_MOVE: {
+				if (pIncomingMsg->m_cbSize < (int)sizeof(MovePacket)) {
+					return false;
 				}
+				break;
+			}
+			// Recieved unknown data type
+			default: {
+				// std::cout << "Recieved data of no known type" << std::endl;
+				return false;
 			}
-			// std::cout << "Recieved game data from client: " << std::endl;
+		}
+
+		RoomEvent event;
+		event.type = RoomEvent::Type::MESSAGE;
+		event.roomId = itClient->second.m_nRoomId;
+		event.seat = itClient->second.m_nSeat;
+		event.conn = pIncomingMsg->m_conn;
+		event.pMsg = pIncomingMsg;
+		ShardForRoom(event.roomId).Post(event);
+		return true;
+	}
+
+	void HandleJoin(HSteamNetConnection conn, Client_t &client, JoinPacket *join)
+	{
+		m_timers.Cancel(client.m_nJoinTimer);
+		client.m_nJoinTimer = 0;
+
+		// already in a room or waiting for one
+		if (client.m_eRole != Client_t::Role::NONE)
+			return;
+
+		if (join->role == JoinPacket::Role::SPECTATOR)
+		{
+			JoinAsSpectator(conn, client, join->roomId);
+			return;
+		}
+
+		// coming back to a seat they still hold
+		if (join->sessionToken != 0 && ResumeSession(conn, client, join->sessionToken, join->lastSeq))
+			return;
+
+		// a room of their own choosing or a bot, otherwise they wait for the matchmaker to find them somebody
+		if (join->againstBot != 0)
+		{
+			StartBotMatch(conn, client);
+			return;
+		}
+		if (join->roomId != 0)
+		{
+			uint32 roomId;
+			int seat;
+			AssignSeat(join->roomId, roomId, seat);
+			SeatPlayer(conn, client, roomId, seat);
+			return;
+		}
+
+		client.m_eRole = Client_t::Role::QUEUED;
+		client.m_usecQueued = SteamNetworkingUtils()->GetLocalTimestamp();
+		m_matchmaker.Enqueue(conn, join->rating > 0 ? join->rating : k_nDefaultRating, client.m_usecQueued);
+		SendStringToClient(conn, "Looking for an opponent...");
+	}
+
+	// a new room with the player in the first seat and a bot in the other
+	void StartBotMatch(HSteamNetConnection conn, Client_t &client)
+	{
+		uint32 roomId = CreateRoom();
+		SeatPlayer(conn, client, roomId, 0);
+
+		m_mapRooms[roomId].m_bBots[1] = true;
+		m_pBotRooms->Add(1);
+
+		RoomEvent event;
+		event.type = RoomEvent::Type::BOT_JOIN;
+		event.roomId = roomId;
+		event.seat = 1;
+		ShardForRoom(roomId).Post(event);
+	}
+
+	// put the connection back in the seat the token belongs to and let the room catch it up.
+	// returns false if the token is unknown or expired or its room is gone, the client then joins like a new player.
+	bool ResumeSession(HSteamNetConnection conn, Client_t &client, uint64 token, uint32 lastSeq)
+	{
+		auto itSession = m_mapSessions.find(token);
+		if (itSession == m_mapSessions.end())
+			return false;
+
+		uint32 roomId = itSession->second.m_nRoomId;
+		int seat = itSession->second.m_nSeat;
+
+		// a session outliving its room has nothing to go back to, and operator[] would bring back an empty one
+		auto itRoom = m_mapRooms.find(roomId);
+		if (itRoom == m_mapRooms.end())
+		{
+			m_mapSessions.erase(itSession);
+			return false;
+		}
+		RoomSeats_t &room = itRoom->second;
 
-			// We don't need this anymore.
-			pIncomingMsg->Release();
+		// we may not have noticed the old connection is dead yet, the new one wins
+		HSteamNetConnection old = room.m_players[seat];
+		if (old != k_HSteamNetConnection_Invalid && old != conn)
+		{
+			std::cout << "Replacing the old connection of player " << seat + 1 << " in room " << roomId << std::endl;
+			m_pInterface->CloseConnection(old, 0, "Replaced by a new connection", false);
+			m_mapClients.erase(old);
+			m_pConnectionsClosed->Add();
+			if (m_pCapture)
+				m_pCapture->Disconnect(old);
 		}
+
+		room.m_players[seat] = conn;
+		m_timers.Cancel(room.m_seatTimers[seat]);
+		room.m_seatTimers[seat] = 0;
+
+		client.m_eRole = Client_t::Role::PLAYER;
+		client.m_nRoomId = roomId;
+		client.m_nSeat = seat;
+
+		std::string nick = "Player " + std::to_string(seat + 1) + " (room " + std::to_string(roomId) + ")";
+		SetClientNick(conn, nick.c_str());
+
+		RoomEvent event;
+		event.type = RoomEvent::Type::RESUME;
+		event.roomId = roomId;
+		event.seat = seat;
+		event.conn = conn;
+		event.token = token;
+		event.lastSeq = lastSeq;
+		ShardForRoom(roomId).Post(event);
+
+		m_pSessionsResumed->Add();
+		return true;
 	}
 
-	void PollLocalUserInput()
+	// spectators live only on the network thread, the shard never hears about them
+	void JoinAsSpectator(HSteamNetConnection conn, Client_t &client, uint32 requestedRoomId)
 	{
-		std::string cmd;
-		while (!g_bQuit && LocalUserInput_GetNext(cmd))
+		auto itRoom = m_mapRooms.find(requestedRoomId);
+
+		// the match with the most people watching, otherwise the oldest one with both players
+		if (requestedRoomId == 0)
 		{
-			if (strcmp(cmd.c_str(), "/quit") == 0)
+			for (auto it = m_mapRooms.begin(); it != m_mapRooms.end(); ++it)
 			{
-				g_bQuit = true;
-				std::cout << "Shutting down server" << std::endl;
-				break;
+				if (it->second.m_players[0] == k_HSteamNetConnection_Invalid || it->second.m_players[1] == k_HSteamNetConnection_Invalid)
+					continue;
+				if (itRoom == m_mapRooms.end() || it->second.m_vecSpectators.size() > itRoom->second.m_vecSpectators.size())
+					itRoom = it;
 			}
-			if (strcmp(cmd.c_str(), "/test") == 0)
-			{
-				SendStringToAllClients("Recieved test msg from server");
-				
-				std::cout << "Sent Test Messages" << std::endl;
+		}
 
-				break;
+		if (itRoom == m_mapRooms.end())
+		{
+			SendStringToClient(conn, "There is no match to watch right now.");
+			return;
+		}
+
+		client.m_eRole = Client_t::Role::SPECTATOR;
+		client.m_nRoomId = itRoom->first;
+		client.m_bBehind = false;
+		itRoom->second.m_vecSpectators.push_back(conn);
+
+		std::string nick = "Spectator (room " + std::to_string(itRoom->first) + ")";
+		SetClientNick(conn, nick.c_str());
+
+		DataPacket data;
+		data.type = data.GAME_SETUP;
+		data.assignedTurn = 0;
+		m_outbox.Add(conn, &data, (uint32)sizeof(data), k_nSteamNetworkingSend_Reliable);
+
+		// an evicted room's board comes with the broadcast once the shard has it back
+		if (itRoom->second.m_pSnapshot == nullptr)
+		{
+			RoomEvent event;
+			event.type = RoomEvent::Type::WATCH;
+			event.roomId = itRoom->first;
+			ShardForRoom(itRoom->first).Post(event);
+		}
+		SendSnapshot(conn, itRoom->second);
+	}
+
+	void RemoveSpectator(HSteamNetConnection conn, uint32 roomId)
+	{
+		auto itRoom = m_mapRooms.find(roomId);
+		if (itRoom == m_mapRooms.end())
+			return;
+
+		std::vector< HSteamNetConnection > &vecSpectators = itRoom->second.m_vecSpectators;
+		vecSpectators.erase(std::remove(vecSpectators.begin(), vecSpectators.end(), conn), vecSpectators.end());
+	}
+
+	// whatever the client was doing in its room
+	// for connections we close ourselves, the library doesn't tell us about those
+	void DropClient(HSteamNetConnection conn, const char *pszReason)
+	{
+		auto itClient = m_mapClients.find(conn);
+		if (itClient != m_mapClients.end())
+		{
+			std::cout << "Closing connection " << itClient->second.m_sNick << ": " << pszReason << std::endl;
+			LeaveRoom(conn, itClient->second);
+			m_mapClients.erase(itClient);
+			m_pConnectionsClosed->Add();
+		}
+		m_pInterface->CloseConnection(conn, 0, pszReason, false);
+		if (m_pCapture)
+			m_pCapture->Disconnect(conn);
+	}
+
+	void LeaveRoom(HSteamNetConnection conn, Client_t &client)
+	{
+		if (client.m_eRole == Client_t::Role::PLAYER)
+			ReleaseSeat(client.m_nRoomId, client.m_nSeat);
+		else if (client.m_eRole == Client_t::Role::SPECTATOR)
+			RemoveSpectator(conn, client.m_nRoomId);
+		else if (client.m_eRole == Client_t::Role::QUEUED)
+			m_matchmaker.Remove(conn);
+		client.m_eRole = Client_t::Role::NONE;
+	}
+
+	void RegisterCommands()
+	{
+		m_commands.Add("/quit", nullptr, [](const std::string &) {
+			g_bQuit = true;
+			std::cout << "Shutting down server" << std::endl;
+		});
+		m_commands.Add("/test", nullptr, [this](const std::string &) {
+			SendStringToAllClients("Recieved test msg from server");
+			std::cout << "Sent Test Messages" << std::endl;
+		});
+		// time between a move or cursor update reaching the server and the server sending it on
+		m_commands.Add("/latency", nullptr, [this](const std::string &) {
+			std::cout << "Relay latency over " << m_pRelayLatency->Count() << " messages: p50 " << m_pRelayLatency->Percentile(50) << " us, p99 " << m_pRelayLatency->Percentile(99) << " us" << std::endl;
+		});
+		m_commands.Add("/ping", nullptr, [this](const std::string &) {
+			PrintPings();
+		});
+		m_commands.Add("/rooms", nullptr, [this](const std::string &) {
+			std::cout << m_mapRooms.size() << " rooms, " << m_mapClients.size() << " players" << std::endl;
+			for (size_t i = 0; i < m_vecShards.size(); i++)
+				std::cout << "Shard " << i << ": " << m_vecShards[i]->roomCount.Get() << " rooms, " << m_vecShards[i]->roomsEvicted.Get() << " evicted, " << m_vecShards[i]->movesHandled.Get() << " moves handled" << std::endl;
+		});
+		m_commands.Add("/stats", nullptr, [this](const std::string &) {
+			PrintStats();
+		});
+		m_commands.Add("/kick", "ROOM SEAT", [this](const std::string &args) {
+			unsigned int roomId = 0;
+			int seat = 0;
+			if (sscanf(args.c_str(), "%u %d", &roomId, &seat) != 2 || (seat != 1 && seat != 2))
+			{
+				std::cout << "Usage: /kick ROOM SEAT, the seat is 1 or 2" << std::endl;
+				return;
 			}
+			KickPlayer((uint32)roomId, seat - 1);
+		});
+		m_commands.Add("/help", nullptr, [this](const std::string &) {
+			m_commands.PrintCommands();
+		});
+	}
+
+	// disconnects the player and gives their seat up for good, their token won't get them back in
+	void KickPlayer(uint32 roomId, int seat)
+	{
+		auto itRoom = m_mapRooms.find(roomId);
+		if (itRoom == m_mapRooms.end() || itRoom->second.m_players[seat] == k_HSteamNetConnection_Invalid)
+		{
+			std::cout << "Nobody is in seat " << seat + 1 << " of room " << roomId << std::endl;
+			return;
+		}
+
+		DropClient(itRoom->second.m_players[seat], "Kicked by the server");
 
-			// That's the only command we support
-			std::cout << "Server commands include: '/quit' and '/test'" << std::endl;
+		// without a reconnect grace the seat is already free, and the room may be gone with it
+		itRoom = m_mapRooms.find(roomId);
+		if (itRoom != m_mapRooms.end() && itRoom->second.m_tokens[seat] != 0)
+		{
+			m_timers.Cancel(itRoom->second.m_seatTimers[seat]);
+			itRoom->second.m_seatTimers[seat] = 0;
+			FreeSeat(roomId, seat);
 		}
 	}
 
@@ -259,7 +2162,26 @@ private:
 
 	void OnSteamNetConnectionStatusChanged(SteamNetConnectionStatusChangedCallback_t *pInfo)
 	{
-		char temp[1024];
+		m_bActivity = true;
+
+		// our own connection to the room directory, not a client
+		if (pInfo->m_hConn == m_hDirectory)
+		{
+			OnDirectoryConnectionChanged(pInfo);
+			return;
+		}
+
+		// the standby we replicate to, or the primary replicating to us
+		if (pInfo->m_hConn == m_hStandby)
+		{
+			OnStandbyConnectionChanged(pInfo);
+			return;
+		}
+		if (pInfo->m_hConn == m_hPrimary)
+		{
+			OnPrimaryConnectionChanged(pInfo);
+			return;
+		}
 
 		// What's the state of the connection?
 		switch (pInfo->m_info.m_eState)
@@ -287,14 +2209,12 @@ private:
 				if (pInfo->m_info.m_eState == k_ESteamNetworkingConnectionState_ProblemDetectedLocally)
 				{
 					pszDebugLogAction = "problem detected locally";
-					sprintf_s(temp, "Alas, %s hath fallen into shadow.  (%s)", itClient->second.m_sNick.c_str(), pInfo->m_info.m_szEndDebug);
 				}
 				else
 				{
 					// Note that here we could check the reason code to see if
 					// it was a "usual" connection or an "unusual" one.
 					pszDebugLogAction = "closed by peer";
-					sprintf_s(temp, "%s hath departed", itClient->second.m_sNick.c_str());
 				}
 
 				// Spew something to our own log.  Note that because we put their nick
@@ -302,14 +2222,27 @@ private:
 				// transport-specific data (e.g. their IP address)
 				std::cout << "Connection " << pInfo->m_info.m_szConnectionDescription << pszDebugLogAction << ", reason " << pInfo->m_info.m_eEndReason << ": " << pInfo->m_info.m_szEndDebug << std::endl;
 
+				// free the seat, the room tells the other player what happened
+				LeaveRoom(pInfo->m_hConn, itClient->second);
 				m_mapClients.erase(itClient);
-
-				// Send a message so everybody else knows what happened
-				SendStringToAllClients(temp);
+				m_pConnectionsClosed->Add();
+				if (m_pCapture)
+					m_pCapture->Disconnect(pInfo->m_hConn);
 			}
 			else
 			{
 				assert(pInfo->m_eOldState == k_ESteamNetworkingConnectionState_Connecting);
+
+				// accepted but gone before it finished connecting
+				auto itClient = m_mapClients.find(pInfo->m_hConn);
+				if (itClient != m_mapClients.end())
+				{
+					LeaveRoom(pInfo->m_hConn, itClient->second);
+					m_mapClients.erase(itClient);
+					m_pConnectionsClosed->Add();
+					if (m_pCapture)
+						m_pCapture->Disconnect(pInfo->m_hConn);
+				}
 			}
 
 			// Clean up the connection.  This is important!
@@ -327,15 +2260,23 @@ private:
 			// This must be a new connection
 			assert(m_mapClients.find(pInfo->m_hConn) == m_mapClients.end());
 
-			std::cout << "Connection request from " << pInfo->m_info.m_szConnectionDescription << std::endl;
-
-			// deny the request if the number of people in the server already is over two
-			if ((int)m_mapClients.size() + 1 > 2) {
-				// SendStringToClient(pInfo->m_hConn, "The server is currently full. Please wait or make another server on a different port or ip address.");
-				std::cout << "More than two clients attempting to connect." << std::endl;
+			// turned away before we spend anything on it, so a storm of connections can't take the server down
+			SteamNetworkingMicroseconds now = SteamNetworkingUtils()->GetLocalTimestamp();
+			if ((int)m_mapClients.size() >= maxConnections)
+			{
+				m_pInterface->CloseConnection(pInfo->m_hConn, 0, "Server full", false);
+				m_pConnectionsRejectedFull->Add();
+				break;
+			}
+			if (acceptRate > 0 && !m_acceptBucket.Take(now))
+			{
+				m_pInterface->CloseConnection(pInfo->m_hConn, 0, "Server busy, try again later", false);
+				m_pConnectionsRejectedRate->Add();
 				break;
 			}
 
+			std::cout << "Connection request from " << pInfo->m_info.m_szConnectionDescription << std::endl;
+
 			// A client is attempting to connect
 			// Try to accept the connection.
 			if (m_pInterface->AcceptConnection(pInfo->m_hConn) != k_EResultOK)
@@ -356,24 +2297,20 @@ private:
 				break;
 			}
 
-			// give a name based on the number of players connected to the server
-			string nick = "Player " + std::to_string(m_mapClients.size());
-
-			// send message to all players that somebody joined
-			SendStringToAllClients(nick + " joined the server. Current # of players on server: " + to_string((int)m_mapClients.size()), pInfo->m_hConn);
-
-			// send game setup info to the new connection so they know what turn they are
-			DataPacket data;
-			data.type = data.GAME_SETUP;
-			data.assignedTurn = ((int)m_mapClients.size()) % 2 + 1;
-			SendDataToClient(pInfo->m_hConn, &data);
-
-			// send current gamedata
-			SendCurrentDataToClient(pInfo->m_hConn);
-
-			// Add them to the client list, using std::map wacky syntax
-			m_mapClients[pInfo->m_hConn];
-			SetClientNick(pInfo->m_hConn, nick.c_str());
+			m_pConnectionsAccepted->Add();
+			if (m_pCapture)
+				m_pCapture->Connect(pInfo->m_hConn);
+
+			// Add them to the client list, using std::map wacky syntax.
+			// they get a seat or a room to watch once they send GAME_JOIN
+			SetClientNick(pInfo->m_hConn, "New connection");
+			Client_t &client = m_mapClients[pInfo->m_hConn];
+			client.m_addrRemote = pInfo->m_info.m_addrRemote;
+			Timer_t timer;
+			timer.m_eKind = Timer_t::Kind::JOIN;
+			timer.m_hConn = pInfo->m_hConn;
+			client.m_nJoinTimer = m_timers.Schedule(now + k_usecJoinTimeout, timer);
+			InitMessageLimits(client, now);
 			break;
 		}
 
@@ -400,32 +2337,6 @@ private:
 		s_pCallbackInstance = this;
 		m_pInterface->RunCallbacks();
 	}
-
-	// game stuff
-	// convert the pieces on the board to data 1's and 2's to represent red and blue respectivley.
-	// returns a datapacket with the int array converted to numbers
-	DataPacket convertBoardToPacket() {
-		DataPacket data;
-		data.type = DataPacket::MsgType::GAME_DATA;
-
-		for (int x = 0; x < 4; x++) {
-			for (int y = 0; y < 4; y++) {
-				for (int z = 0; z < 4; z++) {
-					if (game.board.data[x][y][z].type == Piece::Color::NONE) {
-						data.board[x][y][z] = 0;
-					}
-					if (game.board.data[x][y][z].type == Piece::Color::RED) {
-						data.board[x][y][z] = 1;
-					}
-					if (game.board.data[x][y][z].type == Piece::Color::BLUE) {
-						data.board[x][y][z] = 2;
-					}
-				}
-			}
-		}
-
-		return data;
-	}
 };
 
-#endif
+#endif
\ No newline at end of file
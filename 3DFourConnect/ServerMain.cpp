@@ -0,0 +1,115 @@
+// the dedicated server on its own, built from the rules, the networking and Tools without any of the graphics.
+// it needs nothing but GameNetworkingSockets so it runs on a box with no display, see the readme for how to build it.
+
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include "Tools.h"
+#include "Server.h"
+#include "ServerOptions.h"
+#include "Replayer.h"
+#include "Directory.h"
+
+Server *Server::s_pCallbackInstance = nullptr;
+
+Replayer *Replayer::s_pCallbackInstance = nullptr;
+
+Directory *Directory::s_pCallbackInstance = nullptr;
+
+void PrintUsageAndExit()
+{
+	std::cout << "The information entered was invalid.\n" <<
+		"Cmd argument usage:\n" <<
+		"3DFourConnectServer [server] " << k_pszServerUsage << "\n" <<
+		"3DFourConnectServer replay CAPTURE_FILE [--fast] (and the server options)\n" <<
+		"3DFourConnectServer directory [--port PORT] [--match-wait SECONDS]" << std::endl;
+	exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	ServerOptions options;
+	bool bReplay = false;
+	bool bDirectory = false;
+	std::string replayFile;
+	Replayer replayer;
+	Directory directory;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		// the same command line as the game exe works here too
+		if (i == 1 && !strcmp(argv[i], "server"))
+			continue;
+
+		// plays a capture back to a server in this process, for benchmarking a build
+		if (i == 1 && !strcmp(argv[i], "replay"))
+		{
+			bReplay = true;
+			continue;
+		}
+		if (bReplay && !strcmp(argv[i], "--fast"))
+		{
+			replayer.fast = true;
+			continue;
+		}
+
+		// sends players on to the servers that report to it instead of hosting matches itself
+		if (i == 1 && !strcmp(argv[i], "directory"))
+		{
+			bDirectory = true;
+			continue;
+		}
+		if (bDirectory && !strcmp(argv[i], "--match-wait"))
+		{
+			++i;
+			if (i >= argc)
+				PrintUsageAndExit();
+			directory.matchWaitSeconds = std::max(0, atoi(argv[i]));
+			continue;
+		}
+
+		bool bInvalid;
+		if (options.Parse(argc, argv, i, bInvalid))
+		{
+			if (bInvalid)
+				PrintUsageAndExit();
+			continue;
+		}
+
+		if (bReplay && replayFile.empty())
+		{
+			replayFile = argv[i];
+			continue;
+		}
+
+		PrintUsageAndExit();
+	}
+	if (bReplay && replayFile.empty())
+		PrintUsageAndExit();
+
+	InitSteamDatagramConnectionSockets();
+	LocalUserInput_Init();
+
+	if (bReplay)
+	{
+		options.RunOnLoopback([&](ITransport *pTransport, const SteamNetworkingIPAddr &addrLoopback, const Server &) {
+			replayer.transport = pTransport;
+			replayer.Run(replayFile, addrLoopback);
+		});
+	}
+	else if (bDirectory)
+	{
+		directory.Run((uint16)options.port);
+	}
+	else
+	{
+		options.Run();
+	}
+
+	LocalUserInput_Kill();
+	ShutdownSteamDatagramConnectionSockets();
+}
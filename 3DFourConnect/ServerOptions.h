@@ -0,0 +1,321 @@
+// the server's command line options, shared by the game exe ("3DFourConnect.exe server ...") and the
+// headless server build (ServerMain.cpp) so both take exactly the same flags.
+
+#ifndef SERVEROPTIONS_H
+#define SERVEROPTIONS_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <iostream>
+
+#include "Tools.h"
+#include "Server.h"
+#include "LoopbackTransport.h"
+
+// the server flags as they appear in the usage text
+static const char *k_pszServerUsage = "[--port PORT] [--tick fixed|adaptive|busy] [--threads N] [--metrics-file PATH] [--metrics-interval SECONDS] [--reconnect-grace SECONDS] [--journal PATH] [--journal-interval MS] [--evict-after SECONDS] [--bot-threads N] [--bot-budget MS] [--bot-wait SECONDS] [--capture PATH] [--accept-rate N] [--max-connections N] [--directory ADDR] [--advertise ADDR] [--standby ADDR] [--hot-standby --primary ADDR] [--replica-key KEY]";
+
+struct ServerOptions
+{
+	int port = DEFAULT_SERVER_PORT;
+	const char *tickMode = "adaptive";
+	int numShards = 0;
+	const char *metricsFile = "";
+	int metricsInterval = 10;
+	int reconnectGrace = 30;
+	const char *journalFile = "";
+	int journalInterval = 20;
+	int evictAfter = 10;
+	int botThreads = 1;
+	int botBudget = 50;
+	int botWait = 10;
+	const char *captureFile = "";
+	int acceptRate = 500;
+	int maxConnections = 10000;
+	SteamNetworkingIPAddr directoryAddr = {};
+	SteamNetworkingIPAddr advertiseAddr = {};
+	SteamNetworkingIPAddr standbyAddr = {};
+	bool hotStandby = false;
+	SteamNetworkingIPAddr primaryAddr = {};
+	const char *replicaKey = "";
+
+	// true if argv[i] is one of the server flags, i is left on its value.
+	// bInvalid is set if the value is missing or out of range.
+	bool Parse(int argc, const char *argv[], int &i, bool &bInvalid)
+	{
+		bInvalid = false;
+
+		if (!strcmp(argv[i], "--port"))
+		{
+			if (!NextArg(argc, i, bInvalid))
+				return true;
+			port = atoi(argv[i]);
+			if (port <= 0 || port > 65535)
+				std::cout << "Invalid port " << port << std::endl;
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--tick"))
+		{
+			if (NextArg(argc, i, bInvalid))
+				tickMode = argv[i];
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--threads"))
+		{
+			if (NextArg(argc, i, bInvalid))
+				numShards = atoi(argv[i]);
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--metrics-file"))
+		{
+			if (NextArg(argc, i, bInvalid))
+				metricsFile = argv[i];
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--metrics-interval"))
+		{
+			if (!NextArg(argc, i, bInvalid))
+				return true;
+			metricsInterval = atoi(argv[i]);
+			if (metricsInterval <= 0)
+				std::cout << "Invalid metrics interval " << metricsInterval << std::endl;
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--reconnect-grace"))
+		{
+			if (!NextArg(argc, i, bInvalid))
+				return true;
+			reconnectGrace = atoi(argv[i]);
+			bInvalid = reconnectGrace < 0;
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--journal"))
+		{
+			if (NextArg(argc, i, bInvalid))
+				journalFile = argv[i];
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--journal-interval"))
+		{
+			if (!NextArg(argc, i, bInvalid))
+				return true;
+			journalInterval = atoi(argv[i]);
+			bInvalid = journalInterval <= 0;
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--evict-after"))
+		{
+			if (!NextArg(argc, i, bInvalid))
+				return true;
+			evictAfter = atoi(argv[i]);
+			bInvalid = evictAfter < 0;
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--bot-threads"))
+		{
+			if (!NextArg(argc, i, bInvalid))
+				return true;
+			botThreads = atoi(argv[i]);
+			bInvalid = botThreads <= 0;
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--bot-budget"))
+		{
+			if (!NextArg(argc, i, bInvalid))
+				return true;
+			botBudget = atoi(argv[i]);
+			bInvalid = botBudget <= 0;
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--bot-wait"))
+		{
+			if (!NextArg(argc, i, bInvalid))
+				return true;
+			botWait = atoi(argv[i]);
+			bInvalid = botWait < 0;
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--capture"))
+		{
+			if (NextArg(argc, i, bInvalid))
+				captureFile = argv[i];
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--accept-rate"))
+		{
+			if (!NextArg(argc, i, bInvalid))
+				return true;
+			acceptRate = atoi(argv[i]);
+			bInvalid = acceptRate < 0;
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--max-connections"))
+		{
+			if (!NextArg(argc, i, bInvalid))
+				return true;
+			maxConnections = atoi(argv[i]);
+			bInvalid = maxConnections <= 0;
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--directory"))
+		{
+			if (NextArg(argc, i, bInvalid))
+				bInvalid = !ParseAddr(argv[i], directoryAddr, DEFAULT_SERVER_PORT);
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--advertise"))
+		{
+			if (NextArg(argc, i, bInvalid))
+				bInvalid = !ParseAddr(argv[i], advertiseAddr, 0);
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--standby"))
+		{
+			if (NextArg(argc, i, bInvalid))
+				bInvalid = !ParseAddr(argv[i], standbyAddr, DEFAULT_SERVER_PORT);
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--hot-standby"))
+		{
+			hotStandby = true;
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--primary"))
+		{
+			if (NextArg(argc, i, bInvalid))
+				bInvalid = !ParseAddr(argv[i], primaryAddr, 0);
+			return true;
+		}
+
+		if (!strcmp(argv[i], "--replica-key"))
+		{
+			if (NextArg(argc, i, bInvalid))
+			{
+				replicaKey = argv[i];
+				bInvalid = replicaKey[0] == 0 || strlen(replicaKey) >= (size_t)k_cchReplicaKey;
+			}
+			return true;
+		}
+
+		return false;
+	}
+
+	// runs a server with these options until it is told to quit, on the real network unless given a transport
+	void Run(ITransport *pTransport = nullptr) const
+	{
+		Server server;
+		Run(server, pTransport);
+	}
+
+	// the same with a server the caller can look at while it runs
+	void Run(Server &server, ITransport *pTransport) const
+	{
+		// anybody could replicate to a standby that doesn't know where its primary is
+		if (hotStandby && primaryAddr.IsIPv6AllZeros())
+		{
+			std::cout << "--hot-standby needs --primary ADDR, the address of the server replicating to it" << std::endl;
+			return;
+		}
+
+		// or anybody on the primary's machine, which is every process when they share one
+		if ((hotStandby || !standbyAddr.IsIPv6AllZeros()) && replicaKey[0] == 0)
+		{
+			std::cout << "--standby and --hot-standby need --replica-key KEY, the same on the server and its standby" << std::endl;
+			return;
+		}
+
+		server.transport = pTransport;
+		if (!server.scheduler.SetMode(tickMode))
+			std::cout << "Invalid tick mode " << tickMode << ", using adaptive" << std::endl;
+		server.numShards = numShards;
+		server.metricsFile = metricsFile;
+		server.metricsIntervalSeconds = metricsInterval;
+		server.reconnectGraceSeconds = reconnectGrace;
+		server.journalFile = journalFile;
+		server.journalIntervalMs = journalInterval;
+		server.evictAfterSeconds = evictAfter;
+		server.botThreads = botThreads;
+		server.botBudgetMs = botBudget;
+		server.botWaitSeconds = botWait;
+		server.captureFile = captureFile;
+		server.acceptRate = acceptRate;
+		server.maxConnections = maxConnections;
+		server.directoryAddr = directoryAddr;
+		server.advertiseAddr = advertiseAddr;
+		server.standbyAddr = standbyAddr;
+		server.hotStandby = hotStandby;
+		server.primaryAddr = primaryAddr;
+		server.replicaKey = replicaKey;
+		server.Run((uint16)port);
+	}
+
+	// runs a server on its own thread with the loopback transport and calls fn with a transport and address to reach
+	// it through, in process queues instead of sockets, and the server itself. the server is stopped once fn returns.
+	template <typename Fn>
+	void RunOnLoopback(Fn fn) const
+	{
+		LoopbackNetwork network;
+		LoopbackTransport serverTransport(network);
+		LoopbackTransport clientTransport(network);
+
+		Server server;
+		std::thread serverThread([&]() { Run(server, &serverTransport); });
+		while (!network.IsListening((uint16)port) && !g_bQuit)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		SteamNetworkingIPAddr addrServer;
+		addrServer.SetIPv4(0x7f000001, (uint16)port);
+		fn(&clientTransport, addrServer, (const Server &)server);
+
+		g_bQuit = true;
+		serverThread.join();
+	}
+
+private:
+	static bool NextArg(int argc, int &i, bool &bInvalid)
+	{
+		++i;
+		if (i >= argc)
+		{
+			bInvalid = true;
+			return false;
+		}
+		return true;
+	}
+
+	// nDefaultPort if the address has no port, 0 leaves it to the server
+	static bool ParseAddr(const char *pszAddr, SteamNetworkingIPAddr &addr, uint16 nDefaultPort)
+	{
+		if (!addr.ParseString(pszAddr))
+		{
+			std::cout << "Invalid address " << pszAddr << std::endl;
+			return false;
+		}
+		if (addr.m_port == 0)
+			addr.m_port = nDefaultPort;
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,91 @@
+// a message body that is serialised once and then sent to any number of connections.
+// every message made from it points at the same bytes instead of holding its own copy,
+// the networking library drops one reference when it is done with each message and the last one frees the buffer.
+
+#ifndef SHAREDPAYLOAD_H
+#define SHAREDPAYLOAD_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <atomic>
+#include <new>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include "MessagePool.h"
+
+class SharedPayload {
+public:
+	// copies the data in, the caller holds the first reference. the memory comes from pPool if there is one and it fits,
+	// only the thread that owns the pool may create from it but any thread can release.
+	static SharedPayload *Create(const void *pData, uint32 cbData, MessagePool *pPool = nullptr) {
+		void *pMemory = pPool != nullptr ? pPool->AllocateBlock(k_cbHeader + cbData) : nullptr;
+		bool bPooled = pMemory != nullptr;
+		if (!bPooled) {
+			pMemory = malloc(k_cbHeader + cbData);
+		}
+		SharedPayload *pPayload = new (pMemory) SharedPayload(cbData, bPooled);
+		memcpy(pPayload->Data(), pData, cbData);
+		return pPayload;
+	}
+
+	// a message for one connection that shares this payload, it holds its own reference until the library releases it.
+	// safe to call from any thread.
+	SteamNetworkingMessage_t *CreateMessage(HSteamNetConnection conn, int nSendFlags) {
+		AddRef();
+
+		SteamNetworkingMessage_t *pMsg = SteamNetworkingUtils()->AllocateMessage(0);
+		pMsg->m_pData = Data();
+		pMsg->m_cbSize = (int)m_cbSize;
+		pMsg->m_pfnFreeData = FreeMessageData;
+		pMsg->m_conn = conn;
+		pMsg->m_nFlags = nSendFlags;
+
+		return pMsg;
+	}
+
+	void AddRef() {
+		m_nRefs.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void Release() {
+		if (m_nRefs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			bool bPooled = m_bPooled;
+			this->~SharedPayload();
+			if (bPooled) {
+				MessagePool::FreeBlock(this);
+			}
+			else {
+				free(this);
+			}
+		}
+	}
+
+	void *Data() {
+		return (char*)this + k_cbHeader;
+	}
+
+	uint32 Size() {
+		return m_cbSize;
+	}
+
+private:
+	// the data starts right after the header, rounded up so it stays aligned for the packet structs
+	static const size_t k_cbHeader = 32;
+
+	std::atomic<int> m_nRefs;
+	uint32 m_cbSize;
+	bool m_bPooled;
+
+	SharedPayload(uint32 cbSize, bool bPooled) : m_nRefs(1), m_cbSize(cbSize), m_bPooled(bPooled) {}
+
+	// m_pfnFreeData of every message made by CreateMessage, can run on the library's own thread
+	static void FreeMessageData(SteamNetworkingMessage_t *pMsg) {
+		SharedPayload *pPayload = (SharedPayload*)((char*)pMsg->m_pData - k_cbHeader);
+		pPayload->Release();
+	}
+};
+
+#endif
@@ -0,0 +1,105 @@
+// decides how long the server loop waits between polls.
+// the networking library has no way to wake us up when a packet comes in, so instead of a fixed sleep
+// the loop polls again right away while there is traffic and backs off while it is quiet, to no more than
+// usecMaxWait. that is the most a message can wait to be picked up while anybody is connected. a server with no
+// connections and no timers armed has nothing to be quick for and backs off to usecMaxIdleWait, so it hardly wakes
+// at all, and the first connection is all that waits for it.
+// a quiet wait never goes past the next timer deadline and is cut short when a console line comes in.
+
+#ifndef TICKSCHEDULER_H
+#define TICKSCHEDULER_H
+
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include "Tools.h"
+
+class TickScheduler {
+public:
+	// FIXED is the old 10 ms sleep, BUSY_POLL never sleeps (costs a whole core but adds no latency)
+	enum Mode { FIXED, ADAPTIVE, BUSY_POLL };
+	Mode mode;
+
+	// the first quiet wait after some activity, doubles every quiet tick after that
+	SteamNetworkingMicroseconds usecMinWait;
+	// longest quiet wait, this is the most latency a message can pick up
+	SteamNetworkingMicroseconds usecMaxWait;
+	// longest quiet wait while the server is idle
+	SteamNetworkingMicroseconds usecMaxIdleWait;
+
+	TickScheduler() {
+		mode = Mode::ADAPTIVE;
+
+		usecMinWait = 100;
+		usecMaxWait = 1000;
+		usecMaxIdleWait = 100000;
+
+		m_usecWait = usecMinWait;
+		m_usecDeadline = 0;
+	}
+
+	// parse the name used on the command line, returns false if it is not a known mode
+	bool SetMode(const char *pszMode) {
+		if (!strcmp(pszMode, "fixed"))
+			mode = Mode::FIXED;
+		else if (!strcmp(pszMode, "adaptive"))
+			mode = Mode::ADAPTIVE;
+		else if (!strcmp(pszMode, "busy"))
+			mode = Mode::BUSY_POLL;
+		else
+			return false;
+		return true;
+	}
+
+	// something has to run at this time, the next wait will not go past it. the earliest deadline set before a wait wins.
+	void SetDeadline(SteamNetworkingMicroseconds usecDeadline) {
+		if (m_usecDeadline == 0 || usecDeadline < m_usecDeadline)
+			m_usecDeadline = usecDeadline;
+	}
+
+	// called once at the end of every loop. bActivity says if the tick handled any messages or connection changes,
+	// bIdle that there is no connection and no timer.
+	void Wait(bool bActivity, bool bIdle) {
+		SteamNetworkingMicroseconds usecDeadline = m_usecDeadline;
+		m_usecDeadline = 0;
+
+		if (mode == Mode::FIXED) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			return;
+		}
+
+		if (mode == Mode::BUSY_POLL) {
+			std::this_thread::yield();
+			return;
+		}
+
+		// more is probably coming so look again straight away
+		if (bActivity) {
+			m_usecWait = usecMinWait;
+			return;
+		}
+
+		SteamNetworkingMicroseconds usecMax = bIdle ? usecMaxIdleWait : usecMaxWait;
+		SteamNetworkingMicroseconds usecWait = std::min(m_usecWait, usecMax);
+		m_usecWait = std::min(usecWait * 2, usecMax);
+
+		if (usecDeadline != 0) {
+			SteamNetworkingMicroseconds usecUntilDeadline = usecDeadline - SteamNetworkingUtils()->GetLocalTimestamp();
+			usecWait = std::max((SteamNetworkingMicroseconds)0, std::min(usecWait, usecUntilDeadline));
+		}
+
+		if (usecWait > 0)
+			LocalUserInput_Wait(usecWait);
+	}
+
+private:
+	SteamNetworkingMicroseconds m_usecWait;
+	SteamNetworkingMicroseconds m_usecDeadline;
+};
+
+#endif
@@ -0,0 +1,256 @@
+// timeouts for the server loop that cost nothing until they go off, however many are armed.
+// a hierarchical timing wheel: four levels of 64 slots, the first a millisecond a slot and every level above 64 times
+// coarser. a timer goes in the finest level its time fits in and moves down a level each time the slot it is in comes
+// round, so arming and cancelling are O(1) and a tick only looks at the slots whose time has come.
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+#include "Tools.h"
+
+// T is whatever the owner needs to tell its timers apart, it is handed back when the timer goes off
+template <typename T>
+class TimerWheel {
+public:
+	// identifies an armed timer, 0 is never one. stays safe to cancel after the timer went off.
+	typedef uint64 TimerId;
+
+	// the wheel counts from usecNow, nothing it is given may be earlier
+	void Start(SteamNetworkingMicroseconds usecNow) {
+		m_nNow = (uint64)usecNow / k_usecPerTick;
+	}
+
+	// goes off in the first Advance at or after usecWhen, never early and at most a millisecond late
+	TimerId Schedule(SteamNetworkingMicroseconds usecWhen, const T &value) {
+		uint32 index;
+		if (m_nFreeHead != k_nNone) {
+			index = m_nFreeHead;
+			m_nFreeHead = m_vecNodes[index].next;
+		}
+		else {
+			index = (uint32)m_vecNodes.size();
+			m_vecNodes.emplace_back();
+		}
+
+		Node_t &node = m_vecNodes[index];
+		node.value = value;
+		node.tick = ((uint64)std::max(usecWhen, (SteamNetworkingMicroseconds)0) + k_usecPerTick - 1) / k_usecPerTick;
+		node.armed = true;
+		Insert(index);
+		m_nArmed++;
+		return ((TimerId)node.generation << 32) | index;
+	}
+
+	// false if it already went off or was cancelled
+	bool Cancel(TimerId id) {
+		uint32 index = (uint32)id;
+		if (id == 0 || index >= m_vecNodes.size()) {
+			return false;
+		}
+		Node_t &node = m_vecNodes[index];
+		if (!node.armed || node.generation != (uint32)(id >> 32)) {
+			return false;
+		}
+		Unlink(index);
+		Free(index);
+		return true;
+	}
+
+	// appends the value of every timer due by usecNow to vecExpired, a millisecond at a time. empty stretches are skipped
+	// straight over, a call costs the slots that had something in them and not the time since the last one.
+	void Advance(SteamNetworkingMicroseconds usecNow, std::vector<T> &vecExpired) {
+		uint64 target = (uint64)usecNow / k_usecPerTick;
+		while (m_nNow < target) {
+			uint64 next = NextTick();
+			if (next > target) {
+				m_nNow = target;
+				break;
+			}
+			m_nNow = next;
+
+			// the coarse slots that came round move down first, then the finest one goes off
+			int numLevels = 1;
+			while (numLevels < k_nLevels && (m_nNow & ((1ull << (k_nSlotBits * numLevels)) - 1)) == 0) {
+				numLevels++;
+			}
+			for (int level = numLevels - 1; level >= 1; level--) {
+				Cascade(level, vecExpired);
+			}
+			Expire(SlotOf(0, m_nNow), vecExpired);
+		}
+	}
+
+	// when Advance next has something to do, 0 if nothing is armed. a timer in a coarse slot makes this the time its
+	// slot comes round, which can be before the timer itself. the wait until then is never too long, only sometimes short.
+	SteamNetworkingMicroseconds NextDeadline() const {
+		if (m_nArmed == 0) {
+			return 0;
+		}
+		return (SteamNetworkingMicroseconds)(NextTick() * k_usecPerTick);
+	}
+
+	size_t Armed() const {
+		return m_nArmed;
+	}
+
+private:
+	static const int k_nSlotBits = 6;
+	static const int k_nSlots = 1 << k_nSlotBits;
+	static const int k_nLevels = 4;
+	static const uint64 k_usecPerTick = 1000;
+	static const uint32 k_nNone = 0xffffffff;
+
+	// a timer further off than the top level reaches (about four and a half hours) waits in its furthest slot and
+	// is put back in from there
+	static const uint64 k_nMaxSpan = 1ull << (k_nSlotBits * k_nLevels);
+
+	struct Node_t
+	{
+		T value = T();
+		uint64 tick = 0;
+		uint32 prev = k_nNone;
+		uint32 next = k_nNone;
+		// which slot list the node is on, for unlinking
+		uint16 level = 0;
+		uint16 slot = 0;
+		uint32 generation = 1;
+		bool armed = false;
+	};
+
+	// nodes are reused through the free list, a cancelled or expired one gets a new generation so old ids miss
+	std::vector<Node_t> m_vecNodes;
+	uint32 m_nFreeHead = k_nNone;
+	size_t m_nArmed = 0;
+
+	uint32 m_heads[k_nLevels][k_nSlots] = {};
+	// a bit per slot that has anything in it, so finding the next busy slot doesn't walk empty ones
+	uint64 m_occupied[k_nLevels] = {};
+
+	// every tick up to and including this one has gone off
+	uint64 m_nNow = 0;
+
+	// the heads start out empty without needing a constructor
+	uint32 Head(int level, int slot) const {
+		return (m_occupied[level] >> slot) & 1 ? m_heads[level][slot] : k_nNone;
+	}
+
+	static int SlotOf(int level, uint64 tick) {
+		return (int)((tick >> (k_nSlotBits * level)) & (k_nSlots - 1));
+	}
+
+	void Insert(uint32 index) {
+		Node_t &node = m_vecNodes[index];
+
+		// already due goes off on the next tick
+		uint64 tick = std::max(node.tick, m_nNow + 1);
+		uint64 delta = std::min(tick - m_nNow, k_nMaxSpan - 1);
+		tick = m_nNow + delta;
+
+		int level = 0;
+		while (level < k_nLevels - 1 && delta >= (1ull << (k_nSlotBits * (level + 1)))) {
+			level++;
+		}
+		int slot = SlotOf(level, tick);
+
+		node.level = (uint16)level;
+		node.slot = (uint16)slot;
+		node.prev = k_nNone;
+		node.next = Head(level, slot);
+		if (node.next != k_nNone) {
+			m_vecNodes[node.next].prev = index;
+		}
+		m_heads[level][slot] = index;
+		m_occupied[level] |= 1ull << slot;
+	}
+
+	void Unlink(uint32 index) {
+		Node_t &node = m_vecNodes[index];
+		if (node.prev != k_nNone) {
+			m_vecNodes[node.prev].next = node.next;
+		}
+		else {
+			m_heads[node.level][node.slot] = node.next;
+			if (node.next == k_nNone) {
+				m_occupied[node.level] &= ~(1ull << node.slot);
+			}
+		}
+		if (node.next != k_nNone) {
+			m_vecNodes[node.next].prev = node.prev;
+		}
+	}
+
+	void Free(uint32 index) {
+		Node_t &node = m_vecNodes[index];
+		node.armed = false;
+		node.generation++;
+		node.value = T();
+		node.next = m_nFreeHead;
+		m_nFreeHead = index;
+		m_nArmed--;
+	}
+
+	// takes a whole slot list off, the caller owns the nodes on it
+	uint32 TakeSlot(int level, int slot) {
+		uint32 head = Head(level, slot);
+		m_occupied[level] &= ~(1ull << slot);
+		return head;
+	}
+
+	// the slot of this level whose time has come, its timers go down to the finer levels (or off, if they are due)
+	void Cascade(int level, std::vector<T> &vecExpired) {
+		uint32 index = TakeSlot(level, SlotOf(level, m_nNow));
+		while (index != k_nNone) {
+			uint32 next = m_vecNodes[index].next;
+			if (m_vecNodes[index].tick <= m_nNow) {
+				vecExpired.push_back(m_vecNodes[index].value);
+				Free(index);
+			}
+			else {
+				Insert(index);
+			}
+			index = next;
+		}
+	}
+
+	void Expire(int slot, std::vector<T> &vecExpired) {
+		uint32 index = TakeSlot(0, slot);
+		while (index != k_nNone) {
+			uint32 next = m_vecNodes[index].next;
+			vecExpired.push_back(m_vecNodes[index].value);
+			Free(index);
+			index = next;
+		}
+	}
+
+	// the first tick after now with a timer to go off or a coarse slot to move down, ~0 if there are none
+	uint64 NextTick() const {
+		uint64 best = ~0ull;
+		for (int level = 0; level < k_nLevels; level++) {
+			if (m_occupied[level] == 0) {
+				continue;
+			}
+
+			// the slots after the current one, in the order they come round. the current slot itself is last, what
+			// is in it is a whole turn of the wheel away.
+			int shift = k_nSlotBits * level;
+			uint64 block = m_nNow >> shift;
+			for (uint64 offset = 1; offset <= (uint64)k_nSlots; offset++) {
+				int slot = (int)((block + offset) & (k_nSlots - 1));
+				if ((m_occupied[level] >> slot) & 1) {
+					best = std::min(best, (block + offset) << shift);
+					break;
+				}
+			}
+		}
+		return best;
+	}
+};
+
+#endif
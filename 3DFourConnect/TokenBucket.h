@@ -0,0 +1,58 @@
+// a rate limit that lets short bursts through. tokens come in at a steady rate up to a cap and every event that
+// is let through takes one, so over time no more than the rate gets through but a quiet spell can be made up for.
+
+#ifndef TOKENBUCKET_H
+#define TOKENBUCKET_H
+
+#include <algorithm>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+
+class TokenBucket {
+public:
+	TokenBucket() {
+		Set(0, 0, 0);
+	}
+
+	// starts full
+	TokenBucket(double ratePerSecond, double burst, SteamNetworkingMicroseconds now) {
+		Set(ratePerSecond, burst, now);
+	}
+
+	void Set(double ratePerSecond, double burst, SteamNetworkingMicroseconds now) {
+		m_flRatePerMicrosecond = ratePerSecond / 1000000.0;
+		m_flBurst = burst;
+		m_flTokens = burst;
+		m_usecLast = now;
+	}
+
+	// false if there are not enough tokens, none are taken then
+	bool Take(SteamNetworkingMicroseconds now, double tokens = 1.0) {
+		Refill(now);
+		if (m_flTokens < tokens) {
+			return false;
+		}
+		m_flTokens -= tokens;
+		return true;
+	}
+
+	double Tokens(SteamNetworkingMicroseconds now) {
+		Refill(now);
+		return m_flTokens;
+	}
+
+private:
+	double m_flRatePerMicrosecond;
+	double m_flBurst;
+	double m_flTokens;
+	SteamNetworkingMicroseconds m_usecLast;
+
+	void Refill(SteamNetworkingMicroseconds now) {
+		if (now > m_usecLast) {
+			m_flTokens = std::min(m_flBurst, m_flTokens + (now - m_usecLast) * m_flRatePerMicrosecond);
+			m_usecLast = now;
+		}
+	}
+};
+
+#endif
@@ -1,10 +1,5 @@
 #include "Tools.h"
 
-#include <glm/glm.hpp>
-#include <glm/gtc/matrix_transform.hpp>
-#include <glm/gtc/type_ptr.hpp>
-#include <glm/gtx/string_cast.hpp>
-
 #include <assert.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -15,6 +10,7 @@
 #include <chrono>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <queue>
 #include <map>
 #include <cctype>
@@ -29,45 +25,200 @@
 
 #include <signal.h>
 
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/select.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
 // all vars and static methods are defined in the Tools.h fill
 
+// stdin is read by the thread that called LocalUserInput_Init, from inside its own wait, so nothing here needs a lock.
+// any other thread (the server thread of a loopback run) gets no input and just sleeps in LocalUserInput_Wait.
+// only used in here, so unlike the rest they aren't in Tools.h.
+static std::thread::id s_idUserInputThread;
+static std::string s_sUserInputPartial;
+static std::queue< std::string > queueUserInput;
+static bool s_bUserInputClosed = false;
+
+// how stdin is read depends on what it is. a console and a pipe on windows can't be waited on like a socket, a
+// console is read a key at a time (and echoed by us) and a pipe is peeked at every few milliseconds.
+#ifdef _WIN32
+static HANDLE s_hUserInput = INVALID_HANDLE_VALUE;
+static DWORD s_dwUserInputType = FILE_TYPE_UNKNOWN;
+static bool s_bUserInputConsole = false;
+#endif
+
 void LocalUserInput_Init()
 {
-	s_pThreadUserInput = new std::thread([]()
+	s_idUserInputThread = std::this_thread::get_id();
+	s_bUserInputClosed = false;
+
+#ifdef _WIN32
+	s_hUserInput = GetStdHandle(STD_INPUT_HANDLE);
+	DWORD dwMode;
+	s_bUserInputConsole = GetConsoleMode(s_hUserInput, &dwMode) != 0;
+	s_dwUserInputType = GetFileType(s_hUserInput);
+#endif
+}
+
+void LocalUserInput_Kill()
+{
+	s_idUserInputThread = std::thread::id();
+	s_sUserInputPartial.clear();
+	queueUserInput = std::queue< std::string >();
+}
+
+// stdin ran out (or was never there, a server started with it on /dev/null). the loop carries on without commands.
+static void UserInputClosed()
+{
+	if (!s_sUserInputPartial.empty())
+	{
+		queueUserInput.push(s_sUserInputPartial);
+		s_sUserInputPartial.clear();
+	}
+	s_bUserInputClosed = true;
+	std::cout << "Nothing more to read on stdin, console commands are off" << std::endl;
+}
+
+// queues every whole line in what was just read, the rest waits for the next read
+static void AddUserInput(const char *pData, size_t cbData)
+{
+	for (size_t i = 0; i < cbData; i++)
 	{
-		while (!g_bQuit)
+		if (pData[i] == '\n')
 		{
-			char szLine[4000];
-			if (!fgets(szLine, sizeof(szLine), stdin))
+			queueUserInput.push(s_sUserInputPartial);
+			s_sUserInputPartial.clear();
+		}
+		else
+		{
+			s_sUserInputPartial += pData[i];
+		}
+	}
+}
+
+#ifdef _WIN32
+// the keys typed into the console since the last call, echoed as they would be in line mode
+static void ReadConsoleKeys()
+{
+	DWORD dwEvents = 0;
+	while (GetNumberOfConsoleInputEvents(s_hUserInput, &dwEvents) && dwEvents > 0)
+	{
+		INPUT_RECORD records[64];
+		DWORD dwRead = 0;
+		if (!ReadConsoleInputA(s_hUserInput, records, 64, &dwRead))
+		{
+			UserInputClosed();
+			return;
+		}
+
+		for (DWORD i = 0; i < dwRead; i++)
+		{
+			if (records[i].EventType != KEY_EVENT || !records[i].Event.KeyEvent.bKeyDown)
+				continue;
+
+			char c = records[i].Event.KeyEvent.uChar.AsciiChar;
+			for (WORD n = 0; n < records[i].Event.KeyEvent.wRepeatCount; n++)
 			{
-				// Well, you would hope that you could close the handle
-				// from the other thread to trigger this.  Nope.
-				if (g_bQuit)
-					return;
-				g_bQuit = true;
-				std::cout << "Failed to read on stdin, quitting" << std::endl;
-				break;
+				if (c == '\r')
+				{
+					std::cout << std::endl;
+					AddUserInput("\n", 1);
+				}
+				else if (c == '\b')
+				{
+					if (!s_sUserInputPartial.empty())
+					{
+						s_sUserInputPartial.pop_back();
+						std::cout << "\b \b" << std::flush;
+					}
+				}
+				else if (c == '\t' || (unsigned char)c >= ' ')
+				{
+					std::cout << c << std::flush;
+					AddUserInput(&c, 1);
+				}
 			}
-
-			mutexUserInputQueue.lock();
-			queueUserInput.push(std::string(szLine));
-			mutexUserInputQueue.unlock();
 		}
-	});
+	}
 }
+#endif
 
-void LocalUserInput_Kill()
+// reads whatever stdin has, waiting up to usecTimeout for something to turn up. 0 only looks.
+static void ReadUserInput(SteamNetworkingMicroseconds usecTimeout)
 {
-	// Does not work.  We won't clean up, we'll just nuke the process.
-	// 	g_bQuit = true;
-	// 	_close( fileno( stdin ) );
-	// 
-	// 	if ( s_pThreadUserInput )
-	// 	{
-	// 		s_pThreadUserInput->join();
-	// 		delete s_pThreadUserInput;
-	// 		s_pThreadUserInput = nullptr;
-	// 	}
+	char buf[4000];
+
+#ifdef _WIN32
+	if (s_bUserInputConsole)
+	{
+		if (usecTimeout > 0)
+			WaitForSingleObject(s_hUserInput, (DWORD)((usecTimeout + 999) / 1000));
+		ReadConsoleKeys();
+		return;
+	}
+
+	DWORD cbToRead = sizeof(buf);
+	if (s_dwUserInputType == FILE_TYPE_PIPE)
+	{
+		SteamNetworkingMicroseconds usecDeadline = SteamNetworkingUtils()->GetLocalTimestamp() + usecTimeout;
+		while (true)
+		{
+			DWORD cbAvailable = 0;
+			if (!PeekNamedPipe(s_hUserInput, nullptr, 0, nullptr, &cbAvailable, nullptr))
+			{
+				UserInputClosed();
+				return;
+			}
+			if (cbAvailable > 0)
+			{
+				cbToRead = std::min(cbToRead, cbAvailable);
+				break;
+			}
+
+			SteamNetworkingMicroseconds usecLeft = usecDeadline - SteamNetworkingUtils()->GetLocalTimestamp();
+			if (usecLeft <= 0)
+				return;
+			std::this_thread::sleep_for(std::chrono::microseconds(std::min(usecLeft, (SteamNetworkingMicroseconds)10000)));
+		}
+	}
+
+	// a pipe with something in it, or a file which never makes us wait
+	DWORD cbRead = 0;
+	if (!ReadFile(s_hUserInput, buf, cbToRead, &cbRead, nullptr) || cbRead == 0)
+	{
+		UserInputClosed();
+		return;
+	}
+	AddUserInput(buf, cbRead);
+#else
+	fd_set readFds;
+	FD_ZERO(&readFds);
+	FD_SET(STDIN_FILENO, &readFds);
+	timeval tv;
+	tv.tv_sec = (long)(usecTimeout / 1000000);
+	tv.tv_usec = (long)(usecTimeout % 1000000);
+
+	int nReady = select(STDIN_FILENO + 1, &readFds, nullptr, nullptr, &tv);
+	if (nReady == 0 || (nReady < 0 && errno == EINTR))
+		return;
+
+	ssize_t cbRead = nReady > 0 ? read(STDIN_FILENO, buf, sizeof(buf)) : -1;
+	if (cbRead < 0 && errno == EINTR)
+		return;
+	if (cbRead <= 0)
+	{
+		UserInputClosed();
+		return;
+	}
+	AddUserInput(buf, (size_t)cbRead);
+#endif
 }
 
 // You really gotta wonder what kind of pedantic garbage was
@@ -93,8 +244,12 @@ static inline void rtrim(std::string &s) {
 // Read the next line of input from stdin, if anything is available.
 bool LocalUserInput_GetNext(std::string &result)
 {
+	if (std::this_thread::get_id() != s_idUserInputThread)
+		return false;
+	if (queueUserInput.empty() && !s_bUserInputClosed)
+		ReadUserInput(0);
+
 	bool got_input = false;
-	mutexUserInputQueue.lock();
 	while (!queueUserInput.empty() && !got_input)
 	{
 		result = queueUserInput.front();
@@ -103,6 +258,17 @@ bool LocalUserInput_GetNext(std::string &result)
 		rtrim(result);
 		got_input = !result.empty(); // ignore blank lines
 	}
-	mutexUserInputQueue.unlock();
 	return got_input;
 }
+
+// Sleep until a line of input is waiting or the timeout passes, whichever is first.
+void LocalUserInput_Wait(SteamNetworkingMicroseconds usecTimeout)
+{
+	if (std::this_thread::get_id() != s_idUserInputThread || s_bUserInputClosed)
+	{
+		std::this_thread::sleep_for(std::chrono::microseconds(usecTimeout));
+		return;
+	}
+	if (queueUserInput.empty())
+		ReadUserInput(usecTimeout);
+}
@@ -2,21 +2,18 @@
 #ifndef TOOLS_H
 #define TOOLS_H
 
-#include <glm/glm.hpp>
-#include <glm/gtc/matrix_transform.hpp>
-#include <glm/gtc/type_ptr.hpp>
-#include <glm/gtx/string_cast.hpp>
-
 #include <assert.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stddef.h>
 #include <algorithm>
 #include <string>
 #include <random>
 #include <chrono>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <queue>
 #include <map>
 #include <cctype>
@@ -35,24 +32,32 @@ static bool g_bQuit = false;
 
 static SteamNetworkingMicroseconds g_logTimeZero;
 
-// includes the board, currently selected piece, and the scores of both players
+// includes the board and the scores of both players
 // score is optional and only for the server to use
 struct DataPacket
 {
 	// game data handles per move data, game_setup sends the setup info to the clients, game selection is a per selection update that just sends the position of cursor, connection status is basically just a message
-	enum MsgType {GAME_DATA, GAME_SETUP, GAME_SELECTION, CONNECTION_STATUS};
+	// game join is the first thing a client sends and says if it wants to play or watch, game resume catches a reconnected player up
+	// game move is a single piece the client already shows, game move result tells it whether the server took it
+	// ping and pong measure the round trip and clock offset, either end can send a ping
+	// game delta is just the moves since the last board, game resync asks for the whole board again when they don't add up
+	// directory report is between a server process and the room directory, clients never see it
+	// replica batch and replica ack are between a server process and its hot standby (see Replication.h), clients never see them either
+	enum MsgType {GAME_DATA, GAME_SETUP, GAME_SELECTION, CONNECTION_STATUS, GAME_JOIN, GAME_RESUME, GAME_MOVE, GAME_MOVE_RESULT, PING, PONG, GAME_DELTA, GAME_RESYNC, DIRECTORY_REPORT, REPLICA_BATCH, REPLICA_ACK};
 	MsgType type;
 
 	// connection status info
 	std::string msg;
 
-	// game setup
+	// game setup, 0 for spectators
 	int assignedTurn;
-
-	// game selection
-	bool selectedVisible;
-	// board coordinate system 0-3 inclusive, not world space
-	glm::vec3 selectedPiecePos;
+	// hand this back in GAME_JOIN after losing the connection to get the same seat back
+	uint64 sessionToken = 0;
+	// from a room directory instead of a server: connect to redirect and join redirectRoomId there (0 lets that server pick)
+	SteamNetworkingIPAddr redirect = {};
+	uint32 redirectRoomId = 0;
+	// the server's hot standby, where to try reconnecting if the server itself can't be reached. all zeros without one.
+	SteamNetworkingIPAddr standby = {};
 
 	// game data info
 	// 0 is None, 1 is red, blue is 2
@@ -60,8 +65,219 @@ struct DataPacket
 	int score2 = 0;
 	int currentTurn;
 	int board[4][4][4];
+
+	// goes up every time the room's board changes, a reconnecting player sends the last one it saw
+	uint32 seq = 0;
+};
+
+// number of message types above and a name for each, used to label stats
+const int k_nNumMsgTypes = 15;
+
+static inline const char *MsgTypeName(int type) {
+	switch (type) {
+		case DataPacket::MsgType::GAME_DATA: return "game_data";
+		case DataPacket::MsgType::GAME_SETUP: return "game_setup";
+		case DataPacket::MsgType::GAME_SELECTION: return "game_selection";
+		case DataPacket::MsgType::CONNECTION_STATUS: return "connection_status";
+		case DataPacket::MsgType::GAME_JOIN: return "game_join";
+		case DataPacket::MsgType::GAME_RESUME: return "game_resume";
+		case DataPacket::MsgType::GAME_MOVE: return "game_move";
+		case DataPacket::MsgType::GAME_MOVE_RESULT: return "game_move_result";
+		case DataPacket::MsgType::PING: return "ping";
+		case DataPacket::MsgType::PONG: return "pong";
+		case DataPacket::MsgType::GAME_DELTA: return "game_delta";
+		case DataPacket::MsgType::GAME_RESYNC: return "game_resync";
+		case DataPacket::MsgType::DIRECTORY_REPORT: return "directory_report";
+		case DataPacket::MsgType::REPLICA_BATCH: return "replica_batch";
+		case DataPacket::MsgType::REPLICA_ACK: return "replica_ack";
+		default: return "unknown";
+	}
+}
+
+// cursor updates get their own small packet since they are sent many times a second.
+// they go out unreliable so they never queue up behind the reliable game moves.
+// the type field is first so it lines up with DataPacket::type when the receiver checks it.
+struct SelectionPacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::GAME_SELECTION;
+
+	// goes up by one every time the sender's cursor changes. unreliable messages can arrive out of order so the receiver drops anything older than what it already has.
+	// the server numbers them again per seat before passing them on, so the count doesn't start over when somebody new takes the seat.
+	uint32 seq = 0;
+
+	// the hovered board cell (see CellFromCoord), -1 means the cursor is not over an empty cell
+	int8 cell = -1;
+};
+
+// a piece the player placed. the client shows it right away and keeps it until the server answers.
+struct MovePacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::GAME_MOVE;
+
+	// goes up by one with every move the client sends, the result carries it back
+	uint32 moveId = 0;
+
+	int8 cell = -1;
+	int8 color = 0;
+};
+
+// the server's answer to a GAME_MOVE, only sent to the player that made it
+struct MoveResultPacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::GAME_MOVE_RESULT;
+
+	uint32 moveId = 0;
+	int32 accepted = 0;
+
+	// accepted: the seq of the first board that has the move on it, rejected: the room's seq right now
+	uint32 seq = 0;
+};
+
+// a PING carries the sender's timestamp, the other end sends it straight back as a PONG with its own two filled in
+struct TimePacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::PING;
+
+	// the sender's clock when the ping went out
+	int64 usecSent = 0;
+
+	// the replier's clock when the ping arrived and when the pong went out
+	int64 usecPeerReceived = 0;
+	int64 usecPeerReplied = 0;
+};
+
+// sent by the client once it is connected. players take a seat, spectators watch a room without taking one.
+struct JoinPacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::GAME_JOIN;
+
+	enum Role { PLAYER, SPECTATOR };
+	int32 role = Role::PLAYER;
+
+	// the room to join, 0 lets the server pick (any free seat for players, the most watched match for spectators)
+	uint32 roomId = 0;
+
+	// players only. a token from an earlier GAME_SETUP takes back that seat, lastSeq is the newest board the client has.
+	uint64 sessionToken = 0;
+	uint32 lastSeq = 0;
+
+	// players only. who the matchmaker pairs them with, 0 for the server's default
+	int32 rating = 0;
+
+	// players only. 1 to play one of the server's bots right away instead of waiting for a person
+	int32 againstBot = 0;
+};
+
+// one piece placed on a room's board
+struct MoveRecord
+{
+	uint32 seq;
+	int8 cell;
+	int8 color;
+	// whose turn it was after the move
+	int8 nextTurn;
+	int8 pad = 0;
 };
 
+// most moves a game can have before the board is full and has to be cleared
+const int k_nMaxMovesPerGame = 64;
+
+// most moves one GAME_DELTA carries, a board that got more than that since the last one goes out whole
+const int k_nMaxDeltaMoves = 4;
+
+// sent instead of GAME_DATA when all the board got since the last one were a few moves. the client puts them on the
+// board it has from baseSeq and checks what it gets against hash, if it doesn't have that board or the hash is off it
+// asks for the whole board with GAME_RESYNC. only numMoves entries of moves are sent.
+struct DeltaPacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::GAME_DELTA;
+
+	uint32 baseSeq = 0;
+
+	// BitBoard::hash of the board after the moves xored with ZobristTurn of whose turn it is then
+	uint64 hash = 0;
+
+	int32 numMoves = 0;
+	MoveRecord moves[k_nMaxDeltaMoves];
+
+	uint32 size() const {
+		return (uint32)(offsetof(DeltaPacket, moves) + numMoves * sizeof(MoveRecord));
+	}
+};
+
+// sent by a client whose board stopped matching the server's, it gets the whole board back once
+struct ResyncPacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::GAME_RESYNC;
+};
+
+// sent to a player that got its seat back. if the moves since the client's last seq are still known it only gets those,
+// otherwise it also gets the board as it was before the first of them. only numMoves entries of moves are sent.
+struct ResumePacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::GAME_RESUME;
+
+	int32 hasSnapshot = 0;
+
+	// the board at snapshotSeq, one bit per cell (see CellFromCoord)
+	uint32 snapshotSeq = 0;
+	uint64 red = 0;
+	uint64 blue = 0;
+	int32 score1 = 0;
+	int32 score2 = 0;
+	int32 currentTurn = 0;
+
+	int32 numMoves = 0;
+	MoveRecord moves[k_nMaxMovesPerGame];
+
+	uint32 size() const {
+		return (uint32)(offsetof(ResumePacket, moves) + numMoves * sizeof(MoveRecord));
+	}
+};
+
+// room ids are handed out in blocks, one per server process behind a room directory, so the directory can tell which
+// process has a room from its id alone. a process names its own rooms from the bottom half of its block and the
+// directory names the rooms for the matches it makes from the top half.
+const uint32 k_nRoomIdsPerProcess = 1u << 24;
+
+// a server process telling the room directory where clients reach it and how busy it is, sent when it connects
+// and then every second. the directory sends it back once with firstRoomId set to the start of the process's block.
+struct DirectoryPacket
+{
+	DataPacket::MsgType type = DataPacket::MsgType::DIRECTORY_REPORT;
+
+	SteamNetworkingIPAddr addr = {};
+	int32 connections = 0;
+	int32 maxConnections = 0;
+	int32 rooms = 0;
+	int32 queued = 0;
+
+	// 0 until the process has a block, a process that had one before the directory restarted keeps it
+	uint32 firstRoomId = 0;
+};
+
+// port the server listens on and clients connect to when none is given
+const uint16 DEFAULT_SERVER_PORT = 25565;
+
+// send flags for the cursor channel
+const int k_nSelectionSendFlags = k_nSteamNetworkingSend_UnreliableNoNagle;
+
+// most messages taken off a connection or poll group in one receive call
+const int k_nMaxMessagesPerPoll = 64;
+
+// default number of cursor updates a client sends per second at most
+const float k_flDefaultSelectionSendRate = 20.0f;
+
+// board cells are packed into a single id 0-63 so they fit in a byte
+static inline int CellFromCoord(int x, int y, int z) {
+	return x * 16 + y * 4 + z;
+}
+
+// true if sequence number a is newer than b, works across the uint32 wrap around
+static inline bool IsNewerSeq(uint32 a, uint32 b) {
+	return (int32)(a - b) > 0;
+}
+
 // static methods
 static void DebugOutput(ESteamNetworkingSocketsDebugOutputType eType, const char *pszMsg) {
 	std::cout << pszMsg << std::endl;
@@ -95,15 +311,10 @@ static void InitSteamDatagramConnectionSockets()
 	SteamNetworkingUtils()->SetDebugOutputFunction(k_ESteamNetworkingSocketsDebugOutputType_Msg, DebugOutput);
 }
 
+// whoever closed the connections already waited for what they had to send with FlushConnections (see Transport.h),
+// so there is nothing left to give time to
 static void ShutdownSteamDatagramConnectionSockets()
 {
-	// Give connections time to finish up.  This is an application layer protocol
-	// here, it's not TCP.  Note that if you have an application and you need to be
-	// more sure about cleanup, you won't be able to do this.  You will need to send
-	// a message and then either wait for the peer to close the connection, or
-	// you can pool the connection to see if any reliable data is pending.
-	std::this_thread::sleep_for(std::chrono::milliseconds(500));
-
 #ifdef STEAMNETWORKINGSOCKETS_OPENSOURCE
 	GameNetworkingSockets_Kill();
 #else
@@ -113,13 +324,9 @@ static void ShutdownSteamDatagramConnectionSockets()
 
 // vars
 
-static std::mutex mutexUserInputQueue;
-static std::queue< std::string > queueUserInput;
-
-static std::thread *s_pThreadUserInput = nullptr;
-
 void LocalUserInput_Init();
 
+// stops reading stdin, there is no thread to stop
 void LocalUserInput_Kill();
 
 // trim from start (in place)
@@ -132,4 +339,8 @@ static inline void rtrim(std::string &s);
 // Read the next line of input from stdin, if anything is available.
 bool LocalUserInput_GetNext(std::string &result);
 
+// Sleep until a line of input is waiting or the timeout passes, whichever is first. this is the loop's idle wait,
+// it waits on stdin itself so a command is picked up as soon as it is typed.
+void LocalUserInput_Wait(SteamNetworkingMicroseconds usecTimeout);
+
 #endif
\ No newline at end of file
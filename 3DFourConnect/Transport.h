@@ -0,0 +1,145 @@
+// the part of the networking library the server, client and load generator use, behind an interface so the game and
+// protocol code can run over something other than real sockets (see LoopbackTransport.h).
+// the calls are the ISteamNetworkingSockets ones with the same arguments and results, GNSTransport just passes them on.
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <GameNetworkingSockets/steam/steamnetworkingsockets.h>
+#include <GameNetworkingSockets/steam/isteamnetworkingutils.h>
+
+class ITransport {
+public:
+	virtual ~ITransport() {}
+
+	// the connection status changed callback is passed in pOptions the same way the library takes it
+	virtual HSteamListenSocket CreateListenSocketIP(const SteamNetworkingIPAddr &localAddress, int nOptions, const SteamNetworkingConfigValue_t *pOptions) = 0;
+	virtual bool CloseListenSocket(HSteamListenSocket hSocket) = 0;
+	virtual HSteamNetConnection ConnectByIPAddress(const SteamNetworkingIPAddr &address, int nOptions, const SteamNetworkingConfigValue_t *pOptions) = 0;
+	virtual EResult AcceptConnection(HSteamNetConnection hConn) = 0;
+	virtual bool CloseConnection(HSteamNetConnection hPeer, int nReason, const char *pszDebug, bool bEnableLinger) = 0;
+
+	virtual bool SetConnectionUserData(HSteamNetConnection hPeer, int64 nUserData) = 0;
+	virtual void SetConnectionName(HSteamNetConnection hPeer, const char *pszName) = 0;
+	virtual bool GetQuickConnectionStatus(HSteamNetConnection hConn, SteamNetworkingQuickConnectionStatus *pStats) = 0;
+
+	// takes ownership of every message, a negative result is a failed send
+	virtual void SendMessages(int nMessages, SteamNetworkingMessage_t *const *pMessages, int64 *pOutMessageNumberOrResult) = 0;
+	virtual int ReceiveMessagesOnConnection(HSteamNetConnection hConn, SteamNetworkingMessage_t **ppOutMessages, int nMaxMessages) = 0;
+
+	virtual HSteamNetPollGroup CreatePollGroup() = 0;
+	virtual bool DestroyPollGroup(HSteamNetPollGroup hPollGroup) = 0;
+	virtual bool SetConnectionPollGroup(HSteamNetConnection hConn, HSteamNetPollGroup hPollGroup) = 0;
+	virtual int ReceiveMessagesOnPollGroup(HSteamNetPollGroup hPollGroup, SteamNetworkingMessage_t **ppOutMessages, int nMaxMessages) = 0;
+
+	// calls the connection status changed callbacks for everything that happened since the last call
+	virtual void RunCallbacks() = 0;
+};
+
+// the real network through GameNetworkingSockets
+class GNSTransport : public ITransport {
+public:
+	GNSTransport(ISteamNetworkingSockets *pInterface) {
+		m_pInterface = pInterface;
+	}
+
+	HSteamListenSocket CreateListenSocketIP(const SteamNetworkingIPAddr &localAddress, int nOptions, const SteamNetworkingConfigValue_t *pOptions) override {
+		return m_pInterface->CreateListenSocketIP(localAddress, nOptions, pOptions);
+	}
+
+	bool CloseListenSocket(HSteamListenSocket hSocket) override {
+		return m_pInterface->CloseListenSocket(hSocket);
+	}
+
+	HSteamNetConnection ConnectByIPAddress(const SteamNetworkingIPAddr &address, int nOptions, const SteamNetworkingConfigValue_t *pOptions) override {
+		return m_pInterface->ConnectByIPAddress(address, nOptions, pOptions);
+	}
+
+	EResult AcceptConnection(HSteamNetConnection hConn) override {
+		return m_pInterface->AcceptConnection(hConn);
+	}
+
+	bool CloseConnection(HSteamNetConnection hPeer, int nReason, const char *pszDebug, bool bEnableLinger) override {
+		return m_pInterface->CloseConnection(hPeer, nReason, pszDebug, bEnableLinger);
+	}
+
+	bool SetConnectionUserData(HSteamNetConnection hPeer, int64 nUserData) override {
+		return m_pInterface->SetConnectionUserData(hPeer, nUserData);
+	}
+
+	void SetConnectionName(HSteamNetConnection hPeer, const char *pszName) override {
+		m_pInterface->SetConnectionName(hPeer, pszName);
+	}
+
+	bool GetQuickConnectionStatus(HSteamNetConnection hConn, SteamNetworkingQuickConnectionStatus *pStats) override {
+		return m_pInterface->GetQuickConnectionStatus(hConn, pStats);
+	}
+
+	void SendMessages(int nMessages, SteamNetworkingMessage_t *const *pMessages, int64 *pOutMessageNumberOrResult) override {
+		m_pInterface->SendMessages(nMessages, pMessages, pOutMessageNumberOrResult);
+	}
+
+	int ReceiveMessagesOnConnection(HSteamNetConnection hConn, SteamNetworkingMessage_t **ppOutMessages, int nMaxMessages) override {
+		return m_pInterface->ReceiveMessagesOnConnection(hConn, ppOutMessages, nMaxMessages);
+	}
+
+	HSteamNetPollGroup CreatePollGroup() override {
+		return m_pInterface->CreatePollGroup();
+	}
+
+	bool DestroyPollGroup(HSteamNetPollGroup hPollGroup) override {
+		return m_pInterface->DestroyPollGroup(hPollGroup);
+	}
+
+	bool SetConnectionPollGroup(HSteamNetConnection hConn, HSteamNetPollGroup hPollGroup) override {
+		return m_pInterface->SetConnectionPollGroup(hConn, hPollGroup);
+	}
+
+	int ReceiveMessagesOnPollGroup(HSteamNetPollGroup hPollGroup, SteamNetworkingMessage_t **ppOutMessages, int nMaxMessages) override {
+		return m_pInterface->ReceiveMessagesOnPollGroup(hPollGroup, ppOutMessages, nMaxMessages);
+	}
+
+	void RunCallbacks() override {
+		m_pInterface->RunCallbacks();
+	}
+
+private:
+	ISteamNetworkingSockets *m_pInterface;
+};
+
+// the real network, only once the library has been initialised
+inline ITransport *DefaultTransport() {
+	static GNSTransport transport(SteamNetworkingSockets());
+	return &transport;
+}
+
+// the longest anything waits on its way out for the last messages it sent to be acked
+const SteamNetworkingMicroseconds k_usecMaxFlushOnShutdown = 500000;
+
+// waits until nothing reliable sent on the connections is still queued or unacked, or usecMax has passed. everything
+// that closes its connections on the way out calls this first, so the library can be shut down straight after
+// without anybody missing their last messages. a connection that isn't connected anymore has nothing to wait for.
+inline void FlushConnections(ITransport *pInterface, const std::vector<HSteamNetConnection> &vecConns, SteamNetworkingMicroseconds usecMax) {
+	SteamNetworkingMicroseconds usecDeadline = SteamNetworkingUtils()->GetLocalTimestamp() + usecMax;
+	while (true) {
+		bool bPending = false;
+		for (HSteamNetConnection conn : vecConns) {
+			SteamNetworkingQuickConnectionStatus status;
+			if (pInterface->GetQuickConnectionStatus(conn, &status) && status.m_eState == k_ESteamNetworkingConnectionState_Connected
+				&& (status.m_cbPendingReliable > 0 || status.m_cbSentUnackedReliable > 0)) {
+				bPending = true;
+				break;
+			}
+		}
+		if (!bPending || SteamNetworkingUtils()->GetLocalTimestamp() >= usecDeadline) {
+			return;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+#endif